@@ -0,0 +1,373 @@
+#include "AsyncFileStreamResponse.h"
+#include <Arduino.h>
+#include <IoWorkers.h>
+#include <lwip/priv/tcp_priv.h>
+#include <lwip/tcpip.h>
+
+QueueHandle_t AsyncFileStreamResponse::_queue = NULL;
+std::atomic<AsyncFileStreamResponse::Source *>
+    AsyncFileStreamResponse::_retired(NULL);
+AsyncFileStreamResponse::Source *AsyncFileStreamResponse::_reaping = NULL;
+uint32_t AsyncFileStreamResponse::_checked = 0;
+std::atomic<uint64_t> AsyncFileStreamResponse::_bytesSent(0);
+std::atomic<uint32_t> AsyncFileStreamResponse::_busyMillis(0);
+std::atomic<uint32_t> AsyncFileStreamResponse::_stalls(0);
+std::atomic<uint32_t> AsyncFileStreamResponse::_active(0);
+std::atomic<uint32_t> AsyncFileStreamResponse::_retained(0);
+
+AsyncFileStreamResponse::Source::Source()
+    : packed(false), length(0), blockSize(0), pcb(NULL),
+      wake(std::make_shared<IoWake>()), waiting(false), pending(0),
+      state(SOURCE_OPEN), next(NULL) {
+  for (int i = 0; i < SD_STREAM_BLOCKS; i++) {
+    blocks[i].data = NULL;
+    blocks[i].state = BLOCK_EMPTY;
+  }
+}
+
+AsyncFileStreamResponse::Source::~Source() {
+  for (int i = 0; i < SD_STREAM_BLOCKS; i++) {
+    if (blocks[i].data) {
+      heap_caps_free(blocks[i].data);
+    }
+  }
+  file.close();
+}
+
+AsyncFileStreamResponse::AsyncFileStreamResponse(FS &fs, const String &path,
+                                                 const String &contentType)
+    : _source(new Source()), _valid(false), _blockCount(0), _sendBlock(0),
+      _sendPos(0), _releaseBlock(0), _fillBlock(0), _nextOffset(0),
+      _startTime(0) {
+  _code = 200;
+  _contentType = contentType;
+
+  Source &source = *_source;
+  source.file = fs.open(path, FILE_READ);
+  if (!source.file || source.file.isDirectory() || !startReaderTask()) {
+    return;
+  }
+  source.packed = source.unpacker.begin(source.file);
+  source.length = source.packed ? source.unpacker.size() : source.file.size();
+  _contentLength = source.length;
+
+  // small files get a single block just big enough for them
+  source.blockSize = SD_STREAM_BLOCK_SIZE;
+  if (_contentLength < source.blockSize) {
+    source.blockSize = (_contentLength + 511) & ~511;
+  }
+  size_t blocks = source.blockSize ? (_contentLength + source.blockSize - 1) /
+                                         source.blockSize
+                                   : 0;
+  _blockCount = min(blocks, (size_t)SD_STREAM_BLOCKS);
+  for (uint8_t i = 0; i < _blockCount; i++) {
+    source.blocks[i].data =
+        (uint8_t *)heap_caps_malloc(source.blockSize, MALLOC_CAP_DMA);
+    if (!source.blocks[i].data) {
+      return;
+    }
+  }
+  _valid = true;
+}
+
+AsyncFileStreamResponse::~AsyncFileStreamResponse() {
+  if (!_startTime) {
+    // nothing was read or sent, no one else knows of the source
+    delete _source;
+    return;
+  }
+  _active--;
+  _source->wake->detach();
+  retire(_source);
+}
+
+bool AsyncFileStreamResponse::startReaderTask() {
+  if (_queue) {
+    return true;
+  }
+  _queue = xQueueCreate(SD_STREAM_QUEUE, sizeof(Job));
+  if (!_queue) {
+    return false;
+  }
+  return xTaskCreate(readerTask, "sd_reader", 4096, NULL, 2, NULL) == pdPASS;
+}
+
+void AsyncFileStreamResponse::readerTask(void *arg) {
+  Job job;
+  for (;;) {
+    TickType_t wait =
+        _reaping ? pdMS_TO_TICKS(SD_STREAM_REAP_MS) : portMAX_DELAY;
+    if (xQueueReceive(_queue, &job, wait) == pdTRUE && job.source) {
+      read(job.source, job.block);
+    }
+    reap();
+  }
+}
+
+// on the reader task
+void AsyncFileStreamResponse::read(Source *source, uint8_t index) {
+  Block &block = source->blocks[index];
+  if (source->state == SOURCE_OPEN) {
+    size_t len = min(source->blockSize, source->length - block.start);
+    size_t got;
+    if (source->packed) {
+      // blocks are queued in order, the unpacker just carries on
+      got = source->unpacker.read(source->file, block.data, len);
+    } else {
+      if (source->file.position() != block.start) {
+        source->file.seek(block.start, SeekSet);
+      }
+      got = source->file.read(block.data, len);
+    }
+    block.len = got == len ? len : 0;
+    block.state = BLOCK_READY;
+    if (source->waiting.exchange(false)) {
+      source->wake->poll();
+    }
+  }
+  // the source is only reaped once no read is pending, on this task
+  source->pending--;
+}
+
+// Hands the source over to the reader task, without waiting for it. lwIP
+// may still hold segments pointing into the blocks, a read may still be
+// filling one.
+void AsyncFileStreamResponse::retire(Source *source) {
+  _retained++;
+  source->state = SOURCE_RETIRED;
+  source->next = _retired.load();
+  while (!_retired.compare_exchange_weak(source->next, source)) {
+  }
+  Job wake = {NULL, 0};
+  // a full queue wakes the reader task anyway
+  xQueueSend(_queue, &wake, 0);
+}
+
+// on the reader task: frees the sources lwIP let go of and asks it about
+// those with no read pending, the new ones at once and the others every
+// SD_STREAM_REAP_MS
+void AsyncFileStreamResponse::reap() {
+  Source *fresh = _retired.exchange(NULL);
+  if (!fresh && !_reaping) {
+    return;
+  }
+  bool check = fresh || millis() - _checked >= SD_STREAM_REAP_MS;
+  if (check) {
+    _checked = millis();
+  }
+  while (fresh) {
+    Source *next = fresh->next;
+    fresh->next = _reaping;
+    _reaping = fresh;
+    fresh = next;
+  }
+
+  for (Source **link = &_reaping; *link;) {
+    Source *source = *link;
+    if (check && !source->pending && source->state == SOURCE_RETIRED) {
+      source->state = SOURCE_CHECKING;
+      if (tcpip_callback(checkNow, source) != ERR_OK) {
+        source->state = SOURCE_RETIRED;
+      }
+    }
+    if (source->state != SOURCE_FREE) {
+      link = &source->next;
+      continue;
+    }
+    *link = source->next;
+    delete source;
+    _retained--;
+  }
+}
+
+// On the lwIP thread. A connection that is no longer listed had its
+// segments freed, one still listed has sent them all once both of its queues
+// are empty; until then a retransmission may read the blocks.
+void AsyncFileStreamResponse::checkNow(void *arg) {
+  Source *source = (Source *)arg;
+  uint8_t state = SOURCE_FREE;
+  for (tcp_pcb *pcb = tcp_active_pcbs; pcb; pcb = pcb->next) {
+    if (pcb == source->pcb) {
+      if (pcb->unsent || pcb->unacked) {
+        state = SOURCE_RETIRED;
+      }
+      break;
+    }
+  }
+  source->state = state;
+}
+
+// queues reads for the free blocks in file order, a full queue is tried again
+// on the next ack or poll
+void AsyncFileStreamResponse::fill() {
+  while (_nextOffset < _contentLength) {
+    Block &block = _source->blocks[_fillBlock];
+    if (block.state != BLOCK_EMPTY) {
+      break;
+    }
+    block.start = _nextOffset;
+    block.state = BLOCK_QUEUED;
+    _source->pending++;
+    Job job = {_source, _fillBlock};
+    if (xQueueSend(_queue, &job, 0) != pdTRUE) {
+      _source->pending--;
+      block.state = BLOCK_EMPTY;
+      break;
+    }
+    _nextOffset += _source->blockSize;
+    _fillBlock = (_fillBlock + 1) % _blockCount;
+  }
+}
+
+void AsyncFileStreamResponse::_respond(AsyncWebServerRequest *request) {
+  _startTime = max(millis(), 1ul);
+  _active++;
+  _source->pcb = request->client()->pcb();
+  _source->wake->attach(request->client());
+  _head = _assembleHead(request->version());
+  _headLength = _head.length();
+  fill();
+  _state = RESPONSE_HEADERS;
+  _ack(request, 0, 0);
+}
+
+size_t AsyncFileStreamResponse::_ack(AsyncWebServerRequest *request,
+                                     size_t len, uint32_t time) {
+  AsyncClient *client = request->client();
+  _ackedLength += len;
+
+  size_t written = 0;
+  size_t space = client->space();
+  if (_state == RESPONSE_HEADERS) {
+    size_t n = min(space, _headLength - _writtenLength);
+    n = client->add(_head.c_str() + _writtenLength, n);
+    _writtenLength += n;
+    written += n;
+    space -= n;
+    if (_writtenLength == _headLength) {
+      _head = String();
+      _state = _contentLength ? RESPONSE_CONTENT : RESPONSE_WAIT_ACK;
+    }
+  }
+  if (_state == RESPONSE_CONTENT) {
+    release();
+    fill();
+    written += sendContent(client, space);
+  }
+  if (written) {
+    client->send();
+  }
+
+  if (_state == RESPONSE_WAIT_ACK && _ackedLength >= _writtenLength) {
+    _state = RESPONSE_END;
+    _busyMillis += millis() - _startTime;
+  }
+  return written;
+}
+
+// blocks the client acknowledged in full can be read into again
+void AsyncFileStreamResponse::release() {
+  size_t acked = _ackedLength > _headLength ? _ackedLength - _headLength : 0;
+  for (uint8_t i = 0; i < _blockCount; i++) {
+    Block &block = _source->blocks[_releaseBlock];
+    if (block.state != BLOCK_SENT || block.start + block.len > acked) {
+      break;
+    }
+    block.state = BLOCK_EMPTY;
+    _releaseBlock = (_releaseBlock + 1) % _blockCount;
+  }
+}
+
+size_t AsyncFileStreamResponse::sendContent(AsyncClient *client,
+                                            size_t space) {
+  size_t written = 0;
+  while (space) {
+    Block &block = _source->blocks[_sendBlock];
+    if (block.state != BLOCK_READY) {
+      if (block.state == BLOCK_SENT || _ackedLength < _writtenLength) {
+        // an outstanding ack calls back in
+        break;
+      }
+      // the card is behind the link, the reader task polls the connection
+      // once the block is in; it may have just been. A poll that finds it
+      // still missing is the same stall
+      bool waiting = _source->waiting.exchange(true);
+      if (block.state != BLOCK_READY) {
+        if (!waiting) {
+          _stalls++;
+        }
+        break;
+      }
+      _source->waiting = false;
+    }
+    if (!block.len) {
+      // read error, there is no way to tell the client but to hang up
+      _state = RESPONSE_FAILED;
+      client->close();
+      break;
+    }
+
+    size_t n = min(space, block.len - _sendPos);
+    n = client->add((const char *)block.data + _sendPos, n, 0);
+    if (!n) {
+      break;
+    }
+    _sendPos += n;
+    _writtenLength += n;
+    _bytesSent += n;
+    written += n;
+    space -= n;
+
+    if (_sendPos == block.len) {
+      block.state = BLOCK_SENT;
+      _sendPos = 0;
+      _sendBlock = (_sendBlock + 1) % _blockCount;
+      if (block.start + block.len >= _contentLength) {
+        _state = RESPONSE_WAIT_ACK;
+        break;
+      }
+    }
+  }
+  return written;
+}
+
+// case-insensitive, without a lowercase copy of the path
+static bool hasExtension(const String &path, const char *extension) {
+  size_t len = strlen(extension);
+  return path.length() >= len &&
+         !strcasecmp(path.c_str() + path.length() - len, extension);
+}
+
+const char *AsyncFileStreamResponse::contentType(const String &path) {
+  if (hasExtension(path, ".gcode") || hasExtension(path, ".gco") ||
+      hasExtension(path, ".g")) {
+    return "text/x.gcode";
+  } else if (hasExtension(path, ".html") || hasExtension(path, ".htm")) {
+    return "text/html";
+  } else if (hasExtension(path, ".css")) {
+    return "text/css";
+  } else if (hasExtension(path, ".js")) {
+    return "application/javascript";
+  } else if (hasExtension(path, ".json")) {
+    return "application/json";
+  } else if (hasExtension(path, ".txt")) {
+    return "text/plain";
+  } else if (hasExtension(path, ".xml")) {
+    return "text/xml";
+  } else if (hasExtension(path, ".png")) {
+    return "image/png";
+  } else if (hasExtension(path, ".jpg") || hasExtension(path, ".jpeg")) {
+    return "image/jpeg";
+  } else if (hasExtension(path, ".gif")) {
+    return "image/gif";
+  } else if (hasExtension(path, ".svg")) {
+    return "image/svg+xml";
+  } else if (hasExtension(path, ".ico")) {
+    return "image/x-icon";
+  } else if (hasExtension(path, ".zip")) {
+    return "application/zip";
+  } else if (hasExtension(path, ".gz")) {
+    return "application/x-gzip";
+  }
+  return "application/octet-stream";
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <GcodePack.h>
+#include <IoWorkers.h>
+#include <atomic>
+#include <lwip/tcp.h>
+
+// Read-ahead block size, a multiple of the SD sector size
+#ifndef SD_STREAM_BLOCK_SIZE
+#define SD_STREAM_BLOCK_SIZE (8 * 1024)
+#endif
+#ifndef SD_STREAM_BLOCKS
+#define SD_STREAM_BLOCKS 3
+#endif
+// reads queued for the reader task over all responses; a response that finds
+// the queue full tries again on its next ack or poll
+#ifndef SD_STREAM_QUEUE
+#define SD_STREAM_QUEUE 16
+#endif
+// how often the reader task asks lwIP again about the blocks of responses
+// that are gone but whose last segments are still unacknowledged
+#ifndef SD_STREAM_REAP_MS
+#define SD_STREAM_REAP_MS 100
+#endif
+
+// Sends a file from a ring of read-ahead blocks. A shared reader task fills
+// the blocks from the card, and the blocks are handed to lwIP without being
+// copied, so each one is only refilled once the client acknowledged it.
+// Packed G-code is sent as it was uploaded, unpacked by the reader task.
+// The AsyncTCP task never waits for the card: the reader task polls the
+// connection when the block it waits for is ready. Once the response is
+// gone, the reader task closes the file and frees the blocks as soon as lwIP
+// holds no segment of the connection any more.
+class AsyncFileStreamResponse : public AsyncWebServerResponse {
+  using FS = fs::FS;
+
+public:
+  AsyncFileStreamResponse(FS &fs, const String &path,
+                          const String &contentType);
+  ~AsyncFileStreamResponse();
+
+  bool _sourceValid() const override { return _valid; }
+  void _respond(AsyncWebServerRequest *request) override;
+  size_t _ack(AsyncWebServerRequest *request, size_t len,
+              uint32_t time) override;
+
+  static const char *contentType(const String &path);
+
+  // totals over all finished responses
+  static uint64_t bytesSent() { return _bytesSent; }
+  static uint32_t busyMillis() { return _busyMillis; }
+  static uint32_t stalls() { return _stalls; }
+  static uint32_t active() { return _active; }
+  // responses gone whose blocks wait for lwIP or for a read to finish
+  static uint32_t retained() { return _retained; }
+
+private:
+  enum BlockState { BLOCK_EMPTY, BLOCK_QUEUED, BLOCK_READY, BLOCK_SENT };
+  enum SourceState {
+    SOURCE_OPEN,
+    SOURCE_RETIRED,
+    SOURCE_CHECKING,
+    SOURCE_FREE
+  };
+  struct Block {
+    uint8_t *data;
+    size_t start;
+    size_t len;
+    std::atomic<uint8_t> state;
+  };
+  // what the reader task and lwIP use, it outlives the response until both
+  // are done with it
+  struct Source {
+    Source();
+    ~Source();
+
+    File file;
+    GcodeUnpacker unpacker;
+    bool packed;
+    size_t length;
+    size_t blockSize;
+    Block blocks[SD_STREAM_BLOCKS];
+    tcp_pcb *pcb;
+    // polls the connection when a block it waits for is read
+    std::shared_ptr<IoWake> wake;
+    // the response found the next block still being read
+    std::atomic<bool> waiting;
+    std::atomic<uint8_t> pending;
+    std::atomic<uint8_t> state;
+    Source *next;
+  };
+  struct Job {
+    // NULL just wakes the reader task up to reap
+    Source *source;
+    uint8_t block;
+  };
+
+  void release();
+  void fill();
+  size_t sendContent(AsyncClient *client, size_t space);
+  static bool startReaderTask();
+  static void readerTask(void *arg);
+  static void read(Source *source, uint8_t block);
+  static void retire(Source *source);
+  static void reap();
+  static void checkNow(void *arg);
+
+  Source *_source;
+  bool _valid;
+  uint8_t _blockCount;
+  uint8_t _sendBlock;
+  size_t _sendPos;
+  uint8_t _releaseBlock;
+  uint8_t _fillBlock;
+  size_t _nextOffset;
+  uint32_t _startTime;
+  String _head;
+
+  static QueueHandle_t _queue;
+  // pushed to by any task, taken over by the reader task
+  static std::atomic<Source *> _retired;
+  // the reader task's own, waiting for lwIP
+  static Source *_reaping;
+  static uint32_t _checked;
+  // written by the AsyncTCP and reader tasks, read for the stats
+  static std::atomic<uint64_t> _bytesSent;
+  static std::atomic<uint32_t> _busyMillis;
+  static std::atomic<uint32_t> _stalls;
+  static std::atomic<uint32_t> _active;
+  static std::atomic<uint32_t> _retained;
+};
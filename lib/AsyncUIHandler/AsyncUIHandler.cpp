@@ -0,0 +1,257 @@
+#include "AsyncUIHandler.h"
+#include <Arduino.h>
+#include <AsyncFileStreamResponse.h>
+#include <Hash.h>
+#include <RequestMetrics.h>
+#include <algorithm>
+
+AsyncUIHandler::AsyncUIHandler(FS &fs, const String &root)
+    : _fs(fs), _root(root), _defaultFile("index.html"),
+      _lock(xSemaphoreCreateMutex()) {
+  // no trailing '/', request urls bring their own
+  if (_root.endsWith("/")) {
+    _root = _root.substring(0, _root.length() - 1);
+  }
+}
+
+AsyncUIHandler::~AsyncUIHandler() { vSemaphoreDelete(_lock); }
+
+AsyncUIHandler &AsyncUIHandler::setDefaultFile(const String &filename) {
+  _defaultFile = filename;
+  return *this;
+}
+
+AsyncUIHandler &AsyncUIHandler::setCacheControl(const String &cacheControl) {
+  _cacheControl = cacheControl;
+  return *this;
+}
+
+AsyncUIHandler &AsyncUIHandler::cache(const String &file) {
+  String path = _root + (file.startsWith("/") ? file : "/" + file);
+  std::vector<std::shared_ptr<UIAsset>> loaded;
+  load(path, loaded);
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _hot.push_back(path);
+  _assets.insert(_assets.end(), loaded.begin(), loaded.end());
+  xSemaphoreGive(_lock);
+  return *this;
+}
+
+void AsyncUIHandler::load(const String &path,
+                          std::vector<std::shared_ptr<UIAsset>> &out) {
+  // one encoding per file, the smallest there is; a client that can't take
+  // it is served from the card
+  static const char *const encodings[] = {"br", "gzip", NULL};
+  for (const char *encoding : encodings) {
+    std::shared_ptr<UIAsset> asset = loadAsset(path, encoding);
+    if (asset) {
+      out.push_back(asset);
+      return;
+    }
+  }
+}
+
+void AsyncUIHandler::invalidate(const String &path) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (size_t i = 0; i < _hot.size(); i++) {
+    const String &hot = _hot[i];
+    // the file, one of its encodings, or a directory it is in
+    bool changed = hot.equals(path) || path.equals(hot + ".br") ||
+                   path.equals(hot + ".gz") || path.equals("/") ||
+                   hot.startsWith(path + "/");
+    if (!changed) {
+      continue;
+    }
+    dropAssets(hot);
+    if (std::find(_stale.begin(), _stale.end(), hot) == _stale.end()) {
+      _stale.push_back(hot);
+    }
+  }
+  xSemaphoreGive(_lock);
+}
+
+void AsyncUIHandler::loop() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  std::vector<String> stale;
+  stale.swap(_stale);
+  xSemaphoreGive(_lock);
+
+  for (size_t i = 0; i < stale.size(); i++) {
+    std::vector<std::shared_ptr<UIAsset>> loaded;
+    load(stale[i], loaded);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    // changed again while it was read, the next loop() has another go
+    if (std::find(_stale.begin(), _stale.end(), stale[i]) == _stale.end()) {
+      dropAssets(stale[i]);
+      _assets.insert(_assets.end(), loaded.begin(), loaded.end());
+    }
+    xSemaphoreGive(_lock);
+  }
+}
+
+void AsyncUIHandler::dropAssets(const String &path) {
+  for (size_t i = 0; i < _assets.size();) {
+    if (_assets[i]->path.equals(path)) {
+      _assets.erase(_assets.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+const char *AsyncUIHandler::encodingSuffix(const char *encoding) {
+  if (!encoding) {
+    return "";
+  }
+  return strcmp(encoding, "br") == 0 ? ".br" : ".gz";
+}
+
+std::shared_ptr<UIAsset> AsyncUIHandler::loadAsset(const String &path,
+                                                   const char *encoding) {
+  File file = _fs.open(path + encodingSuffix(encoding), FILE_READ);
+  if (!file || file.isDirectory()) {
+    return NULL;
+  }
+
+  std::shared_ptr<UIAsset> asset = std::make_shared<UIAsset>();
+  asset->path = path;
+  asset->encoding = encoding;
+  asset->len = file.size();
+  asset->data =
+      (uint8_t *)(psramFound() ? ps_malloc(asset->len) : malloc(asset->len));
+  if (!asset->data || file.read(asset->data, asset->len) != asset->len) {
+    file.close();
+    return NULL;
+  }
+  file.close();
+
+  // strong validator, each encoding has its own bytes and so its own tag
+  asset->etag = "\"" + sha1(asset->data, asset->len) + "\"";
+  return asset;
+}
+
+std::shared_ptr<UIAsset> AsyncUIHandler::findAsset(const String &path,
+                                                   bool br,
+                                                   bool gzip) const {
+  std::shared_ptr<UIAsset> found;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (size_t i = 0; i < _assets.size(); i++) {
+    const std::shared_ptr<UIAsset> &asset = _assets[i];
+    if (!asset->path.equals(path)) {
+      continue;
+    }
+    if (!asset->encoding || (br && strcmp(asset->encoding, "br") == 0) ||
+        (gzip && strcmp(asset->encoding, "gzip") == 0)) {
+      found = asset;
+    }
+    break;
+  }
+  xSemaphoreGive(_lock);
+  return found;
+}
+
+size_t AsyncUIHandler::cachedBytes() const {
+  size_t total = 0;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (size_t i = 0; i < _assets.size(); i++) {
+    total += _assets[i]->len;
+  }
+  xSemaphoreGive(_lock);
+  return total;
+}
+
+String AsyncUIHandler::filePath(AsyncWebServerRequest *request) const {
+  String path = _root + request->url();
+  if (path.endsWith("/")) {
+    path += _defaultFile;
+  }
+  return path;
+}
+
+String AsyncUIHandler::cacheControl(const String &path) const {
+  // bundles named like bundle.3f2a9c1d.js never change under the same name
+  int end = path.lastIndexOf('.');
+  int start = end > 0 ? path.lastIndexOf('.', end - 1) : -1;
+  if (start != -1 && end - start > 8) {
+    bool hashed = true;
+    for (int i = start + 1; i < end && hashed; i++) {
+      hashed = isxdigit(path[i]);
+    }
+    if (hashed) {
+      return "public, max-age=31536000, immutable";
+    }
+  }
+  return _cacheControl;
+}
+
+bool AsyncUIHandler::canHandle(AsyncWebServerRequest *request) {
+  if (request->method() != HTTP_GET && request->method() != HTTP_HEAD) {
+    return false;
+  }
+  String path = filePath(request);
+  if (!findAsset(path, true, true) && !_fs.exists(path) &&
+      !_fs.exists(path + ".gz") && !_fs.exists(path + ".br")) {
+    return false;
+  }
+  request->addInterestingHeader("Accept-Encoding");
+  request->addInterestingHeader("If-None-Match");
+  return true;
+}
+
+void AsyncUIHandler::handleRequest(AsyncWebServerRequest *request) {
+  RequestMetrics::track(request, REQUEST_HANDLER_STATIC);
+  String path = filePath(request);
+  String type = AsyncFileStreamResponse::contentType(path);
+  AsyncWebHeader *acceptHeader = request->getHeader("Accept-Encoding");
+  String accept = acceptHeader ? acceptHeader->value() : String();
+  bool br = accept.indexOf("br") != -1;
+  bool gzip = accept.indexOf("gzip") != -1;
+
+  // hot set straight from RAM
+  std::shared_ptr<UIAsset> asset = findAsset(path, br, gzip);
+  if (asset) {
+    AsyncWebHeader *noneMatch = request->getHeader("If-None-Match");
+    AsyncWebServerResponse *response;
+    if (noneMatch && noneMatch->value().indexOf(asset->etag) != -1) {
+      response = request->beginResponse(304);
+    } else {
+      // the response keeps the asset, a change on the card may drop it
+      // from the hot set while it is still being sent
+      response = request->beginResponse(
+          type, asset->len,
+          [asset](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+            size_t n = std::min(maxLen, asset->len - index);
+            memcpy(buffer, asset->data + index, n);
+            return n;
+          });
+      if (asset->encoding) {
+        response->addHeader("Content-Encoding", asset->encoding);
+      }
+    }
+    response->addHeader("ETag", asset->etag);
+    response->addHeader("Vary", "Accept-Encoding");
+    response->addHeader("Cache-Control", cacheControl(path));
+    return request->send(response);
+  }
+
+  // everything else from the card, compressed when there is a variant
+  const char *encoding = NULL;
+  if (br && _fs.exists(path + ".br")) {
+    encoding = "br";
+  } else if (gzip && _fs.exists(path + ".gz")) {
+    encoding = "gzip";
+  } else if (!_fs.exists(path)) {
+    return request->send(406);
+  }
+  AsyncWebServerResponse *response = new AsyncFileStreamResponse(
+      _fs, path + encodingSuffix(encoding), type);
+  if (encoding) {
+    response->addHeader("Content-Encoding", encoding);
+  }
+  response->addHeader("Vary", "Accept-Encoding");
+  String control = cacheControl(path);
+  if (control.length()) {
+    response->addHeader("Cache-Control", control);
+  }
+  request->send(response);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <memory>
+#include <vector>
+
+// One encoding of a UI file kept in RAM. Responses hold on to it, so one
+// dropped while it is still being sent lives until the send is done.
+struct UIAsset {
+  String path;
+  const char *encoding;
+  uint8_t *data;
+  size_t len;
+  String etag;
+
+  UIAsset() : encoding(NULL), data(NULL), len(0) {}
+  UIAsset(const UIAsset &) = delete;
+  UIAsset &operator=(const UIAsset &) = delete;
+  ~UIAsset() { free(data); }
+};
+
+// Serves the web UI from a directory on the card. Pre-compressed .br and .gz
+// variants are picked by Accept-Encoding, and a small hot set is loaded into
+// RAM at boot so the first page load does not wait on the card; it keeps the
+// smallest variant of each file only. A hot file changed on the card is
+// served from the card until loop() has loaded it again.
+class AsyncUIHandler : public AsyncWebHandler {
+  using FS = fs::FS;
+
+protected:
+  FS _fs;
+  String _root;
+  String _defaultFile;
+  String _cacheControl;
+  std::vector<std::shared_ptr<UIAsset>> _assets;
+  // files given to cache(), and the ones of them changed since
+  std::vector<String> _hot;
+  std::vector<String> _stale;
+  SemaphoreHandle_t _lock;
+
+public:
+  AsyncUIHandler(FS &fs, const String &root);
+  ~AsyncUIHandler();
+
+  AsyncUIHandler &setDefaultFile(const String &filename);
+  AsyncUIHandler &setCacheControl(const String &cacheControl);
+  // keeps the file, relative to the root, in RAM from now on
+  AsyncUIHandler &cache(const String &file);
+  // a path on the card changed, with everything below it; from any task
+  void invalidate(const String &path);
+  // loads changed hot files again, from the main loop
+  void loop();
+
+  virtual bool canHandle(AsyncWebServerRequest *request) override final;
+  virtual void handleRequest(AsyncWebServerRequest *request) override final;
+  virtual bool isRequestHandlerTrivial() override final { return false; }
+
+  size_t cachedBytes() const;
+
+private:
+  String filePath(AsyncWebServerRequest *request) const;
+  void load(const String &path, std::vector<std::shared_ptr<UIAsset>> &out);
+  std::shared_ptr<UIAsset> loadAsset(const String &path,
+                                     const char *encoding);
+  std::shared_ptr<UIAsset> findAsset(const String &path, bool br,
+                                     bool gzip) const;
+  void dropAssets(const String &path);
+  String cacheControl(const String &path) const;
+  static const char *encodingSuffix(const char *encoding);
+};
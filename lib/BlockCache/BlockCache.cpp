@@ -0,0 +1,334 @@
+#include "BlockCache.h"
+
+BlockCache::BlockCache()
+    : _lock(xSemaphoreCreateMutex()), _data(NULL), _head(NONE), _tail(NONE),
+      _free(NONE), _nextId(1), _tick(0), _hits(0), _misses(0), _evictions(0),
+      _readAheads(0) {}
+
+bool BlockCache::begin() {
+  if (_data) {
+    return true;
+  }
+  if (!psramFound()) {
+    return false;
+  }
+  _data = (uint8_t *)ps_malloc((size_t)BLOCK_CACHE_BLOCK * BLOCK_CACHE_BLOCKS);
+  if (!_data) {
+    return false;
+  }
+  for (int i = BLOCK_CACHE_BLOCKS - 1; i >= 0; i--) {
+    _slots[i].next = _free;
+    _free = i;
+  }
+  return true;
+}
+
+uint32_t BlockCache::fileId(const String &path, size_t size,
+                            time_t lastWrite) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  std::map<String, FileEntry>::iterator it = _files.find(path);
+  if (it == _files.end()) {
+    if (_files.size() >= BLOCK_CACHE_FILES) {
+      // the file read longest ago makes room
+      std::map<String, FileEntry>::iterator oldest = _files.begin();
+      for (it = _files.begin(); it != _files.end(); ++it) {
+        if (it->second.used < oldest->second.used) {
+          oldest = it;
+        }
+      }
+      _files.erase(oldest);
+    }
+    FileEntry entry = {_nextId++, size, lastWrite, 0};
+    it = _files.insert(std::make_pair(path, entry)).first;
+  } else if (it->second.size != size || it->second.lastWrite != lastWrite) {
+    it->second.id = _nextId++;
+    it->second.size = size;
+    it->second.lastWrite = lastWrite;
+  }
+  it->second.used = ++_tick;
+  uint32_t id = it->second.id;
+  xSemaphoreGive(_lock);
+  return id;
+}
+
+void BlockCache::invalidate(const String &path, bool tree) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _files.erase(path);
+  if (tree) {
+    String prefix = path.endsWith("/") ? path : path + "/";
+    std::map<String, FileEntry>::iterator it = _files.lower_bound(prefix);
+    while (it != _files.end() && it->first.startsWith(prefix)) {
+      it = _files.erase(it);
+    }
+  }
+  xSemaphoreGive(_lock);
+}
+
+bool BlockCache::read(uint32_t file, uint32_t block, size_t offset,
+                      uint8_t *data, size_t &len) {
+  if (!_data) {
+    return false;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  std::map<uint64_t, uint16_t>::iterator it = _index.find(key(file, block));
+  if (it == _index.end() || offset >= _slots[it->second].len) {
+    xSemaphoreGive(_lock);
+    _misses++;
+    return false;
+  }
+  uint16_t slot = it->second;
+  len = min(len, (size_t)_slots[slot].len - offset);
+  memcpy(data, _data + (size_t)slot * BLOCK_CACHE_BLOCK + offset, len);
+  unlink(slot);
+  pushFront(slot);
+  xSemaphoreGive(_lock);
+  _hits++;
+  return true;
+}
+
+bool BlockCache::contains(uint32_t file, uint32_t block) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  bool found = _index.count(key(file, block));
+  xSemaphoreGive(_lock);
+  return found;
+}
+
+bool BlockCache::load(uint32_t file, uint32_t block, bool ahead,
+                      std::function<size_t(uint8_t *)> fill) {
+  if (!_data) {
+    return false;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (_index.count(key(file, block))) {
+    xSemaphoreGive(_lock);
+    return true;
+  }
+  uint16_t slot = _free;
+  if (slot != NONE) {
+    _free = _slots[slot].next;
+  } else {
+    slot = _tail;
+    unlink(slot);
+    _index.erase(_slots[slot].key);
+    _evictions++;
+  }
+  xSemaphoreGive(_lock);
+
+  // the slot is in neither the index nor the list while the card fills it,
+  // so nobody else can see it
+  size_t len = fill(_data + (size_t)slot * BLOCK_CACHE_BLOCK);
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  bool loaded = len &&
+                _index.insert(std::make_pair(key(file, block), slot)).second;
+  if (loaded) {
+    _slots[slot].key = key(file, block);
+    _slots[slot].len = len;
+    pushFront(slot);
+    if (ahead) {
+      _readAheads++;
+    }
+  } else {
+    _slots[slot].next = _free;
+    _free = slot;
+  }
+  xSemaphoreGive(_lock);
+  return loaded;
+}
+
+size_t BlockCache::used() const {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t used = _index.size();
+  xSemaphoreGive(_lock);
+  return used;
+}
+
+void BlockCache::unlink(uint16_t slot) {
+  Slot &s = _slots[slot];
+  if (s.prev != NONE) {
+    _slots[s.prev].next = s.next;
+  } else {
+    _head = s.next;
+  }
+  if (s.next != NONE) {
+    _slots[s.next].prev = s.prev;
+  } else {
+    _tail = s.prev;
+  }
+}
+
+void BlockCache::pushFront(uint16_t slot) {
+  _slots[slot].prev = NONE;
+  _slots[slot].next = _head;
+  if (_head != NONE) {
+    _slots[_head].prev = slot;
+  } else {
+    _tail = slot;
+  }
+  _head = slot;
+}
+
+BlockCacheFile::BlockCacheFile(BlockCache &cache, File file,
+                               const String &path, bool writable)
+    : _cache(cache), _file(file), _path(path), _writable(writable),
+      _cached(false), _id(0), _size(0), _pos(0), _last(-1) {
+  if (_writable) {
+    _cache.invalidate(_path);
+  } else if (_cache.enabled() && _file && !_file.isDirectory() &&
+             _file.size() <= BLOCK_CACHE_MAX_FILE) {
+    _cached = true;
+    _size = _file.size();
+    _id = _cache.fileId(_path, _size, _file.getLastWrite());
+  }
+}
+
+size_t BlockCacheFile::write(const uint8_t *buf, size_t size) {
+  if (!_writable) {
+    return 0;
+  }
+  size_t written = _file.write(buf, size);
+  _cache.invalidate(_path);
+  return written;
+}
+
+size_t BlockCacheFile::read(uint8_t *buf, size_t size) {
+  if (!_cached) {
+    return readTimed(buf, size);
+  }
+  size_t done = 0;
+  while (done < size && _pos < _size) {
+    uint32_t block = _pos / BLOCK_CACHE_BLOCK;
+    size_t offset = _pos % BLOCK_CACHE_BLOCK;
+    size_t len = size - done;
+    if (!_cache.read(_id, block, offset, buf + done, len)) {
+      bool sequential = (int32_t)block == _last + 1;
+      bool copied = false;
+      fetch(block, buf + done, offset, len, copied);
+      if (!copied && !_cache.read(_id, block, offset, buf + done, len)) {
+        // the card failed, or the block is gone again already
+        return done + readCard(buf + done, size - done);
+      }
+      size_t unused = 0;
+      for (uint32_t ahead = block + 1;
+           sequential && ahead <= block + BLOCK_CACHE_READ_AHEAD &&
+           ahead * BLOCK_CACHE_BLOCK < _size;
+           ahead++) {
+        if (!_cache.contains(_id, ahead) &&
+            !fetch(ahead, NULL, 0, unused, copied)) {
+          break;
+        }
+      }
+    }
+    _last = block;
+    _pos += len;
+    done += len;
+  }
+  return done;
+}
+
+bool BlockCacheFile::fetch(uint32_t block, uint8_t *copy, size_t offset,
+                           size_t &len, bool &copied) {
+  size_t at = (size_t)block * BLOCK_CACHE_BLOCK;
+  size_t want = min((size_t)BLOCK_CACHE_BLOCK, _size - at);
+  return _cache.load(_id, block, !copy, [&](uint8_t *data) -> size_t {
+    if (_file.position() != at && !_file.seek(at, SeekSet)) {
+      return 0;
+    }
+    // a short block would be asked for again and again
+    if (readTimed(data, want) != want) {
+      return 0;
+    }
+    if (copy) {
+      // straight out of the block while it is still ours
+      len = min(len, want - offset);
+      memcpy(copy, data + offset, len);
+      copied = true;
+    }
+    return want;
+  });
+}
+
+size_t BlockCacheFile::readCard(uint8_t *buf, size_t size) {
+  if (_file.position() != _pos && !_file.seek(_pos, SeekSet)) {
+    return 0;
+  }
+  size_t len = readTimed(buf, size);
+  _pos += len;
+  return len;
+}
+
+size_t BlockCacheFile::readTimed(uint8_t *buf, size_t size) {
+  uint32_t start = micros();
+  size_t len = _file.read(buf, size);
+  _cache.recordRead(micros() - start);
+  return len;
+}
+
+bool BlockCacheFile::seek(uint32_t pos, SeekMode mode) {
+  if (!_cached) {
+    return _file.seek(pos, mode);
+  }
+  size_t to = pos;
+  if (mode == SeekCur) {
+    to = _pos + pos;
+  } else if (mode == SeekEnd) {
+    to = _size + pos;
+  }
+  if (to > _size) {
+    return false;
+  }
+  _pos = to;
+  return true;
+}
+
+size_t BlockCacheFile::position() const {
+  return _cached ? _pos : _file.position();
+}
+
+size_t BlockCacheFile::size() const { return _cached ? _size : _file.size(); }
+
+void BlockCacheFile::close() {
+  _file.close();
+  if (_writable) {
+    // the date only settles once the file is closed
+    _cache.invalidate(_path);
+  }
+}
+
+fs::FileImplPtr BlockCacheFile::openNextFile(const char *mode) {
+  File next = _file.openNextFile(mode);
+  if (!next) {
+    return fs::FileImplPtr();
+  }
+  String path = next.name();
+  return std::make_shared<BlockCacheFile>(_cache, next, path,
+                                          mode[0] != 'r' || strchr(mode, '+'));
+}
+
+fs::FileImplPtr BlockCacheFSImpl::open(const char *path, const char *mode) {
+  File file = _fs.open(path, mode);
+  if (!file) {
+    return fs::FileImplPtr();
+  }
+  return std::make_shared<BlockCacheFile>(cache, file, path,
+                                          mode[0] != 'r' || strchr(mode, '+'));
+}
+
+bool BlockCacheFSImpl::rename(const char *pathFrom, const char *pathTo) {
+  bool renamed = _fs.rename(pathFrom, pathTo);
+  cache.invalidate(pathFrom, true);
+  cache.invalidate(pathTo, true);
+  return renamed;
+}
+
+bool BlockCacheFSImpl::remove(const char *path) {
+  bool removed = _fs.remove(path);
+  cache.invalidate(path);
+  return removed;
+}
+
+bool BlockCacheFSImpl::rmdir(const char *path) {
+  bool removed = _fs.rmdir(path);
+  cache.invalidate(path, true);
+  return removed;
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <FSImpl.h>
+#include <LatencyHistogram.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+
+// bytes per cached block, a multiple of the sector size
+#ifndef BLOCK_CACHE_BLOCK
+#define BLOCK_CACHE_BLOCK 4096
+#endif
+// blocks kept in PSRAM, half of the 4 MB on the esp32cam
+#ifndef BLOCK_CACHE_BLOCKS
+#define BLOCK_CACHE_BLOCKS 512
+#endif
+// blocks read after a miss once a handle goes through its file front to back
+#ifndef BLOCK_CACHE_READ_AHEAD
+#define BLOCK_CACHE_READ_AHEAD 4
+#endif
+// larger files are read straight from the card, a single pass over one would
+// push everything else out
+#ifndef BLOCK_CACHE_MAX_FILE
+#define BLOCK_CACHE_MAX_FILE (BLOCK_CACHE_BLOCK * BLOCK_CACHE_BLOCKS / 4)
+#endif
+// files whose contents are tracked at once
+#ifndef BLOCK_CACHE_FILES
+#define BLOCK_CACHE_FILES 64
+#endif
+
+// Blocks of recently read files in PSRAM, evicted least recently used first.
+// Blocks belong to an id rather than a path: every change to a file gives
+// its path a new id, and the blocks of the old one are never looked at again
+// and age out.
+class BlockCache {
+public:
+  BlockCache();
+
+  // takes the blocks from PSRAM, false leaves the cache off
+  bool begin();
+  bool enabled() const { return _data != NULL; }
+
+  // id of what path holds now; size and date are checked, so a change made
+  // around the cache is noticed as well
+  uint32_t fileId(const String &path, size_t size, time_t lastWrite);
+  // forgets path, and with tree everything below it
+  void invalidate(const String &path, bool tree = false);
+
+  // copies from offset in a cached block, len is cut to what the block holds
+  bool read(uint32_t file, uint32_t block, size_t offset, uint8_t *data,
+            size_t &len);
+  bool contains(uint32_t file, uint32_t block);
+  // caches what fill puts in a free or evicted block, fill returns the bytes
+  // it read or 0 to give the block back
+  bool load(uint32_t file, uint32_t block, bool ahead,
+            std::function<size_t(uint8_t *)> fill);
+
+  uint32_t hits() const { return _hits; }
+  uint32_t misses() const { return _misses; }
+  uint32_t evictions() const { return _evictions; }
+  // blocks loaded before they were asked for
+  uint32_t readAheads() const { return _readAheads; }
+  size_t used() const;
+  // read calls that went to the card, misses and uncached files alike
+  const LatencyHistogram &readLatency() const { return _readLatency; }
+  void recordRead(uint32_t us) { _readLatency.record(us); }
+
+private:
+  struct FileEntry {
+    uint32_t id;
+    size_t size;
+    time_t lastWrite;
+    uint32_t used;
+  };
+  struct Slot {
+    uint64_t key;
+    uint16_t len;
+    // the list runs from most to least recently used, NONE ends it
+    uint16_t prev;
+    uint16_t next;
+  };
+  static const uint16_t NONE = 0xffff;
+
+  static uint64_t key(uint32_t file, uint32_t block) {
+    return ((uint64_t)file << 32) | block;
+  }
+  void unlink(uint16_t slot);
+  void pushFront(uint16_t slot);
+
+  SemaphoreHandle_t _lock;
+  uint8_t *_data;
+  Slot _slots[BLOCK_CACHE_BLOCKS];
+  std::map<uint64_t, uint16_t> _index;
+  std::map<String, FileEntry> _files;
+  uint16_t _head;
+  uint16_t _tail;
+  // slots never used or given back, chained through next
+  uint16_t _free;
+  uint32_t _nextId;
+  uint32_t _tick;
+  std::atomic<uint32_t> _hits;
+  std::atomic<uint32_t> _misses;
+  std::atomic<uint32_t> _evictions;
+  std::atomic<uint32_t> _readAheads;
+  LatencyHistogram _readLatency;
+};
+
+// A file opened through BlockCacheFS. Small files opened for reading are
+// served from the cache, everything else goes to the card as it is and
+// invalidates the file when written.
+class BlockCacheFile : public fs::FileImpl {
+public:
+  BlockCacheFile(BlockCache &cache, File file, const String &path,
+                 bool writable);
+
+  size_t write(const uint8_t *buf, size_t size) override;
+  size_t read(uint8_t *buf, size_t size) override;
+  void flush() override { _file.flush(); }
+  bool seek(uint32_t pos, SeekMode mode) override;
+  size_t position() const override;
+  size_t size() const override;
+  void close() override;
+  time_t getLastWrite() override { return _file.getLastWrite(); }
+  const char *name() const override { return _file.name(); }
+  boolean isDirectory(void) override { return _file.isDirectory(); }
+  fs::FileImplPtr openNextFile(const char *mode) override;
+  void rewindDirectory(void) override { _file.rewindDirectory(); }
+  operator bool() override { return _file; }
+
+private:
+  // loads block, and copies len bytes from offset when copy is given
+  bool fetch(uint32_t block, uint8_t *copy, size_t offset, size_t &len,
+             bool &copied);
+  size_t readCard(uint8_t *buf, size_t size);
+  size_t readTimed(uint8_t *buf, size_t size);
+
+  BlockCache &_cache;
+  mutable File _file;
+  String _path;
+  bool _writable;
+  bool _cached;
+  uint32_t _id;
+  size_t _size;
+  size_t _pos;
+  // last block read, a miss on the one after it reads ahead
+  int32_t _last;
+};
+
+class BlockCacheFSImpl : public fs::FSImpl {
+public:
+  BlockCacheFSImpl(fs::FS &fs) : _fs(fs) {}
+
+  fs::FileImplPtr open(const char *path, const char *mode) override;
+  bool exists(const char *path) override { return _fs.exists(path); }
+  bool rename(const char *pathFrom, const char *pathTo) override;
+  bool remove(const char *path) override;
+  bool mkdir(const char *path) override { return _fs.mkdir(path); }
+  bool rmdir(const char *path) override;
+
+  BlockCache cache;
+
+private:
+  fs::FS &_fs;
+};
+
+// The card with a read cache in PSRAM in front of it. Hand it to everything
+// that reads files for clients, so repeated downloads and UI assets don't
+// touch the card, and to everything that changes them, so the cache sees
+// every change.
+class BlockCacheFS : public fs::FS {
+public:
+  BlockCacheFS(fs::FS &fs)
+      : BlockCacheFS(std::make_shared<BlockCacheFSImpl>(fs)) {}
+
+  // without PSRAM every call goes straight to the card
+  bool begin() { return _cache.begin(); }
+  const BlockCache &cache() const { return _cache; }
+
+private:
+  BlockCacheFS(std::shared_ptr<BlockCacheFSImpl> impl)
+      : fs::FS(impl), _cache(impl->cache) {}
+
+  BlockCache &_cache;
+};
@@ -0,0 +1,42 @@
+#include "BlockPool.h"
+
+BlockPool::BlockPool(size_t size, size_t count)
+    : _size(size), _count(count), _base((uint8_t *)malloc(size * count)),
+      _free(xQueueCreate(count, sizeof(uint8_t *))), _fallbacks(0) {
+  if (!_base || !_free) {
+    _count = 0;
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    uint8_t *block = _base + i * size;
+    xQueueSend(_free, &block, 0);
+  }
+}
+
+BlockPool::~BlockPool() {
+  if (_free) {
+    vQueueDelete(_free);
+  }
+  free(_base);
+}
+
+uint8_t *BlockPool::acquire() {
+  uint8_t *block;
+  if (_count && xQueueReceive(_free, &block, 0) == pdTRUE) {
+    return block;
+  }
+  _fallbacks++;
+  return (uint8_t *)malloc(_size);
+}
+
+void BlockPool::release(uint8_t *block) {
+  if (block >= _base && block < _base + _size * _count) {
+    xQueueSend(_free, &block, 0);
+  } else {
+    free(block);
+  }
+}
+
+size_t BlockPool::available() const {
+  return _count ? uxQueueMessagesWaiting(_free) : 0;
+}
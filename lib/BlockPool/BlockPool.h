@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+// Fixed-size blocks for buffers that live as long as one request. They are
+// taken from the heap in one piece when the pool is made and handed around
+// from then on, so short-lived buffers never leave holes between the
+// allocations that outlive them. An empty pool falls back to malloc.
+class BlockPool {
+public:
+  BlockPool(size_t size, size_t count);
+  // every block has to be back by then
+  ~BlockPool();
+
+  // never NULL unless the heap is exhausted as well
+  uint8_t *acquire();
+  // takes blocks from acquire(), including the ones it had to malloc
+  void release(uint8_t *block);
+
+  size_t blockSize() const { return _size; }
+  size_t available() const;
+  // acquire() calls the pool couldn't serve
+  uint32_t fallbacks() const { return _fallbacks; }
+
+private:
+  size_t _size;
+  size_t _count;
+  uint8_t *_base;
+  QueueHandle_t _free;
+  std::atomic<uint32_t> _fallbacks;
+};
+
+// Puts the nodes of long-lived containers in PSRAM when the board has it
+template <class T> struct PsramAllocator {
+  typedef T value_type;
+
+  PsramAllocator() {}
+  template <class U> PsramAllocator(const PsramAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    void *p = psramFound() ? ps_malloc(n * sizeof(T)) : NULL;
+    if (!p) {
+      p = malloc(n * sizeof(T));
+    }
+    return (T *)p;
+  }
+  void deallocate(T *p, size_t) { free(p); }
+};
+
+template <class T, class U>
+bool operator==(const PsramAllocator<T> &, const PsramAllocator<U> &) {
+  return true;
+}
+template <class T, class U>
+bool operator!=(const PsramAllocator<T> &, const PsramAllocator<U> &) {
+  return false;
+}
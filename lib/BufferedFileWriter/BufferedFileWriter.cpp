@@ -0,0 +1,413 @@
+#include "BufferedFileWriter.h"
+#include <Arduino.h>
+#include <vector>
+
+QueueHandle_t BufferedFileWriter::_queue = NULL;
+QueueHandle_t BufferedFileWriter::_pool = NULL;
+std::atomic<uint32_t> BufferedFileWriter::_received(0);
+std::atomic<uint32_t> BufferedFileWriter::_openWriters(0);
+LatencyHistogram BufferedFileWriter::_writeLatency;
+uint32_t BufferedFileWriter::_lastRate = 0;
+std::atomic<uint32_t> BufferedFileWriter::_throttled(0);
+
+BufferedFileWriter::BufferedFileWriter()
+    : _fs(NULL), _expected(0), _abort(false), _buffers{NULL, NULL},
+      _bufferCount(0), _active(0), _fill(0), _written(0), _direct(false),
+      _stored(0), _published(0), _packer(NULL), _failed(false), _openedAt(0),
+      _free(NULL), _waiting(false), _starved(false), _client(NULL),
+      _lock(NULL), _held(0) {}
+
+BufferedFileWriter::~BufferedFileWriter() {
+  if (_openedAt) {
+    uint32_t elapsed = millis() - _openedAt;
+    _lastRate = elapsed ? (uint64_t)_written * 1000 / elapsed : 0;
+    _openWriters--;
+  }
+  for (uint8_t i = 0; i < _bufferCount; i++) {
+    xQueueSend(_pool, &_buffers[i], 0);
+  }
+  if (_free) {
+    vSemaphoreDelete(_free);
+  }
+  if (_lock) {
+    vSemaphoreDelete(_lock);
+  }
+  delete _packer;
+}
+
+bool BufferedFileWriter::start() {
+  if (_queue) {
+    return true;
+  }
+  _pool = xQueueCreate(BUFFERED_WRITER_POOL_BLOCKS, sizeof(uint8_t *));
+  if (!_pool) {
+    return false;
+  }
+  for (int i = 0; i < BUFFERED_WRITER_POOL_BLOCKS; i++) {
+    uint8_t *buffer = (uint8_t *)heap_caps_malloc(BUFFERED_WRITER_BLOCK_SIZE,
+                                                  MALLOC_CAP_DMA);
+    if (buffer) {
+      xQueueSend(_pool, &buffer, 0);
+    }
+  }
+  _queue = xQueueCreate(2 * BUFFERED_WRITER_POOL_BLOCKS, sizeof(Job));
+  if (!_queue) {
+    return false;
+  }
+  if (xTaskCreate(writerTask, "sd_writer", 4096, NULL, 2, NULL) != pdPASS) {
+    vQueueDelete(_queue);
+    _queue = NULL;
+    return false;
+  }
+  return true;
+}
+
+size_t BufferedFileWriter::freeBuffers() {
+  return _pool ? uxQueueMessagesWaiting(_pool) : 0;
+}
+
+bool BufferedFileWriter::open(FS &fs, const String &path, bool direct,
+                              bool raw) {
+  _fs = &fs;
+  _path = path;
+  // without the writer task or any buffer, fall back to writing through; a
+  // throttled upload can't, it is turned away before touching the card
+  if (start()) {
+    while (_bufferCount < 2 &&
+           xQueueReceive(_pool, &_buffers[_bufferCount], 0) == pdTRUE) {
+      _bufferCount++;
+    }
+  }
+  if (_bufferCount) {
+    _free = xSemaphoreCreateCounting(_bufferCount, _bufferCount - 1);
+  }
+  if (_client && _bufferCount == 2) {
+    _lock = xSemaphoreCreateMutex();
+  }
+  if (!_free || (_client && !_lock)) {
+    for (uint8_t i = 0; i < _bufferCount; i++) {
+      xQueueSend(_pool, &_buffers[i], 0);
+    }
+    _bufferCount = 0;
+    if (_client) {
+      _starved = true;
+      return false;
+    }
+  }
+
+  // a direct upload would truncate the file there, and an abort would take
+  // it away; replacing one goes through the temp file
+  if (direct && fs.exists(path)) {
+    direct = false;
+  }
+  _tempPath = direct ? path : tempPath(path);
+  _direct = direct;
+  if (direct) {
+    // the writer task publishes progress through it from the first block
+    completion();
+  }
+  _file = fs.open(_tempPath, FILE_WRITE);
+  if (!_file) {
+    return false;
+  }
+  // a direct upload is read while it comes in, it stays as it is
+  if (!direct && !raw && GcodePacker::wants(path)) {
+    _packer = new GcodePacker();
+    if (!_packer->begin()) {
+      delete _packer;
+      _packer = NULL;
+    }
+  }
+  _openedAt = max(millis(), 1ul);
+  _openWriters++;
+  if (_client) {
+    // held bytes are acknowledged through the connection's own callbacks
+    completion()->wake()->attach(_client);
+  }
+  return true;
+}
+
+size_t BufferedFileWriter::write(const uint8_t *data, size_t len) {
+  if (_onData) {
+    _onData(data, len);
+  }
+  if (!_bufferCount) {
+    size_t n = store(data, len);
+    _failed = _failed || n != len;
+    synced(n);
+    _written += n;
+    _received += n;
+    return n;
+  }
+
+  size_t remaining = len;
+  while (remaining) {
+    // only a client sending past the receive window finds no buffer
+    if (_waiting && !nextBuffer()) {
+      _failed = true;
+      break;
+    }
+    size_t n = min(remaining, (size_t)BUFFERED_WRITER_BLOCK_SIZE - _fill);
+    memcpy(_buffers[_active] + _fill, data, n);
+    _fill += n;
+    data += n;
+    remaining -= n;
+    if (_fill == BUFFERED_WRITER_BLOCK_SIZE) {
+      submit(JOB_WRITE);
+    }
+  }
+  if (_client) {
+    hold(len);
+  }
+  len -= remaining;
+  _written += len;
+  _received += len;
+  return len;
+}
+
+void BufferedFileWriter::submit(JobType type) {
+  // a buffer still waited for was submitted whole, nothing is left to close
+  Job job = {this, type, _active, _waiting ? 0 : _fill};
+  // never full: a writer has a job for each of its buffers and a close at
+  // most, and no more writers have buffers than the pool has
+  xQueueSend(_queue, &job, 0);
+  if (type == JOB_WRITE) {
+    nextBuffer();
+  }
+}
+
+// the writer task completes jobs in order, so the buffer handed back is
+// always the oldest one submitted; a throttled writer doesn't wait for it
+bool BufferedFileWriter::nextBuffer() {
+  _waiting = xSemaphoreTake(_free, _client ? 0 : portMAX_DELAY) != pdTRUE;
+  if (_waiting) {
+    return false;
+  }
+  _active = (_active + 1) % _bufferCount;
+  _fill = 0;
+  return true;
+}
+
+// what the buffers take before the writer task hands one back
+size_t BufferedFileWriter::room() {
+  size_t room = uxSemaphoreGetCount(_free) * BUFFERED_WRITER_BLOCK_SIZE;
+  return _waiting ? room : room + BUFFERED_WRITER_BLOCK_SIZE - _fill;
+}
+
+// With less room left than a receive window, the client might send more
+// than fits, so the chunk isn't acknowledged. A buffer is then always in
+// flight, the writer task acknowledges what was held once it comes back.
+void BufferedFileWriter::hold(size_t len) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (room() < BUFFERED_WRITER_RX_WINDOW) {
+    _client->ackLater();
+    _held += len;
+    _throttled++;
+  }
+  xSemaphoreGive(_lock);
+}
+
+// on the writer task, once a buffer came back or the file is closed
+void BufferedFileWriter::release() {
+  if (!_lock) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  size_t held = _held;
+  _held = 0;
+  xSemaphoreGive(_lock);
+  if (held) {
+    _completion->wake()->acknowledge(held);
+  }
+}
+
+void BufferedFileWriter::close() {
+  if (!_bufferCount) {
+    return finish();
+  }
+  submit(JOB_CLOSE);
+}
+
+void BufferedFileWriter::abort() {
+  _abort = true;
+  close();
+}
+
+std::shared_ptr<WriterCompletion> BufferedFileWriter::completion() {
+  if (!_completion) {
+    _completion = std::make_shared<WriterCompletion>();
+  }
+  return _completion;
+}
+
+void BufferedFileWriter::finish() {
+  // the connection may carry on with another request
+  release();
+  bool ok = false;
+  if (_file) {
+    if (_packer && !_failed && !_abort) {
+      _failed = !_packer->finish(_file);
+    }
+    _file.flush();
+    synced(0);
+    _file.close();
+    ok = !_failed && !_abort && (!_expected || _written == _expected);
+    // FAT can't rename over an existing file
+    if (ok && !_direct && _fs->exists(_path)) {
+      ok = _fs->remove(_path);
+    }
+    if (ok && !_direct) {
+      ok = _fs->rename(_tempPath, _path);
+    }
+    if (!ok) {
+      _fs->remove(_tempPath);
+    }
+  }
+  if (_onClose) {
+    _onClose(ok);
+  }
+  if (_completion) {
+    _completion->signal(ok);
+  }
+  delete this;
+}
+
+size_t BufferedFileWriter::store(const uint8_t *data, size_t len) {
+  uint32_t start = micros();
+  size_t n =
+      _packer ? _packer->write(_file, data, len) : _file.write(data, len);
+  _writeLatency.record(micros() - start);
+  return n;
+}
+
+// direct uploads flush every block and tell readers how far they may read
+void BufferedFileWriter::synced(size_t len) {
+  _stored += len;
+  if (!_direct) {
+    return;
+  }
+  if (len && _stored - _published < BUFFERED_WRITER_BLOCK_SIZE) {
+    return;
+  }
+  if (len) {
+    _file.flush();
+  }
+  _published = _stored;
+  _completion->sync(_published);
+}
+
+String BufferedFileWriter::tempPath(const String &path) {
+  int slash = path.lastIndexOf('/');
+  return path.substring(0, slash + 1) + "." + path.substring(slash + 1) +
+         ".part";
+}
+
+bool BufferedFileWriter::isTempFile(const String &path) {
+  int slash = path.lastIndexOf('/');
+  return path.length() > (unsigned int)slash + 1 && path[slash + 1] == '.' &&
+         path.endsWith(".part");
+}
+
+void BufferedFileWriter::removeStale(FS &fs) {
+  std::vector<String> dirs;
+  std::vector<String> stale;
+  dirs.push_back("/");
+  while (!dirs.empty()) {
+    String dir = dirs.back();
+    dirs.pop_back();
+    File root = fs.open(dir);
+    if (!root || !root.isDirectory()) {
+      continue;
+    }
+    File child = root.openNextFile();
+    while (child) {
+      // name() is the full path on older cores, only the name on newer
+      String name = child.name();
+      String path = (dir.equals("/") ? "" : dir) + "/" +
+                    name.substring(name.lastIndexOf('/') + 1);
+      if (child.isDirectory()) {
+        dirs.push_back(path);
+      } else if (isTempFile(path)) {
+        stale.push_back(path);
+      }
+      child.close();
+      child = root.openNextFile();
+    }
+    root.close();
+  }
+  for (size_t i = 0; i < stale.size(); i++) {
+    fs.remove(stale[i]);
+  }
+}
+
+void BufferedFileWriter::writerTask(void *arg) {
+  Job job;
+  for (;;) {
+    if (xQueueReceive(_queue, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    BufferedFileWriter *writer = job.writer;
+    if (job.len && !writer->_failed) {
+      size_t n = writer->store(writer->_buffers[job.buffer], job.len);
+      writer->_failed = n != job.len;
+      writer->synced(n);
+    }
+    if (job.type == JOB_WRITE) {
+      xSemaphoreGive(writer->_free);
+      writer->release();
+    } else {
+      writer->finish();
+    }
+  }
+}
+
+AsyncCommitResponse::AsyncCommitResponse(
+    std::shared_ptr<WriterCompletion> completion, uint32_t timeoutMs,
+    Builder build)
+    : _completion(completion), _timeout(timeoutMs), _started(0),
+      _build(build), _inner(NULL) {}
+
+AsyncCommitResponse::~AsyncCommitResponse() {
+  _completion->wake()->detach();
+  delete _inner;
+}
+
+bool AsyncCommitResponse::_finished() const {
+  return _inner ? _inner->_finished() : _state > RESPONSE_WAIT_ACK;
+}
+
+bool AsyncCommitResponse::_failed() const {
+  return _inner ? _inner->_failed() : _state == RESPONSE_FAILED;
+}
+
+void AsyncCommitResponse::_respond(AsyncWebServerRequest *request) {
+  // unfinished, so polls keep coming to _ack() until the outcome is known;
+  // attached first, a commit finishing after the take() below polls it
+  _state = RESPONSE_HEADERS;
+  _started = millis();
+  _completion->wake()->attach(request->client());
+  take(request);
+}
+
+size_t AsyncCommitResponse::_ack(AsyncWebServerRequest *request, size_t len,
+                                 uint32_t time) {
+  if (_inner) {
+    return _inner->_ack(request, len, time);
+  }
+  take(request);
+  return 0;
+}
+
+bool AsyncCommitResponse::take(AsyncWebServerRequest *request) {
+  bool finished = _completion->finished();
+  if (!finished && millis() - _started < _timeout) {
+    return false;
+  }
+  _inner = _build(request, finished && _completion->ok());
+  if (!_inner || !_inner->_sourceValid()) {
+    delete _inner;
+    _inner = new AsyncBasicResponse(500);
+  }
+  _inner->_respond(request);
+  return true;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <FS.h>
+#include <GcodePack.h>
+#include <IoWorkers.h>
+#include <LatencyHistogram.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// Size of each write-behind buffer. A multiple of the SD sector and FAT
+// cluster size, so every flush is a whole-sector aligned write.
+#ifndef BUFFERED_WRITER_BLOCK_SIZE
+#define BUFFERED_WRITER_BLOCK_SIZE (16 * 1024)
+#endif
+// Buffers shared by all uploads, allocated once and never freed
+#ifndef BUFFERED_WRITER_POOL_BLOCKS
+#define BUFFERED_WRITER_POOL_BLOCKS 4
+#endif
+// lwIP's receive window, TCP_WND: how much more a client may send once its
+// body is no longer acknowledged, at most a buffer
+#ifndef BUFFERED_WRITER_RX_WINDOW
+#define BUFFERED_WRITER_RX_WINDOW 5744
+#endif
+
+// Signalled by the writer task once the upload is committed or discarded, or
+// by whoever else finishes a change a response waits for.
+// Direct uploads also publish how much of the file is already on the card,
+// so it can be read while the upload is still running.
+class WriterCompletion {
+public:
+  WriterCompletion()
+      : _done(xSemaphoreCreateBinary()), _ok(false), _finished(false),
+        _synced(0), _wake(std::make_shared<IoWake>()) {}
+  ~WriterCompletion() { vSemaphoreDelete(_done); }
+
+  bool wait(uint32_t ms) {
+    return xSemaphoreTake(_done, pdMS_TO_TICKS(ms)) == pdTRUE;
+  }
+  bool ok() const { return _ok; }
+  // unlike wait(), doesn't consume the signal
+  bool finished() const { return _finished; }
+  // bytes written and flushed, readable by anyone who opens the file now
+  uint32_t synced() const { return _synced; }
+  void sync(uint32_t bytes) { _synced = bytes; }
+  // polls the connection waiting for the outcome once it is known
+  const std::shared_ptr<IoWake> &wake() const { return _wake; }
+  void signal(bool ok) {
+    _ok = ok;
+    _finished = true;
+    xSemaphoreGive(_done);
+    _wake->poll();
+  }
+
+private:
+  SemaphoreHandle_t _done;
+  volatile bool _ok;
+  std::atomic<bool> _finished;
+  std::atomic<uint32_t> _synced;
+  std::shared_ptr<IoWake> _wake;
+};
+
+// Answers an upload once the writer task committed or discarded it. The
+// status can only go out when the outcome is known, so the response waits in
+// its header state without blocking the AsyncTCP task, and the writer task
+// polls the connection when it is done. build makes the actual response;
+// ok is false when the upload failed or wasn't done within timeoutMs.
+class AsyncCommitResponse : public AsyncWebServerResponse {
+public:
+  typedef std::function<AsyncWebServerResponse *(
+      AsyncWebServerRequest *request, bool ok)>
+      Builder;
+
+  AsyncCommitResponse(std::shared_ptr<WriterCompletion> completion,
+                      uint32_t timeoutMs, Builder build);
+  ~AsyncCommitResponse();
+
+  bool _sourceValid() const override { return true; }
+  bool _finished() const override;
+  bool _failed() const override;
+  void _respond(AsyncWebServerRequest *request) override;
+  size_t _ack(AsyncWebServerRequest *request, size_t len,
+              uint32_t time) override;
+
+private:
+  bool take(AsyncWebServerRequest *request);
+
+  std::shared_ptr<WriterCompletion> _completion;
+  uint32_t _timeout;
+  uint32_t _started;
+  Builder _build;
+  AsyncWebServerResponse *_inner;
+};
+
+// Streams an upload into a file through up to two large buffers taken from a
+// shared pool. Full buffers are handed to a shared writer task, so the caller
+// only copies bytes and never waits on the card unless all of its buffers are
+// still in flight. When the pool is empty the writer makes do with one
+// buffer, or writes straight through.
+//
+// The AsyncTCP task must not wait at all, so an upload fed from its
+// callbacks is throttled instead: it needs both buffers or doesn't open, and
+// once they can't take another receive window the body is no longer
+// acknowledged. The client stops sending until the writer task hands a
+// buffer back and acknowledges what was held.
+//
+// The data goes to a hidden temp file next to the target, which only
+// replaces the target once everything is on the card, so a dropped upload
+// never leaves a half-written G-code under the real name. A direct upload
+// writes under the real name instead and flushes every block, so the file
+// can be printed while it is still coming in; FAT can't rename a file that
+// is open for reading. Only a new file is written directly, an upload that
+// replaces one always goes through the temp file. With GCODE_PACK, other
+// G-code uploads are packed on the writer task on their way to the card.
+class BufferedFileWriter {
+  using FS = fs::FS;
+
+public:
+  BufferedFileWriter();
+
+  // a raw writer never packs, for bytes that are already on the card; direct
+  // is ignored when path exists, see direct()
+  bool open(FS &fs, const String &path, bool direct = false, bool raw = false);
+  // before open(): the upload comes in through client's receive callbacks;
+  // detach completion()->wake() once the client is gone
+  void throttle(AsyncClient *client) { _client = client; }
+  size_t write(const uint8_t *data, size_t len);
+  // the upload is only committed when exactly this many bytes were written
+  void expectSize(size_t size) { _expected = size; }
+  // Queues the remaining data, fsync, close and the rename into place. The
+  // writer deletes itself once the file is closed, so the pointer must not be
+  // used afterwards.
+  void close();
+  // like close(), but the temp file is removed instead
+  void abort();
+  std::shared_ptr<WriterCompletion> completion();
+  // called from the writer task once the file is closed, before completion()
+  // is signalled, with whether the file was committed under its name
+  void onClose(std::function<void(bool committed)> fn) { _onClose = fn; }
+  // sees every chunk as it is written, on the caller's task
+  void onData(std::function<void(const uint8_t *data, size_t len)> fn) {
+    _onData = fn;
+  }
+
+  bool failed() const { return _failed; }
+  // open() failed for want of buffers, worth a retry later
+  bool starved() const { return _starved; }
+  // whether the upload is written under its real name
+  bool direct() const { return _direct; }
+  size_t written() const { return _written; }
+
+  static size_t freeBuffers();
+  static bool isTempFile(const String &path);
+  // removes temp files left behind by uploads cut off by a reset
+  static void removeStale(FS &fs);
+  // totals for telemetry: bytes handed to any writer, writers open, card
+  // write latency and the rate of the last finished upload in bytes/s
+  static uint32_t received() { return _received; }
+  static uint32_t openWriters() { return _openWriters; }
+  static const LatencyHistogram &writeLatency() { return _writeLatency; }
+  static uint32_t lastRate() { return _lastRate; }
+  // chunks whose acknowledgement was held back
+  static uint32_t throttled() { return _throttled; }
+
+private:
+  enum JobType { JOB_WRITE, JOB_CLOSE };
+  struct Job {
+    BufferedFileWriter *writer;
+    JobType type;
+    uint8_t buffer;
+    size_t len;
+  };
+
+  ~BufferedFileWriter();
+  void submit(JobType type);
+  bool nextBuffer();
+  size_t room();
+  void hold(size_t len);
+  void release();
+  void finish();
+  size_t store(const uint8_t *data, size_t len);
+  void synced(size_t len);
+  static String tempPath(const String &path);
+  static void writerTask(void *arg);
+  static bool start();
+
+  FS *_fs;
+  String _path;
+  String _tempPath;
+  File _file;
+  size_t _expected;
+  bool _abort;
+  std::shared_ptr<WriterCompletion> _completion;
+  uint8_t *_buffers[2];
+  uint8_t _bufferCount;
+  uint8_t _active;
+  size_t _fill;
+  size_t _written;
+  bool _direct;
+  size_t _stored;
+  size_t _published;
+  GcodePacker *_packer;
+  volatile bool _failed;
+  uint32_t _openedAt;
+  SemaphoreHandle_t _free;
+  // all of the active buffer went to the writer task, none came back yet
+  bool _waiting;
+  bool _starved;
+  AsyncClient *_client;
+  // received bytes not acknowledged yet, under _lock
+  SemaphoreHandle_t _lock;
+  size_t _held;
+  std::function<void(bool committed)> _onClose;
+  std::function<void(const uint8_t *data, size_t len)> _onData;
+
+  static QueueHandle_t _queue;
+  static QueueHandle_t _pool;
+  static std::atomic<uint32_t> _received;
+  static std::atomic<uint32_t> _openWriters;
+  static LatencyHistogram _writeLatency;
+  static uint32_t _lastRate;
+  static std::atomic<uint32_t> _throttled;
+};
@@ -1,15 +1,34 @@
 #include "AsyncWebDAV.h"
 #include <Arduino.h>
-#include <DateTime.h>
 #include <ESPAsyncWebServer.h>
-#include <Hash.h>
+#include <RequestMetrics.h>
+#include <memory>
 
-AsyncWebDAV::AsyncWebDAV(const String &url, FS &fs) : _fs(fs), _url(url) {
+static String davBaseUrl(const String &url) {
   // Ensure leading '/'
-  if (_url.length() == 0 || _url[0] != '/')
-    _url = "/" + _url;
+  if (url.length() == 0 || url[0] != '/')
+    return "/" + url;
+  return url;
 }
 
+// prints s with its spaces as %20, without a copy
+static void printEscaped(Print *out, const char *s) {
+  const char *start = s;
+  for (; *s; s++) {
+    if (*s == ' ') {
+      out->write((const uint8_t *)start, s - start);
+      out->print("%20");
+      start = s + 1;
+    }
+  }
+  out->write((const uint8_t *)start, s - start);
+}
+
+AsyncWebDAV::AsyncWebDAV(const String &url, FS &fs, GcodeIndex *index)
+    : _fs(fs), _url(davBaseUrl(url)), _cache(fs, _url), _index(index),
+      _blocks(DAV_FRAGMENT_SIZE, DAV_FRAGMENT_BLOCKS), _lastPropfindHeap(0),
+      _peakPropfindHeap(0) {}
+
 bool AsyncWebDAV::canHandle(AsyncWebServerRequest *request) {
   if (request->url().startsWith(_url)) {
     if (request->method() == HTTP_PROPFIND ||
@@ -19,13 +38,26 @@ bool AsyncWebDAV::canHandle(AsyncWebServerRequest *request) {
     }
     if (request->method() == HTTP_MOVE) {
       request->addInterestingHeader("destination");
+      request->addInterestingHeader("overwrite");
+      return true;
+    }
+    if (request->method() == HTTP_COPY) {
+      request->addInterestingHeader("destination");
+      request->addInterestingHeader("depth");
+      request->addInterestingHeader("overwrite");
+      return true;
+    }
+    if (request->method() == HTTP_GET) {
+      request->addInterestingHeader("range");
+      request->addInterestingHeader("if-range");
+      request->addInterestingHeader("if-none-match");
+      request->addInterestingHeader("if-modified-since");
       return true;
     }
-    if (request->method() == HTTP_GET || request->method() == HTTP_HEAD ||
-        request->method() == HTTP_OPTIONS || request->method() == HTTP_PUT ||
-        request->method() == HTTP_LOCK || request->method() == HTTP_UNLOCK ||
-        request->method() == HTTP_MKCOL || request->method() == HTTP_DELETE ||
-        request->method() == HTTP_COPY) {
+    if (request->method() == HTTP_HEAD || request->method() == HTTP_OPTIONS ||
+        request->method() == HTTP_PUT || request->method() == HTTP_LOCK ||
+        request->method() == HTTP_UNLOCK || request->method() == HTTP_MKCOL ||
+        request->method() == HTTP_DELETE) {
       return true;
     }
   }
@@ -33,47 +65,37 @@ bool AsyncWebDAV::canHandle(AsyncWebServerRequest *request) {
 }
 
 void AsyncWebDAV::handleRequest(AsyncWebServerRequest *request) {
-  // parse the url to a proper path
-  String path = request->url().substring(_url.length());
-  if (path.isEmpty()) {
-    path = "/";
+  RequestMetrics::track(request, REQUEST_HANDLER_DAV);
+  String path = requestPath(request);
+
+  // reads look the path up on an I/O worker
+  if (request->method() == HTTP_PROPFIND ||
+      request->method() == HTTP_PROPPATCH) {
+    return handlePropfind(path, request);
+  }
+  if (request->method() == HTTP_GET) {
+    return handleGet(path, request);
   }
-  if (!path.equals("/") && path.endsWith("/")) {
-    path = path.substring(0, path.length() - 1);
+  // an upload looked its path up with the first chunk, the card may be busy
+  // with its writes by now
+  if (request->method() == HTTP_PUT && _uploads.count(request)) {
+    return handlePut(path, DAV_RESOURCE_FILE, request);
   }
 
-  // check resource type on local storage
+  // check resource type, from the cache when possible
   DavResourceType resource = DAV_RESOURCE_NONE;
-  File baseFile = _fs.open(path, FILE_READ);
-
-  if (baseFile) {
-    resource = baseFile.isDirectory() ? DAV_RESOURCE_DIR : DAV_RESOURCE_FILE;
-    baseFile.close();
+  DavMetaEntry entry;
+  entry.type = DAV_RESOURCE_NONE;
+  if (_cache.lookup(path, entry)) {
+    resource = entry.type;
   }
 
   // route the request
-  if (request->method() == HTTP_PROPFIND ||
-      request->method() == HTTP_PROPPATCH) {
-    return handlePropfind(path, resource, request);
-  }
-  if (request->method() == HTTP_GET) {
-    return handleGet(path, resource, request);
-  }
   if (request->method() == HTTP_HEAD || request->method() == HTTP_OPTIONS) {
     return handleHead(resource, request);
   }
   if (request->method() == HTTP_PUT) {
-    if (_fs.exists(path)) {
-      return request->send(200);
-    } else {
-      File f = _fs.open(path, "a");
-      if (f) {
-        f.close();
-        return request->send(201);
-      } else {
-        return request->send(500);
-      }
-    }
+    return handlePut(path, resource, request);
   }
   if (request->method() == HTTP_LOCK) {
     return handleLock(path, resource, request);
@@ -87,6 +109,9 @@ void AsyncWebDAV::handleRequest(AsyncWebServerRequest *request) {
   if (request->method() == HTTP_MOVE) {
     return handleMove(path, resource, request);
   }
+  if (request->method() == HTTP_COPY) {
+    return handleCopy(path, resource, request);
+  }
   if (request->method() == HTTP_DELETE) {
     return handleDelete(path, resource, request);
   }
@@ -97,36 +122,14 @@ void AsyncWebDAV::handleRequest(AsyncWebServerRequest *request) {
 void AsyncWebDAV::handleBody(AsyncWebServerRequest *request,
                              unsigned char *data, size_t len, size_t index,
                              size_t total) {
-  // parse the url to a proper path
-  String path = request->url().substring(_url.length());
-  if (path.isEmpty()) {
-    path = "/";
-  }
-  if (!path.equals("/") && path.endsWith("/")) {
-    path = path.substring(0, path.length() - 1);
-  }
-
-  // check resource type on local storage
-  DavResourceType resource = DAV_RESOURCE_NONE;
-  File baseFile = _fs.open(path, FILE_READ);
-  if (baseFile) {
-    resource = baseFile.isDirectory() ? DAV_RESOURCE_DIR : DAV_RESOURCE_FILE;
-    baseFile.close();
-  }
-
   // route the request
   if (request->method() == HTTP_PUT) {
-    return handlePut(path, resource, request, data, len, index, total);
+    return handlePutBody(request, data, len, index, total);
   }
 }
 
-void AsyncWebDAV::handlePropfind(const String &path, DavResourceType resource,
+void AsyncWebDAV::handlePropfind(const String &path,
                                  AsyncWebServerRequest *request) {
-  // check whether file or dir exists
-  if (resource == DAV_RESOURCE_NONE) {
-    return handleNotFound(request);
-  }
-
   // check depth header
   DavDepthType depth = DAV_DEPTH_NONE;
   AsyncWebHeader *depthHeader = request->getHeader("Depth");
@@ -138,57 +141,670 @@ void AsyncWebDAV::handlePropfind(const String &path, DavResourceType resource,
     }
   }
 
-  // prepare response
-  File baseFile = _fs.open(path, FILE_READ);
-  AsyncResponseStream *response =
-      request->beginResponseStream("application/xml");
+  // the batches after the first poll the connection the same way
+  std::shared_ptr<IoWake> wake = std::make_shared<IoWake>();
+  request->send(new AsyncIoResponse(
+      IO_OP_DAV_PROPFIND,
+      [this, path, depth, wake]() {
+        return buildPropfind(path, depth, wake);
+      },
+      wake));
+}
+
+// runs on an I/O worker
+AsyncWebServerResponse *
+AsyncWebDAV::buildPropfind(const String &path, DavDepthType depth,
+                           std::shared_ptr<IoWake> wake) {
+  // check whether file or dir exists
+  DavMetaEntry entry;
+  if (!_cache.lookup(path, entry)) {
+    return notFound();
+  }
+
+  // stream the multistatus a few entries at a time, so the heap stays flat
+  // no matter how many files the directory holds
+  std::shared_ptr<DavPropfindState> state =
+      std::make_shared<DavPropfindState>();
+  state->path = path;
+  state->resource = entry.type;
+  state->depth = depth;
+  state->stage = DAV_PROPFIND_HEAD;
+  state->entries = 0;
+  state->busy = false;
+  state->largest = 0;
+  state->wake = wake;
+  state->startHeap = ESP.getFreeHeap();
+  state->minHeap = state->startHeap;
+  state->fragment.begin(_blocks);
+  state->sending.begin(_blocks);
+  nextPropfindBatch(*state);
+
+  AsyncWebServerResponse *response = new AsyncChunkedResponse(
+      "application/xml",
+      [this, state](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return fillPropfind(state, buffer, maxLen);
+      });
   response->setCode(207);
+  return response;
+}
+
+// Sends what the worker wrote and hands it the next batch. Only memory is
+// touched here, the directories are read on the worker.
+size_t
+AsyncWebDAV::fillPropfind(const std::shared_ptr<DavPropfindState> &state,
+                          uint8_t *buffer, size_t maxLen) {
+  DavFragment &sending = state->sending;
+  size_t written = 0;
+  while (written < maxLen) {
+    size_t n = sending.read(buffer + written, maxLen - written);
+    if (n) {
+      written += n;
+      continue;
+    }
+    if (state->busy || !state->fragment.available()) {
+      break;
+    }
+    sending.clear();
+    sending.swap(state->fragment);
+    if (state->stage != DAV_PROPFIND_DONE) {
+      state->busy = true;
+      state->self = state;
+      // two pointers fit in std::function without an allocation
+      DavPropfindState *next = state.get();
+      IoWorkers::submit(IO_OP_DAV_PROPFIND, [this, next]() {
+        nextPropfindBatch(*next);
+        std::shared_ptr<DavPropfindState> self;
+        self.swap(next->self);
+        next->busy = false;
+        next->wake->poll();
+      });
+    }
+  }
+
+  // track how much heap the request needed at its worst
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < state->minHeap) {
+    state->minHeap = freeHeap;
+  }
+  if (written) {
+    return written;
+  }
+  if (state->busy) {
+    // the batch polls the connection when it is there
+    return RESPONSE_TRY_AGAIN;
+  }
+  _lastPropfindHeap = state->startHeap - state->minHeap;
+  if (_lastPropfindHeap > _peakPropfindHeap) {
+    _peakPropfindHeap = _lastPropfindHeap;
+  }
+  return 0;
+}
+
+// runs on an I/O worker: entries until the block may not hold another one,
+// reading directories from the card where the cache doesn't have them
+void AsyncWebDAV::nextPropfindBatch(DavPropfindState &state) {
+  DavFragment &fragment = state.fragment;
+  size_t before = fragment.available();
+  while (nextPropfindFragment(state)) {
+    size_t after = fragment.available();
+    state.largest = max(state.largest, after - before);
+    before = after;
+    if (after + state.largest > _blocks.blockSize()) {
+      break;
+    }
+  }
+}
+
+bool AsyncWebDAV::nextPropfindFragment(DavPropfindState &state) {
+  switch (state.stage) {
+  case DAV_PROPFIND_HEAD: {
+    state.fragment.print("<?xml version=\"1.0\"?>");
+    state.fragment.print("<d:multistatus xmlns:d=\"DAV:\">");
+    DavMetaEntry entry;
+    if (!_cache.lookup(state.path, entry)) {
+      state.stage = DAV_PROPFIND_TAIL;
+      return true;
+    }
+    sendPropResponse(&state.fragment, state.path, entry);
+    state.entries++;
+    state.stage = DAV_PROPFIND_TAIL;
+    if (entry.type == DAV_RESOURCE_DIR && state.depth != DAV_DEPTH_NONE) {
+      openPropfindDir(state, state.path);
+      state.stage = DAV_PROPFIND_CHILDREN;
+    }
+    return true;
+  }
+  case DAV_PROPFIND_CHILDREN: {
+    // walk the tree depth first with an explicit stack, one entry per call
+    while (!state.frames.empty() || !state.deferred.empty()) {
+      if (state.frames.empty()) {
+        String path = state.deferred.back();
+        state.deferred.pop_back();
+        openPropfindDir(state, path);
+        continue;
+      }
+      String childPath;
+      DavMetaEntry entry;
+      if (!nextPropfindChild(state.frames.back(), childPath, entry)) {
+        state.frames.pop_back();
+        continue;
+      }
+      if (state.entries >= DAV_PROPFIND_MAX_ENTRIES) {
+        // tell the client the listing is incomplete (RFC 5842 / DASL)
+        state.fragment.print("<d:response>");
+        state.fragment.print("<d:href>");
+        printEscaped(&state.fragment, _url.c_str());
+        printEscaped(&state.fragment, state.path.c_str());
+        state.fragment.print("</d:href>");
+        state.fragment.print(
+            "<d:status>HTTP/1.1 507 Insufficient Storage</d:status>");
+        state.fragment.print(
+            "<d:error><d:number-of-matches-within-limits/></d:error>");
+        state.fragment.print("</d:response>");
+        closePropfind(state);
+        break;
+      }
+      sendPropResponse(&state.fragment, childPath, entry);
+      state.entries++;
+      if (entry.type == DAV_RESOURCE_DIR && state.depth == DAV_DEPTH_ALL) {
+        if (state.frames.size() < DAV_PROPFIND_MAX_OPEN_DIRS) {
+          openPropfindDir(state, childPath);
+        } else {
+          state.deferred.push_back(childPath);
+        }
+      }
+      return true;
+    }
+    state.stage = DAV_PROPFIND_TAIL;
+  }
+  // fall through
+  case DAV_PROPFIND_TAIL:
+    state.fragment.print("</d:multistatus>");
+    state.stage = DAV_PROPFIND_DONE;
+    return true;
+  default:
+    closePropfind(state);
+    return false;
+  }
+}
 
-  response->print("<?xml version=\"1.0\"?>");
-  response->print("<d:multistatus xmlns:d=\"DAV:\">");
-  sendPropResponse(response, false, &baseFile);
-  if (resource == DAV_RESOURCE_DIR && depth == DAV_DEPTH_CHILD) {
-    File root = _fs.open(path);
-    File childFile = root.openNextFile();
-    while (childFile) {
-      sendPropResponse(response, true, &childFile);
+void AsyncWebDAV::openPropfindDir(DavPropfindState &state,
+                                  const String &path) {
+  DavMetaEntry entry;
+  if (!_cache.lookup(path, entry) || entry.type != DAV_RESOURCE_DIR) {
+    return;
+  }
+  DavPropfindFrame frame;
+  frame.path = path;
+  frame.cached = entry.listed;
+  frame.generation = _cache.generation();
+  if (!frame.cached) {
+    frame.dir = _fs.open(path);
+    if (!frame.dir) {
+      return;
+    }
+  }
+  state.frames.push_back(frame);
+}
+
+bool AsyncWebDAV::nextPropfindChild(DavPropfindFrame &frame, String &path,
+                                    DavMetaEntry &entry) {
+  if (frame.cached) {
+    if (frame.generation == _cache.generation()) {
+      if (!_cache.nextChild(frame.path, frame.childKey, entry)) {
+        return false;
+      }
+      path = frame.childKey;
+      return true;
+    }
+    // the cache changed under us, carry on from the card after the last
+    // child sent
+    frame.cached = false;
+    frame.generation = _cache.generation();
+    frame.dir = _fs.open(frame.path);
+    if (!frame.dir) {
+      return false;
+    }
+  }
+
+  File childFile = frame.dir.openNextFile();
+  while (childFile) {
+    // name() is the full path on older cores, only the name on newer
+    const char *name = childFile.name();
+    const char *slash = strrchr(name, '/');
+    path = frame.path.equals("/") ? "" : frame.path;
+    path += '/';
+    path += slash ? slash + 1 : name;
+    // uploads in progress and the G-code index are not part of the
+    // listing, neither is what the cache already handed out
+    if (BufferedFileWriter::isTempFile(path) ||
+        GcodeIndex::isIndexPath(path) ||
+        (!frame.childKey.isEmpty() && path.compareTo(frame.childKey) <= 0)) {
       childFile.close();
-      childFile = root.openNextFile();
+      childFile = frame.dir.openNextFile();
+      continue;
     }
+    _cache.store(path, childFile, entry, frame.generation);
+    childFile.close();
+    return true;
+  }
+  frame.dir.close();
+  if (frame.childKey.isEmpty()) {
+    _cache.markListed(frame.path, frame.generation);
   }
-  response->print("</d:multistatus>");
+  return false;
+}
 
-  baseFile.close();
-  return request->send(response);
+void AsyncWebDAV::closePropfind(DavPropfindState &state) {
+  for (size_t i = 0; i < state.frames.size(); i++) {
+    if (state.frames[i].dir) {
+      state.frames[i].dir.close();
+    }
+  }
+  state.frames.clear();
+  state.deferred.clear();
 }
 
-void AsyncWebDAV::handleGet(const String &path, DavResourceType resource,
+void AsyncWebDAV::handleGet(const String &path,
                             AsyncWebServerRequest *request) {
-  if (resource != DAV_RESOURCE_FILE) {
-    return handleNotFound(request);
+  // the headers are copied, the request may be gone once the worker runs
+  DavGetRequest get;
+  get.path = path;
+  AsyncWebHeader *header;
+  if ((header = request->getHeader("If-None-Match"))) {
+    get.noneMatch = header->value();
+  }
+  if ((header = request->getHeader("If-Modified-Since"))) {
+    get.modifiedSince = header->value();
+  }
+  if ((header = request->getHeader("Range"))) {
+    get.range = header->value();
+  }
+  if ((header = request->getHeader("If-Range"))) {
+    get.ifRange = header->value();
+  }
+  request->send(new AsyncIoResponse(IO_OP_DAV_GET,
+                                    [this, get]() { return buildGet(get); }));
+}
+
+// runs on an I/O worker
+AsyncWebServerResponse *AsyncWebDAV::buildGet(const DavGetRequest &get) {
+  DavMetaEntry entry;
+  if (!_cache.lookup(get.path, entry) || entry.type != DAV_RESOURCE_FILE) {
+    return notFound();
+  }
+
+  // answer revalidation with the same ETag PROPFIND hands out; a date is
+  // only looked at without one, and any date since the last write will do
+  time_t since;
+  if ((!get.noneMatch.isEmpty() && etagMatches(get.noneMatch, entry.etag)) ||
+      (get.noneMatch.isEmpty() && !get.modifiedSince.isEmpty() &&
+       parseHttpDate(get.modifiedSince, since) && entry.lastWrite <= since)) {
+    AsyncWebServerResponse *response = new AsyncBasicResponse(304);
+    response->addHeader("ETag", String("\"") + entry.etag + "\"");
+    response->addHeader("Last-Modified", entry.lastModified);
+    return response;
+  }
+
+  // a Range only applies while the client's copy is still current; packed
+  // G-code can only be unpacked from the start, so it is sent whole
+  if (!get.range.isEmpty() && !entry.packed &&
+      (get.ifRange.isEmpty() || etagMatches(get.ifRange, entry.etag) ||
+       get.ifRange.equals(entry.lastModified))) {
+    return buildRange(get.path, entry, get.range);
   }
 
-  AsyncWebServerResponse *response = request->beginResponse(_fs, path);
+  AsyncWebServerResponse *response = new AsyncFileStreamResponse(
+      _fs, get.path, AsyncFileStreamResponse::contentType(get.path));
   response->addHeader("Allow",
                       "PROPFIND,OPTIONS,DELETE,COPY,MOVE,HEAD,POST,PUT,GET");
-  request->send(response);
+  response->addHeader("Accept-Ranges", entry.packed ? "none" : "bytes");
+  response->addHeader("ETag", String("\"") + entry.etag + "\"");
+  response->addHeader("Last-Modified", entry.lastModified);
+  return response;
+}
+
+AsyncWebServerResponse *AsyncWebDAV::buildRange(const String &path,
+                                                const DavMetaEntry &entry,
+                                                const String &range) {
+  std::shared_ptr<DavRangeState> state = std::make_shared<DavRangeState>();
+  state->count = parseRanges(range, entry.size, state->ranges);
+  state->part = 0;
+  state->offset = 0;
+
+  String size = String(entry.size);
+  if (state->count < 0) {
+    AsyncWebServerResponse *response = new AsyncBasicResponse(416);
+    response->addHeader("Content-Range", "bytes */" + size);
+    return response;
+  }
+
+  state->file = _fs.open(path, FILE_READ);
+  if (!state->count || !state->file) {
+    // malformed or too many ranges, fall back to the whole file
+    AsyncWebServerResponse *response = new AsyncFileStreamResponse(
+        _fs, path, AsyncFileStreamResponse::contentType(path));
+    response->addHeader("Accept-Ranges", "bytes");
+    response->addHeader("ETag", String("\"") + entry.etag + "\"");
+    return response;
+  }
+
+  String type = AsyncFileStreamResponse::contentType(path);
+  String boundary = String(esp_random(), HEX);
+  size_t length = 0;
+  for (int i = 0; i < state->count; i++) {
+    const DavRange &r = state->ranges[i];
+    String contentRange =
+        String("bytes ") + r.start + "-" + r.end + "/" + size;
+    if (state->count > 1) {
+      state->heads[i] = "\r\n--" + boundary + "\r\nContent-Type: " + type +
+                        "\r\nContent-Range: " + contentRange + "\r\n\r\n";
+    }
+    length += state->heads[i].length() + r.end - r.start + 1;
+  }
+  if (state->count > 1) {
+    state->heads[state->count] = "\r\n--" + boundary + "--\r\n";
+    length += state->heads[state->count].length();
+    type = "multipart/byteranges; boundary=" + boundary;
+  }
+
+  AsyncWebServerResponse *response = new AsyncCallbackResponse(
+      type, length,
+      [state](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return fillRange(*state, buffer, maxLen);
+      });
+  response->setCode(206);
+  if (state->count == 1) {
+    response->addHeader("Content-Range",
+                        String("bytes ") + state->ranges[0].start + "-" +
+                            state->ranges[0].end + "/" + size);
+  }
+  response->addHeader("Accept-Ranges", "bytes");
+  response->addHeader("ETag", String("\"") + entry.etag + "\"");
+  response->addHeader("Last-Modified", entry.lastModified);
+  return response;
+}
+
+int AsyncWebDAV::parseRanges(const String &header, size_t size,
+                             DavRange *ranges) {
+  // returns the number of satisfiable ranges, 0 when the header should be
+  // ignored and -1 when none of the ranges can be served
+  if (!header.startsWith("bytes=")) {
+    return 0;
+  }
+
+  int count = 0;
+  bool any = false;
+  int pos = 6;
+  while (pos < (int)header.length()) {
+    int comma = header.indexOf(',', pos);
+    if (comma == -1) {
+      comma = header.length();
+    }
+    String spec = header.substring(pos, comma);
+    spec.trim();
+    pos = comma + 1;
+    if (spec.isEmpty()) {
+      continue;
+    }
+
+    int dash = spec.indexOf('-');
+    if (dash == -1) {
+      return 0;
+    }
+    String first = spec.substring(0, dash);
+    String last = spec.substring(dash + 1);
+    for (unsigned int i = 0; i < spec.length(); i++) {
+      if ((int)i != dash && !isdigit(spec[i])) {
+        return 0;
+      }
+    }
+    any = true;
+
+    size_t start, end;
+    if (first.isEmpty()) {
+      // suffix range, the last n bytes
+      size_t n = last.toInt();
+      if (!n || !size) {
+        continue;
+      }
+      start = n < size ? size - n : 0;
+      end = size - 1;
+    } else {
+      start = first.toInt();
+      end = last.isEmpty() ? size - 1 : (size_t)last.toInt();
+      // an open range past the end is unsatisfiable, not malformed
+      if (!last.isEmpty() && end < start) {
+        return 0;
+      }
+      if (start >= size) {
+        continue;
+      }
+      end = min(end, size - 1);
+    }
+
+    if (count == DAV_MAX_RANGES) {
+      return 0;
+    }
+    ranges[count].start = start;
+    ranges[count].end = end;
+    count++;
+  }
+
+  if (!any) {
+    return 0;
+  }
+  return count ? count : -1;
+}
+
+size_t AsyncWebDAV::fillRange(DavRangeState &state, uint8_t *buffer,
+                              size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen && state.part <= state.count) {
+    const String &head = state.heads[state.part];
+    if (state.offset < head.length()) {
+      size_t n = min(maxLen - written, head.length() - state.offset);
+      memcpy(buffer + written, head.c_str() + state.offset, n);
+      state.offset += n;
+      written += n;
+      continue;
+    }
+    if (state.part == state.count) {
+      state.part++;
+      break;
+    }
+
+    const DavRange &r = state.ranges[state.part];
+    size_t pos = state.offset - head.length();
+    size_t remaining = r.end - r.start + 1 - pos;
+    if (!remaining) {
+      state.part++;
+      state.offset = 0;
+      continue;
+    }
+    if (!pos) {
+      state.file.seek(r.start, SeekSet);
+    }
+    size_t n = state.file.read(buffer + written,
+                               min(maxLen - written, remaining));
+    if (!n) {
+      break;
+    }
+    state.offset += n;
+    written += n;
+  }
+  return written;
+}
+
+bool AsyncWebDAV::etagMatches(const String &header, const char *etag) {
+  // the tags are 40 hex digits, so finding one in the list is exact enough
+  if (!etag[0]) {
+    return false;
+  }
+  return header.equals("*") || header.indexOf(etag) != -1;
+}
+
+// Seconds since the epoch of an HTTP date in any of the three formats RFC
+// 9110 has a recipient accept:
+//   Sun, 06 Nov 1994 08:49:37 GMT  (IMF-fixdate)
+//   Sunday, 06-Nov-94 08:49:37 GMT (RFC 850)
+//   Sun Nov  6 08:49:37 1994       (asctime)
+bool AsyncWebDAV::parseHttpDate(const String &date, time_t &time) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char month[4];
+  int day, year, hour, minute, second;
+  if (date.indexOf(',') != -1) {
+    if (sscanf(date.c_str(), "%*[^,], %d%*[ -]%3[A-Za-z]%*[ -]%d %d:%d:%d",
+               &day, month, &year, &hour, &minute, &second) != 6) {
+      return false;
+    }
+    // RFC 850 years have two digits
+    if (year < 100) {
+      year += year < 70 ? 2000 : 1900;
+    }
+  } else if (sscanf(date.c_str(), "%*s %3[A-Za-z] %d %d:%d:%d %d", month,
+                    &day, &hour, &minute, &second, &year) != 6) {
+    return false;
+  }
+  const char *found = strlen(month) == 3 ? strstr(months, month) : NULL;
+  if (!found || (found - months) % 3 || day < 1 || day > 31 || hour > 23 ||
+      minute > 59 || second > 60) {
+    return false;
+  }
+  // days since the epoch of the civil date, March-based so the leap day
+  // comes last
+  int m = (found - months) / 3 + 1;
+  int y = year - (m <= 2);
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  long days = era * 146097L + doe - 719468;
+  time = (time_t)days * 86400 + hour * 3600 + minute * 60 + second;
+  return true;
 }
 
 void AsyncWebDAV::handlePut(const String &path, DavResourceType resource,
-                            AsyncWebServerRequest *request, unsigned char *data,
-                            size_t len, size_t index, size_t total) {
+                            AsyncWebServerRequest *request) {
   if (resource == DAV_RESOURCE_DIR) {
     return handleNotFound(request);
   }
 
-  File file;
+  // the body has already been handed to the writer, report how it went
+  std::map<AsyncWebServerRequest *, DavUpload>::iterator it =
+      _uploads.find(request);
+  if (it != _uploads.end()) {
+    int status = it->second.status;
+    std::shared_ptr<WriterCompletion> completion = it->second.completion;
+    finishUpload(request);
+    if (!completion) {
+      return request->send(status);
+    }
+    // the file only exists under its name once the rename went through
+    return request->send(new AsyncCommitResponse(
+        completion, DAV_COMMIT_TIMEOUT_MS,
+        [status](AsyncWebServerRequest *request, bool ok) {
+          return request->beginResponse(ok ? status : 500);
+        }));
+  }
+
+  // empty body, just make sure the file exists
+  if (resource == DAV_RESOURCE_FILE) {
+    return request->send(200);
+  }
+  if (!parentExists(path)) {
+    return request->send(409);
+  }
+  _cache.invalidate(path);
+  sendApplied(request, 201, false,
+              mutate(MUTATION_CREATE, path, "", [this, path](bool ok) {
+                changed(path);
+                if (ok && _index) {
+                  _index->store(path, NULL);
+                }
+              }));
+}
+
+void AsyncWebDAV::handlePutBody(AsyncWebServerRequest *request,
+                                unsigned char *data, size_t len, size_t index,
+                                size_t total) {
   if (!index) {
-    file = _fs.open(path, FILE_WRITE);
-  } else {
-    file = _fs.open(path, FILE_APPEND);
+    String path = requestPath(request);
+
+    // check resource type once per upload
+    DavResourceType resource = DAV_RESOURCE_NONE;
+    DavMetaEntry entry;
+    if (_cache.lookup(path, entry)) {
+      resource = entry.type;
+    }
+    if (resource == DAV_RESOURCE_DIR) {
+      return;
+    }
+
+    DavUpload upload;
+    upload.writer = new BufferedFileWriter();
+    upload.status = resource == DAV_RESOURCE_FILE ? 200 : 201;
+    _cache.invalidate(path);
+    upload.writer->throttle(request->client());
+    if (upload.writer->open(_fs, path)) {
+      upload.writer->expectSize(total);
+      upload.completion = upload.writer->completion();
+      std::shared_ptr<GcodeScanner> scanner;
+      if (_index && GcodeScanner::isGcode(path)) {
+        scanner = std::make_shared<GcodeScanner>();
+        upload.writer->onData([scanner](const uint8_t *data, size_t len) {
+          scanner->feed(data, len);
+        });
+      }
+      // the file is renamed into place by the writer task, drop what was
+      // seen since
+      upload.writer->onClose([this, path, scanner](bool committed) {
+        changed(path);
+        if (committed && _index) {
+          _index->store(path, scanner.get());
+        }
+      });
+    } else {
+      upload.status = upload.writer->starved() ? 503 : 500;
+      upload.writer->close();
+      upload.writer = NULL;
+    }
+    _uploads[request] = upload;
+    RequestMetrics::onDisconnect(request, REQUEST_HANDLER_DAV,
+                                 [this, request]() { finishUpload(request); });
+  }
+
+  std::map<AsyncWebServerRequest *, DavUpload>::iterator it =
+      _uploads.find(request);
+  if (it == _uploads.end() || !it->second.writer) {
+    return;
+  }
+  it->second.writer->write(data, len);
+
+  // close as soon as the last chunk is in, handleRequest only reports
+  if (index + len >= total) {
+    if (it->second.writer->failed()) {
+      it->second.status = 500;
+    }
+    it->second.writer->close();
+    it->second.writer = NULL;
   }
-  file.write(data, len);
-  file.close();
+}
+
+void AsyncWebDAV::finishUpload(AsyncWebServerRequest *request) {
+  std::map<AsyncWebServerRequest *, DavUpload>::iterator it =
+      _uploads.find(request);
+  if (it == _uploads.end()) {
+    return;
+  }
+  // a client that disconnects mid-upload leaves the old file untouched
+  if (it->second.writer) {
+    it->second.writer->abort();
+  }
+  if (it->second.completion) {
+    it->second.completion->wake()->detach();
+  }
+  _uploads.erase(it);
 }
 
 void AsyncWebDAV::handleLock(const String &path, DavResourceType resource,
@@ -243,18 +859,22 @@ void AsyncWebDAV::handleUnlock(const String &path, DavResourceType resource,
 void AsyncWebDAV::handleMkcol(const String &path, DavResourceType resource,
                               AsyncWebServerRequest *request) {
   // does the file/dir already exist?
-  int status;
   if (resource != DAV_RESOURCE_NONE) {
-    status = 405;
-  } else {
-    // create dir and send response
-    if (_fs.mkdir(path)) {
-      status = 201;
-    } else {
-      status = 405;
-    }
+    return request->send(405);
   }
-  request->send(status);
+  if (!parentExists(path)) {
+    return request->send(409);
+  }
+
+  // the worker creates the dir, the answer waits for it
+  _cache.invalidate(path);
+  sendApplied(request, 201, false,
+              mutate(MUTATION_MKDIR, path, "", [this, path](bool ok) {
+                changed(path);
+                if (ok && _index) {
+                  _index->store(path, NULL);
+                }
+              }));
 }
 
 void AsyncWebDAV::handleMove(const String &path, DavResourceType resource,
@@ -267,16 +887,111 @@ void AsyncWebDAV::handleMove(const String &path, DavResourceType resource,
   if (!destinationHeader || destinationHeader->value().isEmpty()) {
     return handleNotFound(request);
   }
+  String destination;
+  if (!urlToUri(destinationHeader->value(), request->host(), destination)) {
+    return request->send(502);
+  }
+  if (!destination.equals("/") && destination.endsWith("/")) {
+    destination = destination.substring(0, destination.length() - 1);
+  }
+  if (path.equals("/") || destination.equals(path) ||
+      destination.startsWith(path + "/")) {
+    return request->send(403);
+  }
+
+  // FAT can't rename over a file, an overwrite removes it first
+  AsyncWebHeader *overwriteHeader = request->getHeader("Overwrite");
+  bool overwrite =
+      !overwriteHeader || !overwriteHeader->value().equalsIgnoreCase("F");
+  DavMetaEntry target;
+  bool exists = _cache.lookup(destination, target);
+  if (exists && !overwrite) {
+    return request->send(412);
+  }
+  if (!parentExists(destination)) {
+    return request->send(409);
+  }
+
+  _cache.invalidate(path);
+  _cache.invalidate(destination);
+  if (exists && !mutate(MUTATION_REMOVE, destination, "",
+                        [this, destination](bool ok) {
+                          changed(destination);
+                          if (ok && _index) {
+                            _index->remove(destination);
+                          }
+                        })) {
+    return request->send(503);
+  }
+  // the mutations are applied in order, the rename comes last
+  sendApplied(request, exists ? 204 : 201, true,
+              mutate(MUTATION_RENAME, path, destination,
+                     [this, path, destination](bool ok) {
+                       changed(path);
+                       changed(destination);
+                       if (ok && _index) {
+                         _index->move(path, destination);
+                       }
+                     }));
+}
+
+void AsyncWebDAV::handleCopy(const String &path, DavResourceType resource,
+                             AsyncWebServerRequest *request) {
+  if (resource == DAV_RESOURCE_NONE) {
+    return handleNotFound(request);
+  }
 
-  AsyncWebServerResponse *response;
-  if (_fs.rename(path, urlToUri(destinationHeader->value()))) {
-    response = request->beginResponse(201);
-    response->addHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
-  } else {
-    response = request->beginResponse(500, "text/plain", "Unable to move");
+  AsyncWebHeader *destinationHeader = request->getHeader("destination");
+  if (!destinationHeader || destinationHeader->value().isEmpty()) {
+    return request->send(400);
+  }
+  String destination;
+  if (!urlToUri(destinationHeader->value(), request->host(), destination)) {
+    return request->send(502);
+  }
+  if (!destination.equals("/") && destination.endsWith("/")) {
+    destination = destination.substring(0, destination.length() - 1);
   }
 
-  request->send(response);
+  // a copy into itself would never end
+  if (path.equals("/") || destination.equals(path) ||
+      destination.startsWith(path + "/")) {
+    return request->send(403);
+  }
+
+  // Depth: 0 copies a collection without its members
+  AsyncWebHeader *depthHeader = request->getHeader("Depth");
+  bool recursive = !depthHeader || !depthHeader->value().equals("0");
+  AsyncWebHeader *overwriteHeader = request->getHeader("Overwrite");
+  bool overwrite =
+      !overwriteHeader || !overwriteHeader->value().equalsIgnoreCase("F");
+
+  DavMetaEntry target;
+  bool exists = _cache.lookup(destination, target);
+  if (exists && !overwrite) {
+    return request->send(412);
+  }
+  if (!parentExists(destination)) {
+    return request->send(409);
+  }
+
+  // the copy runs on its own task, the response goes out once it is done
+  _cache.invalidate(destination);
+  std::shared_ptr<CopyJob> job = FileCopier::start(
+      _fs, path, destination, recursive, exists,
+      [this, path, destination](bool ok) {
+        changed(destination);
+        if (_index) {
+          _index->remove(destination);
+        }
+        if (ok && _index) {
+          _index->copy(path, destination);
+        }
+      });
+  if (!job) {
+    return request->send(503);
+  }
+  request->send(new AsyncCopyResponse(job, exists ? 204 : 201));
 }
 
 void AsyncWebDAV::handleDelete(const String &path, DavResourceType resource,
@@ -285,25 +1000,57 @@ void AsyncWebDAV::handleDelete(const String &path, DavResourceType resource,
   if (resource == DAV_RESOURCE_NONE) {
     return handleNotFound(request);
   }
-
-  // delete file or dir
-  bool result;
-  if (resource == DAV_RESOURCE_FILE) {
-    result = _fs.remove(path);
-  } else {
-    result = _fs.rmdir(path);
+  if (path.equals("/")) {
+    return request->send(403);
   }
 
-  // check for error
-  AsyncWebServerResponse *response;
-  if (result) {
-    response = request->beginResponse(200);
-    response->addHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
-  } else {
-    response = request->beginResponse(201);
+  // a collection goes with everything in it
+  _cache.invalidate(path);
+  sendApplied(request, 200, true,
+              mutate(MUTATION_REMOVE, path, "", [this, path](bool ok) {
+                changed(path);
+                if (ok && _index) {
+                  _index->remove(path);
+                }
+              }));
+}
+
+// Queues a change for the mutation worker. The completion is signalled once
+// the change is on the card, NULL when it couldn't be queued.
+std::shared_ptr<WriterCompletion>
+AsyncWebDAV::mutate(MutationType type, const String &path, const String &dest,
+                    std::function<void(bool ok)> onDone) {
+  std::shared_ptr<WriterCompletion> applied =
+      std::make_shared<WriterCompletion>();
+  if (!MutationQueue::submit(_fs, type, path, dest,
+                             [onDone, applied](bool ok) {
+                               onDone(ok);
+                               applied->signal(ok);
+                             })) {
+    return NULL;
   }
+  return applied;
+}
 
-  request->send(response);
+// Answers with status once the change is applied, so the client's next
+// request already sees it. The AsyncTCP task doesn't wait for it, the
+// mutation worker polls the connection when it is done.
+void AsyncWebDAV::sendApplied(AsyncWebServerRequest *request, int status,
+                              bool allow,
+                              std::shared_ptr<WriterCompletion> applied) {
+  if (!applied) {
+    return request->send(503);
+  }
+  request->send(new AsyncCommitResponse(
+      applied, DAV_MUTATION_TIMEOUT_MS,
+      [status, allow](AsyncWebServerRequest *request, bool ok) {
+        AsyncWebServerResponse *response =
+            request->beginResponse(ok ? status : 500);
+        if (allow) {
+          response->addHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
+        }
+        return response;
+      }));
 }
 
 void AsyncWebDAV::handleHead(DavResourceType resource,
@@ -326,78 +1073,150 @@ void AsyncWebDAV::handleHead(DavResourceType resource,
 }
 
 void AsyncWebDAV::handleNotFound(AsyncWebServerRequest *request) {
-  AsyncWebServerResponse *response = request->beginResponse(404);
+  request->send(notFound());
+}
+
+AsyncWebServerResponse *AsyncWebDAV::notFound() {
+  AsyncWebServerResponse *response = new AsyncBasicResponse(404);
   response->addHeader("Allow", "OPTIONS,MKCOL,POST,PUT");
   response->addHeader("DAV", "1,2");
   response->addHeader("MS-Author-Via", "DAV");
-  request->send(response);
+  return response;
 }
 
-String AsyncWebDAV::urlToUri(String url) {
-  if (url.startsWith("http://")) {
-    int uriStart = url.indexOf('/', 7);
-    return url.substring(uriStart + 4);
-  } else if (url.startsWith("https://")) {
-    int uriStart = url.indexOf('/', 8);
-    return url.substring(uriStart + 4);
-  } else {
-    return url.substring(_url.length());
+void AsyncWebDAV::changed(const String &path) {
+  _cache.invalidate(path);
+  if (_onFileChanged) {
+    _onFileChanged(path);
   }
 }
 
-void AsyncWebDAV::sendPropResponse(AsyncResponseStream *response,
-                                   boolean recursing, File *curFile) {
-  String fullPath = curFile->name();
-  if (fullPath.substring(0, 1) != "/") {
-    fullPath = String("/") + fullPath;
+bool AsyncWebDAV::parentExists(const String &path) {
+  int slash = path.lastIndexOf('/');
+  String parent = slash > 0 ? path.substring(0, slash) : String("/");
+  DavMetaEntry entry;
+  return _cache.lookup(parent, entry) && entry.type == DAV_RESOURCE_DIR;
+}
+
+String AsyncWebDAV::requestPath(AsyncWebServerRequest *request) {
+  // one copy of the tail of the url, trimmed in place
+  const String &url = request->url();
+  String path(url.length() > _url.length() ? url.c_str() + _url.length()
+                                            : "/");
+  if (path.length() > 1 && path.endsWith("/")) {
+    path.remove(path.length() - 1);
   }
-  if (curFile->isDirectory() &&
-      fullPath.substring(fullPath.length() - 1, fullPath.length()) != "/") {
-    fullPath += "/";
+  return path;
+}
+
+// host, or host:port, without the port the scheme implies
+static String authority(const String &host, bool https) {
+  const char *port = https ? ":443" : ":80";
+  return host.endsWith(port) ? host.substring(0, host.length() - strlen(port))
+                             : host;
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
   }
-  fullPath = _url + fullPath;
-  fullPath.replace(" ", "%20");
+  c |= 0x20;
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
 
-  // get file modified time
-  time_t lastWrite = curFile->getLastWrite();
-  DateTimeClass dt(lastWrite);
-  String fileTimeStamp = dt.format("%a, %d %b %Y %H:%M:%S GMT");
+bool AsyncWebDAV::urlToUri(const String &url, const String &host,
+                           String &uri) {
+  // an absolute URI has to name this server
+  int start = 0;
+  bool https = url.startsWith("https://");
+  if (https || url.startsWith("http://")) {
+    int hostStart = https ? 8 : 7;
+    start = url.indexOf('/', hostStart);
+    if (start == -1) {
+      start = url.length();
+    }
+    String destinationHost = url.substring(hostStart, start);
+    if (!host.isEmpty() && !authority(destinationHost, https)
+                               .equalsIgnoreCase(authority(host, https))) {
+      return false;
+    }
+  }
+
+  // and a path below the prefix this handler serves
+  const char *path = url.c_str() + start;
+  size_t len = url.length() - start;
+  if (len < _url.length() || strncmp(path, _url.c_str(), _url.length()) ||
+      (len > _url.length() && path[_url.length()] != '/' &&
+       path[_url.length()] != '?')) {
+    return false;
+  }
+  path += _url.length();
+  len -= _url.length();
 
-  // send response
+  // percent-decoded, as the server decodes the request url
+  uri = String();
+  uri.reserve(len + 1);
+  for (size_t i = 0; i < len && path[i] != '?' && path[i] != '#'; i++) {
+    char c = path[i];
+    if (c == '%' && i + 2 < len && hexValue(path[i + 1]) != -1 &&
+        hexValue(path[i + 2]) != -1) {
+      c = hexValue(path[i + 1]) << 4 | hexValue(path[i + 2]);
+      i += 2;
+      if (!c) {
+        return false;
+      }
+    }
+    uri += c;
+  }
+  if (uri.isEmpty()) {
+    uri = "/";
+  }
+  return true;
+}
+
+void AsyncWebDAV::sendPropResponse(Print *response, const String &path,
+                                   const DavMetaEntry &entry) {
+  // everything is printed as it is, Print::printf() allocates for anything
+  // longer than a few dozen bytes
   response->print("<d:response>");
-  response->printf("<d:href>%s</d:href>", fullPath.c_str());
+  response->print("<d:href>");
+  printEscaped(response, _url.c_str());
+  if (!path.startsWith("/")) {
+    response->print("/");
+  }
+  printEscaped(response, path.c_str());
+  if (entry.type == DAV_RESOURCE_DIR && !path.endsWith("/")) {
+    response->print("/");
+  }
+  response->print("</d:href>");
   response->print("<d:propstat>");
   response->print("<d:prop>");
 
   // last modified
-  response->printf("<d:getlastmodified>%s</d:getlastmodified>",
-                   fileTimeStamp.c_str());
-
-  // File root = _fs.open("/");
-
-  // quota
-  // response->printf("<d:quota-used-bytes>%d</d:quota-used-bytes>",
-  // root.size());
-  // response->printf("<d:quota-available-bytes>%d</d:quota-available-bytes>",
-  // root.size() - root.size());
+  response->print("<d:getlastmodified>");
+  response->print(entry.lastModified);
+  response->print("</d:getlastmodified>");
 
-  if (curFile->isDirectory()) {
+  if (entry.type == DAV_RESOURCE_DIR) {
     // resource type
     response->print("<d:resourcetype><d:collection/></d:resourcetype>");
   } else {
     // etag
-    response->printf("<d:getetag>%s</d:getetag>",
-                     sha1(fullPath + fileTimeStamp).c_str());
+    response->print("<d:getetag>");
+    response->print(entry.etag);
+    response->print("</d:getetag>");
 
     // resource type
     response->print("<d:resourcetype/>");
 
     // content length
-    response->printf("<d:getcontentlength>%d</d:getcontentlength>",
-                     curFile->size());
+    response->printf("<d:getcontentlength>%u</d:getcontentlength>",
+                     (unsigned)entry.size);
 
     // content type
-    response->print("<d:getcontenttype>text/plain</d:getcontenttype>");
+    response->print("<d:getcontenttype>");
+    response->print(AsyncFileStreamResponse::contentType(path));
+    response->print("</d:getcontenttype>");
   }
   response->print("</d:prop>");
   response->print("<d:status>HTTP/1.1 200 OK</d:status>");
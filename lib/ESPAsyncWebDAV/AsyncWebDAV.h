@@ -1,8 +1,199 @@
 #include <Arduino.h>
+#include <AsyncFileStreamResponse.h>
+#include <BlockPool.h>
+#include <BufferedFileWriter.h>
+#include <DavMetaCache.h>
 #include <ESPAsyncWebServer.h>
+#include <FileCopier.h>
+#include <GcodeIndex.h>
+#include <IoWorkers.h>
+#include <MutationQueue.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
 
-enum DavResourceType { DAV_RESOURCE_NONE, DAV_RESOURCE_FILE, DAV_RESOURCE_DIR };
 enum DavDepthType { DAV_DEPTH_NONE, DAV_DEPTH_CHILD, DAV_DEPTH_ALL };
+enum DavPropfindStage {
+  DAV_PROPFIND_HEAD,
+  DAV_PROPFIND_CHILDREN,
+  DAV_PROPFIND_TAIL,
+  DAV_PROPFIND_DONE
+};
+
+// a multistatus entry fits unless its path is very long
+#ifndef DAV_FRAGMENT_SIZE
+#define DAV_FRAGMENT_SIZE 1024
+#endif
+// two per PROPFIND in flight, more fall back to the heap
+#ifndef DAV_FRAGMENT_BLOCKS
+#define DAV_FRAGMENT_BLOCKS 8
+#endif
+
+// Holds the XML of a few multistatus entries until the chunked response has
+// room for them. The buffer is a pool block kept for the whole listing; what
+// doesn't fit in it goes on in a String.
+class DavFragment : public Print {
+public:
+  DavFragment() : _pool(NULL), _block(NULL), _len(0), _pos(0) {}
+  DavFragment(const DavFragment &) = delete;
+  ~DavFragment() {
+    if (_block) {
+      _pool->release(_block);
+    }
+  }
+
+  void begin(BlockPool &pool) {
+    _pool = &pool;
+    _block = pool.acquire();
+  }
+  virtual size_t write(uint8_t c) override { return write(&c, 1); }
+  virtual size_t write(const uint8_t *buffer, size_t size) override {
+    size_t n = 0;
+    if (_block && _overflow.isEmpty()) {
+      n = min(size, _pool->blockSize() - _len);
+      memcpy(_block + _len, buffer, n);
+      _len += n;
+    }
+    for (; n < size; n++) {
+      _overflow += (char)buffer[n];
+    }
+    return size;
+  }
+  // copies out what wasn't read yet
+  size_t read(uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    if (_pos < _len) {
+      n = min(size, _len - _pos);
+      memcpy(buffer, _block + _pos, n);
+      _pos += n;
+    }
+    size_t spilled = _pos - _len;
+    if (n < size && spilled < _overflow.length()) {
+      size_t more = min(size - n, _overflow.length() - spilled);
+      memcpy(buffer + n, _overflow.c_str() + spilled, more);
+      _pos += more;
+      n += more;
+    }
+    return n;
+  }
+  size_t available() const { return _len + _overflow.length() - _pos; }
+  void swap(DavFragment &other) {
+    std::swap(_pool, other._pool);
+    std::swap(_block, other._block);
+    std::swap(_len, other._len);
+    std::swap(_pos, other._pos);
+    std::swap(_overflow, other._overflow);
+  }
+  void clear() {
+    _len = 0;
+    _pos = 0;
+    if (!_overflow.isEmpty()) {
+      _overflow = String();
+    }
+  }
+
+private:
+  BlockPool *_pool;
+  uint8_t *_block;
+  size_t _len;
+  size_t _pos;
+  String _overflow;
+};
+
+#ifndef DAV_PROPFIND_MAX_OPEN_DIRS
+#define DAV_PROPFIND_MAX_OPEN_DIRS 4
+#endif
+#ifndef DAV_PROPFIND_MAX_ENTRIES
+#define DAV_PROPFIND_MAX_ENTRIES 2000
+#endif
+
+// One directory being listed. Depth: infinity keeps a stack of them, at most
+// DAV_PROPFIND_MAX_OPEN_DIRS deep.
+struct DavPropfindFrame {
+  String path;
+  File dir;
+  // children come from the cache when the directory was listed before
+  bool cached;
+  // last child sent, children sorting before it were already listed
+  String childKey;
+  uint32_t generation;
+};
+
+struct DavPropfindState {
+  String path;
+  DavResourceType resource;
+  DavDepthType depth;
+  DavPropfindStage stage;
+  std::vector<DavPropfindFrame> frames;
+  // directories found while the stack was full, listed once it drains
+  std::vector<String> deferred;
+  size_t entries;
+  // the I/O worker writes the next entries to fragment while the AsyncTCP
+  // task sends the ones before from sending; they change places when
+  // sending is empty and the worker isn't busy
+  DavFragment fragment;
+  DavFragment sending;
+  std::atomic<bool> busy;
+  // the largest entry so far, a batch stops when another may not fit
+  size_t largest;
+  // polls the connection when a batch is ready
+  std::shared_ptr<IoWake> wake;
+  // keeps the state alive for the worker while busy
+  std::shared_ptr<DavPropfindState> self;
+  uint32_t startHeap;
+  uint32_t minHeap;
+};
+
+// what a GET needs from its request, copied for the I/O worker
+struct DavGetRequest {
+  String path;
+  String noneMatch;
+  String modifiedSince;
+  String range;
+  String ifRange;
+};
+
+#ifndef DAV_MAX_RANGES
+#define DAV_MAX_RANGES 8
+#endif
+
+// inclusive byte range of a GET
+struct DavRange {
+  size_t start;
+  size_t end;
+};
+
+// Serves the parts of a 206 response, each part header followed by its data.
+// A single range has empty headers, so it is sent as plain bytes.
+struct DavRangeState {
+  File file;
+  DavRange ranges[DAV_MAX_RANGES];
+  String heads[DAV_MAX_RANGES + 1];
+  int count;
+  int part;
+  size_t offset;
+};
+
+// how long a PUT's response waits for the file to be committed before it
+// reports a failure
+#ifndef DAV_COMMIT_TIMEOUT_MS
+#define DAV_COMMIT_TIMEOUT_MS 3000
+#endif
+
+// how long MKCOL, MOVE, DELETE and an empty PUT wait for the change to be
+// applied before they report a failure; a large tree takes a while to remove
+#ifndef DAV_MUTATION_TIMEOUT_MS
+#define DAV_MUTATION_TIMEOUT_MS 30000
+#endif
+
+struct DavUpload {
+  BufferedFileWriter *writer;
+  std::shared_ptr<WriterCompletion> completion;
+  int status;
+};
+
+typedef std::function<void(const String &path)> DavFileChangedHandler;
 
 class AsyncWebDAV : public AsyncWebHandler {
   using FS = fs::FS;
@@ -10,9 +201,17 @@ class AsyncWebDAV : public AsyncWebHandler {
 protected:
   FS _fs;
   String _url;
+  DavMetaCache _cache;
+  GcodeIndex *_index;
+  DavFileChangedHandler _onFileChanged;
+  std::map<AsyncWebServerRequest *, DavUpload> _uploads;
+  BlockPool _blocks;
+  uint32_t _lastPropfindHeap;
+  uint32_t _peakPropfindHeap;
 
 public:
-  AsyncWebDAV(const String &url, FS &fs);
+  // the index, when given, is kept in step with every change made here
+  AsyncWebDAV(const String &url, FS &fs, GcodeIndex *index = NULL);
 
   virtual bool canHandle(AsyncWebServerRequest *request) override final;
   virtual void handleRequest(AsyncWebServerRequest *request) override final;
@@ -21,28 +220,70 @@ public:
                           size_t total) override final;
   virtual bool isRequestHandlerTrivial() override final { return false; }
   const char *url() const { return _url.c_str(); }
+  // heap used by the last and by the largest PROPFIND since boot
+  uint32_t lastPropfindHeap() const { return _lastPropfindHeap; }
+  uint32_t peakPropfindHeap() const { return _peakPropfindHeap; }
+  const DavMetaCache &cache() const { return _cache; }
+  const BlockPool &blocks() const { return _blocks; }
+  // for changes made to the card outside of this handler
+  void invalidate(const String &path) { _cache.invalidate(path); }
+  // called once a change made here is on the card, on the task that made it
+  void onFileChanged(DavFileChangedHandler fn) { _onFileChanged = fn; }
 
 private:
-  void handlePropfind(const String &path, DavResourceType resource,
-                      AsyncWebServerRequest *request);
-  void handleGet(const String &path, DavResourceType resource,
-                 AsyncWebServerRequest *request);
+  void handlePropfind(const String &path, AsyncWebServerRequest *request);
+  AsyncWebServerResponse *buildPropfind(const String &path,
+                                        DavDepthType depth,
+                                        std::shared_ptr<IoWake> wake);
+  size_t fillPropfind(const std::shared_ptr<DavPropfindState> &state,
+                      uint8_t *buffer, size_t maxLen);
+  void nextPropfindBatch(DavPropfindState &state);
+  bool nextPropfindFragment(DavPropfindState &state);
+  void openPropfindDir(DavPropfindState &state, const String &path);
+  bool nextPropfindChild(DavPropfindFrame &frame, String &path,
+                         DavMetaEntry &entry);
+  void closePropfind(DavPropfindState &state);
+  void handleGet(const String &path, AsyncWebServerRequest *request);
+  AsyncWebServerResponse *buildGet(const DavGetRequest &get);
+  AsyncWebServerResponse *buildRange(const String &path,
+                                     const DavMetaEntry &entry,
+                                     const String &range);
+  static int parseRanges(const String &header, size_t size, DavRange *ranges);
+  static size_t fillRange(DavRangeState &state, uint8_t *buffer,
+                          size_t maxLen);
+  static bool etagMatches(const String &header, const char *etag);
+  static bool parseHttpDate(const String &date, time_t &time);
   void handlePut(const String &path, DavResourceType resource,
-                 AsyncWebServerRequest *request, unsigned char *data,
-                 size_t len, size_t index, size_t total);
+                 AsyncWebServerRequest *request);
+  void handlePutBody(AsyncWebServerRequest *request, unsigned char *data,
+                     size_t len, size_t index, size_t total);
+  void finishUpload(AsyncWebServerRequest *request);
   void handleLock(const String &path, DavResourceType resource,
                   AsyncWebServerRequest *request);
   void handleUnlock(const String &path, DavResourceType resource,
                     AsyncWebServerRequest *request);
   void handleMkcol(const String &path, DavResourceType resource,
                    AsyncWebServerRequest *request);
+  std::shared_ptr<WriterCompletion>
+  mutate(MutationType type, const String &path, const String &dest,
+         std::function<void(bool ok)> onDone);
+  void sendApplied(AsyncWebServerRequest *request, int status, bool allow,
+                   std::shared_ptr<WriterCompletion> applied);
   void handleMove(const String &path, DavResourceType resource,
                   AsyncWebServerRequest *request);
+  void handleCopy(const String &path, DavResourceType resource,
+                  AsyncWebServerRequest *request);
   void handleDelete(const String &path, DavResourceType resource,
                     AsyncWebServerRequest *request);
   void handleHead(DavResourceType resource, AsyncWebServerRequest *request);
   void handleNotFound(AsyncWebServerRequest *request);
-  void sendPropResponse(AsyncResponseStream *response, boolean recursing,
-                        File *curFile);
-  String urlToUri(String url);
+  static AsyncWebServerResponse *notFound();
+  void sendPropResponse(Print *response, const String &path,
+                        const DavMetaEntry &entry);
+  bool parentExists(const String &path);
+  void changed(const String &path);
+  String requestPath(AsyncWebServerRequest *request);
+  // the path a Destination names below this handler, false when it points
+  // at another server or outside the prefix
+  bool urlToUri(const String &url, const String &host, String &uri);
 };
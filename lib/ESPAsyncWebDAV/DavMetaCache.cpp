@@ -0,0 +1,170 @@
+#include "DavMetaCache.h"
+#include <Arduino.h>
+#include <DateTime.h>
+#include <GcodePack.h>
+#include <GcodeScanner.h>
+#include <Hash.h>
+
+// longer hrefs are hashed from a String
+#define DAV_ETAG_INPUT 320
+
+// appends s with its spaces as %20, false once it doesn't fit
+static bool appendEscaped(char *out, size_t &len, const char *s) {
+  for (; *s; s++) {
+    size_t n = *s == ' ' ? 3 : 1;
+    if (len + n >= DAV_ETAG_INPUT) {
+      return false;
+    }
+    memcpy(out + len, *s == ' ' ? "%20" : s, n);
+    len += n;
+  }
+  return true;
+}
+
+DavMetaCache::DavMetaCache(FS &fs, const String &url)
+    : _fs(fs), _url(url), _lock(xSemaphoreCreateMutex()), _generation(0),
+      _hits(0), _misses(0) {}
+
+bool DavMetaCache::lookup(const String &path, DavMetaEntry &entry) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  EntryMap::iterator it = _entries.find(path);
+  bool found = it != _entries.end();
+  if (found) {
+    entry = it->second;
+    _hits++;
+  } else {
+    _misses++;
+  }
+  uint32_t generation = _generation;
+  xSemaphoreGive(_lock);
+  if (found) {
+    return true;
+  }
+
+  File file = _fs.open(path, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  store(path, file, entry, generation);
+  file.close();
+  return true;
+}
+
+void DavMetaCache::store(const String &path, File &file, DavMetaEntry &entry,
+                         uint32_t generation) {
+  entry.type = file.isDirectory() ? DAV_RESOURCE_DIR : DAV_RESOURCE_FILE;
+  entry.listed = false;
+  entry.size = entry.type == DAV_RESOURCE_FILE ? file.size() : 0;
+  // only G-code is packed on its way to the card, other files aren't read
+  uint32_t size;
+  entry.packed = entry.type == DAV_RESOURCE_FILE &&
+                 GcodeScanner::isGcode(path) &&
+                 GcodeUnpacker::probe(file, size);
+  if (entry.packed) {
+    entry.size = size;
+  }
+  entry.lastWrite = file.getLastWrite();
+
+  DateTimeClass dt(entry.lastWrite);
+  String fileTimeStamp = dt.format("%a, %d %b %Y %H:%M:%S GMT");
+  strlcpy(entry.lastModified, fileTimeStamp.c_str(),
+          sizeof(entry.lastModified));
+
+  // sha1 of the href, the date and the size, put together on the stack; FAT
+  // dates are only good to two seconds, the size tells most rewrites within
+  // them apart
+  entry.etag[0] = '\0';
+  if (entry.type == DAV_RESOURCE_FILE) {
+    char version[48];
+    size_t versionLen = snprintf(version, sizeof(version), "%s %u",
+                                 entry.lastModified, (unsigned)entry.size);
+    char input[DAV_ETAG_INPUT];
+    size_t len = 0;
+    uint8_t hash[20];
+    if (appendEscaped(input, len, _url.c_str()) &&
+        appendEscaped(input, len, path.c_str()) &&
+        len + versionLen < sizeof(input)) {
+      memcpy(input + len, version, versionLen);
+      sha1((const uint8_t *)input, len + versionLen, hash);
+    } else {
+      String href = _url + path;
+      href.replace(" ", "%20");
+      sha1(href + version, hash);
+    }
+    for (int i = 0; i < 20; i++) {
+      sprintf(entry.etag + 2 * i, "%02x", hash[i]);
+    }
+  }
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  // invalidated since the file was opened, what was read may be gone
+  if (generation != _generation) {
+    xSemaphoreGive(_lock);
+    return;
+  }
+  if (_entries.size() >= DAV_META_CACHE_SIZE) {
+    // listings walking the cache have to notice their entries are gone
+    _entries.clear();
+    _generation++;
+  }
+  EntryMap::iterator it = _entries.find(path);
+  if (it != _entries.end()) {
+    // keep the listing of a directory that is stored again
+    entry.listed = it->second.listed && entry.type == DAV_RESOURCE_DIR;
+    it->second = entry;
+  } else {
+    _entries.insert(std::make_pair(path, entry));
+  }
+  xSemaphoreGive(_lock);
+}
+
+bool DavMetaCache::nextChild(const String &dir, String &key,
+                             DavMetaEntry &entry) {
+  String prefix = dir.endsWith("/") ? dir : dir + "/";
+  bool found = false;
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  EntryMap::iterator it = key.isEmpty() ? _entries.lower_bound(prefix)
+                                        : _entries.upper_bound(key);
+  for (; it != _entries.end() && it->first.startsWith(prefix); ++it) {
+    // only direct children, skip anything deeper
+    if (it->first.length() > prefix.length() &&
+        it->first.indexOf('/', prefix.length()) == -1) {
+      key = it->first;
+      entry = it->second;
+      found = true;
+      break;
+    }
+  }
+  xSemaphoreGive(_lock);
+  return found;
+}
+
+void DavMetaCache::markListed(const String &dir, uint32_t generation) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  // a mutation while the directory was read may have been missed
+  EntryMap::iterator it = _entries.find(dir);
+  if (it != _entries.end() && generation == _generation) {
+    it->second.listed = true;
+  }
+  xSemaphoreGive(_lock);
+}
+
+void DavMetaCache::invalidate(const String &path) {
+  String prefix = path.endsWith("/") ? path : path + "/";
+  int slash = path.lastIndexOf('/');
+  String parent = slash > 0 ? path.substring(0, slash) : String("/");
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _generation++;
+  _entries.erase(path);
+  EntryMap::iterator it = _entries.lower_bound(prefix);
+  while (it != _entries.end() && it->first.startsWith(prefix)) {
+    it = _entries.erase(it);
+  }
+  it = _entries.find(parent);
+  if (it != _entries.end()) {
+    it->second.listed = false;
+  }
+  xSemaphoreGive(_lock);
+}
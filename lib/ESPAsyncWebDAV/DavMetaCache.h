@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+#include <BlockPool.h>
+#include <FS.h>
+#include <map>
+
+#ifndef DAV_META_CACHE_SIZE
+#define DAV_META_CACHE_SIZE 1024
+#endif
+
+enum DavResourceType { DAV_RESOURCE_NONE, DAV_RESOURCE_FILE, DAV_RESOURCE_DIR };
+
+struct DavMetaEntry {
+  DavResourceType type;
+  // for directories: every child is in the cache as well
+  bool listed;
+  // packed G-code, size is what GET sends
+  bool packed;
+  size_t size;
+  time_t lastWrite;
+  char etag[41];
+  char lastModified[32];
+};
+
+// Type, size, date and ETag of every path the WebDAV handler has seen, so
+// polling clients are answered without touching the SD card. Entries are
+// copied out under a lock, as uploads invalidate from the writer task.
+class DavMetaCache {
+  using FS = fs::FS;
+
+public:
+  DavMetaCache(FS &fs, const String &url);
+
+  bool lookup(const String &path, DavMetaEntry &entry);
+  // fills entry from file, and caches it unless the cache was invalidated
+  // since generation was read, before the file was opened
+  void store(const String &path, File &file, DavMetaEntry &entry,
+             uint32_t generation);
+  // walks the cached children of dir in key order, starting after key
+  bool nextChild(const String &dir, String &key, DavMetaEntry &entry);
+  uint32_t generation() const { return _generation; }
+  void markListed(const String &dir, uint32_t generation);
+  void invalidate(const String &path);
+
+  uint32_t hits() const { return _hits; }
+  uint32_t misses() const { return _misses; }
+  size_t size() const { return _entries.size(); }
+
+private:
+  typedef std::map<String, DavMetaEntry, std::less<String>,
+                   PsramAllocator<std::pair<const String, DavMetaEntry>>>
+      EntryMap;
+
+  FS _fs;
+  String _url;
+  EntryMap _entries;
+  SemaphoreHandle_t _lock;
+  volatile uint32_t _generation;
+  uint32_t _hits;
+  uint32_t _misses;
+};
@@ -0,0 +1,302 @@
+#include "FileCopier.h"
+#include <vector>
+
+QueueHandle_t FileCopier::_queue = NULL;
+std::atomic<bool> FileCopier::_busy(false);
+std::atomic<uint32_t> FileCopier::_jobCopied(0);
+std::atomic<uint32_t> FileCopier::_jobTotal(0);
+uint64_t FileCopier::_bytesCopied = 0;
+std::atomic<uint32_t> FileCopier::_copies(0);
+
+// name() is the full path on older cores, only the name on newer
+static String childPath(const String &dir, File &child) {
+  String name = child.name();
+  String path = dir.equals("/") ? "" : dir;
+  return path + "/" + name.substring(name.lastIndexOf('/') + 1);
+}
+
+bool FileCopier::startTask() {
+  if (_queue) {
+    return true;
+  }
+  _queue = xQueueCreate(FILE_COPY_QUEUE, sizeof(std::shared_ptr<CopyJob> *));
+  if (!_queue) {
+    return false;
+  }
+  if (xTaskCreate(copyTask, "sd_copy", 4096, NULL, 1, NULL) != pdPASS) {
+    vQueueDelete(_queue);
+    _queue = NULL;
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<CopyJob>
+FileCopier::start(FS &fs, const String &from, const String &to, bool recursive,
+                  bool overwrite, std::function<void(bool ok)> onDone) {
+  if (!startTask()) {
+    return NULL;
+  }
+  std::shared_ptr<CopyJob> job = std::make_shared<CopyJob>();
+  job->fs = &fs;
+  job->from = from;
+  job->to = to;
+  job->recursive = recursive;
+  job->overwrite = overwrite;
+  job->done = false;
+  job->ok = false;
+  job->onDone = onDone;
+
+  // the queue only holds plain data, so it carries a reference of its own
+  std::shared_ptr<CopyJob> *item = new std::shared_ptr<CopyJob>(job);
+  if (xQueueSend(_queue, &item, 0) != pdTRUE) {
+    delete item;
+    return NULL;
+  }
+  return job;
+}
+
+void FileCopier::copyTask(void *arg) {
+  std::shared_ptr<CopyJob> *item;
+  for (;;) {
+    if (xQueueReceive(_queue, &item, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    std::shared_ptr<CopyJob> job = *item;
+    delete item;
+    FS &fs = *job->fs;
+
+    _jobCopied = 0;
+    _jobTotal = treeSize(fs, job->from, job->recursive);
+    _busy = true;
+    uint8_t *buffer =
+        (uint8_t *)heap_caps_malloc(FILE_COPY_BLOCK_SIZE, MALLOC_CAP_DMA);
+    bool ok = buffer != NULL;
+    if (ok && job->overwrite && fs.exists(job->to)) {
+      ok = removeTree(fs, job->to);
+    }
+    if (ok) {
+      ok = copyTree(fs, *job, buffer);
+    }
+    free(buffer);
+    _copies++;
+    _busy = false;
+
+    job->ok = ok;
+    if (job->onDone) {
+      job->onDone(ok);
+    }
+    job->done = true;
+  }
+}
+
+bool FileCopier::copyTree(FS &fs, const CopyJob &job, uint8_t *buffer) {
+  File source = fs.open(job.from);
+  if (!source) {
+    return false;
+  }
+  bool isDirectory = source.isDirectory();
+  source.close();
+  if (!isDirectory) {
+    return copyFile(fs, job.from, job.to, buffer);
+  }
+
+  // directories still to copy, so deep trees don't need deep recursion
+  std::vector<String> pending;
+  pending.push_back(job.from);
+  while (!pending.empty()) {
+    String dir = pending.back();
+    pending.pop_back();
+    String target = job.to + dir.substring(job.from.length());
+    if (!fs.exists(target) && !fs.mkdir(target)) {
+      return false;
+    }
+    if (!job.recursive) {
+      break;
+    }
+
+    // only one directory handle is kept open while its files are copied
+    File handle = fs.open(dir);
+    if (!handle) {
+      return false;
+    }
+    File child = handle.openNextFile();
+    while (child) {
+      String path = childPath(dir, child);
+      bool childIsDirectory = child.isDirectory();
+      child.close();
+      if (childIsDirectory) {
+        pending.push_back(path);
+      } else if (!BufferedFileWriter::isTempFile(path) &&
+                 !copyFile(fs, path, job.to + path.substring(job.from.length()),
+                           buffer)) {
+        handle.close();
+        return false;
+      }
+      child = handle.openNextFile();
+    }
+    handle.close();
+  }
+  return true;
+}
+
+bool FileCopier::copyFile(FS &fs, const String &from, const String &to,
+                          uint8_t *buffer) {
+  File source = fs.open(from, FILE_READ);
+  if (!source) {
+    return false;
+  }
+  BufferedFileWriter *writer = new BufferedFileWriter();
+  // a packed file stays packed
+  if (!writer->open(fs, to, false, true)) {
+    writer->close();
+    source.close();
+    return false;
+  }
+  writer->expectSize(source.size());
+  std::shared_ptr<WriterCompletion> completion = writer->completion();
+
+  // the writer task flushes one block while the next one is read
+  bool ok = true;
+  while (ok) {
+    size_t n = source.read(buffer, FILE_COPY_BLOCK_SIZE);
+    if (!n) {
+      break;
+    }
+    ok = writer->write(buffer, n) == n && !writer->failed();
+    _jobCopied += n;
+    _bytesCopied += n;
+  }
+  source.close();
+  if (ok) {
+    writer->close();
+  } else {
+    writer->abort();
+  }
+  return completion->wait(FILE_COPY_COMMIT_TIMEOUT_MS) && completion->ok();
+}
+
+uint32_t FileCopier::treeSize(FS &fs, const String &path, bool recursive) {
+  uint32_t size = 0;
+  std::vector<String> pending;
+  pending.push_back(path);
+  while (!pending.empty()) {
+    String dir = pending.back();
+    pending.pop_back();
+    File file = fs.open(dir);
+    if (!file) {
+      continue;
+    }
+    if (!file.isDirectory()) {
+      size += file.size();
+    } else if (recursive) {
+      File child = file.openNextFile();
+      while (child) {
+        if (child.isDirectory()) {
+          pending.push_back(childPath(dir, child));
+        } else {
+          size += child.size();
+        }
+        child.close();
+        child = file.openNextFile();
+      }
+    }
+    file.close();
+  }
+  return size;
+}
+
+bool FileCopier::removeTree(FS &fs, const String &path) {
+  File file = fs.open(path);
+  if (!file) {
+    return false;
+  }
+  bool isDirectory = file.isDirectory();
+  file.close();
+  if (!isDirectory) {
+    return fs.remove(path);
+  }
+
+  // files go as soon as their directory is read, directories deepest first
+  std::vector<String> pending;
+  std::vector<String> dirs;
+  std::vector<String> files;
+  pending.push_back(path);
+  while (!pending.empty()) {
+    String dir = pending.back();
+    pending.pop_back();
+    dirs.push_back(dir);
+    File handle = fs.open(dir);
+    if (!handle) {
+      return false;
+    }
+    File child = handle.openNextFile();
+    while (child) {
+      if (child.isDirectory()) {
+        pending.push_back(childPath(dir, child));
+      } else {
+        files.push_back(childPath(dir, child));
+      }
+      child.close();
+      child = handle.openNextFile();
+    }
+    handle.close();
+    for (size_t i = 0; i < files.size(); i++) {
+      if (!fs.remove(files[i])) {
+        return false;
+      }
+    }
+    files.clear();
+  }
+  for (size_t i = dirs.size(); i > 0; i--) {
+    if (!fs.rmdir(dirs[i - 1])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+AsyncCopyResponse::AsyncCopyResponse(std::shared_ptr<CopyJob> job, int code)
+    : _job(job) {
+  _code = code;
+  _contentLength = 0;
+}
+
+void AsyncCopyResponse::_respond(AsyncWebServerRequest *request) {
+  _state = RESPONSE_HEADERS;
+  _ack(request, 0, 0);
+}
+
+size_t AsyncCopyResponse::_ack(AsyncWebServerRequest *request, size_t len,
+                               uint32_t time) {
+  _ackedLength += len;
+  size_t written = 0;
+  if (_state == RESPONSE_HEADERS) {
+    // still copying, the connection's next poll checks again
+    if (!_job->done) {
+      return 0;
+    }
+    if (_head.isEmpty()) {
+      if (!_job->ok) {
+        _code = 500;
+      }
+      _head = _assembleHead(request->version());
+      _headLength = _head.length();
+    }
+    AsyncClient *client = request->client();
+    size_t n = min(client->space(), _headLength - _writtenLength);
+    n = client->add(_head.c_str() + _writtenLength, n);
+    _writtenLength += n;
+    written += n;
+    if (written) {
+      client->send();
+    }
+    if (_writtenLength == _headLength) {
+      _state = RESPONSE_WAIT_ACK;
+    }
+  }
+  if (_state == RESPONSE_WAIT_ACK && _ackedLength >= _writtenLength) {
+    _state = RESPONSE_END;
+  }
+  return written;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Arduino.h>
+#include <BufferedFileWriter.h>
+#include <ESPAsyncWebServer.h>
+#include <FS.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// Size of each read, one write-behind buffer worth of data
+#ifndef FILE_COPY_BLOCK_SIZE
+#define FILE_COPY_BLOCK_SIZE BUFFERED_WRITER_BLOCK_SIZE
+#endif
+// copies waiting for the copy task
+#ifndef FILE_COPY_QUEUE
+#define FILE_COPY_QUEUE 4
+#endif
+// how long to wait for one file to be committed to the card
+#ifndef FILE_COPY_COMMIT_TIMEOUT_MS
+#define FILE_COPY_COMMIT_TIMEOUT_MS 60000
+#endif
+
+// One server-side copy, shared between the copy task and the response
+// waiting for it
+struct CopyJob {
+  fs::FS *fs;
+  String from;
+  String to;
+  // copy a directory with its members, or only the directory itself
+  bool recursive;
+  // remove an existing destination first
+  bool overwrite;
+  std::atomic<bool> done;
+  bool ok;
+  // called from the copy task once the destination is complete
+  std::function<void(bool ok)> onDone;
+};
+
+// Copies files and directory trees on the card from a background task. The
+// task reads large blocks into a buffer of its own while a
+// BufferedFileWriter flushes the previous block, so reading and writing
+// overlap and every write is a whole buffer. Files appear under the
+// destination name only once they are complete.
+class FileCopier {
+  using FS = fs::FS;
+
+public:
+  // NULL when the copy task isn't running or too many copies are waiting
+  static std::shared_ptr<CopyJob> start(FS &fs, const String &from,
+                                        const String &to, bool recursive,
+                                        bool overwrite,
+                                        std::function<void(bool ok)> onDone);
+  // removes a file or a directory with everything below it
+  static bool removeTree(FS &fs, const String &path);
+
+  // progress of the copy running now and totals since boot
+  static bool busy() { return _busy; }
+  static uint32_t jobCopied() { return _jobCopied; }
+  static uint32_t jobTotal() { return _jobTotal; }
+  static uint64_t bytesCopied() { return _bytesCopied; }
+  static uint32_t copies() { return _copies; }
+
+private:
+  static bool startTask();
+  static void copyTask(void *arg);
+  static bool copyTree(FS &fs, const CopyJob &job, uint8_t *buffer);
+  static bool copyFile(FS &fs, const String &from, const String &to,
+                       uint8_t *buffer);
+  static uint32_t treeSize(FS &fs, const String &path, bool recursive);
+
+  static QueueHandle_t _queue;
+  static std::atomic<bool> _busy;
+  static std::atomic<uint32_t> _jobCopied;
+  static std::atomic<uint32_t> _jobTotal;
+  static uint64_t _bytesCopied;
+  static std::atomic<uint32_t> _copies;
+};
+
+// Answers a COPY once the copy task is done with it. The status line can only
+// go out when the outcome is known, so the response waits in its header state
+// and checks again on every poll of the connection.
+class AsyncCopyResponse : public AsyncWebServerResponse {
+public:
+  AsyncCopyResponse(std::shared_ptr<CopyJob> job, int code);
+
+  bool _sourceValid() const override { return true; }
+  void _respond(AsyncWebServerRequest *request) override;
+  size_t _ack(AsyncWebServerRequest *request, size_t len,
+              uint32_t time) override;
+
+private:
+  std::shared_ptr<CopyJob> _job;
+  String _head;
+};
@@ -0,0 +1,460 @@
+#include "GcodeIndex.h"
+#include <BufferedFileWriter.h>
+#include <GcodePack.h>
+#include <Hash.h>
+#include <set>
+
+#define GCODE_INDEX_MAGIC 0x58444947 // "GIDX"
+#define GCODE_INDEX_NEW GCODE_INDEX_DIR "/index.new"
+
+GcodeIndex::GcodeIndex(FS &fs)
+    : _fs(fs), _lock(xSemaphoreCreateMutex()), _loaded(false) {}
+
+GcodeIndex::~GcodeIndex() { vSemaphoreDelete(_lock); }
+
+bool GcodeIndex::create(File &file, const char *path) {
+  Header header = {GCODE_INDEX_MAGIC, GCODE_INDEX_VERSION,
+                   sizeof(GcodeIndexRecord)};
+  _fs.mkdir(GCODE_INDEX_DIR);
+  file = _fs.open(path, FILE_WRITE);
+  return file &&
+         file.write((uint8_t *)&header, sizeof(header)) == sizeof(header);
+}
+
+bool GcodeIndex::open(File &file, bool write) {
+  Header expected = {GCODE_INDEX_MAGIC, GCODE_INDEX_VERSION,
+                     sizeof(GcodeIndexRecord)};
+  file = _fs.open(GCODE_INDEX_FILE, write ? "r+" : FILE_READ);
+  if (file) {
+    Header header;
+    if (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+        memcmp(&header, &expected, sizeof(header)) == 0) {
+      if (!_loaded) {
+        load(file);
+      }
+      return true;
+    }
+    file.close();
+  }
+  if (!write) {
+    return false;
+  }
+
+  // missing or written by another version, start over
+  if (!create(file, GCODE_INDEX_FILE)) {
+    return false;
+  }
+  file.close();
+  _slots.clear();
+  _free.clear();
+  _loaded = true;
+  file = _fs.open(GCODE_INDEX_FILE, "r+");
+  return file && file.seek(sizeof(Header));
+}
+
+void GcodeIndex::load(File &file) {
+  _slots.clear();
+  _free.clear();
+  GcodeIndexRecord record;
+  uint32_t pos = sizeof(Header);
+  while (file.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) {
+    if (record.live) {
+      _slots[record.path] = pos;
+    } else {
+      _free.push_back(pos);
+    }
+    pos += sizeof(record);
+  }
+  file.seek(sizeof(Header));
+  _loaded = true;
+}
+
+long GcodeIndex::find(const String &path) {
+  SlotMap::iterator it = _slots.find(path);
+  return it == _slots.end() ? -1 : (long)it->second;
+}
+
+uint32_t GcodeIndex::freeSlot(File &file) {
+  if (_free.empty()) {
+    return file.size();
+  }
+  uint32_t slot = _free.back();
+  _free.pop_back();
+  return slot;
+}
+
+void GcodeIndex::below(const String &path, std::vector<uint32_t> &slots) {
+  SlotMap::iterator it = _slots.find(path);
+  if (it != _slots.end()) {
+    slots.push_back(it->second);
+  }
+  // everything below sorts right after the path and its slash
+  String prefix = path.equals("/") ? path : path + "/";
+  for (it = _slots.lower_bound(prefix);
+       it != _slots.end() && it->first.startsWith(prefix); ++it) {
+    slots.push_back(it->second);
+  }
+}
+
+bool GcodeIndex::fill(GcodeIndexRecord &record, const String &path) {
+  memset(&record, 0, sizeof(record));
+  if (path.length() >= GCODE_INDEX_PATH) {
+    return false;
+  }
+  File file = _fs.open(path, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  record.folder = file.isDirectory();
+  record.size = record.folder ? 0 : file.size();
+  if (!record.folder) {
+    // what the file prints, packed or not
+    GcodeUnpacker::probe(file, record.size);
+  }
+  record.lastWrite = file.getLastWrite();
+  file.close();
+  if (!record.folder && !GcodeScanner::isGcode(path)) {
+    return false;
+  }
+  strlcpy(record.path, path.c_str(), sizeof(record.path));
+  String identity = path + ":" + record.size + ":" + record.lastWrite;
+  strlcpy(record.hash, sha1(identity).c_str(), sizeof(record.hash));
+  record.live = 1;
+  return true;
+}
+
+bool GcodeIndex::store(const String &path, const GcodeScanner *scanner) {
+  GcodeIndexRecord record;
+  if (!fill(record, path)) {
+    return false;
+  }
+  if (scanner) {
+    record.meta = scanner->meta();
+  }
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  File file;
+  bool ok = open(file, true);
+  if (ok) {
+    long pos = find(path);
+    uint32_t slot = pos >= 0 ? pos : freeSlot(file);
+    ok = file.seek(slot) &&
+         file.write((uint8_t *)&record, sizeof(record)) == sizeof(record);
+    if (ok) {
+      _slots[path] = slot;
+    } else if (pos < 0) {
+      _free.push_back(slot);
+    }
+    file.close();
+  }
+
+  String thumbnail = String(GCODE_THUMBNAIL_DIR "/") + thumbnailName(path);
+  if (ok && scanner && scanner->thumbnail()) {
+    _fs.mkdir(GCODE_THUMBNAIL_DIR);
+    file = _fs.open(thumbnail, FILE_WRITE);
+    if (file) {
+      file.write(scanner->thumbnail(), scanner->thumbnailSize());
+      file.close();
+    }
+  } else if (!record.folder && _fs.exists(thumbnail)) {
+    _fs.remove(thumbnail);
+  }
+  xSemaphoreGive(_lock);
+  return ok;
+}
+
+bool GcodeIndex::lookup(const String &path, GcodeIndexRecord &record) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  File file;
+  bool found = open(file, false);
+  if (found) {
+    long pos = find(path);
+    found = pos >= 0 && file.seek(pos) &&
+            file.read((uint8_t *)&record, sizeof(record)) == sizeof(record);
+    file.close();
+  }
+  xSemaphoreGive(_lock);
+  return found;
+}
+
+void GcodeIndex::remove(const String &path) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  File file;
+  if (open(file, true)) {
+    std::vector<uint32_t> slots;
+    below(path, slots);
+    GcodeIndexRecord record;
+    for (uint32_t pos : slots) {
+      if (!file.seek(pos) ||
+          file.read((uint8_t *)&record, sizeof(record)) != sizeof(record)) {
+        continue;
+      }
+      uint8_t live = 0;
+      file.seek(pos + offsetof(GcodeIndexRecord, live));
+      file.write(&live, 1);
+      _slots.erase(record.path);
+      _free.push_back(pos);
+      if (record.meta.thumbnailWidth) {
+        _fs.remove(String(GCODE_THUMBNAIL_DIR "/") +
+                   thumbnailName(record.path));
+      }
+    }
+    file.close();
+  }
+  xSemaphoreGive(_lock);
+}
+
+void GcodeIndex::move(const String &from, const String &to) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  File file;
+  if (open(file, true)) {
+    std::vector<uint32_t> slots;
+    below(from, slots);
+    GcodeIndexRecord record;
+    for (uint32_t pos : slots) {
+      if (!file.seek(pos) ||
+          file.read((uint8_t *)&record, sizeof(record)) != sizeof(record)) {
+        continue;
+      }
+      String oldPath = record.path;
+      String newPath = to + (record.path + from.length());
+      // the date survives a rename, only the path part of the hash changes
+      String identity = newPath + ":" + record.size + ":" + record.lastWrite;
+      // a file renamed to something that isn't G-code leaves the index,
+      // as it would have on a rebuild
+      record.live = newPath.length() < GCODE_INDEX_PATH &&
+                    (record.folder || GcodeScanner::isGcode(newPath));
+      strlcpy(record.path, newPath.c_str(), sizeof(record.path));
+      strlcpy(record.hash, sha1(identity).c_str(), sizeof(record.hash));
+      file.seek(pos);
+      file.write((uint8_t *)&record, sizeof(record));
+      _slots.erase(oldPath);
+
+      // whatever was indexed under the new name is replaced
+      long replaced = record.live ? find(newPath) : -1;
+      if (replaced >= 0) {
+        uint8_t live = 0;
+        file.seek(replaced + offsetof(GcodeIndexRecord, live));
+        file.write(&live, 1);
+        _free.push_back(replaced);
+      }
+      if (record.live) {
+        _slots[newPath] = pos;
+      } else {
+        _free.push_back(pos);
+      }
+
+      if (record.meta.thumbnailWidth) {
+        String thumbnail =
+            String(GCODE_THUMBNAIL_DIR "/") + thumbnailName(oldPath);
+        if (record.live) {
+          _fs.rename(thumbnail, String(GCODE_THUMBNAIL_DIR "/") +
+                                    thumbnailName(newPath));
+        } else {
+          _fs.remove(thumbnail);
+        }
+      }
+    }
+    file.close();
+  }
+  xSemaphoreGive(_lock);
+}
+
+void GcodeIndex::copy(const String &from, const String &to) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  File file;
+  if (open(file, true)) {
+    // the records present now, not the copies made below
+    std::vector<uint32_t> slots;
+    below(from, slots);
+    GcodeIndexRecord record;
+    for (uint32_t pos : slots) {
+      if (!file.seek(pos) ||
+          file.read((uint8_t *)&record, sizeof(record)) != sizeof(record)) {
+        continue;
+      }
+      String newPath = to + (record.path + from.length());
+      GcodeIndexRecord copy;
+      if (!fill(copy, newPath)) {
+        continue;
+      }
+      copy.meta = record.meta;
+      long existing = find(newPath);
+      uint32_t slot = existing >= 0 ? existing : freeSlot(file);
+      if (!file.seek(slot) ||
+          file.write((uint8_t *)&copy, sizeof(copy)) != sizeof(copy)) {
+        if (existing < 0) {
+          _free.push_back(slot);
+        }
+        break;
+      }
+      _slots[newPath] = slot;
+      if (copy.meta.thumbnailWidth) {
+        copyThumbnail(record.path, newPath);
+      }
+    }
+    file.close();
+  }
+  xSemaphoreGive(_lock);
+}
+
+void GcodeIndex::copyThumbnail(const String &from, const String &to) {
+  File source =
+      _fs.open(String(GCODE_THUMBNAIL_DIR "/") + thumbnailName(from));
+  if (!source) {
+    return;
+  }
+  File target = _fs.open(String(GCODE_THUMBNAIL_DIR "/") + thumbnailName(to),
+                         FILE_WRITE);
+  uint8_t buffer[512];
+  size_t n;
+  while (target && (n = source.read(buffer, sizeof(buffer)))) {
+    target.write(buffer, n);
+  }
+  target.close();
+  source.close();
+}
+
+void GcodeIndex::rebuild() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  // where the metadata of every scanned file is, to carry it over
+  std::map<String, long> scanned;
+  File old;
+  if (open(old, false)) {
+    GcodeIndexRecord record;
+    long pos = sizeof(Header);
+    while (old.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) {
+      if (record.live && !record.folder &&
+          (record.meta.printTime || record.meta.thumbnailWidth)) {
+        scanned[record.path] = pos;
+      }
+      pos += sizeof(record);
+    }
+  }
+
+  File fresh;
+  if (!create(fresh, GCODE_INDEX_NEW)) {
+    old.close();
+    xSemaphoreGive(_lock);
+    return;
+  }
+  _slots.clear();
+  _free.clear();
+  uint32_t slot = sizeof(Header);
+  std::set<String> thumbnails;
+  std::vector<String> pending;
+  pending.push_back("/");
+  while (!pending.empty()) {
+    String dir = pending.back();
+    pending.pop_back();
+    File handle = _fs.open(dir);
+    if (!handle) {
+      continue;
+    }
+    File child = handle.openNextFile();
+    while (child) {
+      // name() is the full path on older cores, only the name on newer
+      String name = child.name();
+      String path = (dir.equals("/") ? "" : dir) + "/" +
+                    name.substring(name.lastIndexOf('/') + 1);
+      child.close();
+      child = handle.openNextFile();
+
+      GcodeIndexRecord record;
+      if (isIndexPath(path) || BufferedFileWriter::isTempFile(path) ||
+          !fill(record, path)) {
+        continue;
+      }
+      if (record.folder) {
+        pending.push_back(path);
+      }
+      std::map<String, long>::iterator it = scanned.find(path);
+      GcodeIndexRecord previous;
+      if (it != scanned.end() && old.seek(it->second) &&
+          old.read((uint8_t *)&previous, sizeof(previous)) ==
+              sizeof(previous) &&
+          previous.size == record.size &&
+          previous.lastWrite == record.lastWrite) {
+        record.meta = previous.meta;
+        if (record.meta.thumbnailWidth) {
+          thumbnails.insert(thumbnailName(path));
+        }
+      }
+      if (fresh.write((uint8_t *)&record, sizeof(record)) == sizeof(record)) {
+        _slots[path] = slot;
+        slot += sizeof(record);
+      }
+    }
+    handle.close();
+  }
+  fresh.close();
+  old.close();
+  _fs.remove(GCODE_INDEX_FILE);
+  // the slots are those of the new file, read them back if it isn't there
+  _loaded = _fs.rename(GCODE_INDEX_NEW, GCODE_INDEX_FILE);
+
+  // thumbnails of files that are gone or changed
+  std::vector<String> stale;
+  File dir = _fs.open(GCODE_THUMBNAIL_DIR);
+  if (dir) {
+    File child = dir.openNextFile();
+    while (child) {
+      String name = child.name();
+      name = name.substring(name.lastIndexOf('/') + 1);
+      if (!thumbnails.count(name)) {
+        stale.push_back(String(GCODE_THUMBNAIL_DIR "/") + name);
+      }
+      child.close();
+      child = dir.openNextFile();
+    }
+    dir.close();
+  }
+  for (size_t i = 0; i < stale.size(); i++) {
+    _fs.remove(stale[i]);
+  }
+  xSemaphoreGive(_lock);
+}
+
+size_t GcodeIndex::read(uint32_t &pos, GcodeIndexRecord *records,
+                        size_t count) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  File file;
+  size_t n = 0;
+  if (open(file, false) &&
+      file.seek(sizeof(Header) + pos * sizeof(GcodeIndexRecord))) {
+    n = file.read((uint8_t *)records, count * sizeof(GcodeIndexRecord)) /
+        sizeof(GcodeIndexRecord);
+    file.close();
+  }
+  xSemaphoreGive(_lock);
+  pos += n;
+  return n;
+}
+
+String GcodeIndex::thumbnailName(const String &path) {
+  char name[GCODE_THUMBNAIL_NAME];
+  thumbnailName(path.c_str(), name);
+  return name;
+}
+
+void GcodeIndex::thumbnailName(const char *path, char *name) {
+  uint8_t hash[20];
+  sha1(path, strlen(path), hash);
+  for (int i = 0; i < 20; i++) {
+    sprintf(name + 2 * i, "%02x", hash[i]);
+  }
+  strcpy(name + 40, ".png");
+}
+
+bool GcodeIndex::isIndexPath(const String &path) {
+  return path.equals(GCODE_INDEX_DIR) || isBelow(path.c_str(), GCODE_INDEX_DIR);
+}
+
+bool GcodeIndex::isBelow(const char *path, const String &root) {
+  if (root.equals("/")) {
+    return path[0] == '/' && path[1];
+  }
+  return strncmp(path, root.c_str(), root.length()) == 0 &&
+         path[root.length()] == '/';
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <Arduino.h>
+#include <BlockPool.h>
+#include <FS.h>
+#include <GcodeScanner.h>
+#include <map>
+#include <vector>
+
+// Directory holding the index and the thumbnails, hidden from listings
+#ifndef GCODE_INDEX_DIR
+#define GCODE_INDEX_DIR "/.prusa-wifi"
+#endif
+#define GCODE_INDEX_FILE GCODE_INDEX_DIR "/index.bin"
+#define GCODE_THUMBNAIL_DIR GCODE_INDEX_DIR "/thumbs"
+// where the web server serves GCODE_THUMBNAIL_DIR
+#ifndef GCODE_THUMBNAIL_URL
+#define GCODE_THUMBNAIL_URL "/thumbs/"
+#endif
+// "<sha1 hex>.png" and the terminator
+#define GCODE_THUMBNAIL_NAME 45
+// longer paths are not indexed
+#ifndef GCODE_INDEX_PATH
+#define GCODE_INDEX_PATH 128
+#endif
+// bump when GcodeIndexRecord changes, older index files are rebuilt
+#define GCODE_INDEX_VERSION 2
+
+// One fixed-size slot of the index file. Removed files leave a slot that is
+// not live and is reused by the next file stored.
+struct GcodeIndexRecord {
+  char path[GCODE_INDEX_PATH];
+  uint32_t size;
+  uint32_t lastWrite;
+  GcodeMeta meta;
+  // identifies this version of the file, sha1 of path, size and date
+  char hash[41];
+  uint8_t live;
+  uint8_t folder;
+  uint8_t reserved;
+};
+
+// Keeps the folders and G-code files on the card in a flat file of records,
+// with what GcodeScanner found in each upload. Thumbnails live next to it as
+// PNG files named after the hash of the G-code's path. Every change to the
+// card made through the web server updates the index, so listings never
+// have to walk the card. Where each path's record is, and which slots are
+// free, is kept in memory, so a change reads and writes only its own
+// records.
+class GcodeIndex {
+  using FS = fs::FS;
+
+public:
+  GcodeIndex(FS &fs);
+  ~GcodeIndex();
+
+  // Records a file or folder once it is complete on the card. Other files
+  // are ignored. The scanner may be NULL when nothing was scanned.
+  bool store(const String &path, const GcodeScanner *scanner);
+  bool lookup(const String &path, GcodeIndexRecord &record);
+  // these cover the path and everything below it
+  void remove(const String &path);
+  void move(const String &from, const String &to);
+  void copy(const String &from, const String &to);
+  // Walks the card once and writes a fresh index, keeping the metadata of
+  // files that didn't change. For changes made outside the web server.
+  void rebuild();
+
+  // Reads up to count records from slot position pos on, including ones that
+  // are not live, and advances pos. Start with pos = 0.
+  size_t read(uint32_t &pos, GcodeIndexRecord *records, size_t count);
+
+  // file name of the thumbnail below GCODE_THUMBNAIL_DIR
+  static String thumbnailName(const String &path);
+  static void thumbnailName(const char *path, char *name);
+  static bool isIndexPath(const String &path);
+  static bool isBelow(const char *path, const String &root);
+
+private:
+  struct Header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+  };
+
+  typedef std::map<String, uint32_t, std::less<String>,
+                   PsramAllocator<std::pair<const String, uint32_t>>>
+      SlotMap;
+
+  bool open(File &file, bool write);
+  bool create(File &file, const char *path);
+  void load(File &file);
+  // offset of the live record for path, -1 if there is none
+  long find(const String &path);
+  // where a new record goes, a free slot or the end of the file
+  uint32_t freeSlot(File &file);
+  // the live records of path and everything below it
+  void below(const String &path, std::vector<uint32_t> &slots);
+  bool fill(GcodeIndexRecord &record, const String &path);
+  void copyThumbnail(const String &from, const String &to);
+
+  FS _fs;
+  SemaphoreHandle_t _lock;
+  // built from the file the first time it is opened, and by rebuild()
+  bool _loaded;
+  SlotMap _slots;
+  std::vector<uint32_t, PsramAllocator<uint32_t>> _free;
+};
@@ -0,0 +1,204 @@
+#include "GcodeScanner.h"
+
+GcodeScanner::GcodeScanner()
+    : _state(SCAN_LINE_START), _lineLen(0), _inThumbnail(false),
+      _decoded(NULL), _decodedSize(0), _decodedCapacity(0), _decodedWidth(0),
+      _decodedHeight(0), _bits(0), _bitCount(0), _thumbnail(NULL),
+      _thumbnailSize(0) {
+  memset(&_meta, 0, sizeof(_meta));
+}
+
+GcodeScanner::~GcodeScanner() {
+  free(_decoded);
+  free(_thumbnail);
+}
+
+bool GcodeScanner::isGcode(const String &path) {
+  String lower = path;
+  lower.toLowerCase();
+  return lower.endsWith(".gcode") || lower.endsWith(".gco") ||
+         lower.endsWith(".g");
+}
+
+void GcodeScanner::feed(const uint8_t *data, size_t len) {
+  const uint8_t *end = data + len;
+  while (data < end) {
+    if (_state == SCAN_LINE_START) {
+      if (*data != ';') {
+        _state = SCAN_SKIP;
+        continue;
+      }
+      _state = SCAN_COMMENT;
+      _lineLen = 0;
+      data++;
+      continue;
+    }
+
+    const uint8_t *newline = (const uint8_t *)memchr(data, '\n', end - data);
+    const uint8_t *stop = newline ? newline : end;
+    if (_state == SCAN_COMMENT) {
+      size_t n = min((size_t)(stop - data), sizeof(_line) - 1 - _lineLen);
+      memcpy(_line + _lineLen, data, n);
+      _lineLen += n;
+      if (newline) {
+        if (_lineLen && _line[_lineLen - 1] == '\r') {
+          _lineLen--;
+        }
+        _line[_lineLen] = '\0';
+        comment(_line);
+      }
+    }
+    if (!newline) {
+      return;
+    }
+    _state = SCAN_LINE_START;
+    data = newline + 1;
+  }
+}
+
+void GcodeScanner::comment(char *text) {
+  while (*text == ' ') {
+    text++;
+  }
+
+  if (_inThumbnail) {
+    if (strncmp(text, "thumbnail", 9) == 0 && strstr(text, " end")) {
+      endThumbnail();
+    } else {
+      decode(text);
+    }
+    return;
+  }
+
+  // "; thumbnail begin 220x124 9036", QOI and JPG variants are skipped
+  unsigned int width, height, encoded;
+  if (sscanf(text, "thumbnail begin %ux%u %u", &width, &height, &encoded) ==
+          3 ||
+      sscanf(text, "thumbnail_PNG begin %ux%u %u", &width, &height,
+             &encoded) == 3) {
+    return beginThumbnail(width, height, encoded);
+  }
+
+  // "; key = value"
+  char *separator = strstr(text, " = ");
+  if (!separator) {
+    return;
+  }
+  *separator = '\0';
+  const char *value = separator + 3;
+  if (strcmp(text, "estimated printing time (normal mode)") == 0) {
+    _meta.printTime = parseDuration(value);
+  } else if (strcmp(text, "filament used [mm]") == 0) {
+    _meta.filamentLength = atof(value);
+  } else if (strcmp(text, "filament used [g]") == 0) {
+    _meta.filamentWeight = atof(value);
+  } else if (strcmp(text, "layer_height") == 0) {
+    _meta.layerHeight = atof(value);
+  } else if (strcmp(text, "printer_model") == 0) {
+    strlcpy(_meta.printerModel, value, sizeof(_meta.printerModel));
+  }
+}
+
+void GcodeScanner::beginThumbnail(uint16_t width, uint16_t height,
+                                  size_t encoded) {
+  _inThumbnail = true;
+  _decodedSize = 0;
+  _bits = 0;
+  _bitCount = 0;
+  // only the largest thumbnail is kept
+  if ((uint32_t)width * height <=
+          (uint32_t)_meta.thumbnailWidth * _meta.thumbnailHeight ||
+      encoded > GCODE_THUMBNAIL_MAX) {
+    return;
+  }
+  size_t capacity = encoded / 4 * 3 + 3;
+  if (capacity > _decodedCapacity) {
+    free(_decoded);
+    _decoded =
+        (uint8_t *)(psramFound() ? ps_malloc(capacity) : malloc(capacity));
+    _decodedCapacity = _decoded ? capacity : 0;
+  }
+  if (_decoded) {
+    _decodedWidth = width;
+    _decodedHeight = height;
+  }
+}
+
+void GcodeScanner::endThumbnail() {
+  _inThumbnail = false;
+  if (!_decodedWidth || !_decodedSize) {
+    return;
+  }
+  free(_thumbnail);
+  _thumbnail = _decoded;
+  _thumbnailSize = _decodedSize;
+  _meta.thumbnailWidth = _decodedWidth;
+  _meta.thumbnailHeight = _decodedHeight;
+  _decoded = NULL;
+  _decodedCapacity = 0;
+  _decodedWidth = 0;
+}
+
+void GcodeScanner::decode(const char *text) {
+  if (!_decodedWidth) {
+    return;
+  }
+  for (; *text; text++) {
+    char c = *text;
+    uint8_t value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '+') {
+      value = 62;
+    } else if (c == '/') {
+      value = 63;
+    } else {
+      // padding and whitespace
+      continue;
+    }
+    _bits = (_bits << 6) | value;
+    _bitCount += 6;
+    if (_bitCount >= 8) {
+      _bitCount -= 8;
+      if (_decodedSize == _decodedCapacity) {
+        // more data than announced, drop the thumbnail
+        _decodedWidth = 0;
+        return;
+      }
+      _decoded[_decodedSize++] = (_bits >> _bitCount) & 0xff;
+    }
+  }
+}
+
+uint32_t GcodeScanner::parseDuration(const char *text) {
+  // "1d 2h 3m 4s", leading units are left out when zero
+  uint32_t seconds = 0;
+  while (*text) {
+    char *unit;
+    unsigned long value = strtoul(text, &unit, 10);
+    if (unit == text) {
+      text++;
+      continue;
+    }
+    switch (*unit) {
+    case 'd':
+      seconds += value * 86400;
+      break;
+    case 'h':
+      seconds += value * 3600;
+      break;
+    case 'm':
+      seconds += value * 60;
+      break;
+    case 's':
+      seconds += value;
+      break;
+    }
+    text = *unit ? unit + 1 : unit;
+  }
+  return seconds;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Longest comment line looked at, the rest of a longer line is ignored.
+// PrusaSlicer wraps thumbnail data at 78 characters.
+#ifndef GCODE_SCAN_LINE
+#define GCODE_SCAN_LINE 96
+#endif
+// thumbnails with more base64 than this are skipped
+#ifndef GCODE_THUMBNAIL_MAX
+#define GCODE_THUMBNAIL_MAX (32 * 1024)
+#endif
+
+// What the slicer wrote about a G-code, zero when it wasn't found
+struct GcodeMeta {
+  // seconds, normal mode
+  uint32_t printTime;
+  float filamentLength;
+  float filamentWeight;
+  float layerHeight;
+  char printerModel[24];
+  uint16_t thumbnailWidth;
+  uint16_t thumbnailHeight;
+};
+
+// Picks slicer metadata out of a G-code while it streams past, so nothing
+// has to read the file again. Only lines starting with ';' are copied, moves
+// are skipped with memchr. PrusaSlicer writes the thumbnails at the top and
+// its settings at the bottom of the file; the largest PNG thumbnail is kept
+// decoded in memory until it is stored.
+class GcodeScanner {
+public:
+  GcodeScanner();
+  ~GcodeScanner();
+
+  void feed(const uint8_t *data, size_t len);
+  const GcodeMeta &meta() const { return _meta; }
+  // decoded PNG, NULL when the file had none
+  const uint8_t *thumbnail() const { return _thumbnail; }
+  size_t thumbnailSize() const { return _thumbnailSize; }
+
+  static bool isGcode(const String &path);
+
+private:
+  enum ScanState { SCAN_LINE_START, SCAN_COMMENT, SCAN_SKIP };
+
+  void comment(char *text);
+  void beginThumbnail(uint16_t width, uint16_t height, size_t encoded);
+  void endThumbnail();
+  void decode(const char *text);
+  static uint32_t parseDuration(const char *text);
+
+  GcodeMeta _meta;
+  ScanState _state;
+  char _line[GCODE_SCAN_LINE];
+  size_t _lineLen;
+
+  // thumbnail being decoded
+  bool _inThumbnail;
+  uint8_t *_decoded;
+  size_t _decodedSize;
+  size_t _decodedCapacity;
+  uint16_t _decodedWidth;
+  uint16_t _decodedHeight;
+  uint32_t _bits;
+  uint8_t _bitCount;
+
+  uint8_t *_thumbnail;
+  size_t _thumbnailSize;
+};
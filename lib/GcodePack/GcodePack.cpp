@@ -0,0 +1,198 @@
+#include "GcodePack.h"
+#include <GcodeScanner.h>
+
+#define GCODE_PACK_MAGIC 0x314b5047 // "GPK1"
+#define GCODE_PACK_FULL 0xf
+// padding of an odd last character, never unpacked
+#define GCODE_PACK_PAD 11
+
+// MeatPack's table
+static const char packChars[15] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                   '8', '9', '.', ' ', '\n', 'G', 'X'};
+
+static uint8_t packCode(uint8_t c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  switch (c) {
+  case '.':
+    return 10;
+  case ' ':
+    return 11;
+  case '\n':
+    return 12;
+  case 'G':
+    return 13;
+  case 'X':
+    return 14;
+  default:
+    return GCODE_PACK_FULL;
+  }
+}
+
+std::atomic<uint32_t> GcodePacker::_bytesIn(0);
+std::atomic<uint32_t> GcodePacker::_bytesOut(0);
+
+GcodePacker::GcodePacker()
+    : _out(NULL), _fill(0), _size(0), _packed(0), _half(false), _first(0),
+      _firstByte(0) {}
+
+GcodePacker::~GcodePacker() { free(_out); }
+
+bool GcodePacker::begin() {
+  _out = (uint8_t *)heap_caps_malloc(GCODE_PACK_CHUNK, MALLOC_CAP_DMA);
+  if (!_out) {
+    return false;
+  }
+  // filled in by finish()
+  memset(_out, 0, sizeof(GcodePackHeader));
+  _fill = sizeof(GcodePackHeader);
+  return true;
+}
+
+bool GcodePacker::wants(const String &path) {
+  return GCODE_PACK && GcodeScanner::isGcode(path);
+}
+
+bool GcodePacker::flush(File &file) {
+  size_t n = file.write(_out, _fill);
+  _packed += n;
+  bool ok = n == _fill;
+  _fill = 0;
+  return ok;
+}
+
+// a pair and the full characters after it may straddle two chunks, the
+// unpacker reads them as one stream
+bool GcodePacker::put(File &file, uint8_t byte) {
+  if (_fill == GCODE_PACK_CHUNK && !flush(file)) {
+    return false;
+  }
+  _out[_fill++] = byte;
+  return true;
+}
+
+size_t GcodePacker::write(File &file, const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    uint8_t code = packCode(data[i]);
+    if (!_half) {
+      _first = code;
+      _firstByte = data[i];
+      _half = true;
+      continue;
+    }
+    if (!put(file, _first | code << 4) ||
+        (_first == GCODE_PACK_FULL && !put(file, _firstByte)) ||
+        (code == GCODE_PACK_FULL && !put(file, data[i]))) {
+      return i;
+    }
+    _half = false;
+  }
+  _size += len;
+  return len;
+}
+
+bool GcodePacker::finish(File &file) {
+  if (_half) {
+    if (!put(file, _first | GCODE_PACK_PAD << 4) ||
+        (_first == GCODE_PACK_FULL && !put(file, _firstByte))) {
+      return false;
+    }
+    _half = false;
+  }
+  if (_fill && !flush(file)) {
+    return false;
+  }
+  GcodePackHeader header = {GCODE_PACK_MAGIC, _size, _packed, 0};
+  if (!file.seek(0) ||
+      file.write((uint8_t *)&header, sizeof(header)) != sizeof(header)) {
+    return false;
+  }
+  _bytesIn += _size;
+  _bytesOut += _packed;
+  return true;
+}
+
+GcodeUnpacker::GcodeUnpacker()
+    : _in(NULL), _inLen(0), _inPos(0), _size(0), _left(0), _slots(0) {}
+
+GcodeUnpacker::~GcodeUnpacker() { free(_in); }
+
+bool GcodeUnpacker::probe(File &file, uint32_t &size) {
+  // the header has to agree with the file, whatever its name is now
+  GcodePackHeader header;
+  uint32_t length = file.size();
+  bool packed =
+      length >= sizeof(header) &&
+      file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+      header.magic == GCODE_PACK_MAGIC && header.packed == length &&
+      !header.reserved && consistent(header.size, length - sizeof(header));
+  file.seek(0);
+  if (packed) {
+    size = header.size;
+  }
+  return packed;
+}
+
+// every pair of characters takes one to three bytes
+bool GcodeUnpacker::consistent(uint32_t size, uint32_t packed) {
+  uint64_t pairs = ((uint64_t)size + 1) / 2;
+  return packed >= pairs && packed <= pairs * 3;
+}
+
+bool GcodeUnpacker::begin(File &file) {
+  if (!probe(file, _size)) {
+    return false;
+  }
+  _in = (uint8_t *)malloc(GCODE_PACK_READ);
+  if (!_in) {
+    return false;
+  }
+  _left = _size;
+  return file.seek(sizeof(GcodePackHeader));
+}
+
+bool GcodeUnpacker::fill(File &file) {
+  if (_inPos < _inLen) {
+    return true;
+  }
+  int n = file.read(_in, GCODE_PACK_READ);
+  _inLen = n > 0 ? n : 0;
+  _inPos = 0;
+  return _inLen;
+}
+
+size_t GcodeUnpacker::read(File &file, uint8_t *data, size_t len) {
+  len = min(len, (size_t)_left);
+  size_t n = 0;
+  while (n < len) {
+    if (!_slots) {
+      if (!fill(file)) {
+        break;
+      }
+      // the common case, two packed characters
+      uint8_t pair = _in[_inPos++];
+      uint8_t low = pair & 0xf, high = pair >> 4;
+      if (low != GCODE_PACK_FULL && high != GCODE_PACK_FULL && n + 2 <= len) {
+        data[n++] = packChars[low];
+        data[n++] = packChars[high];
+        continue;
+      }
+      _slot[0] = low;
+      _slot[1] = high;
+      _slots = 2;
+    }
+    uint8_t code = _slot[2 - _slots];
+    if (code == GCODE_PACK_FULL) {
+      if (!fill(file)) {
+        break;
+      }
+      data[n++] = _in[_inPos++];
+    } else {
+      data[n++] = packChars[code];
+    }
+    _slots--;
+  }
+  _left -= n;
+  return n;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <atomic>
+
+// Store uploaded G-code packed. Only the print host and the web server can
+// read packed files, so leave this off while the card still goes into the
+// printer itself.
+#ifndef GCODE_PACK
+#define GCODE_PACK 0
+#endif
+// packed bytes written to the card at once, a multiple of the sector size
+#ifndef GCODE_PACK_CHUNK
+#define GCODE_PACK_CHUNK 4096
+#endif
+// packed bytes read from the card at once
+#ifndef GCODE_PACK_READ
+#define GCODE_PACK_READ 1024
+#endif
+
+// First bytes of a packed file, sizes in bytes
+struct GcodePackHeader {
+  uint32_t magic;
+  // of the G-code as it was uploaded
+  uint32_t size;
+  uint32_t packed;
+  uint32_t reserved;
+};
+
+// Packs G-code the way MeatPack does, without dropping anything: each byte
+// holds two characters of the 15 most common ones as 4-bit codes, any other
+// character takes the code 0xf and follows the pair as it is. Sliced G-code
+// is mostly digits, dots, spaces and line breaks, so it shrinks to about
+// three fifths.
+//
+// The first chunk starts with room for the header and every chunk but the
+// last is exactly GCODE_PACK_CHUNK, so every write starts on a sector.
+// finish() seeks back to fill in the header.
+class GcodePacker {
+public:
+  GcodePacker();
+  ~GcodePacker();
+
+  bool begin();
+  // returns len, or less once the card took less than it was given
+  size_t write(File &file, const uint8_t *data, size_t len);
+  bool finish(File &file);
+
+  // whether uploads to path are packed
+  static bool wants(const String &path);
+  // totals over all finished files, for the ratio
+  static uint32_t bytesIn() { return _bytesIn; }
+  static uint32_t bytesOut() { return _bytesOut; }
+
+private:
+  bool flush(File &file);
+  bool put(File &file, uint8_t byte);
+
+  uint8_t *_out;
+  size_t _fill;
+  uint32_t _size;
+  uint32_t _packed;
+  bool _half;
+  uint8_t _first;
+  uint8_t _firstByte;
+
+  static std::atomic<uint32_t> _bytesIn;
+  static std::atomic<uint32_t> _bytesOut;
+};
+
+// Reads a packed file back as the G-code that was uploaded, front to back.
+// A file is packed when its header says so and agrees with its size, not by
+// its name: one copied or moved to another name is still read unpacked.
+class GcodeUnpacker {
+public:
+  GcodeUnpacker();
+  ~GcodeUnpacker();
+
+  // true when the file is packed, it is then positioned after the header; a
+  // plain file stays where it is
+  bool begin(File &file);
+  // unpacked size
+  uint32_t size() const { return _size; }
+  size_t read(File &file, uint8_t *data, size_t len);
+
+  // the unpacked size of a packed file, leaves it at the start
+  static bool probe(File &file, uint32_t &size);
+
+private:
+  bool fill(File &file);
+  static bool consistent(uint32_t size, uint32_t packed);
+
+  uint8_t *_in;
+  size_t _inLen;
+  size_t _inPos;
+  uint32_t _size;
+  uint32_t _left;
+  // codes of a pair not fully read yet
+  uint8_t _slots;
+  uint8_t _slot[2];
+};
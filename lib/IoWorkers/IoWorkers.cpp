@@ -0,0 +1,209 @@
+#include "IoWorkers.h"
+#include <lwip/tcpip.h>
+
+IoWorkers::Worker IoWorkers::_workers[IO_WORKERS];
+bool IoWorkers::_started = false;
+LatencyHistogram IoWorkers::_queueTime[IO_OPS];
+LatencyHistogram IoWorkers::_serviceTime[IO_OPS];
+std::atomic<uint32_t> IoWorkers::_overflows(0);
+
+bool IoWorkers::start() {
+  if (_started) {
+    return _workers[0].task != NULL;
+  }
+  _started = true;
+  for (int i = 0; i < IO_WORKERS; i++) {
+    // builders open files and hash ETags, which wants some stack
+    if (xTaskCreatePinnedToCore(workerTask, "io_worker", 6144, &_workers[i], 2,
+                                &_workers[i].task, IO_WORKER_CORE) !=
+        pdPASS) {
+      _workers[i].task = NULL;
+    }
+  }
+  return _workers[0].task != NULL;
+}
+
+void IoWorkers::submit(IoOp op, std::function<void()> job) {
+  uint32_t queued = micros();
+  Worker *worker = NULL;
+  if (start()) {
+    for (int i = 0; i < IO_WORKERS; i++) {
+      if (_workers[i].task &&
+          (!worker || _workers[i].ring.size() < worker->ring.size())) {
+        worker = &_workers[i];
+      }
+    }
+  }
+  Job *slot = worker ? worker->ring.claim() : NULL;
+  if (!slot) {
+    _overflows++;
+    return run(op, queued, job);
+  }
+  slot->op = op;
+  slot->queued = queued;
+  slot->run = job;
+  worker->ring.commit();
+  xTaskNotifyGive(worker->task);
+}
+
+void IoWorkers::run(IoOp op, uint32_t queued, std::function<void()> &job) {
+  uint32_t start = micros();
+  _queueTime[op].record(start - queued);
+  job();
+  _serviceTime[op].record(micros() - start);
+}
+
+void IoWorkers::workerTask(void *arg) {
+  Worker *worker = (Worker *)arg;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    Job *slot;
+    while ((slot = worker->ring.peek())) {
+      // the slot goes back before the job runs, so a slow one doesn't keep
+      // the ring full
+      IoOp op = slot->op;
+      uint32_t queued = slot->queued;
+      std::function<void()> job;
+      job.swap(slot->run);
+      worker->ring.release();
+      run(op, queued, job);
+    }
+  }
+}
+
+const char *IoWorkers::name(IoOp op) {
+  switch (op) {
+  case IO_OP_DAV_GET:
+    return "dav_get";
+  case IO_OP_DAV_PROPFIND:
+    return "dav_propfind";
+  case IO_OP_OCTO_FILES:
+    return "octo_files";
+  default:
+    return "unknown";
+  }
+}
+
+void IoWake::attach(AsyncClient *client) {
+  _pcb = client->pcb();
+  if (!_pcb) {
+    return;
+  }
+  _client = client;
+  if (_poll || _received) {
+    post();
+  }
+}
+
+void IoWake::poll() {
+  _poll = true;
+  post();
+}
+
+void IoWake::acknowledge(size_t len) {
+  _received += len;
+  post();
+}
+
+void IoWake::post() {
+  if (!_client || _posted.exchange(true)) {
+    return;
+  }
+  _self = shared_from_this();
+  if (tcpip_callback(run, this) != ERR_OK) {
+    std::shared_ptr<IoWake> self;
+    self.swap(_self);
+    _posted = false;
+  }
+}
+
+// on the lwIP thread, where a connection can't go away under us
+void IoWake::run(void *arg) {
+  IoWake *wake = (IoWake *)arg;
+  std::shared_ptr<IoWake> self;
+  self.swap(wake->_self);
+  wake->_posted = false;
+  AsyncClient *client = wake->_client;
+  if (!client) {
+    return;
+  }
+  // AsyncTCP clears the pcb's callbacks when it lets the connection go, and
+  // no other connection has our client as its argument while we're attached
+  tcp_pcb *pcb = wake->_pcb;
+  if (pcb->callback_arg != client) {
+    return;
+  }
+  for (size_t len = wake->_received.exchange(0); len;) {
+    uint16_t n = min(len, (size_t)0xffff);
+    tcp_recved(pcb, n);
+    len -= n;
+  }
+  if (wake->_poll.exchange(false) && pcb->poll) {
+    // what lwIP's slow timer calls, AsyncTCP queues a poll event
+    pcb->poll(pcb->callback_arg, pcb);
+  }
+}
+
+AsyncIoResponse::AsyncIoResponse(
+    IoOp op, std::function<AsyncWebServerResponse *()> build,
+    std::shared_ptr<IoWake> wake)
+    : _result(std::make_shared<Result>(wake)), _inner(NULL) {
+  std::shared_ptr<Result> result = _result;
+  IoWorkers::submit(op, [result, build]() {
+    result->response = build();
+    xSemaphoreGive(result->ready);
+    result->wake->poll();
+    if (result->done.exchange(true)) {
+      // nobody is waiting for it anymore
+      delete result->response;
+    }
+  });
+}
+
+AsyncIoResponse::~AsyncIoResponse() {
+  _result->wake->detach();
+  if (_inner) {
+    delete _inner;
+  } else if (_result->done.exchange(true)) {
+    // built, but the client left before it was sent
+    delete _result->response;
+  }
+}
+
+bool AsyncIoResponse::_finished() const {
+  return _inner ? _inner->_finished() : _state > RESPONSE_WAIT_ACK;
+}
+
+bool AsyncIoResponse::_failed() const {
+  return _inner ? _inner->_failed() : _state == RESPONSE_FAILED;
+}
+
+void AsyncIoResponse::_respond(AsyncWebServerRequest *request) {
+  // unfinished, so polls keep coming to _ack() until the response is there;
+  // attached first, a job finishing after the take() below polls it
+  _state = RESPONSE_HEADERS;
+  _result->wake->attach(request->client());
+  take(request);
+}
+
+size_t AsyncIoResponse::_ack(AsyncWebServerRequest *request, size_t len,
+                             uint32_t time) {
+  if (_inner) {
+    return _inner->_ack(request, len, time);
+  }
+  take(request);
+  return 0;
+}
+
+bool AsyncIoResponse::take(AsyncWebServerRequest *request) {
+  if (xSemaphoreTake(_result->ready, 0) != pdTRUE) {
+    return false;
+  }
+  _inner = _result->response;
+  if (!_inner || !_inner->_sourceValid()) {
+    delete _inner;
+    _inner = new AsyncBasicResponse(500);
+  }
+  _inner->_respond(request);
+  return true;
+}
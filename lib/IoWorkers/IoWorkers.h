@@ -0,0 +1,134 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <LatencyHistogram.h>
+#include <SpscRing.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#ifndef IO_WORKERS
+#define IO_WORKERS 2
+#endif
+// WiFi and lwIP live on core 0, which the AsyncTCP task shares with them
+#ifndef IO_WORKER_CORE
+#define IO_WORKER_CORE 1
+#endif
+// jobs waiting per worker, a power of two
+#ifndef IO_WORKER_QUEUE
+#define IO_WORKER_QUEUE 16
+#endif
+
+enum IoOp { IO_OP_DAV_GET, IO_OP_DAV_PROPFIND, IO_OP_OCTO_FILES, IO_OPS };
+
+// Tasks on the core the network doesn't use, for the card work of requests.
+// Each worker takes jobs from its own lock-free ring, and only the AsyncTCP
+// task puts jobs in, so every ring has the single producer it needs.
+class IoWorkers {
+public:
+  // Runs job on the worker with the fewest jobs waiting, or right here when
+  // every ring is full or the workers couldn't be started.
+  static void submit(IoOp op, std::function<void()> job);
+
+  static const char *name(IoOp op);
+  // from submit() until a worker picks the job up, and running it
+  static const LatencyHistogram &queueTime(IoOp op) { return _queueTime[op]; }
+  static const LatencyHistogram &serviceTime(IoOp op) {
+    return _serviceTime[op];
+  }
+  // jobs that had to run on the submitting task
+  static uint32_t overflows() { return _overflows; }
+
+private:
+  struct Job {
+    IoOp op;
+    uint32_t queued;
+    std::function<void()> run;
+  };
+  struct Worker {
+    SpscRing<Job, IO_WORKER_QUEUE> ring;
+    TaskHandle_t task;
+  };
+
+  static bool start();
+  static void workerTask(void *arg);
+  static void run(IoOp op, uint32_t queued, std::function<void()> &job);
+
+  static Worker _workers[IO_WORKERS];
+  static bool _started;
+  static LatencyHistogram _queueTime[IO_OPS];
+  static LatencyHistogram _serviceTime[IO_OPS];
+  static std::atomic<uint32_t> _overflows;
+};
+
+// Has AsyncTCP poll a connection now rather than on lwIP's next slow timer,
+// ~500 ms away, so a response a job finished is sent at once. poll() is safe
+// from any task. The response waiting on the connection attaches it in
+// _respond() and detaches it when it goes; a poll while detached is kept for
+// the next attach, and so are received bytes acknowledged after the
+// client's ackLater(). Shared, so a poll still on its way to the lwIP thread
+// keeps it alive.
+class IoWake : public std::enable_shared_from_this<IoWake> {
+public:
+  IoWake()
+      : _client(NULL), _pcb(NULL), _poll(false), _received(0),
+        _posted(false) {}
+
+  void attach(AsyncClient *client);
+  void detach() { _client = NULL; }
+  void poll();
+  // reopens the receive window by len bytes, the client sends again
+  void acknowledge(size_t len);
+
+private:
+  void post();
+  static void run(void *arg);
+
+  std::atomic<AsyncClient *> _client;
+  tcp_pcb *_pcb;
+  std::atomic<bool> _poll;
+  std::atomic<size_t> _received;
+  // a run() is queued on the lwIP thread, which holds _self until then
+  std::atomic<bool> _posted;
+  std::shared_ptr<IoWake> _self;
+};
+
+// Answers a request with a response built by an I/O worker, and sends it
+// from the AsyncTCP task once it is there, which the worker signals with a
+// poll. The builder runs after the handler returned and the request may be
+// gone by then, so it must only use what it captured. Pass the wake when the
+// builder hands it on to keep polling the connection later.
+class AsyncIoResponse : public AsyncWebServerResponse {
+public:
+  AsyncIoResponse(IoOp op, std::function<AsyncWebServerResponse *()> build,
+                  std::shared_ptr<IoWake> wake = std::make_shared<IoWake>());
+  ~AsyncIoResponse();
+
+  bool _sourceValid() const override { return true; }
+  bool _finished() const override;
+  bool _failed() const override;
+  void _respond(AsyncWebServerRequest *request) override;
+  size_t _ack(AsyncWebServerRequest *request, size_t len,
+              uint32_t time) override;
+
+private:
+  // shared with the job; whichever side lets go last deletes the response
+  struct Result {
+    Result(std::shared_ptr<IoWake> wake)
+        : ready(xSemaphoreCreateBinary()), response(NULL), done(false),
+          wake(wake) {}
+    ~Result() { vSemaphoreDelete(ready); }
+
+    SemaphoreHandle_t ready;
+    AsyncWebServerResponse *response;
+    std::atomic<bool> done;
+    // polls the connection once the response is there
+    std::shared_ptr<IoWake> wake;
+  };
+
+  bool take(AsyncWebServerRequest *request);
+
+  std::shared_ptr<Result> _result;
+  AsyncWebServerResponse *_inner;
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <Arduino.h>
+#include <cmath>
+
+// Writes JSON straight to a Print, member by member, without building a
+// document first. All it keeps is which nesting levels already have a
+// member, to place the commas, so it never allocates and nothing is dropped
+// for lack of room. Up to 32 levels deep.
+class JsonWriter {
+public:
+  explicit JsonWriter(Print &out)
+      : _out(&out), _depth(0), _members(0), _afterKey(false) {}
+
+  JsonWriter &beginObject() { return open('{'); }
+  JsonWriter &endObject() { return close('}'); }
+  JsonWriter &beginArray() { return open('['); }
+  JsonWriter &endArray() { return close(']'); }
+
+  JsonWriter &key(const char *name) {
+    separate();
+    quoted(name);
+    _out->write(':');
+    _afterKey = true;
+    return *this;
+  }
+
+  JsonWriter &value(const char *text) {
+    separate();
+    quoted(text);
+    return *this;
+  }
+  JsonWriter &null() {
+    separate();
+    _out->print("null");
+    return *this;
+  }
+  JsonWriter &value(bool b) {
+    separate();
+    _out->print(b ? "true" : "false");
+    return *this;
+  }
+  JsonWriter &value(int n) { return value((long)n); }
+  JsonWriter &value(unsigned int n) { return value((unsigned long)n); }
+  JsonWriter &value(long n) {
+    separate();
+    _out->print(n);
+    return *this;
+  }
+  JsonWriter &value(unsigned long n) {
+    separate();
+    _out->print(n);
+    return *this;
+  }
+  JsonWriter &value(double n, int decimals = 2) {
+    separate();
+    if (std::isnan(n) || std::isinf(n)) {
+      _out->print("null");
+    } else {
+      _out->print(n, decimals);
+    }
+    return *this;
+  }
+
+  // a string value written in several parts
+  JsonWriter &beginString() {
+    separate();
+    _out->write('"');
+    return *this;
+  }
+  JsonWriter &part(const char *text, size_t len) {
+    escape(text, len);
+    return *this;
+  }
+  JsonWriter &part(const char *text) { return part(text, strlen(text)); }
+  JsonWriter &endString() {
+    _out->write('"');
+    return *this;
+  }
+
+  template <typename T> JsonWriter &field(const char *name, T v) {
+    key(name);
+    return value(v);
+  }
+
+private:
+  JsonWriter &open(char c) {
+    separate();
+    _out->write(c);
+    _depth++;
+    _members &= ~level();
+    return *this;
+  }
+  JsonWriter &close(char c) {
+    _depth--;
+    _out->write(c);
+    return *this;
+  }
+  uint32_t level() const { return _depth ? 1UL << ((_depth - 1) & 31) : 0; }
+
+  void separate() {
+    if (_afterKey) {
+      _afterKey = false;
+      return;
+    }
+    if (_members & level()) {
+      _out->write(',');
+    }
+    _members |= level();
+  }
+
+  void quoted(const char *text) {
+    _out->write('"');
+    escape(text, strlen(text));
+    _out->write('"');
+  }
+
+  void escape(const char *text, size_t len) {
+    // unescaped runs go out in one write
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+      uint8_t c = text[i];
+      if (c != '"' && c != '\\' && c >= 0x20) {
+        continue;
+      }
+      _out->write((const uint8_t *)text + start, i - start);
+      if (c == '"' || c == '\\') {
+        _out->write('\\');
+        _out->write(c);
+      } else {
+        _out->printf("\\u%04x", c);
+      }
+      start = i + 1;
+    }
+    _out->write((const uint8_t *)text + start, len - start);
+  }
+
+  Print *_out;
+  uint8_t _depth;
+  uint32_t _members;
+  bool _afterKey;
+};
+
+// JSON written into one buffer on the heap, which doubles when it is full
+// instead of growing with every write
+class JsonBuffer : public Print {
+public:
+  explicit JsonBuffer(size_t capacity)
+      : _data((uint8_t *)malloc(capacity)), _len(0),
+        _capacity(_data ? capacity : 0) {}
+  ~JsonBuffer() { free(_data); }
+  JsonBuffer(const JsonBuffer &) = delete;
+  JsonBuffer &operator=(const JsonBuffer &) = delete;
+
+  virtual size_t write(uint8_t c) override { return write(&c, 1); }
+  virtual size_t write(const uint8_t *buffer, size_t size) override {
+    if (_len + size > _capacity && !grow(_len + size)) {
+      return 0;
+    }
+    memcpy(_data + _len, buffer, size);
+    _len += size;
+    return size;
+  }
+
+  const char *data() const { return (const char *)_data; }
+  size_t length() const { return _len; }
+
+protected:
+  bool grow(size_t need) {
+    size_t capacity = max(_capacity * 2, need);
+    uint8_t *data = (uint8_t *)realloc(_data, capacity);
+    if (!data) {
+      return false;
+    }
+    _data = data;
+    _capacity = capacity;
+    return true;
+  }
+
+  uint8_t *_data;
+  size_t _len;
+  size_t _capacity;
+};
+
+// Holds JSON for a chunked response until the response has room for it
+class JsonChunk : public JsonBuffer {
+public:
+  explicit JsonChunk(size_t capacity) : JsonBuffer(capacity), _pos(0) {}
+
+  bool empty() const { return _pos >= _len; }
+  // moves what fits into buffer, the buffer is kept for reuse
+  size_t drain(uint8_t *buffer, size_t maxLen) {
+    size_t n = min(maxLen, _len - _pos);
+    memcpy(buffer, _data + _pos, n);
+    _pos += n;
+    if (empty()) {
+      _len = 0;
+      _pos = 0;
+    }
+    return n;
+  }
+
+private:
+  size_t _pos;
+};
+
+// Keeps JSON written once for answers sent many times
+class JsonString : public JsonBuffer {
+public:
+  explicit JsonString(size_t capacity) : JsonBuffer(capacity) {}
+};
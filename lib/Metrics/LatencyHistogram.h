@@ -0,0 +1,67 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+#define LATENCY_BUCKETS 9
+
+// Fixed-bucket latency histogram in microseconds. Recording is one compare
+// loop and one atomic increment, so it is cheap enough for any task.
+class LatencyHistogram {
+public:
+  LatencyHistogram() : _sum(0) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      _counts[i] = 0;
+    }
+  }
+
+  void record(uint32_t us) {
+    int i = 0;
+    while (i < LATENCY_BUCKETS - 1 && us > bound(i)) {
+      i++;
+    }
+    _counts[i]++;
+    _sum += us;
+  }
+
+  // upper bound of bucket i, the last bucket has none
+  static uint32_t bound(int i) {
+    static const uint32_t bounds[LATENCY_BUCKETS - 1] = {
+        500, 1000, 2000, 5000, 10000, 20000, 50000, 100000};
+    return i < LATENCY_BUCKETS - 1 ? bounds[i] : UINT32_MAX;
+  }
+  static int buckets() { return LATENCY_BUCKETS; }
+  uint32_t count(int i) const { return _counts[i]; }
+  uint32_t sum() const { return _sum; }
+  uint32_t total() const {
+    uint32_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      total += _counts[i];
+    }
+    return total;
+  }
+  uint32_t average() const {
+    uint32_t n = total();
+    return n ? _sum / n : 0;
+  }
+  // upper bound of the bucket holding the pct-th percentile
+  uint32_t percentile(uint32_t pct) const {
+    uint32_t n = total();
+    if (!n) {
+      return 0;
+    }
+    uint32_t rank = (n * (uint64_t)pct + 99) / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+      seen += _counts[i];
+      if (seen >= rank) {
+        return bound(i);
+      }
+    }
+    return bound(LATENCY_BUCKETS - 1);
+  }
+
+private:
+  std::atomic<uint32_t> _counts[LATENCY_BUCKETS];
+  std::atomic<uint32_t> _sum;
+};
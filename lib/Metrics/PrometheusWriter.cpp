@@ -0,0 +1,44 @@
+#include "PrometheusWriter.h"
+
+void PrometheusWriter::family(const char *name, const char *type,
+                              const char *help) {
+  _out.print("# HELP ");
+  _out.print(name);
+  _out.print(' ');
+  _out.print(help);
+  _out.print('\n');
+  _out.print("# TYPE ");
+  _out.print(name);
+  _out.print(' ');
+  _out.print(type);
+  _out.print('\n');
+}
+
+void PrometheusWriter::sample(const char *name, const char *labels,
+                              double value) {
+  sampleSuffix(name, "", labels);
+  _out.print(value, 4);
+  _out.print('\n');
+}
+
+void PrometheusWriter::sample(const char *name, const char *labels,
+                              uint64_t value) {
+  sampleSuffix(name, "", labels);
+  // Print has no 64-bit overload, and byte counters outgrow 32 bits
+  char digits[21];
+  snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value);
+  _out.print(digits);
+  _out.print('\n');
+}
+
+void PrometheusWriter::sampleSuffix(const char *name, const char *suffix,
+                                    const char *labels) {
+  _out.print(name);
+  _out.print(suffix);
+  if (labels && *labels) {
+    _out.print('{');
+    _out.print(labels);
+    _out.print('}');
+  }
+  _out.print(' ');
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Writes metrics in the Prometheus text exposition format. Durations are
+// kept in whole micro- or milliseconds and exported in seconds. Lines end in
+// a bare '\n' as the format wants, println() would add a '\r'.
+class PrometheusWriter {
+public:
+  PrometheusWriter(Print &out) : _out(out) {}
+
+  // the HELP and TYPE lines every family starts with
+  void family(const char *name, const char *type, const char *help);
+  // labels are the inside of the braces, as in method="GET"
+  void sample(const char *name, const char *labels, double value);
+  void sample(const char *name, const char *labels, uint64_t value);
+  // buckets as cumulative counts, scale converts the recorded unit to seconds
+  template <class H>
+  void histogram(const char *name, const char *labels, const H &histogram,
+                 double scale) {
+    uint32_t cumulative = 0;
+    for (int i = 0; i < H::buckets(); i++) {
+      cumulative += histogram.count(i);
+      _out.print(name);
+      _out.print("_bucket{");
+      if (labels && *labels) {
+        _out.print(labels);
+        _out.print(',');
+      }
+      _out.print("le=\"");
+      if (i < H::buckets() - 1) {
+        _out.print(H::bound(i) * scale, 4);
+      } else {
+        _out.print("+Inf");
+      }
+      _out.print("\"} ");
+      _out.print(cumulative);
+      _out.print('\n');
+    }
+    sampleSuffix(name, "_sum", labels);
+    _out.print(histogram.sum() * scale, 4);
+    _out.print('\n');
+    sampleSuffix(name, "_count", labels);
+    _out.print(cumulative);
+    _out.print('\n');
+  }
+
+private:
+  void sampleSuffix(const char *name, const char *suffix, const char *labels);
+
+  Print &_out;
+};
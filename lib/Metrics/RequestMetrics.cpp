@@ -0,0 +1,113 @@
+#include "RequestMetrics.h"
+
+RequestMetrics::Tracked RequestMetrics::_tracked[REQUEST_METRICS_SLOTS];
+std::atomic<uint32_t> RequestMetrics::_untracked(0);
+RequestHistogram RequestMetrics::_duration[REQUEST_HANDLERS][REQUEST_METHODS];
+
+RequestMetrics::Tracked *RequestMetrics::find(AsyncWebServerRequest *request) {
+  for (int i = 0; i < REQUEST_METRICS_SLOTS; i++) {
+    if (_tracked[i].request == request) {
+      return &_tracked[i];
+    }
+  }
+  return NULL;
+}
+
+void RequestMetrics::track(AsyncWebServerRequest *request,
+                           RequestHandler handler) {
+  if (find(request)) {
+    return;
+  }
+  // HTTP_GET is bit 0, HTTP_COPY bit 13
+  int method = __builtin_ctz(request->method() | (1 << REQUEST_METHODS));
+  if (method >= REQUEST_METHODS) {
+    return;
+  }
+  Tracked *tracked = find(NULL);
+  if (!tracked) {
+    _untracked++;
+    return;
+  }
+  tracked->request = request;
+  tracked->start = millis();
+  tracked->handler = handler;
+  tracked->method = method;
+  tracked->then = NULL;
+  request->onDisconnect([tracked]() { finish(*tracked); });
+}
+
+void RequestMetrics::onDisconnect(AsyncWebServerRequest *request,
+                                  RequestHandler handler,
+                                  ArDisconnectHandler fn) {
+  track(request, handler);
+  Tracked *tracked = find(request);
+  if (!tracked) {
+    // a method there is no histogram for, or no slot left
+    return request->onDisconnect(fn);
+  }
+  tracked->then = fn;
+}
+
+void RequestMetrics::finish(Tracked &tracked) {
+  _duration[tracked.handler][tracked.method].record(millis() - tracked.start);
+  // the slot is free again before the handler's callback runs
+  ArDisconnectHandler then = NULL;
+  std::swap(then, tracked.then);
+  tracked.request = NULL;
+  if (then) {
+    then();
+  }
+}
+
+static String requestLabels(RequestHandler handler, int method) {
+  return String("handler=\"") + RequestMetrics::handlerName(handler) +
+         "\",method=\"" + RequestMetrics::methodName(method) + "\"";
+}
+
+void RequestMetrics::report(PrometheusWriter &prom) {
+  prom.family("http_requests_total", "counter",
+              "Requests by handler and method.");
+  for (int h = 0; h < REQUEST_HANDLERS; h++) {
+    for (int m = 0; m < REQUEST_METHODS; m++) {
+      uint32_t count = _duration[h][m].total();
+      if (count) {
+        String labels = requestLabels((RequestHandler)h, m);
+        prom.sample("http_requests_total", labels.c_str(), (uint64_t)count);
+      }
+    }
+  }
+  prom.family("http_requests_untracked_total", "counter",
+              "Requests not timed, every slot was taken.");
+  prom.sample("http_requests_untracked_total", NULL, (uint64_t)_untracked);
+  prom.family("http_request_duration_seconds", "histogram",
+              "From the handler taking a request until the client is gone.");
+  for (int h = 0; h < REQUEST_HANDLERS; h++) {
+    for (int m = 0; m < REQUEST_METHODS; m++) {
+      if (_duration[h][m].total()) {
+        String labels = requestLabels((RequestHandler)h, m);
+        prom.histogram("http_request_duration_seconds", labels.c_str(),
+                       _duration[h][m], 0.001);
+      }
+    }
+  }
+}
+
+const char *RequestMetrics::handlerName(RequestHandler handler) {
+  switch (handler) {
+  case REQUEST_HANDLER_DAV:
+    return "webdav";
+  case REQUEST_HANDLER_OCTOPRINT:
+    return "octoprint";
+  case REQUEST_HANDLER_STATIC:
+    return "static";
+  default:
+    return "unknown";
+  }
+}
+
+const char *RequestMetrics::methodName(int method) {
+  static const char *names[REQUEST_METHODS] = {
+      "GET",     "POST",   "DELETE",    "PUT",   "PATCH", "HEAD", "OPTIONS",
+      "PROPFIND", "LOCK", "UNLOCK", "PROPPATCH", "MKCOL", "MOVE", "COPY"};
+  return method >= 0 && method < REQUEST_METHODS ? names[method] : "OTHER";
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "PrometheusWriter.h"
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <atomic>
+
+#define REQUEST_BUCKETS 12
+// requests timed at once, as many as lwIP keeps connections open
+#ifndef REQUEST_METRICS_SLOTS
+#define REQUEST_METRICS_SLOTS 16
+#endif
+// methods ESPAsyncWebServer knows, one bit each from HTTP_GET to HTTP_COPY
+#define REQUEST_METHODS 14
+
+enum RequestHandler {
+  REQUEST_HANDLER_DAV,
+  REQUEST_HANDLER_OCTOPRINT,
+  REQUEST_HANDLER_STATIC,
+  REQUEST_HANDLERS
+};
+
+// Fixed-bucket histogram of request durations in milliseconds, from the
+// handler taking a request until its client is gone. Downloads take seconds,
+// so the buckets reach further than LatencyHistogram's.
+class RequestHistogram {
+public:
+  RequestHistogram() : _sum(0) {
+    for (int i = 0; i < REQUEST_BUCKETS; i++) {
+      _counts[i] = 0;
+    }
+  }
+
+  void record(uint32_t ms) {
+    int i = 0;
+    while (i < REQUEST_BUCKETS - 1 && ms > bound(i)) {
+      i++;
+    }
+    _counts[i]++;
+    _sum += ms;
+  }
+
+  // upper bound of bucket i, the last bucket has none
+  static uint32_t bound(int i) {
+    static const uint32_t bounds[REQUEST_BUCKETS - 1] = {
+        5, 10, 25, 50, 100, 250, 500, 1000, 2500, 10000, 60000};
+    return i < REQUEST_BUCKETS - 1 ? bounds[i] : UINT32_MAX;
+  }
+  static int buckets() { return REQUEST_BUCKETS; }
+  uint32_t count(int i) const { return _counts[i]; }
+  uint32_t sum() const { return _sum; }
+  uint32_t total() const {
+    uint32_t total = 0;
+    for (int i = 0; i < REQUEST_BUCKETS; i++) {
+      total += _counts[i];
+    }
+    return total;
+  }
+
+private:
+  std::atomic<uint32_t> _counts[REQUEST_BUCKETS];
+  std::atomic<uint32_t> _sum;
+};
+
+// Counts and times requests per handler and method. A request is timed from
+// the first track() until its client disconnects. The requests in flight sit
+// in a fixed array of slots, so tracking one allocates nothing; it happens
+// on the AsyncTCP task only and needs no lock. The histograms are atomics
+// and can be read from anywhere.
+class RequestMetrics {
+public:
+  // starts timing request, later calls for the same request are ignored
+  static void track(AsyncWebServerRequest *request, RequestHandler handler);
+  // for handlers that need to hear about the disconnect themselves: the
+  // request only has room for one such callback, which timing takes
+  static void onDisconnect(AsyncWebServerRequest *request,
+                           RequestHandler handler, ArDisconnectHandler fn);
+
+  static const RequestHistogram &duration(RequestHandler handler,
+                                          int method) {
+    return _duration[handler][method];
+  }
+  // requests that found every slot taken and were not timed
+  static uint32_t untracked() { return _untracked; }
+  static const char *handlerName(RequestHandler handler);
+  static const char *methodName(int method);
+
+  // the request counts and durations of every handler and method seen
+  static void report(PrometheusWriter &prom);
+
+private:
+  struct Tracked {
+    AsyncWebServerRequest *request;
+    uint32_t start;
+    RequestHandler handler;
+    int method;
+    ArDisconnectHandler then;
+  };
+
+  static Tracked *find(AsyncWebServerRequest *request);
+  static void finish(Tracked &tracked);
+
+  static Tracked _tracked[REQUEST_METRICS_SLOTS];
+  static std::atomic<uint32_t> _untracked;
+  static RequestHistogram _duration[REQUEST_HANDLERS][REQUEST_METHODS];
+};
+
+// Times the requests of a handler that can't call track() itself, such as
+// the one serveStatic() makes, by handing everything on to it
+class TimedHandler : public AsyncWebHandler {
+public:
+  TimedHandler(AsyncWebHandler &handler, RequestHandler metric)
+      : _handler(handler), _metric(metric) {}
+
+  virtual bool canHandle(AsyncWebServerRequest *request) override final {
+    return _handler.filter(request) && _handler.canHandle(request);
+  }
+  virtual void handleRequest(AsyncWebServerRequest *request) override final {
+    RequestMetrics::track(request, _metric);
+    _handler.handleRequest(request);
+  }
+  virtual void handleUpload(AsyncWebServerRequest *request,
+                            const String &filename, size_t index,
+                            uint8_t *data, size_t len,
+                            bool final) override final {
+    _handler.handleUpload(request, filename, index, data, len, final);
+  }
+  virtual void handleBody(AsyncWebServerRequest *request, uint8_t *data,
+                          size_t len, size_t index,
+                          size_t total) override final {
+    _handler.handleBody(request, data, len, index, total);
+  }
+  virtual bool isRequestHandlerTrivial() override final {
+    return _handler.isRequestHandlerTrivial();
+  }
+
+private:
+  AsyncWebHandler &_handler;
+  RequestHandler _metric;
+};
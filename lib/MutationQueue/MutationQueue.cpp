@@ -0,0 +1,205 @@
+#include "MutationQueue.h"
+#include <FileCopier.h>
+#include <stddef.h>
+#include <vector>
+
+#define MUTATION_MAGIC 0x4e524a4d // "MJRN"
+
+QueueHandle_t MutationQueue::_queue = NULL;
+SemaphoreHandle_t MutationQueue::_lock = NULL;
+File MutationQueue::_journal;
+uint32_t MutationQueue::_seq = 0;
+uint32_t MutationQueue::_records = 0;
+std::atomic<uint32_t> MutationQueue::_depth(0);
+std::atomic<uint32_t> MutationQueue::_applied(0);
+std::atomic<uint32_t> MutationQueue::_failed(0);
+std::atomic<uint32_t> MutationQueue::_batches(0);
+LatencyHistogram MutationQueue::_journalLatency;
+LatencyHistogram MutationQueue::_applyLatency;
+
+bool MutationQueue::start(FS &fs) {
+  if (_queue) {
+    return true;
+  }
+  String journal = MUTATION_JOURNAL_FILE;
+  String dir = journal.substring(0, journal.lastIndexOf('/'));
+  if (dir.length() && !fs.exists(dir)) {
+    fs.mkdir(dir);
+  }
+  // whatever was in it is applied by now, see recover()
+  _journal = fs.open(journal, FILE_WRITE);
+  if (!_journal) {
+    return false;
+  }
+  _lock = xSemaphoreCreateMutex();
+  _queue = xQueueCreate(MUTATION_QUEUE, sizeof(Mutation *));
+  if (!_lock || !_queue ||
+      xTaskCreate(workerTask, "sd_mutate", 4096, &fs, 2, NULL) != pdPASS) {
+    _journal.close();
+    if (_queue) {
+      vQueueDelete(_queue);
+      _queue = NULL;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool MutationQueue::submit(FS &fs, MutationType type, const String &path,
+                           const String &dest,
+                           std::function<void(bool ok)> onDone) {
+  if (path.length() >= MUTATION_PATH || dest.length() >= MUTATION_PATH ||
+      !start(fs)) {
+    return false;
+  }
+  Mutation *mutation = new Mutation();
+  mutation->fs = &fs;
+  memset(&mutation->record, 0, sizeof(mutation->record));
+  mutation->record.type = type;
+  strcpy(mutation->record.path, path.c_str());
+  strcpy(mutation->record.dest, dest.c_str());
+  mutation->submitted = micros();
+  mutation->onDone = onDone;
+
+  // the queue takes intents in journal order; room is checked first, so
+  // nothing journaled is ever left out of it
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  bool ok = _depth < MUTATION_QUEUE && append(mutation->record);
+  if (ok) {
+    _journalLatency.record(micros() - mutation->submitted);
+    _depth++;
+    xQueueSend(_queue, &mutation, portMAX_DELAY);
+  }
+  xSemaphoreGive(_lock);
+  if (!ok) {
+    delete mutation;
+  }
+  return ok;
+}
+
+// called with the lock held
+bool MutationQueue::append(MutationRecord &record) {
+  record.magic = MUTATION_MAGIC;
+  // a commit carries the last sequence number it covers
+  if (record.type != MUTATION_COMMIT) {
+    record.seq = ++_seq;
+  }
+  record.checksum = checksum(record);
+  size_t n = _journal.write((const uint8_t *)&record, sizeof(record));
+  _journal.flush();
+  _records++;
+  return n == sizeof(record);
+}
+
+uint32_t MutationQueue::checksum(const MutationRecord &record) {
+  // FNV-1a
+  const uint8_t *p = (const uint8_t *)&record;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(MutationRecord, checksum); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+bool MutationQueue::apply(FS &fs, const MutationRecord &record) {
+  switch (record.type) {
+  case MUTATION_MKDIR:
+    return fs.exists(record.path) || fs.mkdir(record.path);
+  case MUTATION_REMOVE:
+    return !fs.exists(record.path) || FileCopier::removeTree(fs, record.path);
+  case MUTATION_RENAME:
+    // a replay finds it renamed already
+    if (!fs.exists(record.path)) {
+      return fs.exists(record.dest);
+    }
+    return fs.rename(record.path, record.dest);
+  case MUTATION_CREATE: {
+    File file = fs.open(record.path, FILE_APPEND);
+    bool ok = file;
+    file.close();
+    return ok;
+  }
+  default:
+    return false;
+  }
+}
+
+void MutationQueue::workerTask(void *arg) {
+  FS &fs = *(FS *)arg;
+  Mutation *batch[MUTATION_BATCH];
+  for (;;) {
+    if (xQueueReceive(_queue, &batch[0], portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    size_t count = 1;
+    while (count < MUTATION_BATCH &&
+           xQueueReceive(_queue, &batch[count], 0) == pdTRUE) {
+      count++;
+    }
+
+    MutationRecord commit;
+    memset(&commit, 0, sizeof(commit));
+    commit.type = MUTATION_COMMIT;
+    for (size_t i = 0; i < count; i++) {
+      Mutation *mutation = batch[i];
+      bool ok = apply(*mutation->fs, mutation->record);
+      _applyLatency.record(micros() - mutation->submitted);
+      if (ok) {
+        _applied++;
+      } else {
+        _failed++;
+      }
+      if (mutation->onDone) {
+        mutation->onDone(ok);
+      }
+      commit.seq = mutation->record.seq;
+    }
+
+    // one record covers the whole batch
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    append(commit);
+    _depth -= count;
+    if (!_depth && _records >= MUTATION_JOURNAL_MAX) {
+      _journal.close();
+      _journal = fs.open(MUTATION_JOURNAL_FILE, FILE_WRITE);
+      _records = 0;
+    }
+    xSemaphoreGive(_lock);
+    _batches++;
+    for (size_t i = 0; i < count; i++) {
+      delete batch[i];
+    }
+  }
+}
+
+uint32_t MutationQueue::recover(FS &fs) {
+  std::vector<MutationRecord> pending;
+  File journal = fs.open(MUTATION_JOURNAL_FILE);
+  if (journal && !journal.isDirectory()) {
+    MutationRecord record;
+    // a torn record ends the journal
+    while (journal.read((uint8_t *)&record, sizeof(record)) ==
+               sizeof(record) &&
+           record.magic == MUTATION_MAGIC &&
+           record.checksum == checksum(record)) {
+      if (record.type != MUTATION_COMMIT) {
+        pending.push_back(record);
+        continue;
+      }
+      size_t kept = 0;
+      for (size_t i = 0; i < pending.size(); i++) {
+        if (pending[i].seq > record.seq) {
+          pending[kept++] = pending[i];
+        }
+      }
+      pending.resize(kept);
+    }
+  }
+  journal.close();
+
+  for (size_t i = 0; i < pending.size(); i++) {
+    apply(fs, pending[i]);
+  }
+  start(fs);
+  return pending.size();
+}
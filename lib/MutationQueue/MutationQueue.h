@@ -0,0 +1,103 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <LatencyHistogram.h>
+#include <atomic>
+#include <functional>
+
+// Intents are appended here before they are applied, and replayed at boot if
+// a reset came in between
+#ifndef MUTATION_JOURNAL_FILE
+#define MUTATION_JOURNAL_FILE "/.prusa-wifi/journal.bin"
+#endif
+#ifndef MUTATION_PATH
+#define MUTATION_PATH 128
+#endif
+// mutations waiting for the worker
+#ifndef MUTATION_QUEUE
+#define MUTATION_QUEUE 32
+#endif
+// mutations applied before one commit record covers them all
+#ifndef MUTATION_BATCH
+#define MUTATION_BATCH 8
+#endif
+// records after which an idle journal starts over
+#ifndef MUTATION_JOURNAL_MAX
+#define MUTATION_JOURNAL_MAX 64
+#endif
+
+enum MutationType {
+  MUTATION_MKDIR,
+  // a file, or a directory with everything below it
+  MUTATION_REMOVE,
+  MUTATION_RENAME,
+  // an empty file, unless one exists
+  MUTATION_CREATE,
+  // everything up to seq was applied
+  MUTATION_COMMIT
+};
+
+// One journal record as it is stored on the card
+struct MutationRecord {
+  uint32_t magic;
+  uint32_t seq;
+  uint8_t type;
+  uint8_t reserved[3];
+  char path[MUTATION_PATH];
+  char dest[MUTATION_PATH];
+  // over everything before it, a torn record fails it
+  uint32_t checksum;
+};
+
+// Applies filesystem changes from a worker task, so a request never waits
+// on FAT directory updates. submit() returns once the intent is in the
+// journal on the card; the worker applies queued mutations in order, in
+// batches closed by a single commit record. Each one is repeated at boot
+// when a reset cuts a batch short, so all of them must be idempotent.
+class MutationQueue {
+  using FS = fs::FS;
+
+public:
+  // false when the journal couldn't be written or the queue is full, the
+  // change then never happens; onDone runs on the worker once it is applied
+  static bool submit(FS &fs, MutationType type, const String &path,
+                     const String &dest, std::function<void(bool ok)> onDone);
+  // replays intents a reset cut off, before anything else uses the card
+  static uint32_t recover(FS &fs);
+
+  // mutations submitted but not applied yet
+  static uint32_t depth() { return _depth; }
+  static uint32_t applied() { return _applied; }
+  static uint32_t failed() { return _failed; }
+  static uint32_t batches() { return _batches; }
+  // submit() until the intent is on the card, and until it is applied
+  static const LatencyHistogram &journalLatency() { return _journalLatency; }
+  static const LatencyHistogram &applyLatency() { return _applyLatency; }
+
+private:
+  struct Mutation {
+    FS *fs;
+    MutationRecord record;
+    uint32_t submitted;
+    std::function<void(bool ok)> onDone;
+  };
+
+  static bool start(FS &fs);
+  static void workerTask(void *arg);
+  static bool append(MutationRecord &record);
+  static bool apply(FS &fs, const MutationRecord &record);
+  static uint32_t checksum(const MutationRecord &record);
+
+  static QueueHandle_t _queue;
+  static SemaphoreHandle_t _lock;
+  static File _journal;
+  static uint32_t _seq;
+  static uint32_t _records;
+  static std::atomic<uint32_t> _depth;
+  static std::atomic<uint32_t> _applied;
+  static std::atomic<uint32_t> _failed;
+  static std::atomic<uint32_t> _batches;
+  static LatencyHistogram _journalLatency;
+  static LatencyHistogram _applyLatency;
+};
@@ -0,0 +1,151 @@
+#include "Arduino.h"
+#include "esp_timer.h"
+#include <atomic>
+#include <chrono>
+#include <malloc.h>
+#include <new>
+#include <random>
+#include <thread>
+
+// internal RAM the firmware sees free after boot, and the esp32cam's PSRAM
+#define NATIVE_HEAP_SIZE (320 * 1024)
+#define NATIVE_PSRAM_SIZE (4 * 1024 * 1024)
+
+EspClass ESP;
+
+static const std::chrono::steady_clock::time_point started =
+    std::chrono::steady_clock::now();
+
+static std::atomic<uint64_t> heapAllocations(0);
+static std::atomic<uint64_t> heapAllocated(0);
+static std::atomic<int64_t> heapInUse(0);
+static std::atomic<int64_t> heapPeak(0);
+
+static void *counted(void *p) {
+  if (p) {
+    size_t size = malloc_usable_size(p);
+    heapAllocations++;
+    heapAllocated += size;
+    int64_t inUse = heapInUse += size;
+    int64_t peak = heapPeak;
+    while (inUse > peak && !heapPeak.compare_exchange_weak(peak, inUse)) {
+    }
+  }
+  return p;
+}
+
+static void uncounted(void *p) {
+  if (p) {
+    heapInUse -= malloc_usable_size(p);
+    free(p);
+  }
+}
+
+void *operator new(size_t size) {
+  void *p = counted(malloc(size ? size : 1));
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return counted(malloc(size ? size : 1));
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return counted(malloc(size ? size : 1));
+}
+
+void operator delete(void *p) noexcept { uncounted(p); }
+void operator delete[](void *p) noexcept { uncounted(p); }
+void operator delete(void *p, size_t) noexcept { uncounted(p); }
+void operator delete[](void *p, size_t) noexcept { uncounted(p); }
+
+uint64_t NativeHeap::allocations() { return heapAllocations; }
+uint64_t NativeHeap::allocated() { return heapAllocated; }
+int64_t NativeHeap::inUse() { return heapInUse; }
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - started)
+      .count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - started)
+      .count();
+}
+
+int64_t esp_timer_get_time() { return micros(); }
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size) {
+  size_t len = strlen(src);
+  if (size) {
+    size_t n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return len;
+}
+#endif
+
+uint32_t esp_random() {
+  static thread_local std::mt19937 random(std::random_device{}());
+  return random();
+}
+
+bool psramFound() { return true; }
+
+// the libraries free these with free() as well, so like malloc() itself
+// they are not counted
+void *ps_malloc(size_t size) { return malloc(size); }
+
+void *heap_caps_malloc(size_t size, uint32_t caps) { return malloc(size); }
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+  return calloc(n, size);
+}
+
+void heap_caps_free(void *ptr) { free(ptr); }
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  return caps & MALLOC_CAP_SPIRAM ? ESP.getFreePsram() : ESP.getFreeHeap();
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  return caps & MALLOC_CAP_SPIRAM ? ESP.getMaxAllocPsram()
+                                  : ESP.getMaxAllocHeap();
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+  return caps & MALLOC_CAP_SPIRAM ? ESP.getFreePsram() : ESP.getMinFreeHeap();
+}
+
+uint32_t EspClass::getHeapSize() { return NATIVE_HEAP_SIZE; }
+
+uint32_t EspClass::getFreeHeap() {
+  int64_t inUse = heapInUse;
+  return inUse < NATIVE_HEAP_SIZE ? NATIVE_HEAP_SIZE - inUse : 0;
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+  int64_t peak = heapPeak;
+  return peak < NATIVE_HEAP_SIZE ? NATIVE_HEAP_SIZE - peak : 0;
+}
+
+uint32_t EspClass::getMaxAllocHeap() { return getFreeHeap(); }
+
+uint32_t EspClass::getPsramSize() { return NATIVE_PSRAM_SIZE; }
+
+uint32_t EspClass::getFreePsram() { return NATIVE_PSRAM_SIZE; }
+
+uint32_t EspClass::getMaxAllocPsram() { return NATIVE_PSRAM_SIZE; }
@@ -0,0 +1,73 @@
+#pragma once
+
+// Just enough of the ESP32 Arduino core for the libraries to build and run
+// on the host, for [env:native] tests. Heap use is counted, so tests can
+// tell how much a request allocates.
+
+#include "Print.h"
+#include "WString.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define PROGMEM
+#define PGM_P const char *
+#define F(x) x
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+
+// the core takes these from the std namespace as well
+using std::max;
+using std::min;
+
+// glibc has its own from 2.38 on
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size);
+#endif
+
+uint32_t esp_random();
+
+// 4 MB, as on the esp32cam
+bool psramFound();
+void *ps_malloc(size_t size);
+
+// heap of the ESP32 with what the host process allocated taken off it
+class EspClass {
+public:
+  uint32_t getHeapSize();
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+  uint32_t getMaxAllocHeap();
+  uint32_t getPsramSize();
+  uint32_t getFreePsram();
+  uint32_t getMaxAllocPsram();
+};
+extern EspClass ESP;
+
+// Allocations and bytes allocated with new since start, and what is still
+// allocated now. Only new is counted, as the libraries free what they got
+// from malloc() and ps_malloc() alike.
+struct NativeHeap {
+  static uint64_t allocations();
+  static uint64_t allocated();
+  static int64_t inUse();
+};
+
+#include "HardwareSerial.h"
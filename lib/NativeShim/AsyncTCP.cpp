@@ -0,0 +1,163 @@
+#include "AsyncTCP.h"
+#include <lwip/priv/tcp_priv.h>
+#include <lwip/tcpip.h>
+#include <mutex>
+
+tcp_pcb *tcp_active_pcbs = NULL;
+static std::mutex tcpipLock;
+
+err_t tcpip_callback(tcpip_callback_fn function, void *ctx) {
+  std::lock_guard<std::mutex> lock(tcpipLock);
+  function(ctx);
+  return ERR_OK;
+}
+
+// with tcpipLock held
+void tcp_recved(tcp_pcb *pcb, uint16_t len) {
+  pcb->rcv_wnd = min(pcb->rcv_wnd + len, (uint32_t)NATIVE_TCP_WINDOW);
+}
+
+AsyncClient::AsyncClient(size_t window)
+    : _window(window), _unacked(0), _unsent(0), _copied(0), _zeroCopy(0),
+      _connected(true), _ackLater(false), _pollRequested(false) {
+  _pcb.callback_arg = this;
+  _pcb.poll = onPoll;
+  _pcb.unsent = _pcb.unacked = NULL;
+  _pcb.rcv_wnd = NATIVE_TCP_WINDOW;
+  _queue.next = NULL;
+  std::lock_guard<std::mutex> lock(tcpipLock);
+  _pcb.next = tcp_active_pcbs;
+  tcp_active_pcbs = &_pcb;
+}
+
+AsyncClient::~AsyncClient() {
+  std::lock_guard<std::mutex> lock(tcpipLock);
+  unlink();
+}
+
+err_t AsyncClient::onPoll(void *arg, tcp_pcb *pcb) {
+  ((AsyncClient *)arg)->_pollRequested = true;
+  return ERR_OK;
+}
+
+// the pcb's queues as the lwIP thread sees them; a closed connection is
+// dropped from the list once nothing is left to acknowledge
+void AsyncClient::queued() {
+  std::lock_guard<std::mutex> lock(tcpipLock);
+  _pcb.unsent = _unsent ? &_queue : NULL;
+  _pcb.unacked = _unacked ? &_queue : NULL;
+  if (!_connected && !_unsent && !_unacked) {
+    unlink();
+  }
+}
+
+// with tcpipLock held
+void AsyncClient::unlink() {
+  for (tcp_pcb **link = &tcp_active_pcbs; *link; link = &(*link)->next) {
+    if (*link == &_pcb) {
+      *link = _pcb.next;
+      return;
+    }
+  }
+}
+
+size_t AsyncClient::receiveWindow() {
+  std::lock_guard<std::mutex> lock(tcpipLock);
+  return _pcb.rcv_wnd;
+}
+
+// AsyncTCP takes the bytes itself unless the callback asked it not to
+void AsyncClient::received(size_t len) {
+  if (_ackLater) {
+    std::lock_guard<std::mutex> lock(tcpipLock);
+    _pcb.rcv_wnd -= min((uint32_t)len, _pcb.rcv_wnd);
+  }
+  _ackLater = false;
+}
+
+size_t AsyncClient::space() {
+  size_t used = _unacked + _unsent;
+  return _connected && used < _window ? _window - used : 0;
+}
+
+size_t AsyncClient::add(const char *data, size_t size, uint8_t apiflags) {
+  size = min(size, space());
+  if (!size || !data) {
+    return 0;
+  }
+  Segment segment = {data, std::string(), size, false};
+  if (apiflags & ASYNC_WRITE_FLAG_COPY) {
+    segment.copy.assign(data, size);
+    segment.data = NULL;
+    _copied += size;
+  } else {
+    _zeroCopy += size;
+  }
+  _segments.push_back(segment);
+  _unsent += size;
+  queued();
+  return size;
+}
+
+bool AsyncClient::send() {
+  for (Segment &segment : _segments) {
+    segment.sent = true;
+  }
+  _unacked += _unsent;
+  _unsent = 0;
+  queued();
+  return _connected;
+}
+
+size_t AsyncClient::write(const char *data) {
+  return data ? write(data, strlen(data)) : 0;
+}
+
+size_t AsyncClient::write(const char *data, size_t size, uint8_t apiflags) {
+  size_t n = add(data, size, apiflags);
+  if (n) {
+    send();
+  }
+  return n;
+}
+
+void AsyncClient::close(bool now) {
+  _connected = false;
+  {
+    // AsyncTCP detaches its callbacks from the pcb
+    std::lock_guard<std::mutex> lock(tcpipLock);
+    _pcb.callback_arg = NULL;
+    _pcb.poll = NULL;
+  }
+  if (now) {
+    _segments.clear();
+    _unacked = _unsent = 0;
+  }
+  queued();
+}
+
+size_t AsyncClient::ack(size_t max) {
+  size_t acked = 0;
+  while (acked < max && !_segments.empty() && _segments.front().sent) {
+    Segment &segment = _segments.front();
+    size_t n = min(max - acked, segment.len);
+    // zero-copy data is only read now, as a retransmission would
+    const char *data = segment.data ? segment.data : segment.copy.data();
+    _received.append(data, n);
+    acked += n;
+    if (n == segment.len) {
+      _segments.pop_front();
+    } else if (segment.data) {
+      segment.data += n;
+      segment.len -= n;
+    } else {
+      segment.copy.erase(0, n);
+      segment.len -= n;
+    }
+  }
+  _unacked -= acked;
+  if (acked) {
+    queued();
+  }
+  return acked;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include <deque>
+#include <lwip/tcp.h>
+#include <string>
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+#define ASYNC_WRITE_FLAG_MORE 0x02
+
+#ifndef NATIVE_TCP_WINDOW
+#define NATIVE_TCP_WINDOW 5744
+#endif
+
+// One end of a connection. Data added without ASYNC_WRITE_FLAG_COPY stays
+// where the caller keeps it until the far end acknowledges it, as lwIP's
+// zero-copy segments do; a buffer freed too early shows up under ASan.
+// While connected, its pcb is in tcp_active_pcbs, and calling the pcb's poll
+// callback from another thread asks for a poll the next step delivers. After
+// close() the pcb stays listed without callbacks until what was sent is
+// acknowledged, as lwIP keeps a closing connection until then. Received
+// bytes close the receive window until they are taken, right after the
+// callback they came in, or with tcp_recved() after ackLater().
+class AsyncClient {
+public:
+  AsyncClient(size_t window = NATIVE_TCP_WINDOW);
+  ~AsyncClient();
+
+  size_t space();
+  size_t add(const char *data, size_t size,
+             uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+  bool send();
+  bool canSend() { return space() > 0; }
+  size_t write(const char *data);
+  size_t write(const char *data, size_t size,
+               uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+  // close() still delivers what was sent, close(true) drops it like an abort
+  void close(bool now = false);
+  bool connected() { return _connected; }
+  tcp_pcb *pcb() { return _connected ? &_pcb : NULL; }
+  // the bytes of the current receive callback are taken later on
+  void ackLater() { _ackLater = true; }
+
+  // the far end: takes up to max sent bytes and returns how many
+  size_t ack(size_t max = SIZE_MAX);
+  size_t unacked() const { return _unacked; }
+  size_t unsent() const { return _unsent; }
+  const std::string &received() const { return _received; }
+  void setWindow(size_t window) { _window = window; }
+  // how much more the far end may send, and len bytes it did once the
+  // receive callback returned
+  size_t receiveWindow();
+  void received(size_t len);
+  // true once after the pcb's poll callback ran
+  bool takePoll() { return _pollRequested.exchange(false); }
+
+  uint64_t copiedBytes() const { return _copied; }
+  uint64_t zeroCopyBytes() const { return _zeroCopy; }
+
+private:
+  static err_t onPoll(void *arg, tcp_pcb *pcb);
+  void queued();
+  void unlink();
+
+  struct Segment {
+    const char *data;
+    std::string copy;
+    size_t len;
+    bool sent;
+  };
+
+  std::deque<Segment> _segments;
+  std::string _received;
+  size_t _window;
+  size_t _unacked;
+  size_t _unsent;
+  uint64_t _copied;
+  uint64_t _zeroCopy;
+  bool _connected;
+  bool _ackLater;
+  tcp_pcb _pcb;
+  tcp_seg _queue;
+  std::atomic<bool> _pollRequested;
+};
@@ -0,0 +1,13 @@
+#include "DateTime.h"
+
+DateTimeClass::DateTimeClass(const time_t timeSecs, const int timeZone)
+    : _time(timeSecs), _zone(timeZone) {}
+
+String DateTimeClass::format(const char *fmt) {
+  time_t local = _time + _zone * 3600;
+  struct tm parts;
+  gmtime_r(&local, &parts);
+  char buffer[64];
+  size_t n = strftime(buffer, sizeof(buffer), fmt, &parts);
+  return String(buffer).substring(0, n);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ctime>
+
+// the part of ESPDateTime's DateTimeClass the handlers format dates with
+class DateTimeClass {
+public:
+  DateTimeClass(const time_t timeSecs = 0, const int timeZone = 0);
+
+  time_t getTime() const { return _time; }
+  String format(const char *fmt);
+
+private:
+  time_t _time;
+  int _zone;
+};
@@ -0,0 +1,622 @@
+#include "ESPAsyncWebServer.h"
+
+static const String emptyString;
+
+AsyncWebServerRequest::AsyncWebServerRequest(AsyncClient *client)
+    : _tempObject(NULL), _client(client), _handlerp(NULL), _responsep(NULL),
+      _method(HTTP_GET), _url("/"), _host("printer.local"),
+      _contentLength(0), _multipart(false) {}
+
+AsyncWebServerRequest::~AsyncWebServerRequest() {
+  for (AsyncWebHeader *header : _headers) {
+    delete header;
+  }
+  for (AsyncWebParameter *param : _params) {
+    delete param;
+  }
+  delete _responsep;
+  if (_tempObject) {
+    free(_tempObject);
+  }
+  if (_tempFile) {
+    _tempFile.close();
+  }
+}
+
+const char *AsyncWebServerRequest::methodToString() const {
+  switch (_method) {
+  case HTTP_GET:
+    return "GET";
+  case HTTP_POST:
+    return "POST";
+  case HTTP_DELETE:
+    return "DELETE";
+  case HTTP_PUT:
+    return "PUT";
+  case HTTP_PATCH:
+    return "PATCH";
+  case HTTP_HEAD:
+    return "HEAD";
+  case HTTP_OPTIONS:
+    return "OPTIONS";
+  case HTTP_PROPFIND:
+    return "PROPFIND";
+  case HTTP_LOCK:
+    return "LOCK";
+  case HTTP_UNLOCK:
+    return "UNLOCK";
+  case HTTP_PROPPATCH:
+    return "PROPPATCH";
+  case HTTP_MKCOL:
+    return "MKCOL";
+  case HTTP_MOVE:
+    return "MOVE";
+  case HTTP_COPY:
+    return "COPY";
+  }
+  return "UNKNOWN";
+}
+
+void AsyncWebServerRequest::addInterestingHeader(const String &name) {
+  for (const String &header : _interestingHeaders) {
+    if (header.equalsIgnoreCase(name)) {
+      return;
+    }
+  }
+  _interestingHeaders.push_back(name);
+}
+
+void AsyncWebServerRequest::send(AsyncWebServerResponse *response) {
+  _responsep = response;
+  if (!_responsep) {
+    _client->close(true);
+    return;
+  }
+  if (!_responsep->_sourceValid()) {
+    delete response;
+    _responsep = NULL;
+    send(500);
+  } else {
+    _responsep->_respond(this);
+  }
+}
+
+void AsyncWebServerRequest::send(int code, const String &contentType,
+                                 const String &content) {
+  send(beginResponse(code, contentType, content));
+}
+
+AsyncWebServerResponse *
+AsyncWebServerRequest::beginResponse(int code, const String &contentType,
+                                     const String &content) {
+  return new AsyncBasicResponse(code, contentType, content);
+}
+
+AsyncWebServerResponse *
+AsyncWebServerRequest::beginResponse(const String &contentType, size_t len,
+                                     AwsResponseFiller callback,
+                                     AwsTemplateProcessor templateCallback) {
+  return new AsyncCallbackResponse(contentType, len, callback,
+                                   templateCallback);
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginChunkedResponse(
+    const String &contentType, AwsResponseFiller callback,
+    AwsTemplateProcessor templateCallback) {
+  return new AsyncChunkedResponse(contentType, callback, templateCallback);
+}
+
+AsyncResponseStream *
+AsyncWebServerRequest::beginResponseStream(const String &contentType,
+                                           size_t bufferSize) {
+  return new AsyncResponseStream(contentType, bufferSize);
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginResponse_P(
+    int code, const String &contentType, const uint8_t *content, size_t len,
+    AwsTemplateProcessor callback) {
+  return new AsyncProgmemResponse(code, contentType, content, len, callback);
+}
+
+AsyncWebServerResponse *
+AsyncWebServerRequest::beginResponse_P(int code, const String &contentType,
+                                       PGM_P content,
+                                       AwsTemplateProcessor callback) {
+  return beginResponse_P(code, contentType, (const uint8_t *)content,
+                         strlen_P(content), callback);
+}
+
+AsyncWebHeader *AsyncWebServerRequest::getHeader(const String &name) const {
+  for (AsyncWebHeader *header : _headers) {
+    if (header->name().equalsIgnoreCase(name)) {
+      return header;
+    }
+  }
+  return NULL;
+}
+
+AsyncWebHeader *AsyncWebServerRequest::getHeader(size_t num) const {
+  return num < _headers.size() ? _headers[num] : NULL;
+}
+
+AsyncWebParameter *AsyncWebServerRequest::getParam(const String &name,
+                                                   bool post,
+                                                   bool file) const {
+  for (AsyncWebParameter *param : _params) {
+    if (param->name() == name && param->isPost() == post &&
+        param->isFile() == file) {
+      return param;
+    }
+  }
+  return NULL;
+}
+
+AsyncWebParameter *AsyncWebServerRequest::getParam(size_t num) const {
+  return num < _params.size() ? _params[num] : NULL;
+}
+
+bool AsyncWebServerRequest::hasArg(const char *name) const {
+  for (AsyncWebParameter *param : _params) {
+    if (param->name() == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const String &AsyncWebServerRequest::arg(const String &name) const {
+  for (AsyncWebParameter *param : _params) {
+    if (param->name() == name) {
+      return param->value();
+    }
+  }
+  return emptyString;
+}
+
+void AsyncWebServerRequest::_setContent(const String &type, size_t length,
+                                        bool multipart) {
+  _contentType = type;
+  _contentLength = length;
+  _multipart = multipart;
+}
+
+void AsyncWebServerRequest::_addHeader(const String &name,
+                                       const String &value) {
+  if (name.equalsIgnoreCase("Host")) {
+    _host = value;
+  }
+  _headers.push_back(new AsyncWebHeader(name, value));
+}
+
+bool AsyncWebServerRequest::_attachHandler(
+    const std::vector<AsyncWebHandler *> &handlers) {
+  for (AsyncWebHandler *handler : handlers) {
+    if (handler->filter(this) && handler->canHandle(this)) {
+      _handlerp = handler;
+      break;
+    }
+  }
+
+  for (const String &name : _interestingHeaders) {
+    if (name.equalsIgnoreCase("ANY")) {
+      return _handlerp;
+    }
+  }
+  for (size_t i = 0; i < _headers.size();) {
+    bool interesting = false;
+    for (const String &name : _interestingHeaders) {
+      interesting = interesting || _headers[i]->name().equalsIgnoreCase(name);
+    }
+    if (interesting) {
+      i++;
+    } else {
+      delete _headers[i];
+      _headers.erase(_headers.begin() + i);
+    }
+  }
+  return _handlerp;
+}
+
+void AsyncWebServerRequest::_onAck(size_t len, uint32_t time) {
+  if (!_responsep) {
+    return;
+  }
+  if (!_responsep->_finished()) {
+    _responsep->_ack(this, len, time);
+  } else {
+    AsyncWebServerResponse *response = _responsep;
+    _responsep = NULL;
+    delete response;
+  }
+}
+
+void AsyncWebServerRequest::_onPoll() {
+  if (_responsep && _client->canSend() && !_responsep->_finished()) {
+    _responsep->_ack(this, 0, 0);
+  }
+}
+
+void AsyncWebServerRequest::_onDisconnect() {
+  if (_onDisconnectfn) {
+    _onDisconnectfn();
+  }
+}
+
+AsyncWebServerResponse::AsyncWebServerResponse()
+    : _code(0), _contentLength(0), _sendContentLength(true), _chunked(false),
+      _headLength(0), _sentLength(0), _ackedLength(0), _writtenLength(0),
+      _state(RESPONSE_SETUP) {}
+
+const char *AsyncWebServerResponse::_responseCodeToString(int code) {
+  switch (code) {
+  case 100:
+    return "Continue";
+  case 200:
+    return "OK";
+  case 201:
+    return "Created";
+  case 204:
+    return "No Content";
+  case 206:
+    return "Partial Content";
+  case 207:
+    return "Multi-Status";
+  case 304:
+    return "Not Modified";
+  case 400:
+    return "Bad Request";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 406:
+    return "Not Acceptable";
+  case 409:
+    return "Conflict";
+  case 412:
+    return "Precondition Failed";
+  case 416:
+    return "Requested Range Not Satisfiable";
+  case 500:
+    return "Internal Server Error";
+  case 501:
+    return "Not Implemented";
+  case 502:
+    return "Bad Gateway";
+  case 503:
+    return "Service Unavailable";
+  case 507:
+    return "Insufficient Storage";
+  default:
+    return "";
+  }
+}
+
+void AsyncWebServerResponse::setCode(int code) {
+  if (_state == RESPONSE_SETUP) {
+    _code = code;
+  }
+}
+
+void AsyncWebServerResponse::setContentLength(size_t len) {
+  if (_state == RESPONSE_SETUP) {
+    _contentLength = len;
+  }
+}
+
+void AsyncWebServerResponse::setContentType(const String &type) {
+  if (_state == RESPONSE_SETUP) {
+    _contentType = type;
+  }
+}
+
+void AsyncWebServerResponse::addHeader(const String &name,
+                                       const String &value) {
+  _headers.push_back(AsyncWebHeader(name, value));
+}
+
+String AsyncWebServerResponse::_assembleHead(uint8_t version) {
+  if (version) {
+    addHeader("Accept-Ranges", "none");
+    if (_chunked) {
+      addHeader("Transfer-Encoding", "chunked");
+    }
+  }
+  String out;
+  char buf[300];
+  snprintf(buf, sizeof(buf), "HTTP/1.%d %d %s\r\n", version, _code,
+           _responseCodeToString(_code));
+  out.concat(buf);
+  if (_sendContentLength) {
+    snprintf(buf, sizeof(buf), "Content-Length: %u\r\n",
+             (unsigned)_contentLength);
+    out.concat(buf);
+  }
+  if (_contentType.length()) {
+    snprintf(buf, sizeof(buf), "Content-Type: %s\r\n", _contentType.c_str());
+    out.concat(buf);
+  }
+  for (const AsyncWebHeader &header : _headers) {
+    snprintf(buf, sizeof(buf), "%s: %s\r\n", header.name().c_str(),
+             header.value().c_str());
+    out.concat(buf);
+  }
+  _headers.clear();
+  out.concat("\r\n");
+  _headLength = out.length();
+  return out;
+}
+
+bool AsyncWebServerResponse::_started() const {
+  return _state > RESPONSE_SETUP;
+}
+
+bool AsyncWebServerResponse::_finished() const {
+  return _state > RESPONSE_WAIT_ACK;
+}
+
+bool AsyncWebServerResponse::_failed() const {
+  return _state == RESPONSE_FAILED;
+}
+
+bool AsyncWebServerResponse::_sourceValid() const { return false; }
+
+void AsyncWebServerResponse::_respond(AsyncWebServerRequest *request) {
+  _state = RESPONSE_END;
+  request->client()->close();
+}
+
+size_t AsyncWebServerResponse::_ack(AsyncWebServerRequest *request,
+                                    size_t len, uint32_t time) {
+  return 0;
+}
+
+AsyncBasicResponse::AsyncBasicResponse(int code, const String &contentType,
+                                       const String &content) {
+  _code = code;
+  _content = content;
+  _contentType = contentType;
+  if (_content.length()) {
+    _contentLength = _content.length();
+    if (!_contentType.length()) {
+      _contentType = "text/plain";
+    }
+  }
+  addHeader("Connection", "close");
+}
+
+void AsyncBasicResponse::_respond(AsyncWebServerRequest *request) {
+  _state = RESPONSE_HEADERS;
+  // everything goes through _content, which upstream only does when the
+  // head doesn't fit; the bytes on the wire are the same
+  _content = _assembleHead(request->version()) + _content;
+  _contentLength = _content.length();
+  _state = RESPONSE_CONTENT;
+  _ack(request, 0, 0);
+}
+
+size_t AsyncBasicResponse::_ack(AsyncWebServerRequest *request, size_t len,
+                                uint32_t time) {
+  _ackedLength += len;
+  if (_state == RESPONSE_CONTENT) {
+    size_t available = _contentLength - _sentLength;
+    size_t space = request->client()->space();
+    size_t n = min(space, available);
+    String out = _content.substring(_sentLength, _sentLength + n);
+    _sentLength += n;
+    _writtenLength += request->client()->write(out.c_str(), n);
+    if (_sentLength == _contentLength) {
+      _content = String();
+      _state = RESPONSE_WAIT_ACK;
+    }
+    return n;
+  } else if (_state == RESPONSE_WAIT_ACK && _ackedLength >= _writtenLength) {
+    _state = RESPONSE_END;
+  }
+  return 0;
+}
+
+AsyncAbstractResponse::AsyncAbstractResponse(AwsTemplateProcessor callback)
+    : _callback(callback) {}
+
+void AsyncAbstractResponse::_respond(AsyncWebServerRequest *request) {
+  addHeader("Connection", "close");
+  _head = _assembleHead(request->version());
+  _state = RESPONSE_HEADERS;
+  _ack(request, 0, 0);
+}
+
+size_t AsyncAbstractResponse::_ack(AsyncWebServerRequest *request,
+                                   size_t len, uint32_t time) {
+  if (!_sourceValid()) {
+    _state = RESPONSE_FAILED;
+    request->client()->close();
+    return 0;
+  }
+  _ackedLength += len;
+  size_t space = request->client()->space();
+
+  size_t headLen = _head.length();
+  if (_state == RESPONSE_HEADERS) {
+    if (space >= headLen) {
+      _state = RESPONSE_CONTENT;
+      space -= headLen;
+    } else {
+      String out = _head.substring(0, space);
+      _head = _head.substring(space);
+      _writtenLength += request->client()->write(out.c_str(), out.length());
+      return out.length();
+    }
+  }
+
+  if (_state == RESPONSE_CONTENT) {
+    size_t outLen;
+    if (_chunked) {
+      if (space <= 8) {
+        return 0;
+      }
+      outLen = space;
+    } else if (!_sendContentLength) {
+      outLen = space;
+    } else {
+      outLen = min(_contentLength - _sentLength, space);
+    }
+
+    uint8_t *buf = (uint8_t *)malloc(outLen + headLen);
+    if (!buf) {
+      return 0;
+    }
+    if (headLen) {
+      memcpy(buf, _head.c_str(), headLen);
+    }
+
+    size_t readLen = 0;
+    if (_chunked) {
+      // leading spaces after the length are allowed, RFC 2616 3.6.1
+      readLen = _fillBuffer(buf + headLen + 6, outLen - 8);
+      if (readLen == RESPONSE_TRY_AGAIN) {
+        free(buf);
+        return 0;
+      }
+      char size[9];
+      int sizeLen = snprintf(size, sizeof(size), "%x", (unsigned)readLen);
+      memcpy(buf + headLen, size, sizeLen);
+      outLen = headLen + sizeLen;
+      while (outLen < headLen + 4) {
+        buf[outLen++] = ' ';
+      }
+      buf[outLen++] = '\r';
+      buf[outLen++] = '\n';
+      outLen += readLen;
+      buf[outLen++] = '\r';
+      buf[outLen++] = '\n';
+    } else {
+      readLen = _fillBuffer(buf + headLen, outLen);
+      if (readLen == RESPONSE_TRY_AGAIN) {
+        free(buf);
+        return 0;
+      }
+      outLen = readLen + headLen;
+    }
+
+    if (headLen) {
+      _head = String();
+    }
+    if (outLen) {
+      _writtenLength += request->client()->write((const char *)buf, outLen);
+    }
+    if (_chunked) {
+      _sentLength += readLen;
+    } else {
+      _sentLength += outLen - headLen;
+    }
+    free(buf);
+
+    if ((_chunked && readLen == 0) || (!_sendContentLength && outLen == 0) ||
+        (!_chunked && _sentLength == _contentLength)) {
+      _state = RESPONSE_WAIT_ACK;
+    }
+    return outLen;
+  } else if (_state == RESPONSE_WAIT_ACK) {
+    if (!_sendContentLength || _ackedLength >= _writtenLength) {
+      _state = RESPONSE_END;
+      if (!_chunked && !_sendContentLength) {
+        request->client()->close(true);
+      }
+    }
+  }
+  return 0;
+}
+
+AsyncProgmemResponse::AsyncProgmemResponse(int code,
+                                           const String &contentType,
+                                           const uint8_t *content, size_t len,
+                                           AwsTemplateProcessor callback)
+    : AsyncAbstractResponse(callback), _content(content), _readLength(0) {
+  _code = code;
+  _contentType = contentType;
+  _contentLength = len;
+}
+
+size_t AsyncProgmemResponse::_fillBuffer(uint8_t *buf, size_t maxLen) {
+  size_t n = min(maxLen, _contentLength - _readLength);
+  memcpy_P(buf, _content + _readLength, n);
+  _readLength += n;
+  return n;
+}
+
+AsyncCallbackResponse::AsyncCallbackResponse(
+    const String &contentType, size_t len, AwsResponseFiller callback,
+    AwsTemplateProcessor templateCallback)
+    : AsyncAbstractResponse(templateCallback), _content(callback),
+      _filledLength(0) {
+  _code = 200;
+  _contentLength = len;
+  if (!len) {
+    _sendContentLength = false;
+  }
+  _contentType = contentType;
+}
+
+size_t AsyncCallbackResponse::_fillBuffer(uint8_t *buf, size_t maxLen) {
+  size_t n = _content(buf, maxLen, _filledLength);
+  if (n != RESPONSE_TRY_AGAIN) {
+    _filledLength += n;
+  }
+  return n;
+}
+
+AsyncChunkedResponse::AsyncChunkedResponse(
+    const String &contentType, AwsResponseFiller callback,
+    AwsTemplateProcessor templateCallback)
+    : AsyncAbstractResponse(templateCallback), _content(callback),
+      _filledLength(0) {
+  _code = 200;
+  _contentLength = 0;
+  _contentType = contentType;
+  _sendContentLength = false;
+  _chunked = true;
+}
+
+size_t AsyncChunkedResponse::_fillBuffer(uint8_t *buf, size_t maxLen) {
+  size_t n = _content(buf, maxLen, _filledLength);
+  if (n != RESPONSE_TRY_AGAIN) {
+    _filledLength += n;
+  }
+  return n;
+}
+
+AsyncResponseStream::AsyncResponseStream(const String &contentType,
+                                         size_t bufferSize)
+    : _readPos(0) {
+  _code = 200;
+  _contentLength = 0;
+  _contentType = contentType;
+  _content.reserve(bufferSize);
+}
+
+size_t AsyncResponseStream::_fillBuffer(uint8_t *buf, size_t maxLen) {
+  size_t n = min(maxLen, _content.size() - _readPos);
+  memcpy(buf, _content.data() + _readPos, n);
+  _readPos += n;
+  return n;
+}
+
+size_t AsyncResponseStream::write(const uint8_t *data, size_t len) {
+  if (_started()) {
+    return 0;
+  }
+  _content.append((const char *)data, len);
+  _contentLength += len;
+  return len;
+}
+
+size_t AsyncResponseStream::write(uint8_t data) { return write(&data, 1); }
+
+void AsyncEventSource::send(const char *message, const char *event,
+                            uint32_t id, uint32_t reconnect) {
+  _message = message;
+  _sent++;
+}
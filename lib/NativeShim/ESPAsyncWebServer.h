@@ -0,0 +1,339 @@
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <FS.h>
+#include <functional>
+#include <vector>
+
+// The part of ESPAsyncWebServer the handlers are written against, with the
+// responses doing what upstream's do on every ack. Requests don't parse
+// anything: NativeRequest fills them in and plays the server's part.
+
+typedef enum {
+  HTTP_GET = 0b0000000000000001,
+  HTTP_POST = 0b0000000000000010,
+  HTTP_DELETE = 0b0000000000000100,
+  HTTP_PUT = 0b0000000000001000,
+  HTTP_PATCH = 0b0000000000010000,
+  HTTP_HEAD = 0b0000000000100000,
+  HTTP_OPTIONS = 0b0000000001000000,
+  HTTP_PROPFIND = 0b0000000010000000,
+  HTTP_LOCK = 0b0000000100000000,
+  HTTP_UNLOCK = 0b0000001000000000,
+  HTTP_PROPPATCH = 0b0000010000000000,
+  HTTP_MKCOL = 0b0000100000000000,
+  HTTP_MOVE = 0b0001000000000000,
+  HTTP_COPY = 0b0010000000000000,
+  HTTP_ANY = 0b1111111111111111,
+} WebRequestMethod;
+typedef uint16_t WebRequestMethodComposite;
+
+#define RESPONSE_TRY_AGAIN 0xFFFFFFFF
+
+class AsyncWebServerRequest;
+class AsyncWebServerResponse;
+class AsyncResponseStream;
+class AsyncWebHandler;
+
+typedef std::function<void(void)> ArDisconnectHandler;
+typedef std::function<size_t(uint8_t *, size_t, size_t)> AwsResponseFiller;
+typedef std::function<String(const String &)> AwsTemplateProcessor;
+typedef std::function<void(AsyncWebServerRequest *request)>
+    ArRequestHandlerFunction;
+typedef std::function<bool(AsyncWebServerRequest *request)>
+    ArRequestFilterFunction;
+
+class AsyncWebParameter {
+public:
+  AsyncWebParameter(const String &name, const String &value,
+                    bool form = false, bool file = false, size_t size = 0)
+      : _name(name), _value(value), _size(size), _isForm(form),
+        _isFile(file) {}
+
+  const String &name() const { return _name; }
+  const String &value() const { return _value; }
+  size_t size() const { return _size; }
+  bool isPost() const { return _isForm; }
+  bool isFile() const { return _isFile; }
+
+private:
+  String _name;
+  String _value;
+  size_t _size;
+  bool _isForm;
+  bool _isFile;
+};
+
+class AsyncWebHeader {
+public:
+  AsyncWebHeader(const String &name, const String &value)
+      : _name(name), _value(value) {}
+
+  const String &name() const { return _name; }
+  const String &value() const { return _value; }
+
+private:
+  String _name;
+  String _value;
+};
+
+class AsyncWebServerRequest {
+public:
+  File _tempFile;
+  void *_tempObject;
+
+  AsyncWebServerRequest(AsyncClient *client);
+  ~AsyncWebServerRequest();
+
+  AsyncClient *client() { return _client; }
+  uint8_t version() const { return 1; }
+  WebRequestMethodComposite method() const { return _method; }
+  const String &url() const { return _url; }
+  const String &host() const { return _host; }
+  const String &contentType() const { return _contentType; }
+  size_t contentLength() const { return _contentLength; }
+  bool multipart() const { return _multipart; }
+  const char *methodToString() const;
+
+  void onDisconnect(ArDisconnectHandler fn) { _onDisconnectfn = fn; }
+  void addInterestingHeader(const String &name);
+
+  void send(AsyncWebServerResponse *response);
+  void send(int code, const String &contentType = String(),
+            const String &content = String());
+  AsyncWebServerResponse *beginResponse(int code,
+                                        const String &contentType = String(),
+                                        const String &content = String());
+  AsyncWebServerResponse *
+  beginResponse(const String &contentType, size_t len,
+                AwsResponseFiller callback,
+                AwsTemplateProcessor templateCallback = nullptr);
+  AsyncWebServerResponse *
+  beginChunkedResponse(const String &contentType, AwsResponseFiller callback,
+                       AwsTemplateProcessor templateCallback = nullptr);
+  AsyncResponseStream *beginResponseStream(const String &contentType,
+                                           size_t bufferSize = 1460);
+  AsyncWebServerResponse *
+  beginResponse_P(int code, const String &contentType, const uint8_t *content,
+                  size_t len, AwsTemplateProcessor callback = nullptr);
+  AsyncWebServerResponse *
+  beginResponse_P(int code, const String &contentType, PGM_P content,
+                  AwsTemplateProcessor callback = nullptr);
+
+  size_t headers() const { return _headers.size(); }
+  bool hasHeader(const String &name) const { return getHeader(name); }
+  AsyncWebHeader *getHeader(const String &name) const;
+  AsyncWebHeader *getHeader(size_t num) const;
+
+  size_t params() const { return _params.size(); }
+  bool hasParam(const String &name, bool post = false,
+                bool file = false) const {
+    return getParam(name, post, file);
+  }
+  AsyncWebParameter *getParam(const String &name, bool post = false,
+                              bool file = false) const;
+  AsyncWebParameter *getParam(size_t num) const;
+  bool hasArg(const char *name) const;
+  const String &arg(const String &name) const;
+
+  // what the server's parser and the connection would do
+  void _setMethod(WebRequestMethodComposite method) { _method = method; }
+  void _setUrl(const String &url) { _url = url; }
+  void _setContent(const String &type, size_t length, bool multipart);
+  void _addHeader(const String &name, const String &value);
+  void _addParam(AsyncWebParameter *param) { _params.push_back(param); }
+  // filters and canHandle() in order, then drops the headers nobody asked for
+  bool _attachHandler(const std::vector<AsyncWebHandler *> &handlers);
+  AsyncWebHandler *_handler() const { return _handlerp; }
+  AsyncWebServerResponse *_response() const { return _responsep; }
+  void _onAck(size_t len, uint32_t time);
+  void _onPoll();
+  // runs onDisconnect(); the caller deletes the request afterwards
+  void _onDisconnect();
+
+private:
+  AsyncClient *_client;
+  AsyncWebHandler *_handlerp;
+  AsyncWebServerResponse *_responsep;
+  ArDisconnectHandler _onDisconnectfn;
+  WebRequestMethodComposite _method;
+  String _url;
+  String _host;
+  String _contentType;
+  size_t _contentLength;
+  bool _multipart;
+  std::vector<AsyncWebHeader *> _headers;
+  std::vector<AsyncWebParameter *> _params;
+  std::vector<String> _interestingHeaders;
+};
+
+typedef enum {
+  RESPONSE_SETUP,
+  RESPONSE_HEADERS,
+  RESPONSE_CONTENT,
+  RESPONSE_WAIT_ACK,
+  RESPONSE_END,
+  RESPONSE_FAILED
+} WebResponseState;
+
+class AsyncWebServerResponse {
+protected:
+  int _code;
+  std::vector<AsyncWebHeader> _headers;
+  String _contentType;
+  size_t _contentLength;
+  bool _sendContentLength;
+  bool _chunked;
+  size_t _headLength;
+  size_t _sentLength;
+  size_t _ackedLength;
+  size_t _writtenLength;
+  WebResponseState _state;
+  const char *_responseCodeToString(int code);
+
+public:
+  AsyncWebServerResponse();
+  virtual ~AsyncWebServerResponse() {}
+  virtual void setCode(int code);
+  virtual void setContentLength(size_t len);
+  virtual void setContentType(const String &type);
+  virtual void addHeader(const String &name, const String &value);
+  virtual String _assembleHead(uint8_t version);
+  virtual bool _started() const;
+  virtual bool _finished() const;
+  virtual bool _failed() const;
+  virtual bool _sourceValid() const;
+  virtual void _respond(AsyncWebServerRequest *request);
+  virtual size_t _ack(AsyncWebServerRequest *request, size_t len,
+                      uint32_t time);
+};
+
+class AsyncBasicResponse : public AsyncWebServerResponse {
+private:
+  String _content;
+
+public:
+  AsyncBasicResponse(int code, const String &contentType = String(),
+                     const String &content = String());
+  void _respond(AsyncWebServerRequest *request) override;
+  size_t _ack(AsyncWebServerRequest *request, size_t len,
+              uint32_t time) override;
+  bool _sourceValid() const override { return true; }
+};
+
+class AsyncAbstractResponse : public AsyncWebServerResponse {
+private:
+  String _head;
+
+protected:
+  AwsTemplateProcessor _callback;
+
+public:
+  AsyncAbstractResponse(AwsTemplateProcessor callback = nullptr);
+  void _respond(AsyncWebServerRequest *request) override;
+  size_t _ack(AsyncWebServerRequest *request, size_t len,
+              uint32_t time) override;
+  bool _sourceValid() const override { return false; }
+  virtual size_t _fillBuffer(uint8_t *buf, size_t maxLen) { return 0; }
+};
+
+class AsyncProgmemResponse : public AsyncAbstractResponse {
+private:
+  const uint8_t *_content;
+  size_t _readLength;
+
+public:
+  AsyncProgmemResponse(int code, const String &contentType,
+                       const uint8_t *content, size_t len,
+                       AwsTemplateProcessor callback = nullptr);
+  bool _sourceValid() const override { return true; }
+  size_t _fillBuffer(uint8_t *buf, size_t maxLen) override;
+};
+
+class AsyncCallbackResponse : public AsyncAbstractResponse {
+private:
+  AwsResponseFiller _content;
+  size_t _filledLength;
+
+public:
+  AsyncCallbackResponse(const String &contentType, size_t len,
+                        AwsResponseFiller callback,
+                        AwsTemplateProcessor templateCallback = nullptr);
+  bool _sourceValid() const override { return !!(_content); }
+  size_t _fillBuffer(uint8_t *buf, size_t maxLen) override;
+};
+
+class AsyncChunkedResponse : public AsyncAbstractResponse {
+private:
+  AwsResponseFiller _content;
+  size_t _filledLength;
+
+public:
+  AsyncChunkedResponse(const String &contentType, AwsResponseFiller callback,
+                       AwsTemplateProcessor templateCallback = nullptr);
+  bool _sourceValid() const override { return !!(_content); }
+  size_t _fillBuffer(uint8_t *buf, size_t maxLen) override;
+};
+
+class AsyncResponseStream : public AsyncAbstractResponse, public Print {
+private:
+  std::string _content;
+  size_t _readPos;
+
+public:
+  AsyncResponseStream(const String &contentType, size_t bufferSize);
+  bool _sourceValid() const override { return _state < RESPONSE_END; }
+  size_t _fillBuffer(uint8_t *buf, size_t maxLen) override;
+  size_t write(const uint8_t *data, size_t len) override;
+  size_t write(uint8_t data) override;
+  using Print::write;
+};
+
+class AsyncWebHandler {
+protected:
+  ArRequestFilterFunction _filter;
+
+public:
+  virtual ~AsyncWebHandler() {}
+  AsyncWebHandler &setFilter(ArRequestFilterFunction fn) {
+    _filter = fn;
+    return *this;
+  }
+  bool filter(AsyncWebServerRequest *request) {
+    return !_filter || _filter(request);
+  }
+  virtual bool canHandle(AsyncWebServerRequest *request) { return false; }
+  virtual void handleRequest(AsyncWebServerRequest *request) {}
+  virtual void handleUpload(AsyncWebServerRequest *request,
+                            const String &filename, size_t index,
+                            uint8_t *data, size_t len, bool final) {}
+  virtual void handleBody(AsyncWebServerRequest *request, uint8_t *data,
+                          size_t len, size_t index, size_t total) {}
+  virtual bool isRequestHandlerTrivial() { return true; }
+};
+
+class AsyncEventSourceClient;
+typedef std::function<void(AsyncEventSourceClient *client)>
+    ArEventHandlerFunction;
+
+// keeps the last event so a test can look at it; nobody is ever connected
+class AsyncEventSource : public AsyncWebHandler {
+public:
+  AsyncEventSource(const String &url) : _url(url), _clients(0), _sent(0) {}
+  void onConnect(ArEventHandlerFunction cb) {}
+  void send(const char *message, const char *event = NULL, uint32_t id = 0,
+            uint32_t reconnect = 0);
+  size_t count() const { return _clients; }
+  size_t avgPacketsWaiting() const { return 0; }
+
+  void _setClients(size_t clients) { _clients = clients; }
+  const String &_lastMessage() const { return _message; }
+  size_t _sentCount() const { return _sent; }
+
+private:
+  String _url;
+  String _message;
+  size_t _clients;
+  size_t _sent;
+};
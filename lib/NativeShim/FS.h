@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Arduino.h"
+#include <memory>
+
+// fs::FS and fs::File as the ESP32 core 1.0.x has them: name() is the full
+// path, and the implementation behind a file system is an FSImpl.
+namespace fs {
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+class File;
+
+class FileImpl;
+typedef std::shared_ptr<FileImpl> FileImplPtr;
+class FSImpl;
+typedef std::shared_ptr<FSImpl> FSImplPtr;
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File : public Stream {
+public:
+  File(FileImplPtr p = FileImplPtr()) : _p(p) {}
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override;
+  size_t read(uint8_t *buf, size_t size);
+  size_t readBytes(char *buffer, size_t length) {
+    return read((uint8_t *)buffer, length);
+  }
+
+  bool seek(uint32_t pos, SeekMode mode);
+  bool seek(uint32_t pos) { return seek(pos, SeekSet); }
+  size_t position() const;
+  size_t size() const;
+  void close();
+  operator bool() const;
+  time_t getLastWrite();
+  const char *name() const;
+
+  boolean isDirectory(void);
+  File openNextFile(const char *mode = FILE_READ);
+  void rewindDirectory(void);
+
+protected:
+  FileImplPtr _p;
+};
+
+class FS {
+public:
+  FS(FSImplPtr impl) : _impl(impl) {}
+
+  File open(const char *path, const char *mode = FILE_READ);
+  File open(const String &path, const char *mode = FILE_READ);
+
+  bool exists(const char *path);
+  bool exists(const String &path);
+
+  bool remove(const char *path);
+  bool remove(const String &path);
+
+  bool rename(const char *pathFrom, const char *pathTo);
+  bool rename(const String &pathFrom, const String &pathTo);
+
+  bool mkdir(const char *path);
+  bool mkdir(const String &path);
+
+  bool rmdir(const char *path);
+  bool rmdir(const String &path);
+
+protected:
+  FSImplPtr _impl;
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::SeekCur;
+using fs::SeekEnd;
+using fs::SeekMode;
+using fs::SeekSet;
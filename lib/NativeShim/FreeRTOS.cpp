@@ -0,0 +1,237 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+unsigned long millis();
+
+struct NativeTask {
+  NativeTask() : notified(0) {}
+
+  std::mutex lock;
+  std::condition_variable cv;
+  uint32_t notified;
+};
+
+struct NativeQueue {
+  std::mutex lock;
+  std::condition_variable cv;
+  size_t length;
+  size_t itemSize;
+  std::deque<std::vector<uint8_t>> items;
+};
+
+struct NativeSemaphore {
+  std::mutex lock;
+  std::condition_variable cv;
+  UBaseType_t max;
+  UBaseType_t count;
+};
+
+static thread_local NativeTask *currentTask = NULL;
+static std::recursive_mutex critical;
+
+// waits on cv until ready() or the ticks ran out, with lock held
+template <class Ready>
+static bool waitFor(std::condition_variable &cv,
+                    std::unique_lock<std::mutex> &lock, TickType_t ticks,
+                    Ready ready) {
+  if (ticks == portMAX_DELAY) {
+    cv.wait(lock, ready);
+    return true;
+  }
+  return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+void portENTER_CRITICAL(portMUX_TYPE *mux) { critical.lock(); }
+
+void portEXIT_CRITICAL(portMUX_TYPE *mux) { critical.unlock(); }
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *handle) {
+  // tasks never return and are never joined, like on the device
+  NativeTask *task = new NativeTask();
+  if (handle) {
+    *handle = task;
+  }
+  std::thread([task, fn, arg]() {
+    currentTask = task;
+    fn(arg);
+  }).detach();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+                                   uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core) {
+  return xTaskCreate(fn, name, stack, arg, priority, handle);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  // a detached thread that never returns again
+  for (;;) {
+    std::this_thread::sleep_for(std::chrono::hours(1));
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount() { return millis(); }
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  // the test's own thread becomes a task when it first asks
+  if (!currentTask) {
+    currentTask = new NativeTask();
+  }
+  return currentTask;
+}
+
+void taskYIELD() { std::this_thread::yield(); }
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+  NativeTask *task = xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> lock(task->lock);
+  if (!waitFor(task->cv, lock, ticks, [task]() { return task->notified; })) {
+    return 0;
+  }
+  uint32_t value = task->notified;
+  task->notified = clear ? 0 : value - 1;
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> lock(task->lock);
+  task->notified++;
+  task->cv.notify_all();
+  return pdPASS;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  NativeQueue *queue = new NativeQueue();
+  queue->length = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) { delete queue; }
+
+static BaseType_t queueSend(QueueHandle_t queue, const void *item,
+                            TickType_t ticks, bool front) {
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!waitFor(queue->cv, lock, ticks, [queue]() {
+        return queue->items.size() < queue->length;
+      })) {
+    return pdFALSE;
+  }
+  std::vector<uint8_t> copy((const uint8_t *)item,
+                            (const uint8_t *)item + queue->itemSize);
+  if (front) {
+    queue->items.push_front(copy);
+  } else {
+    queue->items.push_back(copy);
+  }
+  queue->cv.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks) {
+  return queueSend(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item,
+                            TickType_t ticks) {
+  return queueSend(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item,
+                             TickType_t ticks) {
+  return queueSend(queue, item, ticks, true);
+}
+
+static BaseType_t queueReceive(QueueHandle_t queue, void *item,
+                               TickType_t ticks, bool remove) {
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!waitFor(queue->cv, lock, ticks,
+               [queue]() { return !queue->items.empty(); })) {
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  if (remove) {
+    queue->items.pop_front();
+    queue->cv.notify_all();
+  }
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+  return queueReceive(queue, item, ticks, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks) {
+  return queueReceive(queue, item, ticks, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->lock);
+  return queue->items.size();
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->lock);
+  return queue->length - queue->items.size();
+}
+
+static SemaphoreHandle_t createSemaphore(UBaseType_t max,
+                                         UBaseType_t initial) {
+  NativeSemaphore *semaphore = new NativeSemaphore();
+  semaphore->max = max;
+  semaphore->count = initial;
+  return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() { return createSemaphore(1, 0); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return createSemaphore(1, 1); }
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+                                           UBaseType_t initial) {
+  return createSemaphore(max, initial);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) { delete semaphore; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  std::unique_lock<std::mutex> lock(semaphore->lock);
+  if (!waitFor(semaphore->cv, lock, ticks,
+               [semaphore]() { return semaphore->count > 0; })) {
+    return pdFALSE;
+  }
+  semaphore->count--;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  std::lock_guard<std::mutex> lock(semaphore->lock);
+  if (semaphore->count >= semaphore->max) {
+    return pdFALSE;
+  }
+  semaphore->count++;
+  semaphore->cv.notify_one();
+  return pdTRUE;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t semaphore) {
+  std::lock_guard<std::mutex> lock(semaphore->lock);
+  return semaphore->count;
+}
@@ -0,0 +1,69 @@
+#include "HardwareSerial.h"
+#include <chrono>
+#include <cstdio>
+
+HardwareSerial Serial(0, true);
+HardwareSerial Serial1(1);
+HardwareSerial Serial2(2);
+
+void HardwareSerial::begin(unsigned long baud, uint32_t config, int8_t rxPin,
+                           int8_t txPin) {
+  _baud = baud;
+}
+
+int HardwareSerial::available() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return _rx.size();
+}
+
+int HardwareSerial::availableForWrite() {
+  // the UART's TX FIFO
+  return 128;
+}
+
+int HardwareSerial::read() {
+  std::lock_guard<std::mutex> lock(_lock);
+  if (_rx.empty()) {
+    return -1;
+  }
+  uint8_t c = _rx.front();
+  _rx.pop_front();
+  return c;
+}
+
+int HardwareSerial::peek() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return _rx.empty() ? -1 : _rx.front();
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  if (_console) {
+    return fwrite(buffer, 1, size, stdout);
+  }
+  std::lock_guard<std::mutex> lock(_lock);
+  _tx.insert(_tx.end(), buffer, buffer + size);
+  _sent.notify_all();
+  return size;
+}
+
+size_t HardwareSerial::remoteRead(uint8_t *buffer, size_t size, uint32_t ms) {
+  std::unique_lock<std::mutex> lock(_lock);
+  _sent.wait_for(lock, std::chrono::milliseconds(ms),
+                 [this]() { return !_tx.empty(); });
+  size_t n = 0;
+  while (n < size && !_tx.empty()) {
+    buffer[n++] = _tx.front();
+    _tx.pop_front();
+  }
+  return n;
+}
+
+void HardwareSerial::remoteWrite(const uint8_t *buffer, size_t size) {
+  std::lock_guard<std::mutex> lock(_lock);
+  _rx.insert(_rx.end(), buffer, buffer + size);
+}
+
+size_t HardwareSerial::remoteAvailable() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return _tx.size();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Print.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#define SERIAL_8N1 0x800001c
+
+// A UART with nothing but a test on the other end of the wire. What the
+// firmware writes is read with remoteRead(), what remoteWrite() puts on the
+// wire is what the firmware reads. Serial itself prints to stdout.
+class HardwareSerial : public Stream {
+public:
+  HardwareSerial(int uart, bool console = false)
+      : _uart(uart), _console(console), _baud(0) {}
+
+  void begin(unsigned long baud, uint32_t config = SERIAL_8N1,
+             int8_t rxPin = -1, int8_t txPin = -1);
+  void end() {}
+  unsigned long baudRate() const { return _baud; }
+
+  int available() override;
+  int availableForWrite();
+  int read() override;
+  int peek() override;
+  void flush() override {}
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  operator bool() const { return true; }
+
+  // the far end; remoteRead() waits up to ms for the first byte
+  size_t remoteRead(uint8_t *buffer, size_t size, uint32_t ms = 0);
+  void remoteWrite(const uint8_t *buffer, size_t size);
+  void remoteWrite(const char *str) {
+    remoteWrite((const uint8_t *)str, strlen(str));
+  }
+  size_t remoteAvailable();
+
+private:
+  int _uart;
+  bool _console;
+  unsigned long _baud;
+  std::mutex _lock;
+  std::condition_variable _sent;
+  std::deque<uint8_t> _rx;
+  std::deque<uint8_t> _tx;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
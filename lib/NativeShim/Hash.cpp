@@ -0,0 +1,96 @@
+#include "Hash.h"
+
+static uint32_t rotate(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void block(uint32_t state[5], const uint8_t *data) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+           (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t t = rotate(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotate(b, 30);
+    b = a;
+    a = t;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void sha1(const uint8_t *data, uint32_t size, uint8_t hash[20]) {
+  uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                       0xc3d2e1f0};
+  uint32_t full = size & ~63u;
+  for (uint32_t i = 0; i < full; i += 64) {
+    block(state, data + i);
+  }
+  uint8_t tail[128] = {0};
+  uint32_t rest = size - full;
+  memcpy(tail, data + full, rest);
+  tail[rest] = 0x80;
+  uint32_t length = rest < 56 ? 64 : 128;
+  uint64_t bits = (uint64_t)size * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[length - 1 - i] = bits >> (i * 8);
+  }
+  block(state, tail);
+  if (length == 128) {
+    block(state, tail + 64);
+  }
+  for (int i = 0; i < 20; i++) {
+    hash[i] = state[i / 4] >> (24 - (i % 4) * 8);
+  }
+}
+
+void sha1(const char *data, uint32_t size, uint8_t hash[20]) {
+  sha1((const uint8_t *)data, size, hash);
+}
+
+void sha1(const String &data, uint8_t hash[20]) {
+  sha1(data.c_str(), data.length(), hash);
+}
+
+String sha1(const uint8_t *data, uint32_t size) {
+  uint8_t hash[20];
+  sha1(data, size, hash);
+  String hex;
+  hex.reserve(40);
+  for (int i = 0; i < 20; i++) {
+    hex += "0123456789abcdef"[hash[i] >> 4];
+    hex += "0123456789abcdef"[hash[i] & 15];
+  }
+  return hex;
+}
+
+String sha1(const char *data, uint32_t size) {
+  return sha1((const uint8_t *)data, size);
+}
+
+String sha1(const String &data) { return sha1(data.c_str(), data.length()); }
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <Arduino.h>
+#include <algorithm>
+#include <vector>
+
+// Latencies of one kind of request and what serving them cost, printed as
+// one line so runs can be compared
+class NativeBench {
+public:
+  NativeBench(const char *name)
+      : _name(name), _requests(0), _allocations(0), _copied(0),
+        _zeroCopy(0) {}
+
+  // around each request
+  void begin() { _startAllocations = NativeHeap::allocations(); }
+  void end(uint32_t us, uint64_t copied = 0, uint64_t zeroCopy = 0) {
+    _allocations += NativeHeap::allocations() - _startAllocations;
+    _samples.push_back(us);
+    _copied += copied;
+    _zeroCopy += zeroCopy;
+    _requests++;
+  }
+
+  // p in percent, in microseconds
+  uint32_t percentile(uint32_t p) const {
+    if (_samples.empty()) {
+      return 0;
+    }
+    std::vector<uint32_t> sorted = _samples;
+    std::sort(sorted.begin(), sorted.end());
+    size_t i = min(sorted.size() - 1, (sorted.size() * p + 99) / 100 - 1);
+    return sorted[i];
+  }
+  uint32_t requests() const { return _requests; }
+  uint64_t allocationsPerRequest() const {
+    return _requests ? _allocations / _requests : 0;
+  }
+  uint64_t copiedPerRequest() const {
+    return _requests ? _copied / _requests : 0;
+  }
+
+  void report() const {
+    printf("%-10s n=%-4u p50=%6.2fms p90=%6.2fms p99=%6.2fms "
+           "allocs/req=%-5llu copied/req=%-8llu zero-copy/req=%llu\n",
+           _name, _requests, percentile(50) / 1000.0,
+           percentile(90) / 1000.0, percentile(99) / 1000.0,
+           (unsigned long long)allocationsPerRequest(),
+           (unsigned long long)copiedPerRequest(),
+           (unsigned long long)(_requests ? _zeroCopy / _requests : 0));
+  }
+
+private:
+  const char *_name;
+  std::vector<uint32_t> _samples;
+  uint32_t _requests;
+  uint64_t _startAllocations;
+  uint64_t _allocations;
+  uint64_t _copied;
+  uint64_t _zeroCopy;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// Slicer output of about size bytes: moves that vary the way real ones do,
+// and the metadata comments PrusaSlicer ends a file with
+inline std::string nativeGcode(size_t size, unsigned seed = 1) {
+  std::string out;
+  out.reserve(size + 256);
+  out += "; generated by PrusaSlicer 2.4.0\n"
+         "M73 P0 R42\nM107\nG90\nM83\nM104 S215\nM140 S60\nG28 W\n";
+  unsigned x = 100000 + seed * 7, y = 100000 + seed * 13, layer = 0;
+  char line[64];
+  while (out.size() + 200 < size) {
+    x = x * 1103515245u + 12345u;
+    y = y * 1103515245u + 54321u;
+    unsigned step = out.size() % 97;
+    if (step == 0) {
+      snprintf(line, sizeof(line), ";LAYER_CHANGE\nG1 Z%.2f F720\n",
+               0.2 + 0.15 * layer++);
+    } else {
+      snprintf(line, sizeof(line), "G1 X%.3f Y%.3f E%.5f\n",
+               (x >> 16) % 25000 / 100.0, (y >> 16) % 21000 / 100.0,
+               (x >> 8) % 4000 / 100000.0);
+    }
+    out += line;
+  }
+  out += "M107\nM84\n"
+         "; filament used [mm] = 810.60\n"
+         "; filament used [g] = 2.42\n"
+         "; estimated printing time (normal mode) = 19m 48s\n"
+         "; layer_height = 0.15\n"
+         "; printer_model = MK3S\n";
+  while (out.size() < size) {
+    out += ";\n";
+  }
+  out.resize(size);
+  return out;
+}
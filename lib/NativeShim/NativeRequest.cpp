@@ -0,0 +1,265 @@
+#include "NativeRequest.h"
+#include <thread>
+
+NativeRequest::NativeRequest(WebRequestMethodComposite method,
+                             const String &url)
+    : _request(new AsyncWebServerRequest(&_client)), _handler(NULL),
+      _total(0), _index(0), _segment(NATIVE_SEGMENT), _upload(false),
+      _handled(false), _done(false), _beginUs(0), _finishedUs(0),
+      _lastPoll(0), _maxCallbackUs(0), _polls(0), _wakes(0) {
+  int query = url.indexOf('?');
+  _request->_setMethod(method);
+  _request->_setUrl(query == -1 ? url : url.substring(0, query));
+  while (query != -1) {
+    int next = url.indexOf('&', query + 1);
+    String pair = url.substring(query + 1, next == -1 ? url.length() : next);
+    int eq = pair.indexOf('=');
+    param(eq == -1 ? pair : pair.substring(0, eq),
+          eq == -1 ? String() : pair.substring(eq + 1));
+    query = next;
+  }
+}
+
+NativeRequest::~NativeRequest() {
+  if (!_done) {
+    disconnect(true);
+  }
+}
+
+NativeRequest &NativeRequest::header(const String &name,
+                                     const String &value) {
+  _request->_addHeader(name, value);
+  return *this;
+}
+
+NativeRequest &NativeRequest::param(const String &name, const String &value,
+                                    bool post) {
+  _request->_addParam(new AsyncWebParameter(name, value, post));
+  return *this;
+}
+
+NativeRequest &NativeRequest::body(const std::string &data) {
+  std::shared_ptr<std::string> copy = std::make_shared<std::string>(data);
+  return body(data.size(), [copy](uint8_t *out, size_t len, size_t index) {
+    size_t n = min(len, copy->size() - index);
+    memcpy(out, copy->data() + index, n);
+    return n;
+  });
+}
+
+NativeRequest &NativeRequest::body(size_t total, NativeBodySource source) {
+  _total = total;
+  _source = source;
+  _upload = false;
+  _request->_setContent("application/octet-stream", total, false);
+  return *this;
+}
+
+NativeRequest &NativeRequest::upload(const String &filename, size_t total,
+                                     NativeBodySource source) {
+  _total = total;
+  _source = source;
+  _filename = filename;
+  _upload = true;
+  // the form's framing, as much as the Content-Length would count
+  _request->_setContent("multipart/form-data", total + 200, true);
+  return *this;
+}
+
+NativeRequest &NativeRequest::segment(size_t size) {
+  _segment = size;
+  return *this;
+}
+
+NativeRequest &NativeRequest::window(size_t window) {
+  _client.setWindow(window);
+  return *this;
+}
+
+void NativeRequest::timed(std::function<void()> fn) {
+  uint32_t start = micros();
+  fn();
+  _maxCallbackUs = max(_maxCallbackUs, (uint32_t)(micros() - start));
+}
+
+void NativeRequest::begin(const std::vector<AsyncWebHandler *> &handlers) {
+  _beginUs = micros();
+  _lastPoll = millis();
+  timed([&]() {
+    _request->_attachHandler(handlers);
+    _handler = _request->_handler();
+  });
+  if (!_total) {
+    deliverBody();
+  }
+}
+
+bool NativeRequest::deliverBody() {
+  if (_handled) {
+    return false;
+  }
+  if (_index < _total || (_upload && !_index)) {
+    // no more than the receive window lets through
+    size_t size = min(min(_segment, _total - _index), _client.receiveWindow());
+    if (!size && _index < _total) {
+      return false;
+    }
+    std::vector<uint8_t> data(size);
+    size_t n = data.empty() ? 0 : _source(data.data(), data.size(), _index);
+    data.resize(n);
+    bool final = _index + n >= _total;
+    if (_handler) {
+      timed([&]() {
+        if (_upload) {
+          _handler->handleUpload(_request, _filename, _index, data.data(), n,
+                                 final);
+        } else {
+          _handler->handleBody(_request, data.data(), n, _index, _total);
+        }
+      });
+    }
+    _client.received(n);
+    _index += n;
+    if (!n && !final) {
+      // the source ran dry, the client stalls
+      return false;
+    }
+    if (!final) {
+      return true;
+    }
+  }
+  _handled = true;
+  timed([&]() {
+    if (_handler) {
+      _handler->handleRequest(_request);
+    } else {
+      _request->send(404);
+    }
+  });
+  _lastPoll = millis();
+  return true;
+}
+
+bool NativeRequest::step() {
+  if (_done) {
+    return false;
+  }
+  bool busy = deliverBody();
+
+  size_t acked = _client.ack();
+  if (acked) {
+    busy = true;
+    timed([&]() { _request->_onAck(acked, 0); });
+    _lastPoll = millis();
+  } else if (_handled && _client.takePoll()) {
+    _wakes++;
+    _lastPoll = millis();
+    timed([&]() { _request->_onPoll(); });
+  } else if (_handled && millis() - _lastPoll >= NATIVE_POLL_MS) {
+    _polls++;
+    _lastPoll = millis();
+    timed([&]() { _request->_onPoll(); });
+  }
+
+  AsyncWebServerResponse *response = _request->_response();
+  bool finished = _handled && (!response || response->_finished()) &&
+                  !_client.unacked() && !_client.unsent();
+  if (finished || !_client.connected()) {
+    finish();
+    return false;
+  }
+  return busy;
+}
+
+void NativeRequest::finish() {
+  _finishedUs = micros();
+  // the client hangs up after a Connection: close response
+  _client.close();
+  timed([&]() { _request->_onDisconnect(); });
+  delete _request;
+  _request = NULL;
+  _done = true;
+}
+
+bool NativeRequest::run(uint32_t timeoutMs) {
+  return runAll({this}, timeoutMs);
+}
+
+void NativeRequest::disconnect(bool abort) {
+  if (_done) {
+    return;
+  }
+  _client.close(abort);
+  finish();
+}
+
+bool NativeRequest::runAll(const std::vector<NativeRequest *> &requests,
+                           uint32_t timeoutMs) {
+  uint32_t start = millis();
+  while (millis() - start < timeoutMs) {
+    bool busy = false;
+    bool open = false;
+    for (NativeRequest *request : requests) {
+      busy = request->step() || busy;
+      open = open || !request->done();
+    }
+    if (!open) {
+      return true;
+    }
+    if (!busy) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  return false;
+}
+
+int NativeRequest::status() const {
+  const std::string &raw = _client.received();
+  return raw.compare(0, 9, "HTTP/1.1 ") ? 0 : atoi(raw.c_str() + 9);
+}
+
+String NativeRequest::responseHeader(const String &name) const {
+  const std::string &raw = _client.received();
+  size_t end = raw.find("\r\n\r\n");
+  size_t pos = raw.find("\r\n");
+  while (pos != std::string::npos && pos < end) {
+    size_t next = raw.find("\r\n", pos + 2);
+    std::string line = raw.substr(pos + 2, next - pos - 2);
+    size_t colon = line.find(':');
+    if (colon != std::string::npos &&
+        String(line.substr(0, colon).c_str()).equalsIgnoreCase(name)) {
+      String value = line.substr(colon + 1).c_str();
+      value.trim();
+      return value;
+    }
+    pos = next;
+  }
+  return String();
+}
+
+std::string NativeRequest::responseBody() const {
+  const std::string &raw = _client.received();
+  size_t end = raw.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return std::string();
+  }
+  std::string body = raw.substr(end + 4);
+  if (!responseHeader("Transfer-Encoding").equalsIgnoreCase("chunked")) {
+    return body;
+  }
+  std::string out;
+  size_t pos = 0;
+  while (pos < body.size()) {
+    size_t line = body.find("\r\n", pos);
+    if (line == std::string::npos) {
+      break;
+    }
+    size_t len = strtoul(body.c_str() + pos, NULL, 16);
+    if (!len) {
+      break;
+    }
+    out.append(body, line + 2, len);
+    pos = line + 2 + len + 2;
+  }
+  return out;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <ESPAsyncWebServer.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifndef NATIVE_POLL_MS
+#define NATIVE_POLL_MS 500
+#endif
+
+// body bytes per call into the handler, one TCP segment
+#ifndef NATIVE_SEGMENT
+#define NATIVE_SEGMENT 1436
+#endif
+
+// fills data with up to len bytes of the body from offset index
+typedef std::function<size_t(uint8_t *data, size_t len, size_t index)>
+    NativeBodySource;
+
+// One client connection, driven the way the AsyncTCP task would: a segment
+// of the body per step, then the handler, then acks as fast as the window
+// allows and a poll every NATIVE_POLL_MS while the response has nothing to
+// send, or at the next step when another thread asked for one through the
+// client's pcb. All of it runs on the calling thread, which stands in for
+// the AsyncTCP task; the time spent in each callback is measured.
+class NativeRequest {
+public:
+  NativeRequest(WebRequestMethodComposite method, const String &url);
+  ~NativeRequest();
+
+  NativeRequest &header(const String &name, const String &value);
+  NativeRequest &param(const String &name, const String &value,
+                       bool post = false);
+  NativeRequest &body(const std::string &data);
+  NativeRequest &body(size_t total, NativeBodySource source);
+  // a multipart/form-data file field
+  NativeRequest &upload(const String &filename, size_t total,
+                        NativeBodySource source);
+  NativeRequest &segment(size_t size);
+  NativeRequest &window(size_t window);
+
+  // hands the request to the first handler that takes it
+  void begin(const std::vector<AsyncWebHandler *> &handlers);
+  // one round of network events, false once the connection is gone
+  bool step();
+  // steps until the connection is gone, false on timeout
+  bool run(uint32_t timeoutMs = 10000);
+  // the client goes away, abort drops what is still in flight
+  void disconnect(bool abort = false);
+  // steps all of them in turn, as the AsyncTCP task serves connections
+  static bool runAll(const std::vector<NativeRequest *> &requests,
+                     uint32_t timeoutMs = 10000);
+
+  bool done() const { return _done; }
+  int status() const;
+  String responseHeader(const String &name) const;
+  // de-chunked when the response was chunked
+  std::string responseBody() const;
+  const std::string &raw() const { return _client.received(); }
+
+  AsyncClient &client() { return _client; }
+  AsyncWebServerRequest *request() { return _request; }
+  // from begin() until the last byte was acknowledged
+  uint32_t latencyUs() const { return _finishedUs - _beginUs; }
+  // the longest single callback into the handler or response
+  uint32_t maxCallbackUs() const { return _maxCallbackUs; }
+  // polls from lwIP's timer, and the ones asked for through the pcb
+  uint32_t polls() const { return _polls; }
+  uint32_t wakes() const { return _wakes; }
+
+private:
+  bool deliverBody();
+  void finish();
+  void timed(std::function<void()> fn);
+
+  AsyncClient _client;
+  AsyncWebServerRequest *_request;
+  AsyncWebHandler *_handler;
+  NativeBodySource _source;
+  String _filename;
+  size_t _total;
+  size_t _index;
+  size_t _segment;
+  bool _upload;
+  bool _handled;
+  bool _done;
+  uint32_t _beginUs;
+  uint32_t _finishedUs;
+  uint32_t _lastPoll;
+  uint32_t _maxCallbackUs;
+  uint32_t _polls;
+  uint32_t _wakes;
+};
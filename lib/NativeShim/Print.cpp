@@ -0,0 +1,137 @@
+#include "Print.h"
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    if (!write(*buffer++)) {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+size_t Print::printf(const char *format, ...) {
+  char small[64];
+  char *buffer = small;
+  va_list arg;
+  va_start(arg, format);
+  int len = vsnprintf(small, sizeof(small), format, arg);
+  va_end(arg);
+  if (len < 0) {
+    return 0;
+  }
+  if ((size_t)len >= sizeof(small)) {
+    buffer = (char *)malloc(len + 1);
+    if (!buffer) {
+      return 0;
+    }
+    va_start(arg, format);
+    vsnprintf(buffer, len + 1, format, arg);
+    va_end(arg);
+  }
+  len = write((const uint8_t *)buffer, len);
+  if (buffer != small) {
+    free(buffer);
+  }
+  return len;
+}
+
+size_t Print::print(const String &s) { return write(s.c_str(), s.length()); }
+
+size_t Print::print(const char str[]) { return write(str); }
+
+size_t Print::print(char c) { return write((uint8_t)c); }
+
+size_t Print::print(unsigned char num, int base) {
+  return print((unsigned long)num, base);
+}
+
+size_t Print::print(int num, int base) { return print((long)num, base); }
+
+size_t Print::print(unsigned int num, int base) {
+  return print((unsigned long)num, base);
+}
+
+size_t Print::print(long num, int base) { return print(String(num, base)); }
+
+size_t Print::print(unsigned long num, int base) {
+  return print(String(num, base));
+}
+
+size_t Print::print(long long num, int base) {
+  return print((long)num, base);
+}
+
+size_t Print::print(unsigned long long num, int base) {
+  return print((unsigned long)num, base);
+}
+
+size_t Print::print(double num, int digits) {
+  return print(String(num, digits));
+}
+
+size_t Print::println(void) { return write("\r\n"); }
+
+size_t Print::println(const String &s) { return print(s) + println(); }
+
+size_t Print::println(const char str[]) { return print(str) + println(); }
+
+size_t Print::println(char c) { return print(c) + println(); }
+
+size_t Print::println(unsigned char num, int base) {
+  return print(num, base) + println();
+}
+
+size_t Print::println(int num, int base) {
+  return print(num, base) + println();
+}
+
+size_t Print::println(unsigned int num, int base) {
+  return print(num, base) + println();
+}
+
+size_t Print::println(long num, int base) {
+  return print(num, base) + println();
+}
+
+size_t Print::println(unsigned long num, int base) {
+  return print(num, base) + println();
+}
+
+size_t Print::println(long long num, int base) {
+  return print(num, base) + println();
+}
+
+size_t Print::println(unsigned long long num, int base) {
+  return print(num, base) + println();
+}
+
+size_t Print::println(double num, int digits) {
+  return print(num, digits) + println();
+}
+
+size_t Stream::readBytes(char *buffer, size_t length) {
+  size_t n = 0;
+  while (n < length) {
+    int c = read();
+    if (c < 0) {
+      break;
+    }
+    buffer[n++] = (char)c;
+  }
+  return n;
+}
+
+String Stream::readString() {
+  String s;
+  int c;
+  while ((c = read()) >= 0) {
+    s += (char)c;
+  }
+  return s;
+}
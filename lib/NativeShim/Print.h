@@ -0,0 +1,74 @@
+#pragma once
+
+#include "WString.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class Print {
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *str) {
+    return str ? write((const uint8_t *)str, strlen(str)) : 0;
+  }
+  size_t write(const char *buffer, size_t size) {
+    return write((const uint8_t *)buffer, size);
+  }
+
+  // formats into a small stack buffer, longer output is allocated
+  size_t printf(const char *format, ...)
+      __attribute__((format(printf, 2, 3)));
+
+  size_t print(const String &s);
+  size_t print(const char str[]);
+  size_t print(char c);
+  size_t print(unsigned char num, int base = DEC);
+  size_t print(int num, int base = DEC);
+  size_t print(unsigned int num, int base = DEC);
+  size_t print(long num, int base = DEC);
+  size_t print(unsigned long num, int base = DEC);
+  size_t print(long long num, int base = DEC);
+  size_t print(unsigned long long num, int base = DEC);
+  size_t print(double num, int digits = 2);
+
+  size_t println(const String &s);
+  size_t println(const char str[]);
+  size_t println(char c);
+  size_t println(unsigned char num, int base = DEC);
+  size_t println(int num, int base = DEC);
+  size_t println(unsigned int num, int base = DEC);
+  size_t println(long num, int base = DEC);
+  size_t println(unsigned long num, int base = DEC);
+  size_t println(long long num, int base = DEC);
+  size_t println(unsigned long long num, int base = DEC);
+  size_t println(double num, int digits = 2);
+  size_t println(void);
+};
+
+class Stream : public Print {
+public:
+  Stream() : _timeout(1000) {}
+
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+  size_t readBytes(char *buffer, size_t length);
+  size_t readBytes(uint8_t *buffer, size_t length) {
+    return readBytes((char *)buffer, length);
+  }
+  String readString();
+
+protected:
+  unsigned long _timeout;
+};
@@ -0,0 +1,295 @@
+#include "TempFS.h"
+#include <chrono>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+class TempFSImpl : public fs::FSImpl {
+public:
+  TempFSImpl();
+
+  fs::FileImplPtr open(const char *path, const char *mode) override;
+  bool exists(const char *path) override;
+  bool rename(const char *pathFrom, const char *pathTo) override;
+  bool remove(const char *path) override;
+  bool mkdir(const char *path) override;
+  bool rmdir(const char *path) override;
+
+  std::string host(const char *path) const { return root + path; }
+  // counts a call and makes it take as long as the card would
+  void call(std::atomic<uint32_t> &counter) {
+    counter++;
+    if (latency) {
+      std::this_thread::sleep_for(std::chrono::microseconds(latency));
+    }
+  }
+
+  std::string root;
+  std::atomic<uint32_t> latency;
+  std::atomic<uint32_t> opens, closes, reads, writes, seeks, syncs, stats,
+      renames, removes, mkdirs;
+  std::atomic<uint64_t> bytesRead, bytesWritten;
+};
+
+class TempFileImpl : public fs::FileImpl {
+public:
+  TempFileImpl(TempFSImpl &fs, const String &path, int fd, DIR *dir)
+      : _fs(fs), _path(path), _fd(fd), _dir(dir) {}
+  ~TempFileImpl() { close(); }
+
+  size_t write(const uint8_t *buf, size_t size) override {
+    if (_fd < 0) {
+      return 0;
+    }
+    _fs.call(_fs.writes);
+    ssize_t n = ::write(_fd, buf, size);
+    if (n <= 0) {
+      return 0;
+    }
+    _fs.bytesWritten += n;
+    return n;
+  }
+
+  size_t read(uint8_t *buf, size_t size) override {
+    if (_fd < 0) {
+      return 0;
+    }
+    _fs.call(_fs.reads);
+    ssize_t n = ::read(_fd, buf, size);
+    if (n <= 0) {
+      return 0;
+    }
+    _fs.bytesRead += n;
+    return n;
+  }
+
+  void flush() override {
+    if (_fd >= 0) {
+      _fs.call(_fs.syncs);
+      fsync(_fd);
+    }
+  }
+
+  bool seek(uint32_t pos, fs::SeekMode mode) override {
+    if (_fd < 0) {
+      return false;
+    }
+    _fs.call(_fs.seeks);
+    int whence = mode == fs::SeekSet   ? SEEK_SET
+                 : mode == fs::SeekCur ? SEEK_CUR
+                                       : SEEK_END;
+    return lseek(_fd, pos, whence) != -1;
+  }
+
+  size_t position() const override {
+    return _fd >= 0 ? lseek(_fd, 0, SEEK_CUR) : 0;
+  }
+
+  size_t size() const override {
+    struct stat st;
+    return _fd >= 0 && !fstat(_fd, &st) ? st.st_size : 0;
+  }
+
+  void close() override {
+    if (_fd >= 0) {
+      _fs.call(_fs.closes);
+      ::close(_fd);
+      _fd = -1;
+    }
+    if (_dir) {
+      _fs.call(_fs.closes);
+      closedir(_dir);
+      _dir = NULL;
+    }
+  }
+
+  time_t getLastWrite() override {
+    struct stat st;
+    return !stat(_fs.host(_path.c_str()).c_str(), &st) ? st.st_mtime : 0;
+  }
+
+  const char *name() const override { return _path.c_str(); }
+
+  boolean isDirectory(void) override { return _dir != NULL; }
+
+  fs::FileImplPtr openNextFile(const char *mode) override {
+    if (!_dir) {
+      return fs::FileImplPtr();
+    }
+    struct dirent *entry;
+    while ((entry = readdir(_dir))) {
+      if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+        String path = _path.equals("/") ? "" : _path;
+        path += "/";
+        path += entry->d_name;
+        return _fs.open(path.c_str(), mode);
+      }
+    }
+    return fs::FileImplPtr();
+  }
+
+  void rewindDirectory(void) override {
+    if (_dir) {
+      rewinddir(_dir);
+    }
+  }
+
+  operator bool() override { return _fd >= 0 || _dir; }
+
+private:
+  TempFSImpl &_fs;
+  String _path;
+  int _fd;
+  DIR *_dir;
+};
+
+TempFSImpl::TempFSImpl()
+    : latency(0), opens(0), closes(0), reads(0), writes(0), seeks(0),
+      syncs(0), stats(0), renames(0), removes(0), mkdirs(0), bytesRead(0),
+      bytesWritten(0) {
+  char dir[] = "/tmp/native-fs-XXXXXX";
+  root = mkdtemp(dir) ? dir : "";
+}
+
+fs::FileImplPtr TempFSImpl::open(const char *path, const char *mode) {
+  call(opens);
+  std::string file = host(path);
+  struct stat st;
+  bool found = !::stat(file.c_str(), &st);
+  if (found && S_ISDIR(st.st_mode)) {
+    DIR *dir = mode[0] == 'r' ? opendir(file.c_str()) : NULL;
+    if (!dir) {
+      return fs::FileImplPtr();
+    }
+    return std::make_shared<TempFileImpl>(*this, path, -1, dir);
+  }
+
+  int flags;
+  bool plus = strchr(mode, '+');
+  switch (mode[0]) {
+  case 'r':
+    flags = plus ? O_RDWR : O_RDONLY;
+    break;
+  case 'w':
+    flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+    break;
+  case 'a':
+    flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+    break;
+  default:
+    return fs::FileImplPtr();
+  }
+  int fd = ::open(file.c_str(), flags, 0644);
+  if (fd < 0) {
+    return fs::FileImplPtr();
+  }
+  return std::make_shared<TempFileImpl>(*this, path, fd, (DIR *)NULL);
+}
+
+bool TempFSImpl::exists(const char *path) {
+  call(stats);
+  struct stat st;
+  return !::stat(host(path).c_str(), &st);
+}
+
+bool TempFSImpl::rename(const char *pathFrom, const char *pathTo) {
+  call(renames);
+  // FAT doesn't replace the target
+  struct stat st;
+  if (!::stat(host(pathTo).c_str(), &st)) {
+    return false;
+  }
+  return !::rename(host(pathFrom).c_str(), host(pathTo).c_str());
+}
+
+bool TempFSImpl::remove(const char *path) {
+  call(removes);
+  return !::unlink(host(path).c_str());
+}
+
+bool TempFSImpl::mkdir(const char *path) {
+  call(mkdirs);
+  return !::mkdir(host(path).c_str(), 0755);
+}
+
+bool TempFSImpl::rmdir(const char *path) {
+  call(removes);
+  return !::rmdir(host(path).c_str());
+}
+
+TempFS::TempFS() : TempFS(std::make_shared<TempFSImpl>()) {}
+
+TempFS::TempFS(std::shared_ptr<TempFSImpl> impl) : fs::FS(impl), _fs(impl) {}
+
+static int removeEntry(const char *path, const struct stat *st, int flag,
+                       struct FTW *ftw) {
+  return ::remove(path);
+}
+
+TempFS::~TempFS() {
+  if (!_fs->root.empty()) {
+    nftw(_fs->root.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+}
+
+void TempFS::setLatency(uint32_t us) { _fs->latency = us; }
+
+TempFSStats TempFS::stats() const {
+  TempFSStats stats;
+  stats.opens = _fs->opens;
+  stats.closes = _fs->closes;
+  stats.reads = _fs->reads;
+  stats.writes = _fs->writes;
+  stats.seeks = _fs->seeks;
+  stats.syncs = _fs->syncs;
+  stats.stats = _fs->stats;
+  stats.renames = _fs->renames;
+  stats.removes = _fs->removes;
+  stats.mkdirs = _fs->mkdirs;
+  stats.bytesRead = _fs->bytesRead;
+  stats.bytesWritten = _fs->bytesWritten;
+  return stats;
+}
+
+void TempFS::resetStats() {
+  _fs->opens = _fs->closes = _fs->reads = _fs->writes = _fs->seeks = 0;
+  _fs->syncs = _fs->stats = _fs->renames = _fs->removes = _fs->mkdirs = 0;
+  _fs->bytesRead = _fs->bytesWritten = 0;
+}
+
+std::string TempFS::hostPath(const String &path) const {
+  return _fs->host(path.c_str());
+}
+
+bool TempFS::put(const String &path, const std::string &data) {
+  FILE *file = fopen(hostPath(path).c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+  return !fclose(file) && ok;
+}
+
+std::string TempFS::get(const String &path) const {
+  std::string data;
+  FILE *file = fopen(hostPath(path).c_str(), "rb");
+  if (!file) {
+    return data;
+  }
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file))) {
+    data.append(buffer, n);
+  }
+  fclose(file);
+  return data;
+}
+
+bool TempFS::has(const String &path) const {
+  struct stat st;
+  return !::stat(hostPath(path).c_str(), &st);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "FS.h"
+#include "FSImpl.h"
+#include <atomic>
+#include <string>
+
+// Calls that reached the card, and the bytes they moved
+struct TempFSStats {
+  uint32_t opens;
+  uint32_t closes;
+  uint32_t reads;
+  uint32_t writes;
+  uint32_t seeks;
+  uint32_t syncs;
+  uint32_t stats;
+  uint32_t renames;
+  uint32_t removes;
+  uint32_t mkdirs;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+
+  uint32_t calls() const {
+    return opens + closes + reads + writes + seeks + syncs + stats + renames +
+           removes + mkdirs;
+  }
+};
+
+class TempFSImpl;
+
+// An SD card in a fresh directory below /tmp, removed again with the object.
+// It behaves like FAT on the ESP32 where the handlers rely on it: a rename
+// never replaces an existing file and remove() leaves directories alone.
+// Every call can be made to take as long as it would on the card.
+class TempFS : public fs::FS {
+public:
+  TempFS();
+  ~TempFS();
+
+  // added to every call that goes to the card
+  void setLatency(uint32_t us);
+  TempFSStats stats() const;
+  void resetStats();
+
+  // straight to the directory, neither slowed down nor counted
+  std::string hostPath(const String &path) const;
+  bool put(const String &path, const std::string &data);
+  std::string get(const String &path) const;
+  bool has(const String &path) const;
+
+private:
+  TempFS(std::shared_ptr<TempFSImpl> impl);
+
+  std::shared_ptr<TempFSImpl> _fs;
+};
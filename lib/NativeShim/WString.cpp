@@ -0,0 +1,298 @@
+#include "WString.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+static std::string toBase(unsigned long value, unsigned char base) {
+  if (base < 2 || base > 36) {
+    base = 10;
+  }
+  char buf[8 * sizeof(value) + 1];
+  char *p = buf + sizeof(buf) - 1;
+  *p = '\0';
+  do {
+    int digit = value % base;
+    *--p = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    value /= base;
+  } while (value);
+  return p;
+}
+
+static std::string signedToBase(long value, unsigned char base) {
+  if (base == 10 && value < 0) {
+    return "-" + toBase(-(unsigned long)value, base);
+  }
+  return toBase((unsigned long)value, base);
+}
+
+static std::string fromDouble(double value, unsigned char decimals) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+  return buf;
+}
+
+String::String(unsigned char value, unsigned char base)
+    : _s(toBase(value, base)) {}
+String::String(int value, unsigned char base)
+    : _s(signedToBase(value, base)) {}
+String::String(unsigned int value, unsigned char base)
+    : _s(toBase(value, base)) {}
+String::String(long value, unsigned char base)
+    : _s(signedToBase(value, base)) {}
+String::String(unsigned long value, unsigned char base)
+    : _s(toBase(value, base)) {}
+String::String(float value, unsigned char decimals)
+    : _s(fromDouble(value, decimals)) {}
+String::String(double value, unsigned char decimals)
+    : _s(fromDouble(value, decimals)) {}
+
+String &String::operator=(const char *cstr) {
+  _s = cstr ? cstr : "";
+  return *this;
+}
+
+bool String::reserve(unsigned int size) {
+  _s.reserve(size);
+  return true;
+}
+
+bool String::concat(const String &s) {
+  _s += s._s;
+  return true;
+}
+
+bool String::concat(const char *cstr) {
+  if (!cstr) {
+    return false;
+  }
+  _s += cstr;
+  return true;
+}
+
+bool String::concat(const char *cstr, unsigned int len) {
+  if (!cstr) {
+    return false;
+  }
+  _s.append(cstr, len);
+  return true;
+}
+
+bool String::concat(char c) {
+  _s += c;
+  return true;
+}
+
+bool String::concat(unsigned char num) { return concat(String(num)); }
+bool String::concat(int num) { return concat(String(num)); }
+bool String::concat(unsigned int num) { return concat(String(num)); }
+bool String::concat(long num) { return concat(String(num)); }
+bool String::concat(unsigned long num) { return concat(String(num)); }
+bool String::concat(float num) { return concat(String(num)); }
+bool String::concat(double num) { return concat(String(num)); }
+
+StringSumHelper &operator+(const StringSumHelper &lhs, const String &rhs) {
+  StringSumHelper &a = const_cast<StringSumHelper &>(lhs);
+  a.concat(rhs);
+  return a;
+}
+
+StringSumHelper &operator+(const StringSumHelper &lhs, const char *cstr) {
+  StringSumHelper &a = const_cast<StringSumHelper &>(lhs);
+  a.concat(cstr);
+  return a;
+}
+
+#define STRING_SUM(type)                                                       \
+  StringSumHelper &operator+(const StringSumHelper &lhs, type num) {           \
+    StringSumHelper &a = const_cast<StringSumHelper &>(lhs);                   \
+    a.concat(num);                                                             \
+    return a;                                                                  \
+  }
+STRING_SUM(char)
+STRING_SUM(unsigned char)
+STRING_SUM(int)
+STRING_SUM(unsigned int)
+STRING_SUM(long)
+STRING_SUM(unsigned long)
+STRING_SUM(float)
+STRING_SUM(double)
+
+int String::compareTo(const String &s) const {
+  return strcmp(_s.c_str(), s._s.c_str());
+}
+
+bool String::equals(const String &s) const { return _s == s._s; }
+
+bool String::equals(const char *cstr) const {
+  return cstr ? _s == cstr : _s.empty();
+}
+
+bool String::equalsIgnoreCase(const String &s) const {
+  return _s.size() == s._s.size() && !strcasecmp(_s.c_str(), s._s.c_str());
+}
+
+bool String::startsWith(const String &prefix) const {
+  return startsWith(prefix, 0);
+}
+
+bool String::startsWith(const String &prefix, unsigned int offset) const {
+  return offset <= _s.size() && _s.size() - offset >= prefix._s.size() &&
+         !_s.compare(offset, prefix._s.size(), prefix._s);
+}
+
+bool String::endsWith(const String &suffix) const {
+  return _s.size() >= suffix._s.size() &&
+         !_s.compare(_s.size() - suffix._s.size(), suffix._s.size(),
+                     suffix._s);
+}
+
+char String::charAt(unsigned int index) const { return (*this)[index]; }
+
+void String::setCharAt(unsigned int index, char c) {
+  if (index < _s.size()) {
+    _s[index] = c;
+  }
+}
+
+char String::operator[](unsigned int index) const {
+  return index < _s.size() ? _s[index] : '\0';
+}
+
+char &String::operator[](unsigned int index) {
+  static char dummy;
+  if (index >= _s.size()) {
+    dummy = '\0';
+    return dummy;
+  }
+  return _s[index];
+}
+
+void String::getBytes(unsigned char *buf, unsigned int bufsize,
+                      unsigned int index) const {
+  if (!bufsize || !buf) {
+    return;
+  }
+  if (index >= _s.size()) {
+    buf[0] = '\0';
+    return;
+  }
+  unsigned int n = std::min(bufsize - 1, (unsigned int)_s.size() - index);
+  memcpy(buf, _s.c_str() + index, n);
+  buf[n] = '\0';
+}
+
+int String::indexOf(char ch, unsigned int fromIndex) const {
+  size_t pos = _s.find(ch, fromIndex);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::indexOf(const String &str, unsigned int fromIndex) const {
+  if (fromIndex >= _s.size()) {
+    return -1;
+  }
+  size_t pos = _s.find(str._s, fromIndex);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(char ch) const {
+  size_t pos = _s.rfind(ch);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(char ch, unsigned int fromIndex) const {
+  if (fromIndex >= _s.size()) {
+    return -1;
+  }
+  size_t pos = _s.rfind(ch, fromIndex);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(const String &str) const {
+  size_t pos = _s.rfind(str._s);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(const String &str, unsigned int fromIndex) const {
+  if (fromIndex >= _s.size()) {
+    return -1;
+  }
+  size_t pos = _s.rfind(str._s, fromIndex);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+String String::substring(unsigned int beginIndex) const {
+  return substring(beginIndex, _s.size());
+}
+
+String String::substring(unsigned int left, unsigned int right) const {
+  if (left > right) {
+    std::swap(left, right);
+  }
+  String out;
+  if (left >= _s.size()) {
+    return out;
+  }
+  right = std::min(right, (unsigned int)_s.size());
+  out._s = _s.substr(left, right - left);
+  return out;
+}
+
+void String::replace(char find, char replace) {
+  std::replace(_s.begin(), _s.end(), find, replace);
+}
+
+void String::replace(const String &find, const String &replace) {
+  if (find._s.empty()) {
+    return;
+  }
+  size_t pos = 0;
+  while ((pos = _s.find(find._s, pos)) != std::string::npos) {
+    _s.replace(pos, find._s.size(), replace._s);
+    pos += replace._s.size();
+  }
+}
+
+void String::remove(unsigned int index) {
+  if (index < _s.size()) {
+    _s.erase(index);
+  }
+}
+
+void String::remove(unsigned int index, unsigned int count) {
+  if (index < _s.size()) {
+    _s.erase(index, count);
+  }
+}
+
+void String::toLowerCase() {
+  for (size_t i = 0; i < _s.size(); i++) {
+    _s[i] = tolower((unsigned char)_s[i]);
+  }
+}
+
+void String::toUpperCase() {
+  for (size_t i = 0; i < _s.size(); i++) {
+    _s[i] = toupper((unsigned char)_s[i]);
+  }
+}
+
+void String::trim() {
+  size_t begin = 0;
+  while (begin < _s.size() && isspace((unsigned char)_s[begin])) {
+    begin++;
+  }
+  size_t end = _s.size();
+  while (end > begin && isspace((unsigned char)_s[end - 1])) {
+    end--;
+  }
+  _s = _s.substr(begin, end - begin);
+}
+
+long String::toInt() const { return atol(_s.c_str()); }
+
+float String::toFloat() const { return atof(_s.c_str()); }
+
+double String::toDouble() const { return atof(_s.c_str()); }
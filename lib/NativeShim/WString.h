@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class StringSumHelper;
+
+// Arduino String on top of std::string, with the ESP32 core's API
+class String {
+public:
+  String() {}
+  String(const char *cstr) : _s(cstr ? cstr : "") {}
+  String(const String &other) = default;
+  String(String &&other) = default;
+  explicit String(char c) : _s(1, c) {}
+  explicit String(unsigned char value, unsigned char base = 10);
+  explicit String(int value, unsigned char base = 10);
+  explicit String(unsigned int value, unsigned char base = 10);
+  explicit String(long value, unsigned char base = 10);
+  explicit String(unsigned long value, unsigned char base = 10);
+  explicit String(float value, unsigned char decimals = 2);
+  explicit String(double value, unsigned char decimals = 2);
+
+  String &operator=(const String &other) = default;
+  String &operator=(String &&other) = default;
+  String &operator=(const char *cstr);
+
+  unsigned int length() const { return _s.size(); }
+  bool isEmpty() const { return _s.empty(); }
+  const char *c_str() const { return _s.c_str(); }
+  bool reserve(unsigned int size);
+
+  bool concat(const String &s);
+  bool concat(const char *cstr);
+  bool concat(const char *cstr, unsigned int len);
+  bool concat(char c);
+  bool concat(unsigned char num);
+  bool concat(int num);
+  bool concat(unsigned int num);
+  bool concat(long num);
+  bool concat(unsigned long num);
+  bool concat(float num);
+  bool concat(double num);
+
+  template <class T> String &operator+=(const T &rhs) {
+    concat(rhs);
+    return *this;
+  }
+
+  friend StringSumHelper &operator+(const StringSumHelper &lhs,
+                                    const String &rhs);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs,
+                                    const char *cstr);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs, char c);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs,
+                                    unsigned char num);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs, int num);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs,
+                                    unsigned int num);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs, long num);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs,
+                                    unsigned long num);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs, float num);
+  friend StringSumHelper &operator+(const StringSumHelper &lhs, double num);
+
+  int compareTo(const String &s) const;
+  bool equals(const String &s) const;
+  bool equals(const char *cstr) const;
+  bool equalsIgnoreCase(const String &s) const;
+  bool operator==(const String &rhs) const { return equals(rhs); }
+  bool operator==(const char *cstr) const { return equals(cstr); }
+  bool operator!=(const String &rhs) const { return !equals(rhs); }
+  bool operator!=(const char *cstr) const { return !equals(cstr); }
+  bool operator<(const String &rhs) const { return compareTo(rhs) < 0; }
+  bool operator>(const String &rhs) const { return compareTo(rhs) > 0; }
+  bool operator<=(const String &rhs) const { return compareTo(rhs) <= 0; }
+  bool operator>=(const String &rhs) const { return compareTo(rhs) >= 0; }
+  bool startsWith(const String &prefix) const;
+  bool startsWith(const String &prefix, unsigned int offset) const;
+  bool endsWith(const String &suffix) const;
+
+  char charAt(unsigned int index) const;
+  void setCharAt(unsigned int index, char c);
+  char operator[](unsigned int index) const;
+  char &operator[](unsigned int index);
+  void getBytes(unsigned char *buf, unsigned int bufsize,
+                unsigned int index = 0) const;
+  void toCharArray(char *buf, unsigned int bufsize,
+                   unsigned int index = 0) const {
+    getBytes((unsigned char *)buf, bufsize, index);
+  }
+
+  int indexOf(char ch) const { return indexOf(ch, 0); }
+  int indexOf(char ch, unsigned int fromIndex) const;
+  int indexOf(const String &str) const { return indexOf(str, 0); }
+  int indexOf(const String &str, unsigned int fromIndex) const;
+  int lastIndexOf(char ch) const;
+  int lastIndexOf(char ch, unsigned int fromIndex) const;
+  int lastIndexOf(const String &str) const;
+  int lastIndexOf(const String &str, unsigned int fromIndex) const;
+  String substring(unsigned int beginIndex) const;
+  String substring(unsigned int beginIndex, unsigned int endIndex) const;
+
+  void replace(char find, char replace);
+  void replace(const String &find, const String &replace);
+  void remove(unsigned int index);
+  void remove(unsigned int index, unsigned int count);
+  void toLowerCase();
+  void toUpperCase();
+  void trim();
+
+  long toInt() const;
+  float toFloat() const;
+  double toDouble() const;
+
+private:
+  std::string _s;
+};
+
+class StringSumHelper : public String {
+public:
+  StringSumHelper(const String &s) : String(s) {}
+  StringSumHelper(const char *p) : String(p) {}
+  StringSumHelper(char c) : String(c) {}
+  StringSumHelper(unsigned char num) : String(num) {}
+  StringSumHelper(int num) : String(num) {}
+  StringSumHelper(unsigned int num) : String(num) {}
+  StringSumHelper(long num) : String(num) {}
+  StringSumHelper(unsigned long num) : String(num) {}
+  StringSumHelper(float num) : String(num) {}
+  StringSumHelper(double num) : String(num) {}
+};
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "../tcp.h"
+
+// every connected AsyncClient
+extern struct tcp_pcb *tcp_active_pcbs;
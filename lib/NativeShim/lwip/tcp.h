@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+#define ERR_OK 0
+
+struct tcp_pcb;
+// a queued segment, only ever checked for being there
+struct tcp_seg {
+  struct tcp_seg *next;
+};
+typedef err_t (*tcp_poll_fn)(void *arg, struct tcp_pcb *tpcb);
+
+// the fields of a connection's control block the shim uses: the list it is
+// linked in, the poll callback AsyncTCP registers, the queues of segments
+// not sent and not acknowledged yet and how much the far end may still send
+struct tcp_pcb {
+  struct tcp_pcb *next;
+  void *callback_arg;
+  tcp_poll_fn poll;
+  struct tcp_seg *unsent;
+  struct tcp_seg *unacked;
+  uint32_t rcv_wnd;
+};
+
+// reopens the receive window by len bytes taken by the application, on the
+// lwIP thread
+void tcp_recved(struct tcp_pcb *pcb, uint16_t len);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "tcp.h"
+
+typedef void (*tcpip_callback_fn)(void *ctx);
+
+// runs function right away, holding the lock the AsyncClients take to join
+// and leave tcp_active_pcbs, as lwIP runs it on its own thread
+err_t tcpip_callback(tcpip_callback_fn function, void *ctx);
@@ -1,37 +1,90 @@
 #include "OctoPrintAPI.h"
-#include "ArduinoJson.h"
 #include <Arduino.h>
+#include <RequestMetrics.h>
 
 #define VERSION "1.3.10"
 
-OctoPrintAPI::OctoPrintAPI(FS &fs) : _fs(fs), _startTime(0) {}
+// constant answers, put together by the compiler
+static constexpr char versionJson[] =
+    "{\"api\":\"0.1\",\"server\":\"" VERSION "\",\"text\":\"OctoPrint " VERSION
+    "\"}";
+// one answer per printer state, only the state itself changes
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define CONNECTION_JSON(state)                                                 \
+  "{\"current\":{\"state\":\"" state "\",\"port\":\"" PRINT_HOST_PORT          \
+  "\",\"baudrate\":" XSTR(PRINT_HOST_BAUD)                                     \
+  ",\"printerProfile\":\"_default\"},\"options\":{\"ports\":[\""               \
+  PRINT_HOST_PORT "\"],\"baudrates\":[" XSTR(PRINT_HOST_BAUD) "],"             \
+  "\"printerProfiles\":[{\"name\":\"Default\",\"id\":\"_default\"}],"          \
+  "\"portPreference\":\"" PRINT_HOST_PORT "\",\"baudratePreference\":"         \
+  XSTR(PRINT_HOST_BAUD) ",\"printerProfilePreference\":\"_default\","          \
+  "\"autoconnect\":true}}"
+static constexpr char connectionClosed[] = CONNECTION_JSON("Closed");
+static constexpr char connectionOperational[] = CONNECTION_JSON("Operational");
+static constexpr char connectionPrinting[] = CONNECTION_JSON("Printing");
+static constexpr char connectionPaused[] = CONNECTION_JSON("Paused");
+static constexpr char connectionCancelling[] = CONNECTION_JSON("Cancelling");
+
+OctoPrintAPI::OctoPrintAPI(FS &fs, GcodeIndex &index, PrintHost &printer)
+    : _fs(fs), _index(index), _printer(printer), _state(printer, index) {
+  _printer.onResponse([this](const char *line) { _state.parse(line); });
+}
 
 bool OctoPrintAPI::canHandle(AsyncWebServerRequest *request) {
 
   return request->url().startsWith("/api");
 }
 
-bool OctoPrintAPI::on(AsyncWebServerRequest *r,
-                      WebRequestMethodComposite method, const char *uri) {
-  String path = r->url();
-  Serial.printf("%s %s\n", r->methodToString(), path.c_str());
-  return path.equals("/api/version") && r->method() == HTTP_GET;
-}
-
 void OctoPrintAPI::handleRequest(AsyncWebServerRequest *r) {
+  OCTO_LOG("%s %s\n", r->methodToString(), r->url().c_str());
+  RequestMetrics::track(r, REQUEST_HANDLER_OCTOPRINT);
 
-  if (on(r, HTTP_GET, "/api/version")) {
-    return handleGetAPIVersion(r);
-  }
-  if (on(r, HTTP_POST, "/api/files/local")) {
-    return handlePOSTFilesLocal(r);
+  // the exact path first, then the longest wildcard pattern
+  OctoPath path(r->method(), r->url().c_str());
+  if (dispatch(r, path, path.key(), NULL)) {
+    return;
   }
-  if (on(r, HTTP_GET, "/api/connection")) {
-    return handleGETConnection(r);
+  for (int i = path.wildcards() - 1; i >= 0; i--) {
+    if (dispatch(r, path, path.wildcardKey(i), path.param(i))) {
+      return;
+    }
   }
   return handleNotFound(r);
 }
 
+bool OctoPrintAPI::dispatch(AsyncWebServerRequest *r, const OctoPath &path,
+                            uint32_t route, const char *param) {
+  switch (route) {
+    OCTO_ROUTE(HTTP_GET, "/api/version")
+    handleGetAPIVersion(r);
+    return true;
+    OCTO_ROUTE(HTTP_POST, "/api/files/local")
+    handlePOSTFilesLocal(r);
+    return true;
+    OCTO_ROUTE(HTTP_GET, "/api/connection")
+    handleGETConnection(r);
+    return true;
+    OCTO_ROUTE(HTTP_GET, "/api/job")
+    handleGETJob(r);
+    return true;
+    OCTO_ROUTE(HTTP_GET, "/api/printer")
+    handleGETPrinter(r);
+    return true;
+    OCTO_ROUTE(HTTP_GET, "/api/files")
+    handleGETFiles(r, "/");
+    return true;
+    OCTO_ROUTE(HTTP_GET, "/api/files/local")
+    handleGETFiles(r, "/");
+    return true;
+    OCTO_ROUTE(HTTP_GET, "/api/files/local/*")
+    handleGETFiles(r, param);
+    return true;
+  default:
+    return false;
+  }
+}
+
 void OctoPrintAPI::handleGetAPIVersion(AsyncWebServerRequest *request) {
   // http://docs.octoprint.org/en/master/api/version.html
   // HTTP/1.1 200 OK
@@ -43,15 +96,9 @@ void OctoPrintAPI::handleGetAPIVersion(AsyncWebServerRequest *request) {
   //   "text": "OctoPrint 1.3.10"
   // }
 
-  AsyncResponseStream *response =
-      request->beginResponseStream("application/json");
-
-  DynamicJsonDocument doc(JSON_OBJECT_SIZE(3));
-  doc["api"] = VERSION;
-  doc["server"] = VERSION;
-  doc["text"] = "OctoPrint " VERSION;
-  serializeJson(doc, *response);
-  request->send(response);
+  request->send(request->beginResponse_P(200, "application/json",
+                                         (const uint8_t *)versionJson,
+                                         sizeof(versionJson) - 1));
 };
 
 void OctoPrintAPI::handlePOSTFilesLocal(AsyncWebServerRequest *request) {
@@ -77,23 +124,262 @@ void OctoPrintAPI::handlePOSTFilesLocal(AsyncWebServerRequest *request) {
   //   },
   //   "done": false
   // }
+  std::map<AsyncWebServerRequest *, OctoUpload>::iterator it =
+      _uploads.find(request);
+  if (it == _uploads.end()) {
+    return request->send(400);
+  }
+  String filename = it->second.filename;
+  bool failed = it->second.failed;
+  bool conflict = it->second.conflict;
+  bool starved = it->second.starved;
+  std::shared_ptr<WriterCompletion> completion = it->second.completion;
+  finishUpload(request);
+  if (conflict) {
+    return request->send(409);
+  }
+  if (starved) {
+    return request->send(503);
+  }
+  if (failed || !completion) {
+    return request->send(500);
+  }
+  // the file only exists under its name once the rename went through, and
+  // the lookup may go to the card, so the response is built on an I/O worker
+  request->send(new AsyncCommitResponse(
+      completion, OCTO_COMMIT_TIMEOUT_MS,
+      [this, filename](AsyncWebServerRequest *request,
+                       bool ok) -> AsyncWebServerResponse * {
+        if (!ok) {
+          return new AsyncBasicResponse(500);
+        }
+        return new AsyncIoResponse(IO_OP_OCTO_FILES, [this, filename]() {
+          return buildUpload(filename);
+        });
+      }));
+};
+
+// runs on an I/O worker
+AsyncWebServerResponse *OctoPrintAPI::buildUpload(const String &filename) {
+  GcodeIndexRecord record;
+  if (!_index.lookup(filename, record)) {
+    memset(&record, 0, sizeof(record));
+    strlcpy(record.path, filename.c_str(), sizeof(record.path));
+  }
+
   AsyncResponseStream *response =
-      request->beginResponseStream("application/json");
+      new AsyncResponseStream("application/json", 1460);
   response->setCode(201);
-  DynamicJsonDocument local(JSON_OBJECT_SIZE(2));
-  local["name"] = _uploadedFullname;
-  local["origin"] = "local";
-  DynamicJsonDocument files(JSON_OBJECT_SIZE(1));
-  files["local"] = local;
-  DynamicJsonDocument doc(JSON_OBJECT_SIZE(2));
-
-  doc["files"] = files;
-  doc["done"] = true;
-  serializeJson(doc, *response);
+  JsonWriter json(*response);
+  json.beginObject().key("files").beginObject().key("local").beginObject();
+  writeFile(json, record);
+  json.endObject().endObject().field("done", true).endObject();
   response->addHeader("Connection", "close");
+  return response;
+}
 
-  request->send(response);
-};
+void OctoPrintAPI::handleGETFiles(AsyncWebServerRequest *request,
+                                  const char *path) {
+  // https://docs.octoprint.org/en/master/api/files.html
+
+  // {
+  //   "files": [
+  //     {
+  //       "name": "whistle_v2.gcode",
+  //       "path": "whistle_v2.gcode",
+  //       "type": "machinecode",
+  //       "typePath": ["machinecode", "gcode"],
+  //       "origin": "local",
+  //       "size": 1468987,
+  //       "date": 1378847754,
+  //       "hash": "...",
+  //       "refs": {
+  //         "resource": "http://example.com/api/files/local/whistle_v2.gcode"
+  //       },
+  //       "gcodeAnalysis": {
+  //         "estimatedPrintTime": 1188,
+  //         "filament": {"tool0": {"length": 810.6}}
+  //       }
+  //     }
+  //   ],
+  //   "more": false
+  // }
+  //
+  // A folder is answered with its entries as "children". Entries are listed
+  // flat with their full path even when recursive, and offset/limit page
+  // through them.
+  std::shared_ptr<OctoListState> state = std::make_shared<OctoListState>();
+  state->root = path;
+  if (state->root.length() > 1 && state->root.endsWith("/")) {
+    state->root.remove(state->root.length() - 1);
+  }
+  AsyncWebParameter *recursive = request->getParam("recursive");
+  AsyncWebParameter *offset = request->getParam("offset");
+  AsyncWebParameter *limit = request->getParam("limit");
+  state->recursive = recursive && recursive->value().equals("true");
+  state->offset = offset ? offset->value().toInt() : 0;
+  state->limit = limit ? limit->value().toInt() : 0;
+
+  // the lookup may go to the card, so the response is built on an I/O worker
+  request->send(new AsyncIoResponse(
+      IO_OP_OCTO_FILES, [this, state]() { return buildFiles(state); }));
+}
+
+// runs on an I/O worker
+AsyncWebServerResponse *
+OctoPrintAPI::buildFiles(std::shared_ptr<OctoListState> state) {
+  if (!state->root.equals("/")) {
+    GcodeIndexRecord record;
+    if (!_index.lookup(state->root, record)) {
+      // not a G-code or folder, all there is comes from the card
+      File file = _fs.open(state->root, FILE_READ);
+      if (!file || file.isDirectory()) {
+        return new AsyncBasicResponse(404);
+      }
+      memset(&record, 0, sizeof(record));
+      strlcpy(record.path, state->root.c_str(), sizeof(record.path));
+      record.size = file.size();
+      record.lastWrite = file.getLastWrite();
+      file.close();
+    }
+    if (!record.folder) {
+      AsyncResponseStream *response =
+          new AsyncResponseStream("application/json", 1460);
+      JsonWriter json(*response);
+      json.beginObject();
+      writeFile(json, record);
+      json.endObject();
+      return response;
+    }
+    state->json.beginObject();
+    writeFile(state->json, record);
+    state->json.key("children").beginArray();
+  } else {
+    state->json.beginObject().key("files").beginArray();
+  }
+
+  state->matched = 0;
+  state->sent = 0;
+  state->more = false;
+  state->done = false;
+  state->pos = 0;
+  state->batchLen = 0;
+  state->batchPos = 0;
+
+  // streamed from the index a few records at a time, so the heap stays flat
+  // however many files there are
+  return new AsyncChunkedResponse(
+      "application/json",
+      [this, state](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return fillList(*state, buffer, maxLen);
+      });
+}
+
+size_t OctoPrintAPI::fillList(OctoListState &state, uint8_t *buffer,
+                              size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen) {
+    if (!state.chunk.empty()) {
+      written += state.chunk.drain(buffer + written, maxLen - written);
+      continue;
+    }
+    if (!nextListChunk(state)) {
+      break;
+    }
+  }
+  return written;
+}
+
+bool OctoPrintAPI::nextListChunk(OctoListState &state) {
+  if (state.done) {
+    return false;
+  }
+  // direct children have no further slash after the root
+  size_t prefix = state.root.equals("/") ? 1 : state.root.length() + 1;
+  for (;;) {
+    if (state.batchPos == state.batchLen) {
+      state.batchLen = _index.read(state.pos, state.batch, OCTO_LIST_BATCH);
+      state.batchPos = 0;
+      if (!state.batchLen) {
+        break;
+      }
+    }
+    const GcodeIndexRecord &record = state.batch[state.batchPos++];
+    if (!record.live || !GcodeIndex::isBelow(record.path, state.root) ||
+        (!state.recursive && strchr(record.path + prefix, '/'))) {
+      continue;
+    }
+    if (state.matched++ < state.offset) {
+      continue;
+    }
+    if (state.limit && state.sent == state.limit) {
+      state.more = true;
+      break;
+    }
+    state.sent++;
+    state.json.beginObject();
+    writeFile(state.json, record);
+    state.json.endObject();
+    return true;
+  }
+  state.json.endArray().field("more", state.more).endObject();
+  state.done = true;
+  return true;
+}
+
+void OctoPrintAPI::writeFile(JsonWriter &json,
+                             const GcodeIndexRecord &record) {
+  const char *name = strrchr(record.path, '/');
+  json.field("name", name ? name + 1 : record.path);
+  json.field("path", record.path[0] == '/' ? record.path + 1 : record.path);
+  if (record.folder) {
+    json.field("type", "folder");
+    json.key("typePath").beginArray().value("folder").endArray();
+  } else {
+    json.field("type", "machinecode");
+    json.key("typePath").beginArray().value("machinecode").value("gcode");
+    json.endArray();
+    json.field("size", record.size);
+  }
+  json.field("origin", "local");
+  json.field("date", record.lastWrite);
+  if (record.hash[0]) {
+    json.field("hash", record.hash);
+  }
+
+  // the resource URL has its spaces encoded
+  json.key("refs").beginObject().key("resource").beginString();
+  json.part("/api/files/local");
+  const char *segment = record.path;
+  const char *space;
+  while ((space = strchr(segment, ' '))) {
+    json.part(segment, space - segment).part("%20");
+    segment = space + 1;
+  }
+  json.part(segment).endString().endObject();
+
+  const GcodeMeta &meta = record.meta;
+  if (meta.thumbnailWidth) {
+    char thumbnail[GCODE_THUMBNAIL_NAME];
+    GcodeIndex::thumbnailName(record.path, thumbnail);
+    json.key("thumbnail").beginString().part(GCODE_THUMBNAIL_URL);
+    json.part(thumbnail).endString();
+  }
+  if (meta.printTime || meta.filamentLength) {
+    json.key("gcodeAnalysis").beginObject();
+    json.field("estimatedPrintTime", meta.printTime);
+    json.key("filament").beginObject().key("tool0").beginObject();
+    json.field("length", meta.filamentLength).endObject().endObject();
+    json.endObject();
+  }
+  if (meta.printerModel[0] || meta.layerHeight || meta.filamentWeight) {
+    json.key("slicer").beginObject();
+    json.field("printerModel", meta.printerModel);
+    json.field("layerHeight", meta.layerHeight);
+    json.field("filamentWeight", meta.filamentWeight);
+    json.endObject();
+  }
+}
 
 void OctoPrintAPI::handleGETConnection(AsyncWebServerRequest *request) {
   // http://docs.octoprint.org/en/master/api/version.html
@@ -116,53 +402,180 @@ void OctoPrintAPI::handleGETConnection(AsyncWebServerRequest *request) {
   //   }
   // }
 
-  AsyncResponseStream *response =
-      request->beginResponseStream("application/json");
-  response->setCode(200);
-  DynamicJsonDocument current(JSON_OBJECT_SIZE(2));
-  current["state"] = "Operational";
-  current["port"] = "Serial1";
-  current["baudrate"] = 250000;
-  current["printerProfile"] = "_default";
-
-  DynamicJsonDocument options(JSON_OBJECT_SIZE(1));
-  options["ports"] = "";
-  options["baudrates"] = "";
-  options["printerProfiles"] = "";
-  options["portPreference"] = "";
-  options["baudratePreference"] = "";
-  options["printerProfilePreference"] = "_default";
-  options["autoconnect"] = "";
-
-  DynamicJsonDocument doc(JSON_OBJECT_SIZE(2));
-  doc["current"] = current;
-  doc["options"] = options;
-  serializeJson(doc, *response);
+  const char *json = connectionClosed;
+  switch (_printer.state()) {
+  case PRINT_HOST_OPERATIONAL:
+    json = connectionOperational;
+    break;
+  case PRINT_HOST_PRINTING:
+    json = connectionPrinting;
+    break;
+  case PRINT_HOST_PAUSED:
+    json = connectionPaused;
+    break;
+  case PRINT_HOST_CANCELLING:
+    json = connectionCancelling;
+    break;
+  default:
+    break;
+  }
+  AsyncWebServerResponse *response = request->beginResponse_P(
+      200, "application/json", (const uint8_t *)json, strlen(json));
   response->addHeader("Connection", "close");
   request->send(response);
 };
 
+void OctoPrintAPI::handleGETJob(AsyncWebServerRequest *request) {
+  // https://docs.octoprint.org/en/master/api/job.html
+  sendCached(request, _state.job());
+}
+
+void OctoPrintAPI::handleGETPrinter(AsyncWebServerRequest *request) {
+  // https://docs.octoprint.org/en/master/api/printer.html
+  if (_printer.state() == PRINT_HOST_CLOSED) {
+    return request->send(409, "text/plain", "Printer is not operational");
+  }
+  sendCached(request, _state.printer());
+}
+
+// sends an answer written by the state cache, without copying it
+void OctoPrintAPI::sendCached(AsyncWebServerRequest *request,
+                              std::shared_ptr<const JsonString> json) {
+  if (!json) {
+    return request->send(503);
+  }
+  AsyncWebServerResponse *response = request->beginResponse(
+      "application/json", json->length(),
+      [json](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        size_t n = min(maxLen, json->length() - index);
+        memcpy(buffer, json->data() + index, n);
+        return n;
+      });
+  request->send(response);
+}
+
+// a form field or query parameter set to true
+static bool isTrue(AsyncWebServerRequest *request, const char *name) {
+  AsyncWebParameter *param = request->getParam(name, true);
+  if (!param) {
+    param = request->getParam(name);
+  }
+  return param && param->value() == "true";
+}
+
 void OctoPrintAPI::handleUpload(AsyncWebServerRequest *request,
                                 const String &filename, size_t index,
                                 uint8_t *data, size_t len, bool final) {
   // http://docs.octoprint.org/en/master/api/version.html
-  int pos = filename.lastIndexOf("/");
-  _uploadedFullname = pos == -1 ? "/" + filename : filename.substring(pos);
-
   if (!index) {
-    request->_tempFile = _fs.open(_uploadedFullname, FILE_WRITE);
-    _startTime = millis();
-  }
-  if (request->_tempFile) {
-    if (len) {
-      request->_tempFile.write(data, len);
+    // every multipart request under /api comes here, only one of them is an
+    // upload
+    OctoPath route(request->method(), request->url().c_str());
+    if (!route.matches(HTTP_POST, "/api/files/local", NULL)) {
+      return;
+    }
+    int pos = filename.lastIndexOf("/");
+    if (_uploads.find(request) == _uploads.end()) {
+      RequestMetrics::onDisconnect(
+          request, REQUEST_HANDLER_OCTOPRINT,
+          [this, request]() { finishUpload(request); });
+    }
+    OctoUpload &upload = _uploads[request];
+    closeUpload(upload);
+    upload.filename = pos == -1 ? "/" + filename : filename.substring(pos);
+    upload.failed = false;
+    upload.conflict = false;
+    upload.starved = false;
+    upload.completion.reset();
+    PrintHostState state = _printer.state();
+    if (state != PRINT_HOST_CLOSED && state != PRINT_HOST_OPERATIONAL &&
+        upload.filename.equals(_printer.path())) {
+      // the printer is still reading the old one
+      upload.failed = upload.conflict = true;
+      return;
     }
-    if (final) {
-      request->_tempFile.close();
+    // "upload and print" writes a new file under the real name, so printing
+    // can start before the upload is done; one that replaces a file waits
+    // for it to be committed
+    bool print = isTrue(request, "print") && state == PRINT_HOST_OPERATIONAL;
+    upload.writer = new BufferedFileWriter();
+    upload.writer->throttle(request->client());
+    if (upload.writer->open(_fs, upload.filename, print)) {
+      upload.completion = upload.writer->completion();
+      String path = upload.filename;
+      bool printAfter = print && !upload.writer->direct();
+      // metadata is picked up on the way to the card, no second pass
+      std::shared_ptr<GcodeScanner> scanner;
+      if (GcodeScanner::isGcode(path)) {
+        scanner = std::make_shared<GcodeScanner>();
+        upload.writer->onData([scanner](const uint8_t *data, size_t len) {
+          scanner->feed(data, len);
+        });
+      }
+      upload.writer->onClose([this, path, scanner, printAfter](bool committed) {
+        if (committed) {
+          _index.store(path, scanner.get());
+        }
+        if (_onFileChanged) {
+          _onFileChanged(path);
+        }
+        if (committed && printAfter) {
+          _printer.start(path.c_str());
+        }
+      });
+      if (_onFileChanged) {
+        _onFileChanged(path);
+      }
+      if (print && !printAfter) {
+        _printer.start(path.c_str(), upload.completion);
+      }
+    } else {
+      upload.starved = upload.writer->starved();
+      upload.writer->close();
+      upload.writer = NULL;
+      upload.failed = true;
     }
   }
+
+  std::map<AsyncWebServerRequest *, OctoUpload>::iterator it =
+      _uploads.find(request);
+  if (it == _uploads.end() || !it->second.writer) {
+    return;
+  }
+  if (len) {
+    it->second.writer->write(data, len);
+  }
+  if (final) {
+    closeUpload(it->second);
+  }
 };
 
+void OctoPrintAPI::closeUpload(OctoUpload &upload, bool commit) {
+  if (upload.writer) {
+    upload.failed = upload.failed || upload.writer->failed();
+    if (commit) {
+      upload.writer->close();
+    } else {
+      upload.writer->abort();
+    }
+    upload.writer = NULL;
+  }
+}
+
+void OctoPrintAPI::finishUpload(AsyncWebServerRequest *request) {
+  std::map<AsyncWebServerRequest *, OctoUpload>::iterator it =
+      _uploads.find(request);
+  if (it == _uploads.end()) {
+    return;
+  }
+  // a dropped client leaves the previous file on the card untouched
+  closeUpload(it->second, false);
+  if (it->second.completion) {
+    it->second.completion->wake()->detach();
+  }
+  _uploads.erase(it);
+}
+
 void OctoPrintAPI::handleNotFound(AsyncWebServerRequest *request) {
   AsyncWebServerResponse *response = request->beginResponse(404);
   request->send(response);
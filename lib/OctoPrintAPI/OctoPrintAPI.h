@@ -1,16 +1,74 @@
 #include <Arduino.h>
+#include <BufferedFileWriter.h>
 #include <ESPAsyncWebServer.h>
+#include <GcodeIndex.h>
+#include <IoWorkers.h>
+#include <JsonWriter.h>
+#include <OctoRoute.h>
+#include <OctoState.h>
+#include <PrintHost.h>
+#include <functional>
+#include <map>
+#include <memory>
+
+// how long an upload's response waits for the file to be committed before it
+// reports a failure
+#ifndef OCTO_COMMIT_TIMEOUT_MS
+#define OCTO_COMMIT_TIMEOUT_MS 3000
+#endif
+
+// index records read per step of a /api/files listing
+#ifndef OCTO_LIST_BATCH
+#define OCTO_LIST_BATCH 8
+#endif
+
+typedef std::function<void(const String &path)> OctoFileChangedHandler;
+
+// State of one multipart upload, so concurrent uploads don't mix
+struct OctoUpload {
+  String filename;
+  BufferedFileWriter *writer;
+  std::shared_ptr<WriterCompletion> completion;
+  bool failed;
+  // would have replaced the file being printed
+  bool conflict;
+  // no buffers were free for it
+  bool starved;
+};
+
+// Where a streamed /api/files listing is in the index
+struct OctoListState {
+  String root;
+  bool recursive;
+  uint32_t offset;
+  uint32_t limit;
+  uint32_t matched;
+  uint32_t sent;
+  bool more;
+  bool done;
+  uint32_t pos;
+  GcodeIndexRecord batch[OCTO_LIST_BATCH];
+  size_t batchLen;
+  size_t batchPos;
+  JsonChunk chunk;
+  JsonWriter json;
+
+  OctoListState() : chunk(512), json(chunk) {}
+};
 
 class OctoPrintAPI : public AsyncWebHandler {
   using FS = fs::FS;
 
 protected:
   FS _fs;
-  uint32_t _startTime;
-  String _uploadedFullname;
+  GcodeIndex &_index;
+  PrintHost &_printer;
+  OctoState _state;
+  std::map<AsyncWebServerRequest *, OctoUpload> _uploads;
+  OctoFileChangedHandler _onFileChanged;
 
 public:
-  OctoPrintAPI(FS &fs);
+  OctoPrintAPI(FS &fs, GcodeIndex &index, PrintHost &printer);
 
   virtual bool canHandle(AsyncWebServerRequest *request) override final;
   virtual void handleRequest(AsyncWebServerRequest *request) override final;
@@ -18,12 +76,29 @@ public:
                             const String &filename, size_t index, uint8_t *data,
                             size_t len, bool final) override final;
   virtual bool isRequestHandlerTrivial() override final { return false; }
+  // called whenever an upload creates or changes a file on the card
+  void onFileChanged(OctoFileChangedHandler fn) { _onFileChanged = fn; }
+  // samples the printer for /api/job and /api/printer, from the main loop
+  void loop() { _state.loop(); }
+  const OctoState &state() const { return _state; }
 
 private:
-  bool on(AsyncWebServerRequest *r, WebRequestMethodComposite method,
-          const char *uri);
+  bool dispatch(AsyncWebServerRequest *r, const OctoPath &path,
+                uint32_t route, const char *param);
   void handleNotFound(AsyncWebServerRequest *request);
   void handleGetAPIVersion(AsyncWebServerRequest *request);
   void handlePOSTFilesLocal(AsyncWebServerRequest *request);
+  AsyncWebServerResponse *buildUpload(const String &filename);
+  void handleGETFiles(AsyncWebServerRequest *request, const char *path);
+  AsyncWebServerResponse *buildFiles(std::shared_ptr<OctoListState> state);
+  size_t fillList(OctoListState &state, uint8_t *buffer, size_t maxLen);
+  bool nextListChunk(OctoListState &state);
+  static void writeFile(JsonWriter &json, const GcodeIndexRecord &record);
   void handleGETConnection(AsyncWebServerRequest *request);
+  void handleGETJob(AsyncWebServerRequest *request);
+  void handleGETPrinter(AsyncWebServerRequest *request);
+  void sendCached(AsyncWebServerRequest *request,
+                  std::shared_ptr<const JsonString> json);
+  void closeUpload(OctoUpload &upload, bool commit = true);
+  void finishUpload(AsyncWebServerRequest *request);
 };
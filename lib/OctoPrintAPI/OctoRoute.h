@@ -0,0 +1,109 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Debug log of the API, compiled out unless OCTO_DEBUG is defined. Each call
+// site prints at most once per OCTO_LOG_INTERVAL_MS, so a busy client can't
+// flood the UART.
+#ifndef OCTO_LOG_INTERVAL_MS
+#define OCTO_LOG_INTERVAL_MS 1000
+#endif
+#ifdef OCTO_DEBUG
+#define OCTO_LOG(...)                                                          \
+  do {                                                                         \
+    static uint32_t octoLogLast = 0;                                           \
+    uint32_t octoLogNow = millis();                                            \
+    if (!octoLogLast || octoLogNow - octoLogLast >= OCTO_LOG_INTERVAL_MS) {   \
+      octoLogLast = octoLogNow | 1;                                            \
+      Serial.printf(__VA_ARGS__);                                              \
+    }                                                                          \
+  } while (0)
+#else
+#define OCTO_LOG(...)                                                          \
+  do {                                                                         \
+  } while (0)
+#endif
+
+// most slashes looked at for wildcard routes
+#ifndef OCTO_ROUTE_DEPTH
+#define OCTO_ROUTE_DEPTH 8
+#endif
+
+#define OCTO_FNV_OFFSET 2166136261u
+#define OCTO_FNV_PRIME 16777619u
+
+constexpr uint32_t octoFnv(uint32_t hash, uint8_t c) {
+  return (hash ^ c) * OCTO_FNV_PRIME;
+}
+
+constexpr uint32_t octoFnv(uint32_t hash, const char *s) {
+  return *s ? octoFnv(octoFnv(hash, (uint8_t)*s), s + 1) : hash;
+}
+
+// FNV-1a of the method followed by the path. A pattern ending in "/*" takes
+// any rest of the path as its parameter. Used as case labels, so the switch
+// over all routes is built by the compiler; OCTO_ROUTE() compares the literal
+// as well, since another path can have the same hash.
+constexpr uint32_t octoMethod(uint32_t method) {
+  return octoFnv(octoFnv(OCTO_FNV_OFFSET, (uint8_t)method),
+                 (uint8_t)(method >> 8));
+}
+
+constexpr uint32_t octoRoute(WebRequestMethod method, const char *pattern) {
+  return octoFnv(octoMethod(method), pattern);
+}
+
+// a case of the switch over path's key, falling out of it with false unless
+// the path really is the pattern
+#define OCTO_ROUTE(method, pattern)                                            \
+  case octoRoute(method, pattern):                                             \
+    if (!path.matches(method, pattern, param)) {                               \
+      return false;                                                            \
+    }
+
+// Hashes a request path in one pass, exactly and for every wildcard pattern
+// it could match, without copying it
+class OctoPath {
+public:
+  OctoPath(WebRequestMethodComposite method, const char *path)
+      : _method(method), _path(path), _wildcards(0) {
+    uint32_t hash = octoMethod(method);
+    for (const char *p = path; *p; p++) {
+      hash = octoFnv(hash, (uint8_t)*p);
+      if (*p == '/' && _wildcards < OCTO_ROUTE_DEPTH) {
+        _wildcardKeys[_wildcards] = octoFnv(hash, '*');
+        _params[_wildcards] = p - path;
+        _wildcards++;
+      }
+    }
+    _key = hash;
+  }
+
+  uint32_t key() const { return _key; }
+  uint8_t wildcards() const { return _wildcards; }
+  uint32_t wildcardKey(uint8_t i) const { return _wildcardKeys[i]; }
+  // what the wildcard matched, starting at the slash before it
+  const char *param(uint8_t i) const { return _path + _params[i]; }
+
+  // whether the path is the pattern a key was found for; with a wildcard
+  // param, the part before it has to be the pattern without its "/*"
+  bool matches(WebRequestMethod method, const char *pattern,
+               const char *param) const {
+    if (_method != method) {
+      return false;
+    }
+    if (!param) {
+      return !strcmp(_path, pattern);
+    }
+    size_t len = param - _path;
+    return !strncmp(_path, pattern, len) && !strcmp(pattern + len, "/*");
+  }
+
+private:
+  WebRequestMethodComposite _method;
+  const char *_path;
+  uint32_t _key;
+  uint8_t _wildcards;
+  uint32_t _wildcardKeys[OCTO_ROUTE_DEPTH];
+  uint16_t _params[OCTO_ROUTE_DEPTH];
+};
@@ -0,0 +1,223 @@
+#include "OctoState.h"
+#include <math.h>
+
+OctoState::OctoState(PrintHost &printer, GcodeIndex &index)
+    : _printer(printer), _index(index), _tool(0), _toolTarget(0), _bed(0),
+      _bedTarget(0), _lastTemp(0), _lastSample(0),
+      _lock(xSemaphoreCreateMutex()), _rebuilds(0) {
+  memset(&_last, 0, sizeof(_last));
+}
+
+// "T:210.0 /210.0" out of "ok T:210.0 /210.0 B:60.0 /60.0 T0:210.0 /210.0"
+static bool parseTemp(const char *line, const char *key, int16_t &actual,
+                      int16_t &target) {
+  size_t len = strlen(key);
+  const char *p = line;
+  while ((p = strstr(p, key)) && p != line && p[-1] != ' ') {
+    p += len;
+  }
+  if (!p) {
+    return false;
+  }
+  char *end;
+  double value = strtod(p + len, &end);
+  if (end == p + len) {
+    return false;
+  }
+  actual = lround(value * 10);
+  while (*end == ' ') {
+    end++;
+  }
+  if (*end == '/') {
+    target = lround(strtod(end + 1, NULL) * 10);
+  }
+  return true;
+}
+
+void OctoState::parse(const char *line) {
+  int16_t actual, target = _toolTarget;
+  if (parseTemp(line, "T:", actual, target)) {
+    _tool = actual;
+    _toolTarget = target;
+    _lastTemp = millis();
+  }
+  target = _bedTarget;
+  if (parseTemp(line, "B:", actual, target)) {
+    _bed = actual;
+    _bedTarget = target;
+  }
+}
+
+void OctoState::loop() {
+  uint32_t now = millis();
+  if (_job && now - _lastSample < OCTO_STATE_INTERVAL_MS) {
+    return;
+  }
+  _lastSample = now;
+  // temperatures are fetched here, never by a request
+  if (_printer.state() != PRINT_HOST_CLOSED &&
+      now - _lastTemp >= OCTO_TEMP_INTERVAL_MS) {
+    _printer.command("M105");
+  }
+
+  OctoStateSample next;
+  sample(next);
+  if (_job && !memcmp(&next, &_last, sizeof(next))) {
+    return;
+  }
+  _last = next;
+
+  std::shared_ptr<JsonString> job = std::make_shared<JsonString>(512);
+  JsonWriter jobJson(*job);
+  writeJob(jobJson, next);
+  std::shared_ptr<JsonString> printer = std::make_shared<JsonString>(384);
+  JsonWriter printerJson(*printer);
+  writePrinter(printerJson, next);
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _job = job;
+  _printerJson = printer;
+  xSemaphoreGive(_lock);
+  _rebuilds++;
+}
+
+void OctoState::sample(OctoStateSample &sample) {
+  memset(&sample, 0, sizeof(sample));
+  sample.state = _printer.state();
+  strlcpy(sample.path, _printer.path().c_str(), sizeof(sample.path));
+  sample.size = _printer.fileSize();
+  sample.pos = _printer.filePos();
+  // printing, paused or cancelling
+  if (sample.state >= PRINT_HOST_PRINTING) {
+    sample.printTime = (millis() - _printer.jobStarted()) / 1000;
+  }
+  sample.tool = _tool;
+  sample.toolTarget = _toolTarget;
+  sample.bed = _bed;
+  sample.bedTarget = _bedTarget;
+
+  // the slicer's estimate, looked up again only for another file
+  if (!strcmp(sample.path, _last.path) && sample.size == _last.size) {
+    sample.date = _last.date;
+    sample.estimatedTime = _last.estimatedTime;
+    sample.filamentLength = _last.filamentLength;
+  } else if (sample.path[0]) {
+    GcodeIndexRecord record;
+    if (_index.lookup(sample.path, record)) {
+      sample.date = record.lastWrite;
+      sample.estimatedTime = record.meta.printTime;
+      sample.filamentLength = record.meta.filamentLength;
+    }
+  }
+}
+
+std::shared_ptr<const JsonString> OctoState::job() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  std::shared_ptr<const JsonString> job = _job;
+  xSemaphoreGive(_lock);
+  return job;
+}
+
+std::shared_ptr<const JsonString> OctoState::printer() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  std::shared_ptr<const JsonString> printer = _printerJson;
+  xSemaphoreGive(_lock);
+  return printer;
+}
+
+void OctoState::writeJob(JsonWriter &json, const OctoStateSample &sample) {
+  // https://docs.octoprint.org/en/master/api/job.html
+  json.beginObject().key("job").beginObject().key("file");
+  if (sample.path[0]) {
+    const char *name = strrchr(sample.path, '/');
+    json.beginObject();
+    json.field("name", name ? name + 1 : sample.path);
+    json.field("path", sample.path[0] == '/' ? sample.path + 1 : sample.path);
+    json.field("origin", "local");
+    json.field("size", sample.size);
+    json.field("date", sample.date);
+    json.endObject();
+  } else {
+    json.null();
+  }
+  json.key("estimatedPrintTime");
+  if (sample.estimatedTime) {
+    json.value(sample.estimatedTime);
+  } else {
+    json.null();
+  }
+  json.key("filament");
+  if (sample.filamentLength > 0) {
+    json.beginObject().key("tool0").beginObject();
+    json.field("length", sample.filamentLength);
+    json.key("volume").null();
+    json.endObject().endObject();
+  } else {
+    json.null();
+  }
+  json.endObject();
+
+  json.key("progress").beginObject();
+  if (sample.state >= PRINT_HOST_PRINTING && sample.size) {
+    uint32_t left = sample.size - min(sample.pos, sample.size);
+    json.field("completion", sample.pos * 100.0 / sample.size);
+    json.field("filepos", sample.pos);
+    json.field("printTime", sample.printTime);
+    // the slicer's estimate for what is left, or how long the rest took so
+    // far once it has nothing to say
+    if (sample.estimatedTime) {
+      json.field("printTimeLeft",
+                 (uint32_t)((uint64_t)sample.estimatedTime * left /
+                            sample.size));
+      json.field("printTimeLeftOrigin", "estimate");
+    } else if (sample.pos) {
+      json.field("printTimeLeft",
+                 (uint32_t)((uint64_t)sample.printTime * left / sample.pos));
+      json.field("printTimeLeftOrigin", "linear");
+    } else {
+      json.key("printTimeLeft").null();
+      json.key("printTimeLeftOrigin").null();
+    }
+  } else {
+    json.key("completion").null();
+    json.key("filepos").null();
+    json.key("printTime").null();
+    json.key("printTimeLeft").null();
+    json.key("printTimeLeftOrigin").null();
+  }
+  json.endObject();
+  json.field("state", PrintHost::stateName((PrintHostState)sample.state));
+  json.endObject();
+}
+
+void OctoState::writePrinter(JsonWriter &json,
+                             const OctoStateSample &sample) {
+  // https://docs.octoprint.org/en/master/api/printer.html
+  json.beginObject().key("temperature").beginObject();
+  json.key("tool0").beginObject();
+  json.key("actual").value(sample.tool / 10.0, 1);
+  json.key("target").value(sample.toolTarget / 10.0, 1);
+  json.field("offset", 0).endObject();
+  json.key("bed").beginObject();
+  json.key("actual").value(sample.bed / 10.0, 1);
+  json.key("target").value(sample.bedTarget / 10.0, 1);
+  json.field("offset", 0).endObject();
+  json.endObject();
+
+  bool printing = sample.state == PRINT_HOST_PRINTING;
+  bool paused = sample.state == PRINT_HOST_PAUSED;
+  bool cancelling = sample.state == PRINT_HOST_CANCELLING;
+  json.key("state").beginObject();
+  json.field("text", PrintHost::stateName((PrintHostState)sample.state));
+  json.key("flags").beginObject();
+  json.field("operational", sample.state != PRINT_HOST_CLOSED);
+  json.field("printing", printing);
+  json.field("paused", paused);
+  json.field("pausing", false);
+  json.field("cancelling", cancelling);
+  json.field("sdReady", true);
+  json.field("error", false);
+  json.field("ready", sample.state == PRINT_HOST_OPERATIONAL);
+  json.field("closedOrError", sample.state == PRINT_HOST_CLOSED);
+  json.endObject().endObject().endObject();
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Arduino.h>
+#include <GcodeIndex.h>
+#include <JsonWriter.h>
+#include <PrintHost.h>
+#include <atomic>
+#include <memory>
+
+// how often the printer is sampled for /api/job and /api/printer
+#ifndef OCTO_STATE_INTERVAL_MS
+#define OCTO_STATE_INTERVAL_MS 1000
+#endif
+// temperatures older than this are asked for again
+#ifndef OCTO_TEMP_INTERVAL_MS
+#define OCTO_TEMP_INTERVAL_MS 3000
+#endif
+
+// Everything /api/job and /api/printer show. Samples are compared as a
+// whole, so it is kept free of padding garbage.
+struct OctoStateSample {
+  uint8_t state;
+  char path[GCODE_INDEX_PATH];
+  uint32_t size;
+  uint32_t pos;
+  uint32_t date;
+  // seconds
+  uint32_t printTime;
+  uint32_t estimatedTime;
+  float filamentLength;
+  // tenths of a degree
+  int16_t tool;
+  int16_t toolTarget;
+  int16_t bed;
+  int16_t bedTarget;
+};
+
+// Answers for /api/job and /api/printer, kept ready to send.
+//
+// Temperatures come from the printer's own responses, the job from the
+// print host. loop() samples both at most every OCTO_STATE_INTERVAL_MS and
+// writes the answers again only when the sample changed, so a poll never
+// waits on the printer and any number of clients polling cost the same as
+// one.
+class OctoState {
+public:
+  OctoState(PrintHost &printer, GcodeIndex &index);
+
+  // a line from the printer, called from the UART task
+  void parse(const char *line);
+  // called from the main loop
+  void loop();
+
+  // NULL before the first sample
+  std::shared_ptr<const JsonString> job();
+  std::shared_ptr<const JsonString> printer();
+  // how often the answers were written
+  uint32_t rebuilds() const { return _rebuilds; }
+
+private:
+  void sample(OctoStateSample &sample);
+  void writeJob(JsonWriter &json, const OctoStateSample &sample);
+  void writePrinter(JsonWriter &json, const OctoStateSample &sample);
+
+  PrintHost &_printer;
+  GcodeIndex &_index;
+  std::atomic<int16_t> _tool;
+  std::atomic<int16_t> _toolTarget;
+  std::atomic<int16_t> _bed;
+  std::atomic<int16_t> _bedTarget;
+  std::atomic<uint32_t> _lastTemp;
+
+  // owned by loop()
+  OctoStateSample _last;
+  uint32_t _lastSample;
+
+  SemaphoreHandle_t _lock;
+  std::shared_ptr<const JsonString> _job;
+  std::shared_ptr<const JsonString> _printerJson;
+  std::atomic<uint32_t> _rebuilds;
+};
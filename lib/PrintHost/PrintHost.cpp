@@ -0,0 +1,528 @@
+#include "PrintHost.h"
+#include <GcodePack.h>
+
+// a command waiting in the queue, copied in and out by value
+struct PrintCommand {
+  char text[PRINT_HOST_LINE_MAX + 1];
+};
+
+PrintHost::PrintHost(HardwareSerial &serial, FS &fs)
+    : _serial(serial), _fs(fs), _reader(NULL), _commands(NULL),
+      _state(PRINT_HOST_CLOSED), _cancel(false), _reading(false),
+      _pathLock(xSemaphoreCreateMutex()), _fileSize(0), _filePos(0),
+      _jobStarted(0), _jobEnded(true), _jobStalled(true), _acked(0),
+      _sent(0), _next(0), _inflightBytes(0), _ignoreOks(0), _resendLine(0),
+      _staleResends(0), _rxLen(0), _lastRx(0), _lastProbe(0), _rateStart(0),
+      _rateLines(0), _linesSent(0), _lineRate(0), _stalls(0), _resends(0),
+      _timeouts(0), _jobs(0), _uploadWaits(0) {
+  _path[0] = '\0';
+}
+
+bool PrintHost::begin() {
+  if (_commands) {
+    return true;
+  }
+  _commands = xQueueCreate(PRINT_HOST_COMMANDS, sizeof(PrintCommand));
+  if (!_commands) {
+    return false;
+  }
+  _serial.begin(PRINT_HOST_BAUD, SERIAL_8N1, PRINT_HOST_RX_PIN,
+                PRINT_HOST_TX_PIN);
+  if (xTaskCreate(readerTask, "print_reader", 4096, this, 2, &_reader) !=
+      pdPASS) {
+    return false;
+  }
+  return xTaskCreatePinnedToCore(uartTask, "print_uart", 4096, this, 3, NULL,
+                                 PRINT_HOST_CORE) == pdPASS;
+}
+
+const char *PrintHost::stateName(PrintHostState state) {
+  switch (state) {
+  case PRINT_HOST_OPERATIONAL:
+    return "Operational";
+  case PRINT_HOST_PRINTING:
+    return "Printing";
+  case PRINT_HOST_PAUSED:
+    return "Paused";
+  case PRINT_HOST_CANCELLING:
+    return "Cancelling";
+  default:
+    return "Closed";
+  }
+}
+
+bool PrintHost::start(const char *path) {
+  File file = _fs.open(path);
+  if (!file || file.isDirectory()) {
+    return false;
+  }
+  uint32_t size = file.size();
+  GcodeUnpacker::probe(file, size);
+  file.close();
+  return startJob(path, NULL, size);
+}
+
+bool PrintHost::start(const char *path,
+                      std::shared_ptr<WriterCompletion> upload) {
+  return startJob(path, upload, upload->synced());
+}
+
+String PrintHost::path() const {
+  xSemaphoreTake(_pathLock, portMAX_DELAY);
+  String path = _path;
+  xSemaphoreGive(_pathLock);
+  return path;
+}
+
+bool PrintHost::startJob(const char *path,
+                         std::shared_ptr<WriterCompletion> upload,
+                         uint32_t size) {
+  if (!_reader || strlen(path) >= sizeof(_path)) {
+    return false;
+  }
+  // the reader flag doubles as the lock between two starts
+  if (state() != PRINT_HOST_OPERATIONAL || _reading.exchange(true)) {
+    return false;
+  }
+  xSemaphoreTake(_pathLock, portMAX_DELAY);
+  strcpy(_path, path);
+  xSemaphoreGive(_pathLock);
+  _upload = upload;
+  _fileSize = size;
+  _filePos = 0;
+  _jobStarted = millis();
+  _jobEnded = false;
+  _jobStalled = true;
+  _cancel = false;
+  uint8_t expected = PRINT_HOST_OPERATIONAL;
+  if (!_state.compare_exchange_strong(expected, PRINT_HOST_PRINTING)) {
+    _upload.reset();
+    _reading = false;
+    return false;
+  }
+  xTaskNotifyGive(_reader);
+  return true;
+}
+
+void PrintHost::pause() {
+  uint8_t expected = PRINT_HOST_PRINTING;
+  _state.compare_exchange_strong(expected, PRINT_HOST_PAUSED);
+}
+
+void PrintHost::resume() {
+  uint8_t expected = PRINT_HOST_PAUSED;
+  _state.compare_exchange_strong(expected, PRINT_HOST_PRINTING);
+}
+
+void PrintHost::cancel() {
+  uint8_t expected = PRINT_HOST_PRINTING;
+  if (_state.compare_exchange_strong(expected, PRINT_HOST_CANCELLING)) {
+    _cancel = true;
+    return;
+  }
+  expected = PRINT_HOST_PAUSED;
+  if (_state.compare_exchange_strong(expected, PRINT_HOST_CANCELLING)) {
+    _cancel = true;
+  }
+}
+
+bool PrintHost::command(const char *gcode) {
+  PrintCommand command;
+  if (!_commands || strlen(gcode) > PRINT_HOST_LINE_MAX) {
+    return false;
+  }
+  strcpy(command.text, gcode);
+  return xQueueSend(_commands, &command, 0) == pdTRUE;
+}
+
+void PrintHost::readerTask(void *arg) {
+  PrintHost *host = (PrintHost *)arg;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    host->readFile();
+    host->_upload.reset();
+    host->_reading = false;
+  }
+}
+
+// waits for room in the ring, NULL once the job is cancelled
+PrintLine *PrintHost::claimLine() {
+  PrintLine *line;
+  while (!(line = _ring.claim())) {
+    if (_cancel) {
+      return NULL;
+    }
+    vTaskDelay(1);
+  }
+  return line;
+}
+
+// Waits until the upload has synced the given number of bytes past offset or
+// is done, and returns how far the file may be read
+uint32_t PrintHost::waitForUpload(uint32_t offset, uint32_t ahead) {
+  bool waited = false;
+  for (;;) {
+    // finished first, so the synced size read after it is the final one
+    bool finished = _upload->finished();
+    uint32_t synced = _upload->synced();
+    if (finished) {
+      if (_upload->ok()) {
+        _fileSize = synced;
+        return synced;
+      }
+      return offset;
+    }
+    _fileSize = synced;
+    if (synced >= offset + ahead || _cancel) {
+      return synced;
+    }
+    if (!waited) {
+      waited = true;
+      _uploadWaits++;
+    }
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+
+void PrintHost::readFile() {
+  String path = this->path();
+  File file = _fs.open(path);
+  uint8_t *buffer = (uint8_t *)malloc(PRINT_HOST_READ_BLOCK);
+  bool ok = file && buffer;
+  // an upload still coming in is never packed
+  GcodeUnpacker unpacker;
+  bool packed = ok && !_upload && unpacker.begin(file);
+  bool comment = false;
+  uint32_t offset = 0;
+  uint32_t visible = file.size();
+  PrintLine *line = NULL;
+
+  while (ok && !_cancel) {
+    size_t want = PRINT_HOST_READ_BLOCK;
+    if (_upload) {
+      // read behind the upload, never past what it has on the card
+      uint32_t synced = waitForUpload(
+          offset, offset ? PRINT_HOST_READ_BLOCK : PRINT_HOST_PREFETCH);
+      if (synced <= offset) {
+        ok = _upload->finished() && _upload->ok();
+        break;
+      }
+      if (synced > visible) {
+        // an open file only sees the size it had when it was opened
+        file.close();
+        file = _fs.open(path);
+        if (!file || !file.seek(offset)) {
+          ok = false;
+          break;
+        }
+        visible = file.size();
+      }
+      want = min(want, (size_t)(synced - offset));
+    }
+    int got = packed ? unpacker.read(file, buffer, want)
+                     : file.read(buffer, want);
+    if (got <= 0) {
+      // the end of a file, but an upload promised more
+      ok = !_upload;
+      break;
+    }
+    for (int i = 0; i < got; i++) {
+      char c = buffer[i];
+      if (c == '\n' || c == '\r') {
+        comment = false;
+        if (line) {
+          while (line->text[line->len - 1] == ' ' ||
+                 line->text[line->len - 1] == '\t') {
+            line->len--;
+          }
+          line->text[line->len] = '\0';
+          line->end = offset + i + 1;
+          _ring.commit();
+          line = NULL;
+        }
+        continue;
+      }
+      if (comment || c == ';') {
+        comment = true;
+        continue;
+      }
+      if (!line) {
+        if (c == ' ' || c == '\t') {
+          continue;
+        }
+        // lines are parsed straight into the ring
+        if (!(line = claimLine())) {
+          break;
+        }
+        line->kind = PRINT_LINE_GCODE;
+        line->len = 0;
+      }
+      if (line->len == PRINT_HOST_LINE_MAX) {
+        // the printer would reject it, better stop before it
+        ok = false;
+        line = NULL;
+        break;
+      }
+      line->text[line->len++] = c;
+    }
+    offset += got;
+  }
+  // last line without a line break
+  if (ok && line && !_cancel) {
+    line->text[line->len] = '\0';
+    line->end = offset;
+    _ring.commit();
+  }
+  free(buffer);
+  file.close();
+
+  if (!_cancel && (line = claimLine())) {
+    line->kind = ok ? PRINT_LINE_END : PRINT_LINE_FAIL;
+    line->len = 0;
+    line->end = offset;
+    _ring.commit();
+  }
+}
+
+void PrintHost::uartTask(void *arg) {
+  PrintHost *host = (PrintHost *)arg;
+  host->_rateStart = millis();
+  for (;;) {
+    host->poll();
+    vTaskDelay(1);
+  }
+}
+
+void PrintHost::poll() {
+  receive();
+
+  uint32_t now = millis();
+  if (now - _rateStart >= 1000) {
+    _lineRate = _rateLines * 1000 / (now - _rateStart);
+    _rateLines = 0;
+    _rateStart = now;
+  }
+
+  uint8_t state = _state;
+  if (state == PRINT_HOST_CLOSED) {
+    // unnumbered, the answer is all that matters
+    if (now - _lastProbe >= PRINT_HOST_PROBE_MS) {
+      _lastProbe = now;
+      _serial.print("M105\n");
+    }
+    return;
+  }
+  if (state == PRINT_HOST_OPERATIONAL) {
+    if (now - _lastRx >= PRINT_HOST_TIMEOUT_MS) {
+      _state = PRINT_HOST_CLOSED;
+      _acked = _sent = _next = 0;
+      _inflightBytes = 0;
+      return;
+    }
+    if (_acked == _next && now - _lastRx >= PRINT_HOST_PROBE_MS &&
+        now - _lastProbe >= PRINT_HOST_PROBE_MS) {
+      _lastProbe = now;
+      transmit("M105", 4, 0, false);
+    }
+  } else if (_acked < _sent && now - _lastRx >= PRINT_HOST_OK_TIMEOUT_MS) {
+    // a busy printer keeps talking, so the ok got lost on the way
+    _timeouts++;
+    _lastRx = now;
+    handleOk();
+  }
+
+  if (state == PRINT_HOST_CANCELLING && !_reading) {
+    drainJob();
+  } else if (state == PRINT_HOST_PRINTING && _jobEnded && _acked == _next) {
+    _jobs++;
+    _state = PRINT_HOST_OPERATIONAL;
+  }
+  sendLines();
+}
+
+void PrintHost::receive() {
+  while (_serial.available() > 0) {
+    int c = _serial.read();
+    if (c < 0) {
+      break;
+    }
+    if (c == '\n' || c == '\r') {
+      if (_rxLen) {
+        _rx[_rxLen] = '\0';
+        _rxLen = 0;
+        handleResponse(_rx);
+      }
+    } else if (_rxLen < sizeof(_rx) - 1) {
+      _rx[_rxLen++] = c;
+    }
+  }
+}
+
+void PrintHost::handleResponse(const char *line) {
+  bool closed = _state == PRINT_HOST_CLOSED;
+  _lastRx = millis();
+
+  if (!strncmp(line, "ok", 2)) {
+    handleOk();
+  } else if (!strncmp(line, "Resend:", 7) || !strncmp(line, "rs ", 3)) {
+    const char *number = line + strcspn(line, "0123456789");
+    if (*number) {
+      handleResend(strtoul(number, NULL, 10));
+    }
+  }
+  // the printer restarted, or answered a probe
+  if (closed || !strcmp(line, "start")) {
+    connect();
+  }
+  if (_onResponse) {
+    _onResponse(line);
+  }
+}
+
+void PrintHost::handleOk() {
+  if (_ignoreOks) {
+    _ignoreOks--;
+    return;
+  }
+  if (_acked == _sent) {
+    return;
+  }
+  PrintSentLine &line = _window[_acked % PRINT_HOST_WINDOW];
+  _inflightBytes -= line.len;
+  if (line.job) {
+    _filePos = line.end;
+  }
+  _acked++;
+}
+
+void PrintHost::handleResend(uint32_t number) {
+  // the printer answers the resend request with an ok of its own
+  _ignoreOks++;
+  if (_staleResends && number == _resendLine) {
+    _staleResends--;
+    return;
+  }
+  _resends++;
+  if (number < _acked || number >= _next) {
+    return;
+  }
+  _resendLine = number;
+  _staleResends = _sent > number + 1 ? _sent - number - 1 : 0;
+  // everything before the line asked for arrived
+  while (_acked < number) {
+    PrintSentLine &line = _window[_acked % PRINT_HOST_WINDOW];
+    if (line.job) {
+      _filePos = line.end;
+    }
+    _acked++;
+  }
+  // and everything after it was dropped
+  _sent = number;
+  _inflightBytes = 0;
+}
+
+void PrintHost::connect() {
+  uint8_t state = _state;
+  if (state == PRINT_HOST_PRINTING || state == PRINT_HOST_PAUSED) {
+    // a reset printer forgot the job
+    _cancel = true;
+    _state = PRINT_HOST_CANCELLING;
+  } else if (state == PRINT_HOST_CLOSED) {
+    _state = PRINT_HOST_OPERATIONAL;
+  }
+  _acked = _sent = _next = 0;
+  _inflightBytes = 0;
+  _ignoreOks = 0;
+  _staleResends = 0;
+  transmit("M110 N0", 7, 0, false);
+}
+
+void PrintHost::sendLines() {
+  // lines the printer asked for again go first, in order
+  while (_sent < _next) {
+    PrintSentLine &line = _window[_sent % PRINT_HOST_WINDOW];
+    if (_inflightBytes + line.len > PRINT_HOST_RX_BUFFER) {
+      return;
+    }
+    _serial.write((const uint8_t *)line.framed, line.len);
+    _inflightBytes += line.len;
+    _sent++;
+  }
+
+  PrintCommand command;
+  while (_next - _acked < PRINT_HOST_WINDOW) {
+    if (xQueuePeek(_commands, &command, 0) == pdTRUE) {
+      if (!transmit(command.text, strlen(command.text), 0, false)) {
+        return;
+      }
+      xQueueReceive(_commands, &command, 0);
+      continue;
+    }
+    if (_state != PRINT_HOST_PRINTING) {
+      return;
+    }
+    PrintLine *line = _ring.peek();
+    if (!line) {
+      // count each time the reader falls behind, not every poll
+      if (!_jobEnded && !_jobStalled) {
+        _jobStalled = true;
+        _stalls++;
+      }
+      return;
+    }
+    _jobStalled = false;
+    if (line->kind != PRINT_LINE_GCODE) {
+      _jobEnded = true;
+      if (line->kind == PRINT_LINE_FAIL) {
+        _cancel = true;
+        _state = PRINT_HOST_CANCELLING;
+      }
+      _ring.release();
+      return;
+    }
+    if (!transmit(line->text, line->len, line->end, true)) {
+      return;
+    }
+    _ring.release();
+  }
+}
+
+bool PrintHost::transmit(const char *text, uint8_t len, uint32_t end,
+                         bool job) {
+  PrintSentLine &line = _window[_next % PRINT_HOST_WINDOW];
+  int n = snprintf(line.framed, sizeof(line.framed), "N%u %.*s",
+                   (unsigned)_next, len, text);
+  uint8_t checksum = 0;
+  for (int i = 0; i < n; i++) {
+    checksum ^= line.framed[i];
+  }
+  n += snprintf(line.framed + n, sizeof(line.framed) - n, "*%u\n", checksum);
+  if (_inflightBytes + n > PRINT_HOST_RX_BUFFER) {
+    return false;
+  }
+  line.len = n;
+  line.end = end;
+  line.job = job;
+  _serial.write((const uint8_t *)line.framed, n);
+  _inflightBytes += n;
+  _next++;
+  _sent++;
+  _linesSent++;
+  _rateLines++;
+  return true;
+}
+
+void PrintHost::drainJob() {
+  // the reader is done, so the ring belongs to this task alone
+  while (_ring.peek()) {
+    _ring.release();
+  }
+  _jobEnded = true;
+  _cancel = false;
+  _state = PRINT_HOST_OPERATIONAL;
+  // leave the printer cold and its motors off
+  command("M104 S0");
+  command("M140 S0");
+  command("M107");
+  command("M84");
+}
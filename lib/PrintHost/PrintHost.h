@@ -0,0 +1,218 @@
+#pragma once
+
+#include <Arduino.h>
+#include <BufferedFileWriter.h>
+#include <FS.h>
+#include <SpscRing.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// UART wired to the printer's serial header, the MK3 RPi port runs at 115200
+#ifndef PRINT_HOST_BAUD
+#define PRINT_HOST_BAUD 115200
+#endif
+#ifndef PRINT_HOST_PORT
+#define PRINT_HOST_PORT "Serial2"
+#endif
+// the card runs in 1-bit mode, which leaves these free on the ESP32-CAM
+#ifndef PRINT_HOST_RX_PIN
+#define PRINT_HOST_RX_PIN 13
+#endif
+#ifndef PRINT_HOST_TX_PIN
+#define PRINT_HOST_TX_PIN 12
+#endif
+// core of the UART task, the WiFi stack lives on the other one
+#ifndef PRINT_HOST_CORE
+#define PRINT_HOST_CORE 1
+#endif
+// longest G-code line without its N prefix and checksum
+#ifndef PRINT_HOST_LINE_MAX
+#define PRINT_HOST_LINE_MAX 80
+#endif
+// lines read ahead of the UART, a power of two
+#ifndef PRINT_HOST_RING
+#define PRINT_HOST_RING 64
+#endif
+// numbered lines sent but not acknowledged yet, a power of two
+#ifndef PRINT_HOST_WINDOW
+#define PRINT_HOST_WINDOW 4
+#endif
+// bytes the printer can take before it acknowledges them
+#ifndef PRINT_HOST_RX_BUFFER
+#define PRINT_HOST_RX_BUFFER 127
+#endif
+// size of each read from the card
+#ifndef PRINT_HOST_READ_BLOCK
+#define PRINT_HOST_READ_BLOCK 4096
+#endif
+// bytes of an upload on the card before printing it starts
+#ifndef PRINT_HOST_PREFETCH
+#define PRINT_HOST_PREFETCH (64 * 1024)
+#endif
+// commands waiting to be sent between job lines
+#ifndef PRINT_HOST_COMMANDS
+#define PRINT_HOST_COMMANDS 8
+#endif
+// silence after which an idle printer counts as gone
+#ifndef PRINT_HOST_TIMEOUT_MS
+#define PRINT_HOST_TIMEOUT_MS 10000
+#endif
+// how often a missing printer is asked for its temperatures
+#ifndef PRINT_HOST_PROBE_MS
+#define PRINT_HOST_PROBE_MS 2000
+#endif
+// silence with lines in flight after which an ok is assumed lost
+#ifndef PRINT_HOST_OK_TIMEOUT_MS
+#define PRINT_HOST_OK_TIMEOUT_MS 5000
+#endif
+
+enum PrintHostState {
+  PRINT_HOST_CLOSED,
+  PRINT_HOST_OPERATIONAL,
+  PRINT_HOST_PRINTING,
+  PRINT_HOST_PAUSED,
+  PRINT_HOST_CANCELLING
+};
+
+enum PrintLineKind { PRINT_LINE_GCODE, PRINT_LINE_END, PRINT_LINE_FAIL };
+
+// One line handed from the card reader to the UART task
+struct PrintLine {
+  // file offset just past the line, for progress
+  uint32_t end;
+  uint8_t kind;
+  uint8_t len;
+  char text[PRINT_HOST_LINE_MAX + 1];
+};
+
+// A numbered line on its way to the printer, kept until it is acknowledged
+// in case the printer asks for it again
+struct PrintSentLine {
+  uint32_t end;
+  bool job;
+  uint8_t len;
+  // "N<number> <line>*<checksum>\n"
+  char framed[PRINT_HOST_LINE_MAX + 20];
+};
+
+typedef std::function<void(const char *line)> PrintResponseHandler;
+
+// Streams G-code from the card to the printer over a UART.
+//
+// A reader task parses the file into a lock-free ring of lines, dropping
+// comments and blank lines. The UART task, pinned to a core of its own,
+// takes lines from the ring, frames them with a line number and checksum and
+// keeps up to PRINT_HOST_WINDOW of them in flight, as long as they fit the
+// printer's receive buffer. Every "ok" frees a slot, "Resend:" rewinds to the
+// line the printer asks for. Commands queued with command() are sent
+// between job lines.
+class PrintHost {
+  using FS = fs::FS;
+
+public:
+  PrintHost(HardwareSerial &serial, FS &fs);
+
+  bool begin();
+  // false unless the printer is connected and idle, or the file is missing
+  bool start(const char *path);
+  // prints a file while a direct upload is still writing it, reading only
+  // what the upload has synced; until the upload is done the file is as long
+  // as what it has on the card
+  bool start(const char *path, std::shared_ptr<WriterCompletion> upload);
+  void pause();
+  void resume();
+  void cancel();
+  // false when too many commands are waiting
+  bool command(const char *gcode);
+  // every line the printer sends, called from the UART task
+  void onResponse(PrintResponseHandler fn) { _onResponse = fn; }
+
+  PrintHostState state() const { return (PrintHostState)_state.load(); }
+  // state as OctoPrint names it
+  const char *stateName() const { return stateName(state()); }
+  static const char *stateName(PrintHostState state);
+  // file of the current or last job
+  String path() const;
+  uint32_t fileSize() const { return _fileSize; }
+  // bytes of the file the printer has acknowledged
+  uint32_t filePos() const { return _filePos; }
+  uint32_t jobStarted() const { return _jobStarted; }
+
+  // totals since boot
+  uint32_t linesSent() const { return _linesSent; }
+  uint32_t lineRate() const { return _lineRate; }
+  // times the printer had room for lines while the reader had none ready
+  uint32_t stalls() const { return _stalls; }
+  uint32_t resends() const { return _resends; }
+  uint32_t timeouts() const { return _timeouts; }
+  uint32_t jobs() const { return _jobs; }
+  // times a print caught up with the upload it was reading behind
+  uint32_t uploadWaits() const { return _uploadWaits; }
+
+private:
+  static void readerTask(void *arg);
+  static void uartTask(void *arg);
+  bool startJob(const char *path, std::shared_ptr<WriterCompletion> upload,
+                uint32_t size);
+  void readFile();
+  void poll();
+  PrintLine *claimLine();
+  uint32_t waitForUpload(uint32_t offset, uint32_t ahead);
+  void receive();
+  void handleResponse(const char *line);
+  void handleOk();
+  void handleResend(uint32_t number);
+  void connect();
+  void sendLines();
+  bool transmit(const char *text, uint8_t len, uint32_t end, bool job);
+  void drainJob();
+
+  HardwareSerial &_serial;
+  FS &_fs;
+  TaskHandle_t _reader;
+  QueueHandle_t _commands;
+  PrintResponseHandler _onResponse;
+  SpscRing<PrintLine, PRINT_HOST_RING> _ring;
+
+  std::atomic<uint8_t> _state;
+  std::atomic<bool> _cancel;
+  std::atomic<bool> _reading;
+  // guards _path, set by a start from the web server and read by the others
+  SemaphoreHandle_t _pathLock;
+  char _path[128];
+  std::shared_ptr<WriterCompletion> _upload;
+  std::atomic<uint32_t> _fileSize;
+  std::atomic<uint32_t> _filePos;
+  uint32_t _jobStarted;
+  bool _jobEnded;
+  bool _jobStalled;
+
+  // owned by the UART task
+  PrintSentLine _window[PRINT_HOST_WINDOW];
+  // lines below _acked are acknowledged, below _sent on the wire and below
+  // _next numbered; a resend moves _sent back
+  uint32_t _acked;
+  uint32_t _sent;
+  uint32_t _next;
+  uint32_t _inflightBytes;
+  uint32_t _ignoreOks;
+  // the lines that were in flight behind a rejected one each bring another
+  // request for it, only the first one rewinds
+  uint32_t _resendLine;
+  uint32_t _staleResends;
+  char _rx[128];
+  uint8_t _rxLen;
+  uint32_t _lastRx;
+  uint32_t _lastProbe;
+  uint32_t _rateStart;
+  uint32_t _rateLines;
+
+  std::atomic<uint32_t> _linesSent;
+  std::atomic<uint32_t> _lineRate;
+  std::atomic<uint32_t> _stalls;
+  std::atomic<uint32_t> _resends;
+  std::atomic<uint32_t> _timeouts;
+  std::atomic<uint32_t> _jobs;
+  std::atomic<uint32_t> _uploadWaits;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+// Single-producer single-consumer ring of N slots (N a power of two). The
+// producer fills a slot in place between claim() and commit(), the consumer
+// reads it in place between peek() and release(), so nothing is copied and
+// neither side ever takes a lock.
+template <typename T, uint32_t N> class SpscRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+  SpscRing() : _head(0), _tail(0) {}
+
+  // producer side, NULL when full
+  T *claim() {
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) == N) {
+      return NULL;
+    }
+    return &_slots[head & (N - 1)];
+  }
+  void commit() { _head.store(_head.load() + 1, std::memory_order_release); }
+
+  // consumer side, NULL when empty
+  T *peek() {
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    if (_head.load(std::memory_order_acquire) == tail) {
+      return NULL;
+    }
+    return &_slots[tail & (N - 1)];
+  }
+  void release() { _tail.store(_tail.load() + 1, std::memory_order_release); }
+
+  uint32_t size() const { return _head.load() - _tail.load(); }
+
+private:
+  T _slots[N];
+  std::atomic<uint32_t> _head;
+  std::atomic<uint32_t> _tail;
+};
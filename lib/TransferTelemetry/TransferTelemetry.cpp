@@ -0,0 +1,72 @@
+#include "TransferTelemetry.h"
+#include <Arduino.h>
+#include <AsyncFileStreamResponse.h>
+#include <BufferedFileWriter.h>
+
+TransferTelemetry::TransferTelemetry(AsyncEventSource &events,
+                                     uint32_t interval)
+    : _events(events), _interval(interval), _lastSample(0), _lastRx(0),
+      _lastTx(0), _rxActiveMs(0), _rxActiveBytes(0), _txActiveMs(0),
+      _txActiveBytes(0) {}
+
+static String mbps(uint64_t bytes, uint32_t ms) {
+  return String(ms ? bytes / 1000.0 / ms : 0.0, 2);
+}
+
+void TransferTelemetry::loop() {
+  uint32_t now = millis();
+  uint32_t elapsed = now - _lastSample;
+  if (elapsed < _interval) {
+    return;
+  }
+  _lastSample = now;
+
+  uint32_t rx = BufferedFileWriter::received();
+  uint64_t tx = AsyncFileStreamResponse::bytesSent();
+  uint32_t rxDelta = rx - _lastRx;
+  uint32_t txDelta = tx - _lastTx;
+  _lastRx = rx;
+  _lastTx = tx;
+  if (rxDelta) {
+    _rxActiveMs += elapsed;
+    _rxActiveBytes += rxDelta;
+  }
+  if (txDelta) {
+    _txActiveMs += elapsed;
+    _txActiveBytes += txDelta;
+  }
+
+  if (!_events.count()) {
+    return;
+  }
+
+  const LatencyHistogram &latency = BufferedFileWriter::writeLatency();
+  String json;
+  json.reserve(320);
+  json += "{\"rx\":";
+  json += rx;
+  json += ",\"tx\":";
+  json += (uint32_t)tx;
+  json += ",\"rx_mbps\":" + mbps(rxDelta, elapsed);
+  json += ",\"tx_mbps\":" + mbps(txDelta, elapsed);
+  json += ",\"rx_avg_mbps\":" + mbps(_rxActiveBytes, _rxActiveMs);
+  json += ",\"tx_avg_mbps\":" + mbps(_txActiveBytes, _txActiveMs);
+  json += ",\"last_upload_mbps\":" +
+          mbps(BufferedFileWriter::lastRate(), 1000);
+  json += ",\"uploads\":";
+  json += BufferedFileWriter::openWriters();
+  json += ",\"downloads\":";
+  json += AsyncFileStreamResponse::active();
+  json += ",\"sd_write_us\":{\"le\":[";
+  for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    json += String(LatencyHistogram::bound(i)) + ",";
+  }
+  json += "null],\"count\":[";
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    json += String(latency.count(i)) + (i < LATENCY_BUCKETS - 1 ? "," : "");
+  }
+  json += "]},\"heap\":";
+  json += ESP.getFreeHeap();
+  json += "}";
+  _events.send(json.c_str(), "telemetry", now);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+#ifndef TELEMETRY_INTERVAL_MS
+#define TELEMETRY_INTERVAL_MS 1000
+#endif
+
+// Publishes upload and download progress on an EventSource as one
+// "telemetry" event per interval. It only samples counters the transfer
+// paths keep anyway, so it never adds work to a transfer, and it skips
+// formatting entirely while nobody is listening.
+class TransferTelemetry {
+public:
+  TransferTelemetry(AsyncEventSource &events,
+                    uint32_t interval = TELEMETRY_INTERVAL_MS);
+
+  // call from loop()
+  void loop();
+
+private:
+  AsyncEventSource &_events;
+  uint32_t _interval;
+  uint32_t _lastSample;
+  uint32_t _lastRx;
+  uint64_t _lastTx;
+  // time and bytes of the intervals that actually moved data
+  uint32_t _rxActiveMs;
+  uint64_t _rxActiveBytes;
+  uint32_t _txActiveMs;
+  uint64_t _txActiveBytes;
+};
@@ -1,20 +1,42 @@
 
 #include "AsyncJson.h"
 #include "SD_MMC.h"
+#include <AsyncFileStreamResponse.h>
+#include <AsyncUIHandler.h>
 #include <AsyncWebDAV.h>
+#include <BlockCache.h>
+#include <BufferedFileWriter.h>
 #include <DNSServer.h>
 #include <ESPAsyncWebServer.h>
 #include <ESPAsyncWiFiManager.h>
 #include <ESPmDNS.h>
+#include <FileCopier.h>
+#include <GcodeIndex.h>
+#include <GcodePack.h>
+#include <IoWorkers.h>
+#include <MutationQueue.h>
 #include <OctoPrintAPI.h>
+#include <PrintHost.h>
+#include <PrometheusWriter.h>
+#include <RequestMetrics.h>
+#include <TransferTelemetry.h>
 #include <WiFi.h>
+#include <esp_timer.h>
 
 #define VERSION "1.3.10"
 #define SKETCH_VERSION "2.x-localbuild"
 
 AsyncWebServer server(80);
 AsyncEventSource events("/events");
+TransferTelemetry telemetry(events);
 DNSServer dns;
+// what clients read and change goes through the PSRAM cache, prints are read
+// straight from the card
+BlockCacheFS card(SD_MMC);
+AsyncWebDAV *dav;
+AsyncUIHandler *ui;
+PrintHost printer(Serial2, SD_MMC);
+OctoPrintAPI *octoPrint;
 
 const char *hostName = "PrusaWIFI";
 
@@ -64,6 +86,124 @@ void onWiFiEvent(WiFiEvent_t event) {
   }
 }
 
+String stats() {
+  String out;
+  const DavMetaCache &cache = dav->cache();
+  out += String("dav_cache_hits=") + cache.hits() + "\n";
+  out += String("dav_cache_misses=") + cache.misses() + "\n";
+  out += String("dav_cache_entries=") + cache.size() + "\n";
+  out += String("dav_blocks_free=") + dav->blocks().available() + "\n";
+  out += String("dav_block_fallbacks=") + dav->blocks().fallbacks() + "\n";
+
+  uint64_t streamed = AsyncFileStreamResponse::bytesSent();
+  uint32_t busy = AsyncFileStreamResponse::busyMillis();
+  out += String("stream_kbytes=") + (uint32_t)(streamed / 1024) + "\n";
+  out += String("stream_mbps=") +
+         String(busy ? streamed / 1000.0 / busy : 0.0, 2) + "\n";
+  out += String("stream_stalls=") + AsyncFileStreamResponse::stalls() + "\n";
+  out += String("stream_retained=") + AsyncFileStreamResponse::retained() +
+         "\n";
+  // upload chunks left unacknowledged until the card caught up
+  out += String("upload_throttled=") + BufferedFileWriter::throttled() + "\n";
+  // G-code packed on its way to the card, before and after
+  out += String("pack_in_kbytes=") + GcodePacker::bytesIn() / 1024 + "\n";
+  out += String("pack_out_kbytes=") + GcodePacker::bytesOut() / 1024 + "\n";
+  out += String("ui_cached_bytes=") + ui->cachedBytes() + "\n";
+
+  // progress of a running server-side COPY
+  out += String("copy_active=") + (FileCopier::busy() ? 1 : 0) + "\n";
+  out += String("copy_progress_kbytes=") + FileCopier::jobCopied() / 1024 +
+         "\n";
+  out += String("copy_total_kbytes=") + FileCopier::jobTotal() / 1024 + "\n";
+  out += String("copies=") + FileCopier::copies() + "\n";
+
+  // G-code streamed to the printer
+  out += String("print_state=") + printer.stateName() + "\n";
+  out += String("print_lines=") + printer.linesSent() + "\n";
+  out += String("print_lines_per_sec=") + printer.lineRate() + "\n";
+  out += String("print_stalls=") + printer.stalls() + "\n";
+  out += String("print_resends=") + printer.resends() + "\n";
+  out += String("print_timeouts=") + printer.timeouts() + "\n";
+  out += String("print_jobs=") + printer.jobs() + "\n";
+  out += String("print_upload_waits=") + printer.uploadWaits() + "\n";
+  out += String("octo_state_rebuilds=") + octoPrint->state().rebuilds() + "\n";
+
+  // WebDAV changes waiting on and applied by the journal worker
+  out += String("mutation_queue_depth=") + MutationQueue::depth() + "\n";
+  out += String("mutation_applied=") + MutationQueue::applied() + "\n";
+  out += String("mutation_failed=") + MutationQueue::failed() + "\n";
+  out += String("mutation_batches=") + MutationQueue::batches() + "\n";
+  out += String("mutation_journal_avg_us=") +
+         MutationQueue::journalLatency().average() + "\n";
+  out += String("mutation_apply_avg_us=") +
+         MutationQueue::applyLatency().average() + "\n";
+
+  // card work of requests, waiting for and running on the I/O workers
+  for (int op = 0; op < IO_OPS; op++) {
+    String prefix = String("io_") + IoWorkers::name((IoOp)op);
+    const LatencyHistogram &queued = IoWorkers::queueTime((IoOp)op);
+    const LatencyHistogram &service = IoWorkers::serviceTime((IoOp)op);
+    out += prefix + "_queue_avg_us=" + queued.average() + "\n";
+    out += prefix + "_queue_p99_us=" + queued.percentile(99) + "\n";
+    out += prefix + "_service_avg_us=" + service.average() + "\n";
+    out += prefix + "_service_p99_us=" + service.percentile(99) + "\n";
+  }
+  out += String("io_overflows=") + IoWorkers::overflows() + "\n";
+
+  // card blocks served from PSRAM
+  const BlockCache &blocks = card.cache();
+  uint32_t lookups = blocks.hits() + blocks.misses();
+  out += String("block_cache_hits=") + blocks.hits() + "\n";
+  out += String("block_cache_misses=") + blocks.misses() + "\n";
+  out += String("block_cache_hit_pct=") +
+         (uint32_t)(lookups ? blocks.hits() * 100ULL / lookups : 0) + "\n";
+  out += String("block_cache_evictions=") + blocks.evictions() + "\n";
+  out += String("block_cache_read_aheads=") + blocks.readAheads() + "\n";
+  out += String("block_cache_blocks_used=") + blocks.used() + "\n";
+  return out;
+}
+
+// the numbers to alert on, in the Prometheus text format
+void metrics(Print &out) {
+  PrometheusWriter prom(out);
+
+  RequestMetrics::report(prom);
+
+  prom.family("http_received_bytes_total", "counter",
+              "Upload bodies written to the card.");
+  prom.sample("http_received_bytes_total", NULL,
+              (uint64_t)BufferedFileWriter::received());
+  prom.family("http_sent_bytes_total", "counter",
+              "File contents streamed to clients.");
+  prom.sample("http_sent_bytes_total", NULL,
+              AsyncFileStreamResponse::bytesSent());
+  prom.family("upload_rate_bytes_per_second", "gauge",
+              "Throughput of the last finished upload.");
+  prom.sample("upload_rate_bytes_per_second", NULL,
+              (uint64_t)BufferedFileWriter::lastRate());
+
+  prom.family("sd_read_duration_seconds", "histogram",
+              "Card reads made for clients, per read call.");
+  prom.histogram("sd_read_duration_seconds", NULL, card.cache().readLatency(),
+                 0.000001);
+  prom.family("sd_write_duration_seconds", "histogram",
+              "Card writes of upload buffers.");
+  prom.histogram("sd_write_duration_seconds", NULL,
+                 BufferedFileWriter::writeLatency(), 0.000001);
+
+  prom.family("heap_free_bytes", "gauge", "Free internal heap.");
+  prom.sample("heap_free_bytes", NULL, (uint64_t)ESP.getFreeHeap());
+  prom.family("heap_largest_free_block_bytes", "gauge",
+              "Largest block the heap can still hand out.");
+  prom.sample("heap_largest_free_block_bytes", NULL,
+              (uint64_t)ESP.getMaxAllocHeap());
+  prom.family("wifi_rssi_dbm", "gauge", "Signal strength of the access point.");
+  prom.sample("wifi_rssi_dbm", NULL, (double)WiFi.RSSI());
+  prom.family("uptime_seconds", "counter", "Time since boot.");
+  prom.sample("uptime_seconds", NULL,
+              (uint64_t)(esp_timer_get_time() / 1000000));
+}
+
 void setup() {
   Serial.begin(115200);
   WiFi.setHostname(hostName);
@@ -79,13 +219,45 @@ void setup() {
     Serial.println("No SD card attached");
     return;
   }
+  if (!card.begin()) {
+    Serial.println("No PSRAM, card reads are not cached");
+  }
+  // uploads cut off by a reset never got renamed into place
+  BufferedFileWriter::removeStale(card);
+  // finish WebDAV changes a reset cut off, before the index looks at the card
+  uint32_t replayed = MutationQueue::recover(card);
+  if (replayed) {
+    Serial.printf("Replayed %u journaled changes\n", replayed);
+  }
+  // catch up with whatever was changed with the card out of the printer
+  GcodeIndex *files = new GcodeIndex(card);
+  files->rebuild();
 
-  server.addHandler(new AsyncWebDAV("/drive", SD_MMC));
-  server.addHandler(new OctoPrintAPI(SD_MMC));
+  dav = new AsyncWebDAV("/drive", card, files);
+  server.addHandler(dav);
+  if (!printer.begin()) {
+    Serial.println("Print host failed to start");
+  }
+  octoPrint = new OctoPrintAPI(card, *files, printer);
+  octoPrint->onFileChanged([](const String &path) {
+    dav->invalidate(path);
+    ui->invalidate(path);
+  });
+  server.addHandler(octoPrint);
+  // thumbnails pulled out of uploaded G-code, named after the file's path
+  AsyncStaticWebHandler *thumbnails = new AsyncStaticWebHandler(
+      GCODE_THUMBNAIL_URL, card, GCODE_THUMBNAIL_DIR "/", "max-age=60");
+  server.addHandler(new TimedHandler(*thumbnails, REQUEST_HANDLER_STATIC));
 
-  server.serveStatic("/", SD_MMC, "/ui/")
-      .setDefaultFile("index.html")
-      .setCacheControl("max-age=600");
+  ui = new AsyncUIHandler(card, "/ui/");
+  ui->setDefaultFile("index.html").setCacheControl("max-age=600");
+  ui->cache("index.html")
+      .cache("global.css")
+      .cache("build/bundle.js")
+      .cache("build/bundle.css");
+  server.addHandler(ui);
+  // the UI can be replaced over WebDAV, the hot set follows
+  dav->onFileChanged([](const String &path) { ui->invalidate(path); });
 
   events.onConnect([](AsyncEventSourceClient *client) {
     client->send("hello!", NULL, millis(), 1000);
@@ -93,10 +265,43 @@ void setup() {
 
   server.addHandler(&events);
 
+  // registered before /heap, which would match these paths as well
+  server.on("/heap/peak", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/plain",
+                  String("propfind_last=") + dav->lastPropfindHeap() +
+                      "\npropfind_peak=" + dav->peakPropfindHeap() +
+                      "\nmin_free=" + ESP.getMinFreeHeap() + "\n");
+  });
+
+  // how broken up the free heap is: once the largest block is a small part
+  // of what is free, big allocations fail although there is memory left
+  server.on("/heap/fragmentation", HTTP_GET,
+            [](AsyncWebServerRequest *request) {
+              uint32_t free = ESP.getFreeHeap();
+              uint32_t largest = ESP.getMaxAllocHeap();
+              request->send(200, "text/plain",
+                            String("free=") + free +
+                                "\nlargest_free_block=" + largest +
+                                "\nfragmentation_pct=" +
+                                (free ? 100 - largest * 100 / free : 0) +
+                                "\n");
+            });
+
   server.on("/heap", HTTP_GET, [](AsyncWebServerRequest *request) {
     request->send(200, "text/plain", String(ESP.getFreeHeap()));
   });
 
+  server.on("/stats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", stats());
+  });
+
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response =
+        request->beginResponseStream("text/plain; version=0.0.4");
+    metrics(*response);
+    request->send(response);
+  });
+
   AsyncWiFiManager wifiManager(&server, &dns);
   // wifiManager.resetSettings(); // Uncomment this to reset the settings on
 
@@ -107,4 +312,12 @@ void setup() {
   server.begin();
 }
 
-void loop() {}
+void loop() {
+  telemetry.loop();
+  if (ui) {
+    ui->loop();
+  }
+  if (octoPrint) {
+    octoPrint->loop();
+  }
+}
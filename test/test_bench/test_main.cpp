@@ -0,0 +1,146 @@
+// What a request of each kind costs: latency percentiles, the bytes the
+// network layer had to copy, and heap allocations per request. The card is
+// given a latency per call, so the numbers include the waits the handlers
+// are meant to keep off the AsyncTCP task.
+
+#include <AsyncWebDAV.h>
+#include <BlockCache.h>
+#include <GcodeIndex.h>
+#include <MutationQueue.h>
+#include <NativeBench.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <OctoPrintAPI.h>
+#include <PrintHost.h>
+#include <TempFS.h>
+#include <unity.h>
+
+#ifndef BENCH_REQUESTS
+#define BENCH_REQUESTS 40
+#endif
+#ifndef BENCH_FILE_SIZE
+#define BENCH_FILE_SIZE (256 * 1024)
+#endif
+// an SD card in 1-bit mode takes about this long per call
+#ifndef BENCH_CARD_LATENCY_US
+#define BENCH_CARD_LATENCY_US 200
+#endif
+
+static TempFS *card;
+static BlockCacheFS *cached;
+static GcodeIndex *files;
+static AsyncWebDAV *dav;
+static PrintHost *printer;
+static OctoPrintAPI *octoPrint;
+static std::vector<AsyncWebHandler *> handlers;
+static std::string gcode;
+
+void setUp(void) { card->setLatency(BENCH_CARD_LATENCY_US); }
+
+void tearDown(void) { card->setLatency(0); }
+
+// runs one request to the end and adds it to bench
+static void measure(NativeBench &bench, NativeRequest &request,
+                    int expected) {
+  bench.begin();
+  request.begin(handlers);
+  TEST_ASSERT_TRUE(request.run());
+  bench.end(request.latencyUs(), request.client().copiedBytes(),
+            request.client().zeroCopyBytes());
+  TEST_ASSERT_EQUAL_INT(expected, request.status());
+}
+
+static String benchPath(const char *dir, int i) {
+  return String(dir) + "/file" + i + ".gcode";
+}
+
+void test_propfind(void) {
+  card->mkdir("/bench");
+  for (int i = 0; i < 50; i++) {
+    TEST_ASSERT_TRUE(card->put(benchPath("/bench", i), gcode));
+  }
+  NativeBench bench("PROPFIND");
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    NativeRequest request(HTTP_PROPFIND, "/drive/bench");
+    request.header("Depth", "1");
+    measure(bench, request, 207);
+    TEST_ASSERT_TRUE(request.responseBody().find("file49.gcode") !=
+                     std::string::npos);
+  }
+  bench.report();
+}
+
+void test_get(void) {
+  NativeBench bench("GET");
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    NativeRequest request(HTTP_GET, "/drive" + benchPath("/bench", i % 50));
+    measure(bench, request, 200);
+    TEST_ASSERT_TRUE(request.responseBody() == gcode);
+  }
+  bench.report();
+}
+
+void test_put(void) {
+  NativeBench bench("PUT");
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    NativeRequest request(HTTP_PUT, "/drive" + benchPath("", i));
+    request.body(gcode);
+    measure(bench, request, 201);
+  }
+  bench.report();
+  // the last one may still be on its way to the card
+  delay(100);
+  TEST_ASSERT_TRUE(card->get(benchPath("", BENCH_REQUESTS - 1)) == gcode);
+}
+
+void test_move(void) {
+  NativeBench bench("MOVE");
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    NativeRequest request(HTTP_MOVE, "/drive" + benchPath("", i));
+    request.header("Destination", "/drive" + benchPath("/bench", i + 100));
+    measure(bench, request, 201);
+    // one at a time, a burst would only measure the queue filling up
+    while (MutationQueue::depth()) {
+      delay(1);
+    }
+  }
+  bench.report();
+}
+
+void test_octoprint_upload(void) {
+  NativeBench bench("upload");
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    NativeRequest request(HTTP_POST, "/api/files/local");
+    request.upload("upload" + String(i) + ".gcode", gcode.size(),
+                   [](uint8_t *data, size_t len, size_t index) {
+                     memcpy(data, gcode.data() + index, len);
+                     return len;
+                   });
+    measure(bench, request, 201);
+  }
+  bench.report();
+}
+
+int main(int argc, char **argv) {
+  gcode = nativeGcode(BENCH_FILE_SIZE);
+  // put together as setup() in main.cpp does
+  card = new TempFS();
+  cached = new BlockCacheFS(*card);
+  cached->begin();
+  MutationQueue::recover(*cached);
+  files = new GcodeIndex(*cached);
+  files->rebuild();
+  dav = new AsyncWebDAV("/drive", *cached, files);
+  printer = new PrintHost(Serial2, *cached);
+  octoPrint = new OctoPrintAPI(*cached, *files, *printer);
+  octoPrint->onFileChanged([](const String &path) { dav->invalidate(path); });
+  handlers = {dav, octoPrint};
+
+  UNITY_BEGIN();
+  RUN_TEST(test_propfind);
+  RUN_TEST(test_get);
+  RUN_TEST(test_put);
+  RUN_TEST(test_move);
+  RUN_TEST(test_octoprint_upload);
+  return UNITY_END();
+}
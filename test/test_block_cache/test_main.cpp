@@ -0,0 +1,174 @@
+// BlockCacheFS over a card that counts its calls: a second read of a file
+// never reaches the card, a sequential one reads ahead, the least recently
+// used blocks are the ones evicted, and every change made through the cache
+// or around it is seen by the next read.
+
+#include <BlockCache.h>
+#include <NativeGcode.h>
+#include <TempFS.h>
+#include <unity.h>
+
+static TempFS *card;
+static BlockCacheFS *cached;
+
+void setUp(void) { card->resetStats(); }
+
+void tearDown(void) {}
+
+// reads path through the cache in chunk sized pieces
+static std::string readAll(const char *path, size_t chunk = 1024) {
+  File file = cached->open(path);
+  TEST_ASSERT_TRUE(file);
+  std::string out;
+  std::vector<uint8_t> buf(chunk);
+  size_t n;
+  while ((n = file.read(buf.data(), buf.size()))) {
+    out.append((const char *)buf.data(), n);
+  }
+  file.close();
+  return out;
+}
+
+void test_second_read_stays_off_the_card(void) {
+  std::string gcode = nativeGcode(64 * 1024);
+  card->put("/warm.gcode", gcode);
+  const BlockCache &cache = cached->cache();
+  card->resetStats();
+  TEST_ASSERT_TRUE(readAll("/warm.gcode") == gcode);
+  uint32_t cold = card->stats().reads;
+
+  card->resetStats();
+  uint32_t hits = cache.hits();
+  TEST_ASSERT_TRUE(readAll("/warm.gcode") == gcode);
+  printf("\n  64 KB: %u card reads cold, %u warm, %u cache hits\n", cold,
+         card->stats().reads, cache.hits() - hits);
+  TEST_ASSERT_EQUAL_UINT32(0, card->stats().reads);
+  TEST_ASSERT_GREATER_OR_EQUAL(64, cache.hits() - hits);
+}
+
+void test_sequential_read_reads_ahead(void) {
+  std::string gcode = nativeGcode(128 * 1024, 2);
+  card->put("/ahead.gcode", gcode);
+  const BlockCache &cache = cached->cache();
+  uint32_t readAheads = cache.readAheads();
+  card->resetStats();
+  TEST_ASSERT_TRUE(readAll("/ahead.gcode", 512) == gcode);
+  // each block once, most of them before they were asked for
+  TEST_ASSERT_EQUAL_UINT32(128 * 1024 / BLOCK_CACHE_BLOCK,
+                           card->stats().reads);
+  TEST_ASSERT_GREATER_OR_EQUAL(BLOCK_CACHE_READ_AHEAD,
+                               cache.readAheads() - readAheads);
+}
+
+void test_seek_within_cached_file(void) {
+  std::string gcode = nativeGcode(32 * 1024, 3);
+  card->put("/seek.gcode", gcode);
+  readAll("/seek.gcode");
+  card->resetStats();
+  File file = cached->open("/seek.gcode");
+  uint8_t buf[100];
+  TEST_ASSERT_TRUE(file.seek(10000));
+  TEST_ASSERT_EQUAL_UINT32(sizeof(buf), file.read(buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_MEMORY(gcode.data() + 10000, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_UINT32(10100, file.position());
+  TEST_ASSERT_FALSE(file.seek(gcode.size() + 1));
+  file.close();
+  TEST_ASSERT_EQUAL_UINT32(0, card->stats().reads);
+}
+
+void test_least_recently_used_is_evicted(void) {
+  // five files that together need more blocks than the cache has
+  const size_t size = BLOCK_CACHE_MAX_FILE - BLOCK_CACHE_BLOCK;
+  const size_t blocks = size / BLOCK_CACHE_BLOCK;
+  static_assert(5 * (size / BLOCK_CACHE_BLOCK) > BLOCK_CACHE_BLOCKS,
+                "the files have to overflow the cache");
+  std::string files[5];
+  for (int i = 0; i < 5; i++) {
+    files[i] = nativeGcode(size, 10 + i);
+    card->put(String("/lru") + i + ".gcode", files[i]);
+  }
+  const BlockCache &cache = cached->cache();
+  uint32_t evictions = cache.evictions();
+  for (int i = 0; i < 4; i++) {
+    readAll((String("/lru") + i + ".gcode").c_str(), 4096);
+  }
+  // the first one is used again, the second one is now the oldest
+  readAll("/lru0.gcode", 4096);
+  readAll("/lru4.gcode", 4096);
+  TEST_ASSERT_GREATER_THAN(evictions, cache.evictions());
+  TEST_ASSERT_LESS_OR_EQUAL(BLOCK_CACHE_BLOCKS, cache.used());
+
+  card->resetStats();
+  TEST_ASSERT_TRUE(readAll("/lru0.gcode", 4096) == files[0]);
+  TEST_ASSERT_EQUAL_UINT32(0, card->stats().reads);
+  TEST_ASSERT_TRUE(readAll("/lru1.gcode", 4096) == files[1]);
+  TEST_ASSERT_GREATER_THAN(0, card->stats().reads);
+  TEST_ASSERT_LESS_OR_EQUAL(blocks, card->stats().reads);
+}
+
+void test_large_file_bypasses_the_cache(void) {
+  std::string big = nativeGcode(BLOCK_CACHE_MAX_FILE + 1, 4);
+  card->put("/big.gcode", big);
+  size_t used = cached->cache().used();
+  TEST_ASSERT_TRUE(readAll("/big.gcode", 4096) == big);
+  TEST_ASSERT_EQUAL_UINT32(used, cached->cache().used());
+}
+
+void test_write_through_invalidates(void) {
+  card->put("/change.gcode", "G28\nG1 X10\n");
+  TEST_ASSERT_EQUAL_STRING("G28\nG1 X10\n", readAll("/change.gcode").c_str());
+
+  File file = cached->open("/change.gcode", "w");
+  file.print("G28\nG1 X20\n");
+  file.close();
+  TEST_ASSERT_EQUAL_STRING("G28\nG1 X20\n", readAll("/change.gcode").c_str());
+}
+
+// the same sizes within the same second, only the invalidation tells them
+// apart
+void test_rename_and_remove_invalidate(void) {
+  card->put("/a.gcode", "G1 X1\n");
+  card->put("/b.gcode", "G1 X2\n");
+  readAll("/a.gcode");
+  readAll("/b.gcode");
+
+  TEST_ASSERT_TRUE(cached->remove("/b.gcode"));
+  TEST_ASSERT_TRUE(cached->rename("/a.gcode", "/b.gcode"));
+  TEST_ASSERT_EQUAL_STRING("G1 X1\n", readAll("/b.gcode").c_str());
+
+  // a directory moved away takes what was cached below it along
+  cached->mkdir("/dir");
+  card->put("/dir/c.gcode", "G1 X3\n");
+  readAll("/dir/c.gcode");
+  TEST_ASSERT_TRUE(cached->rename("/dir", "/moved"));
+  cached->mkdir("/dir");
+  card->put("/dir/c.gcode", "G1 X4\n");
+  TEST_ASSERT_EQUAL_STRING("G1 X4\n", readAll("/dir/c.gcode").c_str());
+}
+
+void test_change_around_the_cache_is_noticed(void) {
+  card->put("/around.gcode", "G1 X1\n");
+  TEST_ASSERT_EQUAL_STRING("G1 X1\n", readAll("/around.gcode").c_str());
+  // straight to the card, the size gives it away
+  card->put("/around.gcode", "G1 X100\n");
+  TEST_ASSERT_EQUAL_STRING("G1 X100\n", readAll("/around.gcode").c_str());
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  cached = new BlockCacheFS(*card);
+  if (!cached->begin()) {
+    return 1;
+  }
+
+  UNITY_BEGIN();
+  RUN_TEST(test_second_read_stays_off_the_card);
+  RUN_TEST(test_sequential_read_reads_ahead);
+  RUN_TEST(test_seek_within_cached_file);
+  RUN_TEST(test_least_recently_used_is_evicted);
+  RUN_TEST(test_large_file_bypasses_the_cache);
+  RUN_TEST(test_write_through_invalidates);
+  RUN_TEST(test_rename_and_remove_invalidate);
+  RUN_TEST(test_change_around_the_cache_is_noticed);
+  return UNITY_END();
+}
@@ -0,0 +1,134 @@
+// BlockPool and the PROPFIND fragments built on it: blocks come from the
+// slab and go back to it, an empty pool falls back to the heap, and a
+// listing costs a bounded number of heap allocations per entry.
+
+#include <AsyncWebDAV.h>
+#include <BlockPool.h>
+#include <MutationQueue.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <set>
+#include <unity.h>
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_pool_hands_out_distinct_blocks(void) {
+  BlockPool pool(256, 4);
+  TEST_ASSERT_EQUAL_UINT32(4, pool.available());
+  std::set<uint8_t *> blocks;
+  for (int i = 0; i < 4; i++) {
+    uint8_t *block = pool.acquire();
+    TEST_ASSERT_NOT_NULL(block);
+    memset(block, i, pool.blockSize());
+    blocks.insert(block);
+  }
+  TEST_ASSERT_EQUAL_UINT32(4, blocks.size());
+  TEST_ASSERT_EQUAL_UINT32(0, pool.available());
+  TEST_ASSERT_EQUAL_UINT32(0, pool.fallbacks());
+  for (uint8_t *block : blocks) {
+    pool.release(block);
+  }
+  TEST_ASSERT_EQUAL_UINT32(4, pool.available());
+}
+
+void test_empty_pool_falls_back_to_the_heap(void) {
+  BlockPool pool(256, 1);
+  uint8_t *first = pool.acquire();
+  uint8_t *second = pool.acquire();
+  TEST_ASSERT_NOT_NULL(second);
+  TEST_ASSERT_TRUE(first != second);
+  TEST_ASSERT_EQUAL_UINT32(1, pool.fallbacks());
+  // a heap block is freed on release, not added to the pool
+  pool.release(second);
+  TEST_ASSERT_EQUAL_UINT32(0, pool.available());
+  pool.release(first);
+  TEST_ASSERT_EQUAL_UINT32(1, pool.available());
+}
+
+void test_fragment_spills_past_its_block(void) {
+  BlockPool pool(16, 1);
+  std::string written;
+  {
+    DavFragment fragment;
+    fragment.begin(pool);
+    TEST_ASSERT_EQUAL_UINT32(0, pool.available());
+    for (int i = 0; i < 10; i++) {
+      String part = String("<entry") + i + ">";
+      fragment.print(part);
+      written += part.c_str();
+    }
+    // read back in pieces smaller than the block
+    std::string read;
+    uint8_t buf[7];
+    size_t n;
+    while ((n = fragment.read(buf, sizeof(buf)))) {
+      read.append((const char *)buf, n);
+    }
+    TEST_ASSERT_EQUAL_STRING(written.c_str(), read.c_str());
+
+    // the block is kept for the next entry
+    fragment.clear();
+    fragment.print("<next>");
+    TEST_ASSERT_EQUAL_UINT32(6, fragment.read(buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_MEMORY("<next>", buf, 6);
+    TEST_ASSERT_EQUAL_UINT32(0, fragment.read(buf, sizeof(buf)));
+  }
+  TEST_ASSERT_EQUAL_UINT32(1, pool.available());
+  TEST_ASSERT_EQUAL_UINT32(0, pool.fallbacks());
+}
+
+// heap allocations for one Depth: 1 listing of a directory with count files
+static uint64_t propfindAllocations(const char *dir, int count) {
+  card->mkdir(dir);
+  for (int i = 0; i < count; i++) {
+    card->put(String(dir) + "/entry" + i + ".gcode", "G28\n");
+  }
+  uint64_t allocations = 0;
+  // the first listing fills the metadata cache, the second one is measured
+  for (int pass = 0; pass < 2; pass++) {
+    NativeRequest request(HTTP_PROPFIND, String("/drive") + dir);
+    request.header("Depth", "1");
+    uint64_t start = NativeHeap::allocations();
+    request.begin({dav});
+    TEST_ASSERT_TRUE(request.run());
+    allocations = NativeHeap::allocations() - start;
+    TEST_ASSERT_EQUAL_INT(207, request.status());
+    String last = String("entry") + (count - 1) + ".gcode";
+    TEST_ASSERT_TRUE(request.responseBody().find(last.c_str()) !=
+                     std::string::npos);
+  }
+  return allocations;
+}
+
+void test_propfind_allocations_per_entry(void) {
+  uint32_t fallbacks = dav->blocks().fallbacks();
+  uint64_t small = propfindAllocations("/small", 10);
+  uint64_t large = propfindAllocations("/large", 110);
+  double perEntry = (large - small) / 100.0;
+  printf("\n  PROPFIND Depth: 1, %llu allocations for 10 entries, %llu for "
+         "110, %.1f per entry\n",
+         (unsigned long long)small, (unsigned long long)large, perEntry);
+  // every listing fit its pool block and gave it back
+  TEST_ASSERT_EQUAL_UINT32(fallbacks, dav->blocks().fallbacks());
+  TEST_ASSERT_EQUAL_UINT32(DAV_FRAGMENT_BLOCKS, dav->blocks().available());
+  // the metadata cache and the fragment block leave the String temporaries
+  TEST_ASSERT_LESS_OR_EQUAL(4.0, perEntry);
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_pool_hands_out_distinct_blocks);
+  RUN_TEST(test_empty_pool_falls_back_to_the_heap);
+  RUN_TEST(test_fragment_spills_past_its_block);
+  RUN_TEST(test_propfind_allocations_per_entry);
+  return UNITY_END();
+}
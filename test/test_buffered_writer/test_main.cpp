@@ -0,0 +1,77 @@
+// BufferedFileWriter commits and aborts: a direct upload only ever writes a
+// new file, one replacing a file goes through the temp file so the old one
+// survives an abort.
+
+#include <BufferedFileWriter.h>
+#include <TempFS.h>
+#include <unity.h>
+
+static TempFS *card;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+// writes data through a new writer and waits for it to finish
+static bool upload(const char *path, const std::string &data, bool direct,
+                   bool commit, bool *wasDirect = NULL) {
+  BufferedFileWriter *writer = new BufferedFileWriter();
+  TEST_ASSERT_TRUE(writer->open(*card, path, direct, true));
+  if (wasDirect) {
+    *wasDirect = writer->direct();
+  }
+  std::shared_ptr<WriterCompletion> completion = writer->completion();
+  writer->write((const uint8_t *)data.data(), data.size());
+  if (commit) {
+    writer->close();
+  } else {
+    writer->abort();
+  }
+  TEST_ASSERT_TRUE(completion->wait(5000));
+  return completion->ok();
+}
+
+void test_direct_writes_a_new_file_in_place(void) {
+  bool direct = false;
+  TEST_ASSERT_TRUE(upload("/new.gcode", "G28\n", true, true, &direct));
+  TEST_ASSERT_TRUE(direct);
+  TEST_ASSERT_TRUE(card->get("/new.gcode") == "G28\n");
+}
+
+void test_aborted_direct_upload_leaves_nothing(void) {
+  bool direct = false;
+  TEST_ASSERT_FALSE(upload("/gone.gcode", "G28\n", true, false, &direct));
+  TEST_ASSERT_TRUE(direct);
+  TEST_ASSERT_FALSE(card->has("/gone.gcode"));
+}
+
+void test_direct_replacing_a_file_uses_a_temp_file(void) {
+  card->put("/keep.gcode", "G1 X1\n");
+  bool direct = true;
+  TEST_ASSERT_TRUE(upload("/keep.gcode", "G1 X2\nG1 X3\n", true, true,
+                          &direct));
+  TEST_ASSERT_FALSE(direct);
+  TEST_ASSERT_TRUE(card->get("/keep.gcode") == "G1 X2\nG1 X3\n");
+}
+
+void test_aborted_replacement_keeps_the_old_file(void) {
+  card->put("/old.gcode", "G1 X1\n");
+  TEST_ASSERT_FALSE(upload("/old.gcode", "G1 X2\nG1 X3\n", true, false));
+  TEST_ASSERT_TRUE(card->get("/old.gcode") == "G1 X1\n");
+  // and no temp file stays behind
+  File root = card->open("/");
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    TEST_ASSERT_FALSE(BufferedFileWriter::isTempFile(file.name()));
+  }
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_direct_writes_a_new_file_in_place);
+  RUN_TEST(test_aborted_direct_upload_leaves_nothing);
+  RUN_TEST(test_direct_replacing_a_file_uses_a_temp_file);
+  RUN_TEST(test_aborted_replacement_keeps_the_old_file);
+  return UNITY_END();
+}
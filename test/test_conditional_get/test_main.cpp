@@ -0,0 +1,187 @@
+// Conditional and partial GETs: a folder synced a second time should cost
+// little more than the response heads, and an interrupted download should
+// pick up where it stopped.
+
+#include <AsyncWebDAV.h>
+#include <MutationQueue.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <ctime>
+#include <map>
+#include <unity.h>
+
+#define SYNC_FILES 10
+#define SYNC_FILE_SIZE (200 * 1024)
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+struct Fetched {
+  int status;
+  String etag;
+  String lastModified;
+  String contentRange;
+  String contentType;
+  std::string body;
+  size_t wire;
+};
+
+static Fetched get(const String &path, const char *name = NULL,
+                   const String &value = String(), const char *name2 = NULL,
+                   const String &value2 = String()) {
+  NativeRequest request(HTTP_GET, "/drive" + path);
+  if (name) {
+    request.header(name, value);
+  }
+  if (name2) {
+    request.header(name2, value2);
+  }
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run());
+  Fetched fetched;
+  fetched.status = request.status();
+  fetched.etag = request.responseHeader("ETag");
+  fetched.lastModified = request.responseHeader("Last-Modified");
+  fetched.contentRange = request.responseHeader("Content-Range");
+  fetched.contentType = request.responseHeader("Content-Type");
+  fetched.body = request.responseBody();
+  fetched.wire = request.raw().size();
+  return fetched;
+}
+
+static String syncPath(int i) { return String("/sync/part") + i + ".gcode"; }
+
+void test_repeated_sync(void) {
+  card->mkdir("/sync");
+  for (int i = 0; i < SYNC_FILES; i++) {
+    TEST_ASSERT_TRUE(card->put(syncPath(i), nativeGcode(SYNC_FILE_SIZE, i)));
+  }
+
+  std::map<int, String> etags;
+  size_t first = 0;
+  for (int i = 0; i < SYNC_FILES; i++) {
+    Fetched fetched = get(syncPath(i));
+    TEST_ASSERT_EQUAL_INT(200, fetched.status);
+    TEST_ASSERT_TRUE(fetched.body == nativeGcode(SYNC_FILE_SIZE, i));
+    TEST_ASSERT_FALSE(fetched.etag.isEmpty());
+    etags[i] = fetched.etag;
+    first += fetched.wire;
+  }
+
+  size_t second = 0;
+  for (int i = 0; i < SYNC_FILES; i++) {
+    Fetched fetched = get(syncPath(i), "If-None-Match", etags[i]);
+    TEST_ASSERT_EQUAL_INT(304, fetched.status);
+    TEST_ASSERT_TRUE(fetched.body.empty());
+    second += fetched.wire;
+  }
+  printf("\n  first sync %u bytes, repeated sync %u bytes (%.2f%%)\n",
+         (unsigned)first, (unsigned)second, 100.0 * second / first);
+  TEST_ASSERT_LESS_THAN(first / 100, second);
+
+  // a changed file has a new ETag, the old one no longer matches
+  TEST_ASSERT_TRUE(card->put(syncPath(0), nativeGcode(1000, 99)));
+  dav->invalidate(syncPath(0));
+  Fetched changed = get(syncPath(0), "If-None-Match", etags[0]);
+  TEST_ASSERT_EQUAL_INT(200, changed.status);
+  TEST_ASSERT_TRUE(changed.body == nativeGcode(1000, 99));
+}
+
+static String httpDate(time_t time, const char *format) {
+  char out[64];
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(out, sizeof(out), format, &tm);
+  return out;
+}
+
+void test_if_modified_since(void) {
+  Fetched fetched = get(syncPath(1));
+  TEST_ASSERT_EQUAL_INT(304, get(syncPath(1), "If-Modified-Since",
+                                 fetched.lastModified)
+                                 .status);
+
+  struct tm tm = {};
+  TEST_ASSERT_NOT_NULL(strptime(fetched.lastModified.c_str(),
+                                "%a, %d %b %Y %H:%M:%S GMT", &tm));
+  time_t modified = timegm(&tm);
+  // the same time written the other two ways, and any time after it
+  const char *const notModified[] = {
+      "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y"};
+  for (const char *format : notModified) {
+    TEST_ASSERT_EQUAL_INT(304, get(syncPath(1), "If-Modified-Since",
+                                   httpDate(modified, format))
+                                   .status);
+  }
+  TEST_ASSERT_EQUAL_INT(
+      304, get(syncPath(1), "If-Modified-Since",
+               httpDate(modified + 86400, "%a, %d %b %Y %H:%M:%S GMT"))
+               .status);
+
+  // a copy older than the file, or a date that isn't one
+  TEST_ASSERT_EQUAL_INT(
+      200, get(syncPath(1), "If-Modified-Since",
+               httpDate(modified - 60, "%a, %d %b %Y %H:%M:%S GMT"))
+               .status);
+  TEST_ASSERT_EQUAL_INT(
+      200, get(syncPath(1), "If-Modified-Since", "yesterday").status);
+}
+
+void test_resume(void) {
+  std::string file = nativeGcode(SYNC_FILE_SIZE, 2);
+  Fetched full = get(syncPath(2));
+  Fetched tail = get(syncPath(2), "Range", "bytes=150000-", "If-Range",
+                     full.etag);
+  TEST_ASSERT_EQUAL_INT(206, tail.status);
+  TEST_ASSERT_TRUE(tail.body == file.substr(150000));
+  TEST_ASSERT_EQUAL_STRING(
+      (String("bytes 150000-") + (SYNC_FILE_SIZE - 1) + "/" + SYNC_FILE_SIZE)
+          .c_str(),
+      tail.contentRange.c_str());
+
+  Fetched suffix = get(syncPath(2), "Range", "bytes=-100");
+  TEST_ASSERT_EQUAL_INT(206, suffix.status);
+  TEST_ASSERT_TRUE(suffix.body == file.substr(SYNC_FILE_SIZE - 100));
+
+  // the file changed since: all of it, not a piece of the new one
+  Fetched stale = get(syncPath(2), "Range", "bytes=150000-", "If-Range",
+                      "\"0000\"");
+  TEST_ASSERT_EQUAL_INT(200, stale.status);
+  TEST_ASSERT_EQUAL_UINT32(SYNC_FILE_SIZE, stale.body.size());
+}
+
+void test_multi_range(void) {
+  std::string file = nativeGcode(SYNC_FILE_SIZE, 3);
+  Fetched parts = get(syncPath(3), "Range", "bytes=0-9,1000-1099");
+  TEST_ASSERT_EQUAL_INT(206, parts.status);
+  TEST_ASSERT_TRUE(parts.contentType.startsWith("multipart/byteranges"));
+  size_t first = parts.body.find("Content-Range: bytes 0-9/");
+  size_t second = parts.body.find("Content-Range: bytes 1000-1099/");
+  TEST_ASSERT_TRUE(first != std::string::npos);
+  TEST_ASSERT_TRUE(second != std::string::npos);
+  TEST_ASSERT_TRUE(parts.body.find(file.substr(1000, 100)) !=
+                   std::string::npos);
+  TEST_ASSERT_TRUE(parts.body.find("\r\n\r\n" + file.substr(0, 10)) !=
+                   std::string::npos);
+
+  Fetched outside = get(syncPath(3), "Range", "bytes=999999-");
+  TEST_ASSERT_EQUAL_INT(416, outside.status);
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_repeated_sync);
+  RUN_TEST(test_if_modified_since);
+  RUN_TEST(test_resume);
+  RUN_TEST(test_multi_range);
+  return UNITY_END();
+}
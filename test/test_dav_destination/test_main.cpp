@@ -0,0 +1,107 @@
+// The Destination header of MOVE and COPY: absolute URIs on this server and
+// paths below the handler's prefix are accepted and percent-decoded, anything
+// pointing elsewhere gets a 502.
+
+#include <AsyncWebDAV.h>
+#include <MutationQueue.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <unity.h>
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+
+void setUp(void) {
+  card->put("/source.gcode", "G28\n");
+  dav->invalidate("/source.gcode");
+}
+
+void tearDown(void) {}
+
+// runs method on /drive/source.gcode towards destination, and waits for
+// whatever it queued to reach the card
+static int transfer(WebRequestMethodComposite method,
+                    const String &destination) {
+  NativeRequest request(method, "/drive/source.gcode");
+  request.header("Host", "printer.local");
+  request.header("Destination", destination);
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run());
+  while (MutationQueue::depth()) {
+    delay(1);
+  }
+  // the last mutation may still be running
+  delay(20);
+  return request.status();
+}
+
+void test_move_absolute_uri(void) {
+  TEST_ASSERT_EQUAL_INT(
+      201, transfer(HTTP_MOVE, "http://printer.local/drive/moved.gcode"));
+  TEST_ASSERT_FALSE(card->has("/source.gcode"));
+  TEST_ASSERT_TRUE(card->get("/moved.gcode") == "G28\n");
+}
+
+void test_move_https_uri_with_default_port(void) {
+  TEST_ASSERT_EQUAL_INT(
+      201, transfer(HTTP_MOVE, "https://PRINTER.local:443/drive/port.gcode"));
+  TEST_ASSERT_TRUE(card->has("/port.gcode"));
+}
+
+void test_move_percent_encoded(void) {
+  TEST_ASSERT_EQUAL_INT(
+      201, transfer(HTTP_MOVE,
+                    "http://printer.local/drive/my%20part%2Bv2%c3%a9.gcode"));
+  TEST_ASSERT_TRUE(card->has("/my part+v2\xc3\xa9.gcode"));
+}
+
+void test_move_relative_path(void) {
+  TEST_ASSERT_EQUAL_INT(201, transfer(HTTP_MOVE, "/drive/relative.gcode"));
+  TEST_ASSERT_TRUE(card->has("/relative.gcode"));
+}
+
+void test_move_to_another_host(void) {
+  TEST_ASSERT_EQUAL_INT(
+      502, transfer(HTTP_MOVE, "http://elsewhere.local/drive/x.gcode"));
+  TEST_ASSERT_TRUE(card->has("/source.gcode"));
+}
+
+void test_move_outside_the_prefix(void) {
+  TEST_ASSERT_EQUAL_INT(
+      502, transfer(HTTP_MOVE, "http://printer.local/other/x.gcode"));
+  // a longer name that only starts with the prefix is outside as well
+  TEST_ASSERT_EQUAL_INT(502, transfer(HTTP_MOVE, "/drivex/x.gcode"));
+  TEST_ASSERT_EQUAL_INT(502, transfer(HTTP_MOVE, "/x.gcode"));
+  TEST_ASSERT_TRUE(card->has("/source.gcode"));
+}
+
+void test_copy_absolute_uri(void) {
+  TEST_ASSERT_EQUAL_INT(
+      201, transfer(HTTP_COPY, "http://printer.local/drive/copy%201.gcode"));
+  TEST_ASSERT_TRUE(card->get("/copy 1.gcode") == "G28\n");
+  TEST_ASSERT_TRUE(card->has("/source.gcode"));
+}
+
+void test_copy_to_another_host(void) {
+  TEST_ASSERT_EQUAL_INT(
+      502, transfer(HTTP_COPY, "http://elsewhere.local/drive/copy2.gcode"));
+  TEST_ASSERT_EQUAL_INT(502, transfer(HTTP_COPY, "/other/copy2.gcode"));
+  TEST_ASSERT_FALSE(card->has("/copy2.gcode"));
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_move_absolute_uri);
+  RUN_TEST(test_move_https_uri_with_default_port);
+  RUN_TEST(test_move_percent_encoded);
+  RUN_TEST(test_move_relative_path);
+  RUN_TEST(test_move_to_another_host);
+  RUN_TEST(test_move_outside_the_prefix);
+  RUN_TEST(test_copy_absolute_uri);
+  RUN_TEST(test_copy_to_another_host);
+  return UNITY_END();
+}
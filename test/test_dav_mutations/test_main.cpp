@@ -0,0 +1,95 @@
+// MKCOL, MOVE, DELETE and an empty PUT are answered once the mutation
+// worker applied them, so the client's very next request sees the change:
+// a folder made inside one just made, a file put where one was just
+// deleted, and a file read under the name it was just moved to.
+
+#include <AsyncWebDAV.h>
+#include <MutationQueue.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <unity.h>
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+// one request, nothing waited for in between
+static int send(WebRequestMethodComposite method, const String &path,
+                const std::string &body = "",
+                const String &destination = String()) {
+  NativeRequest request(method, "/drive" + path);
+  if (!body.empty()) {
+    request.body(body);
+  }
+  if (destination.length()) {
+    request.header("Destination", "/drive" + destination);
+  }
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run());
+  // the mutation worker polls the connection, the answer doesn't wait for
+  // the timer
+  TEST_ASSERT_EQUAL_UINT32(0, request.polls());
+  return request.status();
+}
+
+static std::string get(const String &path, int &status) {
+  NativeRequest request(HTTP_GET, "/drive" + path);
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run());
+  status = request.status();
+  return request.responseBody();
+}
+
+void test_mkcol_inside_a_new_folder(void) {
+  TEST_ASSERT_EQUAL_INT(201, send(HTTP_MKCOL, "/made"));
+  TEST_ASSERT_EQUAL_INT(201, send(HTTP_MKCOL, "/made/inside"));
+  TEST_ASSERT_EQUAL_INT(201, send(HTTP_PUT, "/made/inside/empty.gcode"));
+  TEST_ASSERT_TRUE(card->has("/made/inside/empty.gcode"));
+  // and the folder is there to be made again
+  TEST_ASSERT_EQUAL_INT(405, send(HTTP_MKCOL, "/made/inside"));
+}
+
+void test_put_after_delete(void) {
+  card->put("/part.gcode", "G28 ; old\n");
+  dav->invalidate("/part.gcode");
+  TEST_ASSERT_EQUAL_INT(200, send(HTTP_DELETE, "/part.gcode"));
+  int status;
+  get("/part.gcode", status);
+  TEST_ASSERT_EQUAL_INT(404, status);
+
+  TEST_ASSERT_EQUAL_INT(201, send(HTTP_PUT, "/part.gcode", "G28 ; new\n"));
+  TEST_ASSERT_TRUE(get("/part.gcode", status) == "G28 ; new\n");
+  // nothing queued before the PUT is left to remove it afterwards
+  while (MutationQueue::depth()) {
+    delay(1);
+  }
+  delay(20);
+  TEST_ASSERT_TRUE(card->get("/part.gcode") == "G28 ; new\n");
+}
+
+void test_get_after_move(void) {
+  card->put("/from.gcode", "G28\n");
+  dav->invalidate("/from.gcode");
+  TEST_ASSERT_EQUAL_INT(201,
+                        send(HTTP_MOVE, "/from.gcode", "", "/to.gcode"));
+  int status;
+  TEST_ASSERT_TRUE(get("/to.gcode", status) == "G28\n");
+  TEST_ASSERT_EQUAL_INT(200, status);
+  get("/from.gcode", status);
+  TEST_ASSERT_EQUAL_INT(404, status);
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_mkcol_inside_a_new_folder);
+  RUN_TEST(test_put_after_delete);
+  RUN_TEST(test_get_after_move);
+  return UNITY_END();
+}
@@ -0,0 +1,175 @@
+// GcodeIndex: lookups and changes go straight to the records they concern
+// instead of reading the whole index, folders take everything below them
+// along, a file renamed away from G-code leaves the index, and the slots
+// kept in memory agree with the file an index opened later reads.
+
+#include <GcodeIndex.h>
+#include <TempFS.h>
+#include <set>
+#include <unity.h>
+
+#define INDEX_FILES 500
+
+static TempFS *card;
+static GcodeIndex *files;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+static bool indexed(const String &path) {
+  GcodeIndexRecord record;
+  return files->lookup(path, record) && path.equals(record.path);
+}
+
+static bool add(const String &path) {
+  card->put(path, "G28\n");
+  return files->store(path, NULL);
+}
+
+// the live paths in the index file
+static std::multiset<std::string> live(GcodeIndex &index) {
+  std::multiset<std::string> paths;
+  GcodeIndexRecord records[16];
+  uint32_t pos = 0;
+  size_t n;
+  while ((n = index.read(pos, records, 16))) {
+    for (size_t i = 0; i < n; i++) {
+      if (records[i].live) {
+        paths.insert(records[i].path);
+      }
+    }
+  }
+  return paths;
+}
+
+void test_lookup_reads_one_record(void) {
+  card->mkdir("/many");
+  for (int i = 0; i < INDEX_FILES; i++) {
+    TEST_ASSERT_TRUE(add(String("/many/part") + i + ".gcode"));
+  }
+  card->resetStats();
+  uint32_t start = micros();
+  for (int i = 0; i < INDEX_FILES; i++) {
+    TEST_ASSERT_TRUE(indexed(String("/many/part") + i + ".gcode"));
+  }
+  uint32_t elapsed = micros() - start;
+  TEST_ASSERT_FALSE(indexed("/many/missing.gcode"));
+  uint64_t perLookup = card->stats().bytesRead / INDEX_FILES;
+  printf("\n  %u records, %llu bytes read and %.1f us per lookup\n",
+         INDEX_FILES, (unsigned long long)perLookup,
+         elapsed / (double)INDEX_FILES);
+  // the header and the record, not the records in front of it
+  TEST_ASSERT_LESS_OR_EQUAL(8 + sizeof(GcodeIndexRecord), perLookup);
+
+  // replacing a file writes its own slot again
+  size_t size = card->get(GCODE_INDEX_FILE).size();
+  card->resetStats();
+  TEST_ASSERT_TRUE(add("/many/part250.gcode"));
+  TEST_ASSERT_EQUAL_UINT32(size, card->get(GCODE_INDEX_FILE).size());
+  TEST_ASSERT_LESS_OR_EQUAL(4096, card->stats().bytesRead);
+}
+
+void test_remove_covers_the_folder(void) {
+  card->mkdir("/dir");
+  card->mkdir("/dir/sub");
+  card->mkdir("/dir2");
+  files->store("/dir", NULL);
+  files->store("/dir/sub", NULL);
+  TEST_ASSERT_TRUE(add("/dir/a.gcode"));
+  TEST_ASSERT_TRUE(add("/dir/sub/b.gcode"));
+  TEST_ASSERT_TRUE(add("/dir2/c.gcode"));
+  TEST_ASSERT_TRUE(add("/dir.gcode"));
+
+  files->remove("/dir");
+  TEST_ASSERT_FALSE(indexed("/dir"));
+  TEST_ASSERT_FALSE(indexed("/dir/sub"));
+  TEST_ASSERT_FALSE(indexed("/dir/a.gcode"));
+  TEST_ASSERT_FALSE(indexed("/dir/sub/b.gcode"));
+  // names that only start the same stay
+  TEST_ASSERT_TRUE(indexed("/dir2/c.gcode"));
+  TEST_ASSERT_TRUE(indexed("/dir.gcode"));
+
+  // the freed slots are used again
+  size_t size = card->get(GCODE_INDEX_FILE).size();
+  TEST_ASSERT_TRUE(add("/reuse1.gcode"));
+  TEST_ASSERT_TRUE(add("/reuse2.gcode"));
+  TEST_ASSERT_EQUAL_UINT32(size, card->get(GCODE_INDEX_FILE).size());
+}
+
+void test_move_follows_the_folder(void) {
+  card->mkdir("/from");
+  card->mkdir("/from/sub");
+  files->store("/from", NULL);
+  files->store("/from/sub", NULL);
+  TEST_ASSERT_TRUE(add("/from/sub/x.gcode"));
+  TEST_ASSERT_TRUE(card->rename("/from", "/to"));
+  files->move("/from", "/to");
+  TEST_ASSERT_FALSE(indexed("/from"));
+  TEST_ASSERT_FALSE(indexed("/from/sub/x.gcode"));
+  TEST_ASSERT_TRUE(indexed("/to"));
+  TEST_ASSERT_TRUE(indexed("/to/sub"));
+  TEST_ASSERT_TRUE(indexed("/to/sub/x.gcode"));
+}
+
+void test_move_away_from_gcode_drops_the_record(void) {
+  TEST_ASSERT_TRUE(add("/rename.gcode"));
+  TEST_ASSERT_TRUE(card->rename("/rename.gcode", "/rename.txt"));
+  files->move("/rename.gcode", "/rename.txt");
+  TEST_ASSERT_FALSE(indexed("/rename.gcode"));
+  TEST_ASSERT_FALSE(indexed("/rename.txt"));
+  TEST_ASSERT_EQUAL_UINT32(0, live(*files).count("/rename.txt"));
+}
+
+void test_copy_replaces_what_was_there(void) {
+  card->mkdir("/src");
+  files->store("/src", NULL);
+  TEST_ASSERT_TRUE(add("/src/y.gcode"));
+  card->mkdir("/dst");
+  card->put("/dst/y.gcode", "G28\n");
+  files->copy("/src", "/dst");
+  files->copy("/src", "/dst");
+  TEST_ASSERT_TRUE(indexed("/dst"));
+  TEST_ASSERT_TRUE(indexed("/dst/y.gcode"));
+  TEST_ASSERT_TRUE(indexed("/src/y.gcode"));
+  TEST_ASSERT_EQUAL_UINT32(1, live(*files).count("/dst/y.gcode"));
+}
+
+void test_slots_agree_with_the_file(void) {
+  std::multiset<std::string> paths = live(*files);
+  // no path twice
+  std::set<std::string> unique(paths.begin(), paths.end());
+  TEST_ASSERT_EQUAL_UINT32(unique.size(), paths.size());
+
+  // an index opened later finds every record from the file alone
+  GcodeIndex reopened(*card);
+  for (const std::string &path : paths) {
+    GcodeIndexRecord record;
+    TEST_ASSERT_TRUE(reopened.lookup(path.c_str(), record));
+  }
+  TEST_ASSERT_TRUE(reopened.store("/reuse1.gcode", NULL));
+  TEST_ASSERT_TRUE(live(reopened) == paths);
+
+  // and one rebuilt from the card as well
+  files->rebuild();
+  for (const std::string &path : live(*files)) {
+    TEST_ASSERT_TRUE(indexed(path.c_str()));
+  }
+  TEST_ASSERT_TRUE(indexed("/many/part0.gcode"));
+  TEST_ASSERT_TRUE(indexed("/to/sub/x.gcode"));
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  files = new GcodeIndex(*card);
+  files->rebuild();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_lookup_reads_one_record);
+  RUN_TEST(test_remove_covers_the_folder);
+  RUN_TEST(test_move_follows_the_folder);
+  RUN_TEST(test_move_away_from_gcode_drops_the_record);
+  RUN_TEST(test_copy_replaces_what_was_there);
+  RUN_TEST(test_slots_agree_with_the_file);
+  return UNITY_END();
+}
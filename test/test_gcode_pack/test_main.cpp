@@ -0,0 +1,214 @@
+// GcodePacker and GcodeUnpacker: G-code comes back as it went in, every
+// chunk but the last reaches the card as exactly one sector aligned write,
+// and a packed file is recognised by its header rather than its name, so it
+// is still served unpacked after a COPY or MOVE to another extension.
+
+#include <AsyncWebDAV.h>
+#include <GcodePack.h>
+#include <MutationQueue.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <vector>
+#include <unity.h>
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+// A file in memory that remembers the size of every write
+class MemoryFile : public fs::FileImpl {
+public:
+  std::string data;
+  std::vector<size_t> writes;
+  size_t pos = 0;
+
+  size_t write(const uint8_t *buf, size_t size) override {
+    writes.push_back(size);
+    if (data.size() < pos + size) {
+      data.resize(pos + size);
+    }
+    data.replace(pos, size, (const char *)buf, size);
+    pos += size;
+    return size;
+  }
+  size_t read(uint8_t *buf, size_t size) override {
+    size_t n = std::min(size, data.size() - pos);
+    memcpy(buf, data.data() + pos, n);
+    pos += n;
+    return n;
+  }
+  void flush() override {}
+  bool seek(uint32_t to, SeekMode mode) override {
+    if (mode != SeekSet || to > data.size()) {
+      return false;
+    }
+    pos = to;
+    return true;
+  }
+  size_t position() const override { return pos; }
+  size_t size() const override { return data.size(); }
+  void close() override {}
+  time_t getLastWrite() override { return 0; }
+  const char *name() const override { return "/memory.gcode"; }
+  boolean isDirectory(void) override { return false; }
+  fs::FileImplPtr openNextFile(const char *mode) override { return NULL; }
+  void rewindDirectory(void) override {}
+  operator bool() override { return true; }
+};
+
+// packs gcode into memory in pieces of chunk bytes
+static std::shared_ptr<MemoryFile> pack(const std::string &gcode,
+                                        size_t chunk = 1460) {
+  std::shared_ptr<MemoryFile> memory = std::make_shared<MemoryFile>();
+  File file(memory);
+  GcodePacker packer;
+  TEST_ASSERT_TRUE(packer.begin());
+  for (size_t i = 0; i < gcode.size(); i += chunk) {
+    size_t len = std::min(chunk, gcode.size() - i);
+    TEST_ASSERT_EQUAL_UINT32(
+        len, packer.write(file, (const uint8_t *)gcode.data() + i, len));
+  }
+  TEST_ASSERT_TRUE(packer.finish(file));
+  // read back from the start, as a file opened again would be
+  memory->pos = 0;
+  return memory;
+}
+
+static std::string unpack(File &file, size_t chunk = 1000) {
+  GcodeUnpacker unpacker;
+  TEST_ASSERT_TRUE(unpacker.begin(file));
+  std::string out;
+  std::vector<uint8_t> buf(chunk);
+  size_t n;
+  while ((n = unpacker.read(file, buf.data(), buf.size()))) {
+    out.append((const char *)buf.data(), n);
+  }
+  TEST_ASSERT_EQUAL_UINT32(out.size(), unpacker.size());
+  return out;
+}
+
+void test_round_trip(void) {
+  std::string gcode = nativeGcode(256 * 1024);
+  uint32_t start = micros();
+  std::shared_ptr<MemoryFile> memory = pack(gcode);
+  uint32_t packing = micros() - start;
+  File file(memory);
+  start = micros();
+  TEST_ASSERT_TRUE(unpack(file) == gcode);
+  uint32_t unpacking = micros() - start;
+  printf("\n  %.1f%% of the size, packed at %.1f MB/s, unpacked at "
+         "%.1f MB/s\n",
+         memory->data.size() * 100.0 / gcode.size(),
+         gcode.size() / (packing + 1.0), gcode.size() / (unpacking + 1.0));
+  TEST_ASSERT_LESS_THAN(gcode.size() * 3 / 4, memory->data.size());
+}
+
+void test_odd_lengths_and_full_characters(void) {
+  // characters outside the table take a byte of their own, and one that is
+  // left over at the end is padded
+  const char *samples[] = {"G", "G1", "M117 Hello\n", "; ~{}[]\n", "~",
+                           "~~~", "G1 X1 ; µ\n"};
+  for (const char *sample : samples) {
+    std::shared_ptr<MemoryFile> memory = pack(sample, 1);
+    File file(memory);
+    TEST_ASSERT_EQUAL_STRING(sample, unpack(file, 1).c_str());
+  }
+}
+
+void test_every_chunk_is_a_whole_sector(void) {
+  // full characters everywhere, so pairs keep landing on chunk boundaries
+  std::string gcode = nativeGcode(200 * 1024, 5);
+  for (size_t i = 0; i < gcode.size(); i += 7) {
+    gcode[i] = i % 2 ? '~' : '{';
+  }
+  std::shared_ptr<MemoryFile> memory = pack(gcode, 999);
+  std::vector<size_t> &writes = memory->writes;
+  // the chunks and the header written over the first one
+  TEST_ASSERT_GREATER_THAN(10, writes.size());
+  TEST_ASSERT_EQUAL_UINT32(sizeof(GcodePackHeader), writes.back());
+  for (size_t i = 0; i + 2 < writes.size(); i++) {
+    TEST_ASSERT_EQUAL_UINT32(GCODE_PACK_CHUNK, writes[i]);
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(GCODE_PACK_CHUNK, writes[writes.size() - 2]);
+  File file(memory);
+  TEST_ASSERT_TRUE(unpack(file, 4096) == gcode);
+}
+
+void test_plain_file_with_the_magic_is_not_unpacked(void) {
+  std::shared_ptr<MemoryFile> memory = pack(nativeGcode(8 * 1024));
+  uint32_t size;
+  {
+    File file(memory);
+    TEST_ASSERT_TRUE(GcodeUnpacker::probe(file, size));
+  }
+  // the same header in front of something else: the sizes disagree
+  memory->data += "G28\n";
+  File file(memory);
+  TEST_ASSERT_FALSE(GcodeUnpacker::probe(file, size));
+  TEST_ASSERT_EQUAL_UINT32(0, file.position());
+  memory->data.resize(sizeof(GcodePackHeader) + 1);
+  TEST_ASSERT_FALSE(GcodeUnpacker::probe(file, size));
+}
+
+// what a client reading path through the drive gets
+static std::string download(const String &path, String &length) {
+  NativeRequest request(HTTP_GET, "/drive" + path);
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run());
+  TEST_ASSERT_EQUAL_INT(200, request.status());
+  length = request.responseHeader("Content-Length");
+  return request.responseBody();
+}
+
+static int transfer(WebRequestMethodComposite method, const String &from,
+                    const String &to) {
+  NativeRequest request(method, "/drive" + from);
+  request.header("Destination", "/drive" + to);
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run());
+  while (MutationQueue::depth()) {
+    delay(1);
+  }
+  // the last mutation may still be running
+  delay(20);
+  return request.status();
+}
+
+// A packed file stays packed on the card under any name and is always sent
+// as the G-code that was uploaded
+void test_copy_and_move_to_another_extension(void) {
+  std::string gcode = nativeGcode(64 * 1024, 7);
+  card->put("/part.gcode", pack(gcode)->data);
+  dav->invalidate("/part.gcode");
+
+  TEST_ASSERT_EQUAL_INT(201, transfer(HTTP_COPY, "/part.gcode", "/part.txt"));
+  TEST_ASSERT_TRUE(card->get("/part.txt") == card->get("/part.gcode"));
+  TEST_ASSERT_EQUAL_INT(201, transfer(HTTP_MOVE, "/part.gcode", "/part.bin"));
+  TEST_ASSERT_FALSE(card->has("/part.gcode"));
+
+  const char *names[] = {"/part.txt", "/part.bin"};
+  for (const char *name : names) {
+    String length;
+    TEST_ASSERT_TRUE(download(name, length) == gcode);
+    TEST_ASSERT_EQUAL_STRING(String((uint32_t)gcode.size()).c_str(),
+                             length.c_str());
+  }
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_odd_lengths_and_full_characters);
+  RUN_TEST(test_every_chunk_is_a_whole_sector);
+  RUN_TEST(test_plain_file_with_the_magic_is_not_unpacked);
+  RUN_TEST(test_copy_and_move_to_another_extension);
+  return UNITY_END();
+}
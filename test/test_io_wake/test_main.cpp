@@ -0,0 +1,139 @@
+// Responses built on the I/O workers under a mixed load on a slow card: a
+// worker that is done polls the connection instead of leaving the response
+// to lwIP's next poll, half a second away, and the AsyncTCP task never waits
+// for the card, not even for a Depth: infinity PROPFIND of directories the
+// cache has never seen or for the blocks of the downloads next to it.
+
+#include <AsyncWebDAV.h>
+#include <MutationQueue.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <memory>
+#include <unity.h>
+
+// long enough that one call on the AsyncTCP task shows in its callbacks
+#ifndef WAKE_CARD_LATENCY_US
+#define WAKE_CARD_LATENCY_US 2000
+#endif
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+static std::string gcode;
+
+void setUp(void) { card->setLatency(WAKE_CARD_LATENCY_US); }
+
+void tearDown(void) { card->setLatency(0); }
+
+static String filePath(const String &dir, int i) {
+  return dir + "/part" + i + ".gcode";
+}
+
+// nothing waited for lwIP's timer and no callback waited for the card
+static void assertNeverWaited(NativeRequest &request) {
+  TEST_ASSERT_EQUAL_UINT32(0, request.polls());
+  TEST_ASSERT_LESS_THAN(WAKE_CARD_LATENCY_US, request.maxCallbackUs());
+}
+
+void test_slow_build_is_sent_at_once(void) {
+  card->setLatency(0);
+  card->mkdir("/flat");
+  for (int i = 0; i < 8; i++) {
+    card->put(filePath("/flat", i), "G28\n");
+  }
+  card->put(filePath("", 0), gcode);
+  card->setLatency(WAKE_CARD_LATENCY_US);
+
+  NativeRequest listing(HTTP_PROPFIND, "/drive/flat");
+  listing.header("Depth", "1");
+  listing.begin({dav});
+  TEST_ASSERT_TRUE(listing.run());
+  TEST_ASSERT_EQUAL_INT(207, listing.status());
+  printf("\n  PROPFIND in %.1f ms, %u wakes\n", listing.latencyUs() / 1000.0,
+         listing.wakes());
+  TEST_ASSERT_GREATER_THAN(0, listing.wakes());
+  TEST_ASSERT_LESS_THAN(NATIVE_POLL_MS * 1000 / 2, listing.latencyUs());
+  assertNeverWaited(listing);
+
+  NativeRequest download(HTTP_GET, "/drive" + filePath("", 0));
+  download.begin({dav});
+  TEST_ASSERT_TRUE(download.run());
+  TEST_ASSERT_EQUAL_INT(200, download.status());
+  TEST_ASSERT_TRUE(download.responseBody() == gcode);
+  TEST_ASSERT_LESS_THAN(NATIVE_POLL_MS * 1000 / 2, download.latencyUs());
+  assertNeverWaited(download);
+}
+
+void test_deep_listing_next_to_downloads(void) {
+  card->setLatency(0);
+  int files = 0;
+  card->mkdir("/deep");
+  for (int d = 0; d < 4; d++) {
+    String dir = String("/deep/dir") + d;
+    card->mkdir(dir);
+    for (int s = 0; s < 3; s++) {
+      String sub = dir + "/sub" + s;
+      card->mkdir(sub);
+      for (int i = 0; i < 4; i++, files++) {
+        card->put(filePath(sub, i), "G28\n");
+      }
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    card->put(filePath("", i), gcode);
+  }
+  card->setLatency(WAKE_CARD_LATENCY_US);
+
+  // nothing of the tree is cached yet, the listing reads it all
+  std::vector<std::unique_ptr<NativeRequest>> requests;
+  requests.emplace_back(new NativeRequest(HTTP_PROPFIND, "/drive/deep"));
+  requests.back()->header("Depth", "infinity");
+  for (int i = 0; i < 4; i++) {
+    requests.emplace_back(
+        new NativeRequest(HTTP_GET, "/drive" + filePath("", i)));
+  }
+  std::vector<NativeRequest *> running;
+  for (std::unique_ptr<NativeRequest> &request : requests) {
+    request->begin({dav});
+    running.push_back(request.get());
+  }
+  TEST_ASSERT_TRUE(NativeRequest::runAll(running, 30000));
+
+  NativeRequest &listing = *requests[0];
+  TEST_ASSERT_EQUAL_INT(207, listing.status());
+  std::string body = listing.responseBody();
+  TEST_ASSERT_TRUE(body.find("/deep/dir3/sub2/part3.gcode") !=
+                   std::string::npos);
+  TEST_ASSERT_TRUE(body.rfind("</d:multistatus>") == body.size() - 16);
+  int entries = 0;
+  for (size_t pos = 0; (pos = body.find("<d:response>", pos)) !=
+                       std::string::npos;
+       pos++) {
+    entries++;
+  }
+  // the folder itself, its 4 folders, their 12 and the files in those
+  TEST_ASSERT_EQUAL_INT(1 + 4 + 12 + files, entries);
+  printf("\n  PROPFIND of %d entries in %.1f ms, %u wakes\n", entries,
+         listing.latencyUs() / 1000.0, listing.wakes());
+  assertNeverWaited(listing);
+
+  for (size_t i = 1; i < requests.size(); i++) {
+    NativeRequest &download = *requests[i];
+    TEST_ASSERT_EQUAL_INT(200, download.status());
+    TEST_ASSERT_TRUE(download.responseBody() == gcode);
+    printf("  GET in %.1f ms\n", download.latencyUs() / 1000.0);
+    assertNeverWaited(download);
+  }
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+  gcode = nativeGcode(64 * 1024);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_slow_build_is_sent_at_once);
+  RUN_TEST(test_deep_listing_next_to_downloads);
+  return UNITY_END();
+}
@@ -0,0 +1,241 @@
+// OctoPrint API dispatch: every route reaches its handler, near misses and
+// paths that only share a route's hash get a 404, a file posted anywhere but
+// the upload route never reaches the card, and what a lookup costs next to
+// comparing the path against each route in turn.
+
+#include <GcodeIndex.h>
+#include <MutationQueue.h>
+#include <NativeBench.h>
+#include <NativeRequest.h>
+#include <OctoPrintAPI.h>
+#include <PrintHost.h>
+#include <TempFS.h>
+#include <algorithm>
+#include <unity.h>
+
+#ifndef ROUTE_LOOKUPS
+#define ROUTE_LOOKUPS 1000000
+#endif
+
+static TempFS *card;
+static GcodeIndex *files;
+static PrintHost *printer;
+static OctoPrintAPI *octoPrint;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+static int status(WebRequestMethodComposite method, const String &url) {
+  NativeRequest request(method, url);
+  request.begin({octoPrint});
+  TEST_ASSERT_TRUE(request.run());
+  return request.status();
+}
+
+static int upload(const String &url, const String &filename) {
+  NativeRequest request(HTTP_POST, url);
+  request.upload(filename, 4, [](uint8_t *data, size_t len, size_t index) {
+    memcpy(data, "G28\n" + index, len);
+    return len;
+  });
+  request.begin({octoPrint});
+  TEST_ASSERT_TRUE(request.run());
+  return request.status();
+}
+
+// The FNV-1a step undone: the hash before c, given the one after it
+static uint32_t unFnv(uint32_t hash, uint8_t c) {
+  uint32_t inverse = OCTO_FNV_PRIME;
+  for (int i = 0; i < 5; i++) {
+    inverse *= 2 - OCTO_FNV_PRIME * inverse;
+  }
+  return (hash * inverse) ^ c;
+}
+
+static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+#define ALPHABET (sizeof(alphabet) - 1)
+#define HALF (ALPHABET * ALPHABET * ALPHABET * ALPHABET)
+
+static void halfName(size_t i, char *out) {
+  for (int c = 0; c < 4; c++, i /= ALPHABET) {
+    out[c] = alphabet[i % ALPHABET];
+  }
+}
+
+// Eight characters that take the hash of prefix to target once suffix
+// follows them, met in the middle: four forward from the prefix, four back
+// from the target
+static String collide(uint32_t prefix, uint32_t target, const char *suffix) {
+  std::vector<std::pair<uint32_t, uint32_t>> forward(HALF);
+  char name[9] = {0};
+  for (size_t i = 0; i < HALF; i++) {
+    halfName(i, name);
+    uint32_t hash = prefix;
+    for (int c = 0; c < 4; c++) {
+      hash = octoFnv(hash, (uint8_t)name[c]);
+    }
+    forward[i] = std::make_pair(hash, (uint32_t)i);
+  }
+  std::sort(forward.begin(), forward.end());
+
+  for (int c = strlen(suffix) - 1; c >= 0; c--) {
+    target = unFnv(target, suffix[c]);
+  }
+  for (size_t i = 0; i < HALF; i++) {
+    halfName(i, name + 4);
+    uint32_t hash = target;
+    for (int c = 7; c >= 4; c--) {
+      hash = unFnv(hash, name[c]);
+    }
+    auto it = std::lower_bound(forward.begin(), forward.end(),
+                               std::make_pair(hash, (uint32_t)0));
+    if (it != forward.end() && it->first == hash) {
+      halfName(it->second, name);
+      return name;
+    }
+  }
+  return String();
+}
+
+void test_routes_reach_their_handlers(void) {
+  TEST_ASSERT_EQUAL_INT(200, status(HTTP_GET, "/api/version"));
+  TEST_ASSERT_EQUAL_INT(200, status(HTTP_GET, "/api/connection"));
+  // the main loop samples the printer for these two
+  octoPrint->loop();
+  TEST_ASSERT_EQUAL_INT(200, status(HTTP_GET, "/api/job"));
+  // as OctoPrint answers while no printer is connected
+  TEST_ASSERT_EQUAL_INT(409, status(HTTP_GET, "/api/printer"));
+  TEST_ASSERT_EQUAL_INT(200, status(HTTP_GET, "/api/files"));
+  TEST_ASSERT_EQUAL_INT(200, status(HTTP_GET, "/api/files/local"));
+  card->put("/part.gcode", "G28\n");
+  TEST_ASSERT_EQUAL_INT(200, status(HTTP_GET, "/api/files/local/part.gcode"));
+}
+
+void test_near_misses_are_not_found(void) {
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_POST, "/api/version"));
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_GET, "/api/versions"));
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_GET, "/api/version/"));
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_GET, "/api/file"));
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_GET, "/api/files/localx/sub"));
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_DELETE, "/api/files/local/sub"));
+}
+
+void test_stray_upload_is_not_written(void) {
+  TEST_ASSERT_EQUAL_INT(404, upload("/api/version", "stray.gcode"));
+  TEST_ASSERT_EQUAL_INT(404, upload("/api/files/local/sub", "stray.gcode"));
+  TEST_ASSERT_FALSE(card->has("/stray.gcode"));
+  TEST_ASSERT_EQUAL_INT(201, upload("/api/files/local", "posted.gcode"));
+  TEST_ASSERT_TRUE(card->get("/posted.gcode") == "G28\n");
+}
+
+void test_colliding_path_is_not_found(void) {
+  String mid = collide(octoFnv(octoMethod(HTTP_GET), "/api/"),
+                       octoRoute(HTTP_GET, "/api/version"), "");
+  TEST_ASSERT_FALSE(mid.isEmpty());
+  String url = "/api/" + mid;
+  OctoPath path(HTTP_GET, url.c_str());
+  TEST_ASSERT_EQUAL_UINT32(octoRoute(HTTP_GET, "/api/version"), path.key());
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_GET, url));
+}
+
+void test_colliding_wildcard_is_not_found(void) {
+  String mid = collide(octoFnv(octoMethod(HTTP_GET), "/api/"),
+                       octoRoute(HTTP_GET, "/api/files/local/*"), "/*");
+  TEST_ASSERT_FALSE(mid.isEmpty());
+  String url = "/api/" + mid + "/sub";
+  OctoPath path(HTTP_GET, url.c_str());
+  TEST_ASSERT_EQUAL_UINT32(octoRoute(HTTP_GET, "/api/files/local/*"),
+                           path.wildcardKey(path.wildcards() - 1));
+  TEST_ASSERT_EQUAL_INT(404, status(HTTP_GET, url));
+}
+
+static const char *const routes[] = {
+    "/api/version", "/api/files/local", "/api/connection",
+    "/api/job",     "/api/printer",     "/api/files",
+};
+
+void test_lookup_cost(void) {
+  const char *paths[] = {"/api/version", "/api/printer",
+                         "/api/files/local/sub/part.gcode", "/api/unknown"};
+  uint32_t found = 0;
+  uint32_t start = micros();
+  for (int i = 0; i < ROUTE_LOOKUPS; i++) {
+    OctoPath path(HTTP_GET, paths[i & 3]);
+    const char *param = NULL;
+    uint32_t key = path.key();
+    for (int w = path.wildcards(); key; w--) {
+      switch (key) {
+      case octoRoute(HTTP_GET, "/api/version"):
+        found += path.matches(HTTP_GET, "/api/version", param);
+        key = 0;
+        continue;
+      case octoRoute(HTTP_GET, "/api/printer"):
+        found += path.matches(HTTP_GET, "/api/printer", param);
+        key = 0;
+        continue;
+      case octoRoute(HTTP_GET, "/api/files/local/*"):
+        found += path.matches(HTTP_GET, "/api/files/local/*", param);
+        key = 0;
+        continue;
+      }
+      key = w ? path.wildcardKey(w - 1) : 0;
+      param = w ? path.param(w - 1) : NULL;
+    }
+  }
+  uint32_t hashed = micros() - start;
+
+  // what it replaced: the url compared with every route
+  String urls[4];
+  for (int i = 0; i < 4; i++) {
+    urls[i] = paths[i];
+  }
+  uint32_t compared = 0;
+  start = micros();
+  for (int i = 0; i < ROUTE_LOOKUPS; i++) {
+    const String &url = urls[i & 3];
+    for (const char *route : routes) {
+      if (url.equals(route)) {
+        compared++;
+        break;
+      }
+    }
+    if (url.startsWith("/api/files/local/")) {
+      compared++;
+    }
+  }
+  uint32_t linear = micros() - start;
+  printf("\n  %.1f ns per lookup hashed, %.1f ns compared in turn\n",
+         hashed * 1000.0 / ROUTE_LOOKUPS, linear * 1000.0 / ROUTE_LOOKUPS);
+  TEST_ASSERT_EQUAL_UINT32(ROUTE_LOOKUPS / 4 * 3, found);
+  TEST_ASSERT_EQUAL_UINT32(found, compared);
+
+  NativeBench bench("version");
+  for (int i = 0; i < 200; i++) {
+    NativeRequest request(HTTP_GET, "/api/version");
+    bench.begin();
+    request.begin({octoPrint});
+    TEST_ASSERT_TRUE(request.run());
+    bench.end(request.latencyUs(), request.client().copiedBytes(),
+              request.client().zeroCopyBytes());
+  }
+  bench.report();
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  files = new GcodeIndex(*card);
+  files->rebuild();
+  printer = new PrintHost(Serial2, *card);
+  octoPrint = new OctoPrintAPI(*card, *files, *printer);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_routes_reach_their_handlers);
+  RUN_TEST(test_near_misses_are_not_found);
+  RUN_TEST(test_stray_upload_is_not_written);
+  RUN_TEST(test_colliding_path_is_not_found);
+  RUN_TEST(test_colliding_wildcard_is_not_found);
+  RUN_TEST(test_lookup_cost);
+  return UNITY_END();
+}
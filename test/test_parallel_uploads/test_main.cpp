@@ -0,0 +1,110 @@
+// Simultaneous OctoPrint uploads, interleaved segment by segment on one
+// AsyncTCP task. Every file must arrive intact under its own name, and
+// every response must name its own file. Uploads the pool has no buffers
+// for are turned away with a 503 and leave nothing behind.
+
+#include <BufferedFileWriter.h>
+#include <GcodeIndex.h>
+#include <MutationQueue.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <OctoPrintAPI.h>
+#include <PrintHost.h>
+#include <TempFS.h>
+#include <memory>
+#include <unity.h>
+
+#ifndef PARALLEL_UPLOADS
+#define PARALLEL_UPLOADS 6
+#endif
+#define PARALLEL_SIZE (1024 * 1024)
+
+static TempFS *card;
+static GcodeIndex *files;
+static PrintHost *printer;
+static OctoPrintAPI *octoPrint;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+static void uploadAll(int count, uint32_t latencyUs) {
+  std::vector<std::shared_ptr<std::string>> bodies;
+  std::vector<NativeRequest *> requests;
+  for (int i = 0; i < count; i++) {
+    std::shared_ptr<std::string> body =
+        std::make_shared<std::string>(nativeGcode(PARALLEL_SIZE, i + 1));
+    bodies.push_back(body);
+    NativeRequest *request = new NativeRequest(HTTP_POST, "/api/files/local");
+    request->upload("part" + String(i) + ".gcode", body->size(),
+                    [body](uint8_t *data, size_t len, size_t index) {
+                      memcpy(data, body->data() + index, len);
+                      return len;
+                    });
+    requests.push_back(request);
+  }
+
+  card->setLatency(latencyUs);
+  uint32_t start = micros();
+  for (NativeRequest *request : requests) {
+    request->begin({octoPrint});
+  }
+  TEST_ASSERT_TRUE(NativeRequest::runAll(requests, 60000));
+  uint32_t us = micros() - start;
+  card->setLatency(0);
+
+  int accepted = 0;
+  for (int i = 0; i < count; i++) {
+    String name = "part" + String(i) + ".gcode";
+    if (requests[i]->status() == 503) {
+      TEST_ASSERT_FALSE(card->has("/" + name));
+      delete requests[i];
+      continue;
+    }
+    accepted++;
+    TEST_ASSERT_EQUAL_INT(201, requests[i]->status());
+    std::string response = requests[i]->responseBody();
+    TEST_ASSERT_TRUE_MESSAGE(response.find("\"name\":\"" +
+                                           std::string(name.c_str()) +
+                                           "\"") != std::string::npos,
+                             response.c_str());
+    TEST_ASSERT_TRUE_MESSAGE(card->get("/" + name) == *bodies[i],
+                             name.c_str());
+    delete requests[i];
+  }
+  printf("\n  %d uploads of %u KB at once, %d accepted: %.2f MB/s in all\n",
+         count, PARALLEL_SIZE >> 10, accepted,
+         accepted * (double)PARALLEL_SIZE / us);
+  // an upload needs two buffers
+  TEST_ASSERT_EQUAL_INT(min(count, BUFFERED_WRITER_POOL_BLOCKS / 2),
+                        accepted);
+  // the writers hand their buffers back once they are closed
+  for (int i = 0; i < 100 && BufferedFileWriter::freeBuffers() <
+                                 BUFFERED_WRITER_POOL_BLOCKS;
+       i++) {
+    delay(10);
+  }
+  TEST_ASSERT_EQUAL_UINT32(BUFFERED_WRITER_POOL_BLOCKS,
+                           BufferedFileWriter::freeBuffers());
+}
+
+void test_two_uploads(void) { uploadAll(2, 0); }
+
+void test_more_uploads_than_buffers(void) {
+  // more writers than pool buffers: the late ones are turned away, nobody
+  // mixes
+  uploadAll(PARALLEL_UPLOADS, 100);
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  files = new GcodeIndex(*card);
+  printer = new PrintHost(Serial2, *card);
+  octoPrint = new OctoPrintAPI(*card, *files, *printer);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_two_uploads);
+  RUN_TEST(test_more_uploads_than_buffers);
+  return UNITY_END();
+}
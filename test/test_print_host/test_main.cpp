@@ -0,0 +1,294 @@
+// PrintHost against an emulated printer on the far end of Serial2. The
+// printer takes bytes at the speed of a 115200 baud wire, checks line
+// numbers and checksums the way Marlin does, and answers each command with
+// "ok" once its planner has room for it. Reports lines per second, the
+// times the card reader fell behind and the times the planner ran dry.
+
+#include <NativeGcode.h>
+#include <PrintHost.h>
+#include <TempFS.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unity.h>
+
+// 8N1, ten bits on the wire per byte
+#define WIRE_BYTE_NS (10 * 1000000000LL / PRINT_HOST_BAUD)
+// Marlin's BLOCK_BUFFER_SIZE
+#define PLANNER_BLOCKS 16
+
+typedef std::chrono::steady_clock Clock;
+
+static TempFS *card;
+static PrintHost *host;
+static std::thread printer;
+static std::atomic<bool> running;
+
+// set by the test, read by the printer
+static std::atomic<uint32_t> moveUs;
+static std::atomic<int32_t> rejectLine;
+static std::atomic<bool> fresh;
+
+// kept by the printer
+static std::mutex lock;
+static std::vector<std::string> received;
+static std::atomic<uint32_t> errors;
+static std::atomic<uint32_t> starved;
+static std::atomic<uint32_t> maxBuffered;
+static std::atomic<uint32_t> wireBytes;
+
+static void reply(const char *text) {
+  Serial2.remoteWrite((const uint8_t *)text, strlen(text));
+}
+
+static bool isMove(const std::string &command) {
+  return command.size() > 2 && command[0] == 'G' &&
+         strchr("0123", command[1]) && command[2] == ' ';
+}
+
+// a move goes into the planner, waiting for the oldest one to finish when
+// it is full; an empty planner mid-job means the host did not keep up
+static void plan(std::deque<Clock::time_point> &planner, bool &moved) {
+  uint32_t us = moveUs;
+  if (!us) {
+    return;
+  }
+  Clock::time_point now = Clock::now();
+  while (!planner.empty() && planner.front() <= now) {
+    planner.pop_front();
+  }
+  if (planner.empty() && moved) {
+    starved++;
+  }
+  if (planner.size() == PLANNER_BLOCKS) {
+    std::this_thread::sleep_until(planner.front());
+    planner.pop_front();
+  }
+  Clock::time_point start = planner.empty() ? Clock::now() : planner.back();
+  planner.push_back(start + std::chrono::microseconds(us));
+  moved = true;
+}
+
+static void printerTask() {
+  std::deque<Clock::time_point> planner;
+  bool moved = false;
+  uint32_t last = 0;
+  std::string line;
+  uint32_t buffered = 0;
+  Clock::time_point wire = Clock::now();
+  uint8_t buf[256];
+  char text[128];
+
+  while (running) {
+    size_t n = Serial2.remoteRead(buf, sizeof(buf), 5);
+    if (fresh.exchange(false)) {
+      planner.clear();
+      moved = false;
+    }
+    wire = max(wire, Clock::now());
+    buffered += n;
+    wireBytes += n;
+    maxBuffered = max((uint32_t)maxBuffered, buffered);
+    for (size_t i = 0; i < n; i++) {
+      wire += std::chrono::nanoseconds(WIRE_BYTE_NS);
+      if (buf[i] != '\n') {
+        line += (char)buf[i];
+        continue;
+      }
+      // the whole line has to be on the wire before the printer sees it
+      std::this_thread::sleep_until(wire);
+      buffered -= line.size() + 1;
+      std::string command = line;
+      line.clear();
+
+      if (command[0] == 'N') {
+        size_t star = command.rfind('*');
+        size_t space = command.find(' ');
+        uint8_t checksum = 0;
+        for (size_t c = 0; c < star && star != std::string::npos; c++) {
+          checksum ^= command[c];
+        }
+        uint32_t number = strtoul(command.c_str() + 1, NULL, 10);
+        bool valid = star != std::string::npos && space < star &&
+                     checksum == atoi(command.c_str() + star + 1);
+        command = command.substr(space + 1, star - space - 1);
+        if (command.compare(0, 4, "M110") == 0) {
+          const char *arg = strchr(command.c_str(), 'N');
+          last = arg ? strtoul(arg + 1, NULL, 10) : number;
+          reply("ok\n");
+          continue;
+        }
+        if (rejectLine == (int32_t)number) {
+          rejectLine = -1;
+          valid = false;
+        }
+        if (!valid || number != last + 1) {
+          errors++;
+          snprintf(text, sizeof(text),
+                   "Error:Line Number is not Last Line Number+1, Last "
+                   "Line: %u\nResend: %u\nok\n",
+                   last, last + 1);
+          reply(text);
+          continue;
+        }
+        last = number;
+      }
+
+      if (command.compare(0, 4, "M105") == 0) {
+        reply("ok T:215.0 /215.0 B:60.0 /60.0 T0:215.0 /215.0 @:0 B@:0\n");
+        continue;
+      }
+      if (isMove(command)) {
+        plan(planner, moved);
+      }
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        received.push_back(command);
+      }
+      reply("ok\n");
+    }
+  }
+}
+
+// the commands the host should send for a file, as its reader parses it,
+// and the offset just past the last one
+static std::vector<std::string> commands(const std::string &gcode,
+                                         uint32_t &last) {
+  std::vector<std::string> out;
+  size_t pos = 0;
+  while (pos < gcode.size()) {
+    size_t end = gcode.find('\n', pos);
+    end = end == std::string::npos ? gcode.size() : end;
+    std::string line = gcode.substr(pos, end - pos);
+    pos = end + 1;
+    line = line.substr(0, line.find(';'));
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t") + 1);
+    if (!line.empty()) {
+      out.push_back(line);
+      last = min(pos, gcode.size());
+    }
+  }
+  return out;
+}
+
+// short moves, the way an arc comes out of a slicer without arc fitting
+static std::string denseArc(size_t segments) {
+  std::string out = "G90\nM83\nG1 X125 Y105 F3000\n";
+  char line[64];
+  for (size_t i = 0; i < segments; i++) {
+    double a = i * 0.02;
+    snprintf(line, sizeof(line), "G1 X%.3f Y%.3f E0.00451\n",
+             105 + 20 * cos(a), 105 + 20 * sin(a));
+    out += line;
+  }
+  return out;
+}
+
+struct PrintResult {
+  uint32_t us;
+  uint32_t stalls;
+  uint32_t resends;
+};
+
+// prints gcode from the card and checks the printer got every command once,
+// in order
+static PrintResult print(const char *path, const std::string &gcode) {
+  TEST_ASSERT_TRUE(card->put(path, gcode));
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    received.clear();
+  }
+  errors = 0;
+  starved = 0;
+  maxBuffered = 0;
+  wireBytes = 0;
+  fresh = true;
+  uint32_t jobs = host->jobs();
+  uint32_t stalls = host->stalls();
+  uint32_t resends = host->resends();
+
+  uint32_t start = micros();
+  TEST_ASSERT_TRUE(host->start(path));
+  while (host->jobs() == jobs && micros() - start < 60000000) {
+    delay(5);
+  }
+  PrintResult result = {(uint32_t)(micros() - start),
+                        host->stalls() - stalls, host->resends() - resends};
+  TEST_ASSERT_EQUAL_UINT32(jobs + 1, host->jobs());
+  TEST_ASSERT_EQUAL_INT(PRINT_HOST_OPERATIONAL, host->state());
+
+  uint32_t last = 0;
+  std::vector<std::string> expected = commands(gcode, last);
+  TEST_ASSERT_EQUAL_UINT32(last, host->filePos());
+  std::lock_guard<std::mutex> guard(lock);
+  TEST_ASSERT_EQUAL_UINT32(expected.size(), received.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    TEST_ASSERT_EQUAL_STRING(expected[i].c_str(), received[i].c_str());
+  }
+  double seconds = result.us / 1e6;
+  printf("\n  %u lines in %.2f s, %.0f lines/s with the wire busy %.0f%% "
+         "of the time; %u reader stalls, %u resends, %u planner underruns\n",
+         (unsigned)expected.size(), seconds, expected.size() / seconds,
+         wireBytes * (double)WIRE_BYTE_NS / 1e3 / result.us * 100,
+         result.stalls, result.resends, (unsigned)starved);
+  return result;
+}
+
+void setUp(void) {
+  moveUs = 0;
+  rejectLine = -1;
+}
+
+void tearDown(void) {}
+
+void test_connects(void) {
+  uint32_t start = millis();
+  while (host->state() == PRINT_HOST_CLOSED && millis() - start < 5000) {
+    delay(5);
+  }
+  TEST_ASSERT_EQUAL_INT(PRINT_HOST_OPERATIONAL, host->state());
+}
+
+void test_lines_per_second(void) {
+  PrintResult result = print("/fast.gcode", nativeGcode(64 * 1024));
+  TEST_ASSERT_EQUAL_UINT32(0, result.resends);
+  TEST_ASSERT_EQUAL_UINT32(0, (uint32_t)errors);
+  // never more than the printer's receive buffer on the wire
+  TEST_ASSERT_LESS_OR_EQUAL(PRINT_HOST_RX_BUFFER, (uint32_t)maxBuffered);
+}
+
+void test_dense_arc_keeps_planner_fed(void) {
+  // 0.4 mm segments at 80 mm/s, slower than the wire carries them
+  moveUs = 5000;
+  print("/arc.gcode", denseArc(1000));
+  TEST_ASSERT_EQUAL_UINT32(0, (uint32_t)starved);
+}
+
+void test_resend(void) {
+  // line numbers carry on from the jobs before
+  rejectLine = host->linesSent() + 200;
+  PrintResult result = print("/resend.gcode", nativeGcode(32 * 1024, 2));
+  TEST_ASSERT_GREATER_OR_EQUAL(1, result.resends);
+  TEST_ASSERT_GREATER_OR_EQUAL(1, (uint32_t)errors);
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  host = new PrintHost(Serial2, *card);
+  running = true;
+  printer = std::thread(printerTask);
+  host->begin();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_connects);
+  RUN_TEST(test_lines_per_second);
+  RUN_TEST(test_dense_arc_keeps_planner_fed);
+  RUN_TEST(test_resend);
+  int failures = UNITY_END();
+  running = false;
+  printer.join();
+  return failures;
+}
@@ -0,0 +1,96 @@
+// A 50 MB PUT through AsyncWebDAV into a card that takes a while per call.
+// The write-behind pipeline should turn ~36000 body segments into a few
+// thousand large writes, with the file opened once.
+
+#include <AsyncWebDAV.h>
+#include <BufferedFileWriter.h>
+#include <MutationQueue.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <unity.h>
+
+#ifndef PUT_SIZE
+#define PUT_SIZE (50 * 1024 * 1024)
+#endif
+#ifndef PUT_CARD_LATENCY_US
+#define PUT_CARD_LATENCY_US 200
+#endif
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+
+void setUp(void) { card->resetStats(); }
+
+void tearDown(void) {}
+
+// the same bytes for the body and for checking the file
+static uint8_t pattern(size_t offset) { return (offset * 31 + offset / 4096); }
+
+static NativeBodySource patternBody() {
+  return [](uint8_t *data, size_t len, size_t index) {
+    for (size_t i = 0; i < len; i++) {
+      data[i] = pattern(index + i);
+    }
+    return len;
+  };
+}
+
+void test_put_50mb(void) {
+  card->setLatency(PUT_CARD_LATENCY_US);
+  NativeRequest request(HTTP_PUT, "/drive/big.gcode");
+  request.body(PUT_SIZE, patternBody());
+  uint32_t start = micros();
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run(120000));
+  uint32_t us = micros() - start;
+  card->setLatency(0);
+  TEST_ASSERT_EQUAL_INT(201, request.status());
+
+  TempFSStats stats = card->stats();
+  uint32_t segments = (PUT_SIZE + NATIVE_SEGMENT - 1) / NATIVE_SEGMENT;
+  printf("\n  %u MB in %.2f s, %.2f MB/s; %u segments became %u writes, "
+         "%u opens, %u syncs, %u card calls in all\n",
+         PUT_SIZE >> 20, us / 1e6, PUT_SIZE / (double)us, segments,
+         stats.writes, stats.opens, stats.syncs, stats.calls());
+  printf("  slowest callback on the AsyncTCP task: %.2f ms\n",
+         request.maxCallbackUs() / 1000.0);
+
+  TEST_ASSERT_EQUAL_UINT64(PUT_SIZE, stats.bytesWritten);
+  // whole buffers, not segments
+  TEST_ASSERT_LESS_OR_EQUAL(PUT_SIZE / BUFFERED_WRITER_BLOCK_SIZE + 2,
+                            stats.writes);
+  TEST_ASSERT_LESS_OR_EQUAL(4, stats.opens);
+
+  std::string file = card->get("/big.gcode");
+  TEST_ASSERT_EQUAL_UINT64(PUT_SIZE, file.size());
+  for (size_t i = 0; i < file.size(); i++) {
+    if ((uint8_t)file[i] != pattern(i)) {
+      TEST_FAIL_MESSAGE("file differs from the body");
+    }
+  }
+}
+
+void test_put_disconnect(void) {
+  // a client that goes away halfway leaves no file and no temp file behind
+  NativeRequest request(HTTP_PUT, "/drive/dropped.gcode");
+  request.body(1024 * 1024, patternBody());
+  request.begin({dav});
+  for (int i = 0; i < 300; i++) {
+    request.step();
+  }
+  request.disconnect(true);
+  delay(200);
+  TEST_ASSERT_FALSE(card->has("/dropped.gcode"));
+  TEST_ASSERT_FALSE(card->has("/.dropped.gcode.part"));
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_put_50mb);
+  RUN_TEST(test_put_disconnect);
+  return UNITY_END();
+}
@@ -0,0 +1,185 @@
+// RequestMetrics and its Prometheus export: every request is counted once
+// however many times its handlers track it, tracking allocates nothing,
+// requests beyond the slots are counted as untracked, and the text export
+// is well formed with cumulative buckets that add up to the count.
+
+#include <AsyncUIHandler.h>
+#include <AsyncWebDAV.h>
+#include <MutationQueue.h>
+#include <NativeRequest.h>
+#include <PrometheusWriter.h>
+#include <RequestMetrics.h>
+#include <TempFS.h>
+#include <map>
+#include <sstream>
+#include <unity.h>
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+static AsyncUIHandler *ui;
+static TimedHandler *timedUi;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+// takes every request and never answers, the client has to go away
+class HoldHandler : public AsyncWebHandler {
+public:
+  bool canHandle(AsyncWebServerRequest *request) override { return true; }
+  void handleRequest(AsyncWebServerRequest *request) override {
+    RequestMetrics::track(request, REQUEST_HANDLER_OCTOPRINT);
+  }
+};
+
+class TextPrint : public Print {
+public:
+  std::string text;
+  size_t write(uint8_t c) override {
+    text += (char)c;
+    return 1;
+  }
+};
+
+static uint32_t count(RequestHandler handler, int method) {
+  return RequestMetrics::duration(handler, method).total();
+}
+
+// bit position of an HTTP method, as RequestMetrics indexes them
+static int method(WebRequestMethod method) { return __builtin_ctz(method); }
+
+void test_requests_are_counted_once(void) {
+  uint32_t gets = count(REQUEST_HANDLER_STATIC, method(HTTP_GET));
+  // the UI handler tracks the request itself and the wrapper does as well
+  NativeRequest page(HTTP_GET, "/index.html");
+  page.begin({timedUi});
+  TEST_ASSERT_TRUE(page.run());
+  TEST_ASSERT_EQUAL_INT(200, page.status());
+  TEST_ASSERT_EQUAL_UINT32(gets + 1,
+                           count(REQUEST_HANDLER_STATIC, method(HTTP_GET)));
+
+  // an upload registers its disconnect callback before the request is
+  // handled, the callback still runs after the request is timed
+  uint32_t puts = count(REQUEST_HANDLER_DAV, method(HTTP_PUT));
+  NativeRequest put(HTTP_PUT, "/drive/put.gcode");
+  put.body("G28\n");
+  put.begin({dav});
+  TEST_ASSERT_TRUE(put.run());
+  TEST_ASSERT_EQUAL_INT(201, put.status());
+  TEST_ASSERT_EQUAL_UINT32(puts + 1,
+                           count(REQUEST_HANDLER_DAV, method(HTTP_PUT)));
+  while (MutationQueue::depth()) {
+    delay(1);
+  }
+  delay(20);
+  TEST_ASSERT_TRUE(card->get("/put.gcode") == "G28\n");
+}
+
+void test_tracking_allocates_nothing(void) {
+  NativeRequest request(HTTP_GET, "/held");
+  uint64_t start = NativeHeap::allocations();
+  RequestMetrics::track(request.request(), REQUEST_HANDLER_OCTOPRINT);
+  RequestMetrics::track(request.request(), REQUEST_HANDLER_OCTOPRINT);
+  TEST_ASSERT_EQUAL_UINT32(0, NativeHeap::allocations() - start);
+}
+
+void test_requests_beyond_the_slots(void) {
+  HoldHandler hold;
+  uint32_t before = count(REQUEST_HANDLER_OCTOPRINT, method(HTTP_GET));
+  uint32_t untracked = RequestMetrics::untracked();
+  {
+    std::vector<std::unique_ptr<NativeRequest>> held;
+    for (int i = 0; i < REQUEST_METRICS_SLOTS + 2; i++) {
+      held.emplace_back(new NativeRequest(HTTP_GET, "/held"));
+      held.back()->begin({&hold});
+    }
+    TEST_ASSERT_EQUAL_UINT32(untracked + 2, RequestMetrics::untracked());
+  }
+  TEST_ASSERT_EQUAL_UINT32(before + REQUEST_METRICS_SLOTS,
+                           count(REQUEST_HANDLER_OCTOPRINT, method(HTTP_GET)));
+
+  // the slots are free again
+  NativeRequest request(HTTP_GET, "/held");
+  request.begin({&hold});
+  request.disconnect();
+  TEST_ASSERT_EQUAL_UINT32(before + REQUEST_METRICS_SLOTS + 1,
+                           count(REQUEST_HANDLER_OCTOPRINT, method(HTTP_GET)));
+  TEST_ASSERT_EQUAL_UINT32(untracked + 2, RequestMetrics::untracked());
+}
+
+void test_prometheus_export(void) {
+  TextPrint out;
+  PrometheusWriter prom(out);
+  RequestMetrics::report(prom);
+
+  std::map<std::string, std::string> types;
+  std::map<std::string, double> samples;
+  std::istringstream lines(out.text);
+  std::string line;
+  std::string family;
+  while (std::getline(lines, line)) {
+    if (line.rfind("# HELP ", 0) == 0) {
+      family = line.substr(7, line.find(' ', 7) - 7);
+      continue;
+    }
+    if (line.rfind("# TYPE ", 0) == 0) {
+      TEST_ASSERT_EQUAL_STRING(family.c_str(),
+                               line.substr(7, family.size()).c_str());
+      types[family] = line.substr(8 + family.size());
+      continue;
+    }
+    // every sample belongs to the family announced before it
+    TEST_ASSERT_EQUAL_INT(0, line.compare(0, family.size(), family));
+    size_t space = line.rfind(' ');
+    TEST_ASSERT_TRUE(space != std::string::npos);
+    samples[line.substr(0, space)] = atof(line.c_str() + space + 1);
+  }
+  TEST_ASSERT_EQUAL_STRING("counter", types["http_requests_total"].c_str());
+  TEST_ASSERT_EQUAL_STRING("histogram",
+                           types["http_request_duration_seconds"].c_str());
+
+  const char *labels = "handler=\"static\",method=\"GET\"";
+  std::string name = std::string("http_requests_total{") + labels + "}";
+  TEST_ASSERT_EQUAL_UINT32(count(REQUEST_HANDLER_STATIC, method(HTTP_GET)),
+                           (uint32_t)samples[name]);
+  TEST_ASSERT_EQUAL_UINT32(RequestMetrics::untracked(),
+                           (uint32_t)samples["http_requests_untracked_total"]);
+
+  // buckets never go down and the last one is the count
+  std::string histogram = "http_request_duration_seconds";
+  double previous = 0;
+  for (int i = 0; i < RequestHistogram::buckets(); i++) {
+    char le[16];
+    if (i < RequestHistogram::buckets() - 1) {
+      snprintf(le, sizeof(le), "%.4f", RequestHistogram::bound(i) * 0.001);
+    } else {
+      strcpy(le, "+Inf");
+    }
+    std::string bucket =
+        histogram + "_bucket{" + labels + ",le=\"" + le + "\"}";
+    TEST_ASSERT_TRUE(samples.count(bucket));
+    TEST_ASSERT_TRUE(samples[bucket] >= previous);
+    previous = samples[bucket];
+  }
+  std::string total = histogram + "_count{" + labels + "}";
+  TEST_ASSERT_EQUAL_UINT32(count(REQUEST_HANDLER_STATIC, method(HTTP_GET)),
+                           (uint32_t)previous);
+  TEST_ASSERT_EQUAL_UINT32((uint32_t)previous, (uint32_t)samples[total]);
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  card->mkdir("/ui");
+  card->put("/ui/index.html", "<html></html>");
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+  ui = new AsyncUIHandler(*card, "/ui/");
+  timedUi = new TimedHandler(*ui, REQUEST_HANDLER_STATIC);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_requests_are_counted_once);
+  RUN_TEST(test_tracking_allocates_nothing);
+  RUN_TEST(test_requests_beyond_the_slots);
+  RUN_TEST(test_prometheus_export);
+  return UNITY_END();
+}
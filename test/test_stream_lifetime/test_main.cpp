@@ -0,0 +1,112 @@
+// AsyncFileStreamResponse hands its blocks to lwIP without copying them: a
+// response gone while its last segments are unacknowledged keeps the blocks
+// until they are, many downloads at once on a slow card never make the
+// AsyncTCP task wait, not for the card and not for the reader's queue, and
+// each time a download waits for the card counts as one stall.
+
+#include <AsyncFileStreamResponse.h>
+#include <AsyncWebDAV.h>
+#include <MutationQueue.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <memory>
+#include <unity.h>
+
+#ifndef LIFETIME_CARD_LATENCY_US
+#define LIFETIME_CARD_LATENCY_US 2000
+#endif
+
+// more blocks than the reader's queue holds reads
+#define LIFETIME_DOWNLOADS (SD_STREAM_QUEUE / SD_STREAM_BLOCKS + 4)
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+static std::string gcode;
+
+void setUp(void) {}
+
+void tearDown(void) { card->setLatency(0); }
+
+static bool waitForRetained(uint32_t count) {
+  for (int i = 0; i < 100 && AsyncFileStreamResponse::retained() != count;
+       i++) {
+    delay(SD_STREAM_REAP_MS / 2);
+  }
+  return AsyncFileStreamResponse::retained() == count;
+}
+
+void test_closed_connection_keeps_the_blocks(void) {
+  std::vector<std::unique_ptr<NativeRequest>> requests;
+  for (int i = 0; i < LIFETIME_DOWNLOADS; i++) {
+    requests.emplace_back(new NativeRequest(HTTP_GET, "/drive/big.gcode"));
+    NativeRequest &request = *requests.back();
+    request.begin({dav});
+    for (int step = 0; step < 1000 && request.client().unacked() <= 1460;
+         step++) {
+      request.step();
+      delay(1);
+    }
+    TEST_ASSERT_GREATER_THAN(1460, request.client().unacked());
+    // the client is gone before it acknowledged the last of it
+    request.disconnect();
+  }
+  // long past the reader's checks, lwIP still holds the segments
+  delay(SD_STREAM_REAP_MS * 3);
+  TEST_ASSERT_EQUAL_UINT32(LIFETIME_DOWNLOADS,
+                           AsyncFileStreamResponse::retained());
+
+  for (std::unique_ptr<NativeRequest> &request : requests) {
+    // a retransmission reads the blocks, ASan tells if they were freed
+    request->client().ack();
+    const std::string &raw = request->raw();
+    size_t body = raw.find("\r\n\r\n") + 4;
+    TEST_ASSERT_TRUE(raw.size() > body);
+    TEST_ASSERT_TRUE(gcode.compare(0, raw.size() - body, raw, body) == 0);
+  }
+  TEST_ASSERT_TRUE(waitForRetained(0));
+}
+
+void test_downloads_never_wait(void) {
+  std::vector<std::unique_ptr<NativeRequest>> requests;
+  std::vector<NativeRequest *> running;
+  for (int i = 0; i < LIFETIME_DOWNLOADS; i++) {
+    requests.emplace_back(new NativeRequest(HTTP_GET, "/drive/big.gcode"));
+    running.push_back(requests.back().get());
+  }
+  card->setLatency(LIFETIME_CARD_LATENCY_US);
+  uint32_t stalls = AsyncFileStreamResponse::stalls();
+  for (NativeRequest *request : running) {
+    request->begin({dav});
+  }
+  TEST_ASSERT_TRUE(NativeRequest::runAll(running, 30000));
+
+  uint32_t longest = 0;
+  for (NativeRequest *request : running) {
+    TEST_ASSERT_EQUAL_INT(200, request->status());
+    TEST_ASSERT_TRUE(request->responseBody() == gcode);
+    longest = max(longest, request->maxCallbackUs());
+  }
+  printf("\n  %d downloads, longest callback %.1f ms, %u stalls\n",
+         LIFETIME_DOWNLOADS, longest / 1000.0,
+         AsyncFileStreamResponse::stalls() - stalls);
+  TEST_ASSERT_LESS_THAN(LIFETIME_CARD_LATENCY_US, longest);
+  // a stall is counted once, however often the connection is polled in it
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(
+      LIFETIME_DOWNLOADS * (gcode.size() / SD_STREAM_BLOCK_SIZE),
+      AsyncFileStreamResponse::stalls() - stalls);
+  TEST_ASSERT_TRUE(waitForRetained(0));
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+  gcode = nativeGcode(64 * 1024);
+  card->put("/big.gcode", gcode);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_closed_connection_keeps_the_blocks);
+  RUN_TEST(test_downloads_never_wait);
+  return UNITY_END();
+}
@@ -0,0 +1,173 @@
+// AsyncUIHandler's hot set after the UI on the card changes: files replaced,
+// re-encoded or moved away over WebDAV are served from the card at once and
+// from RAM again after loop(), and a response still sending a dropped file
+// finishes with the bytes it started with. The hot set keeps one encoding
+// of a file, the others come from the card like any file that isn't hot.
+
+#include <AsyncUIHandler.h>
+#include <AsyncWebDAV.h>
+#include <MutationQueue.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <unity.h>
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+static AsyncUIHandler *ui;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+struct Page {
+  int status;
+  std::string body;
+  String etag;
+  String encoding;
+  uint32_t cardReads;
+};
+
+static Page get(const char *url, const char *accept = NULL) {
+  NativeRequest request(HTTP_GET, url);
+  if (accept) {
+    request.header("Accept-Encoding", accept);
+  }
+  card->resetStats();
+  request.begin({ui});
+  TEST_ASSERT_TRUE(request.run());
+  Page page;
+  page.status = request.status();
+  page.body = request.responseBody();
+  page.etag = request.responseHeader("ETag");
+  page.encoding = request.responseHeader("Content-Encoding");
+  page.cardReads = card->stats().reads;
+  return page;
+}
+
+// a change made over WebDAV, waited for until it is on the card
+static void change(WebRequestMethodComposite method, const String &path,
+                   const std::string &body = "",
+                   const String &destination = String()) {
+  NativeRequest request(method, "/drive" + path);
+  if (method == HTTP_PUT) {
+    request.body(body);
+  }
+  if (destination.length()) {
+    request.header("Destination", "/drive" + destination);
+  }
+  request.begin({dav});
+  TEST_ASSERT_TRUE(request.run());
+  TEST_ASSERT_LESS_THAN(300, request.status());
+  while (MutationQueue::depth()) {
+    delay(1);
+  }
+  // the last mutation may still be running
+  delay(20);
+}
+
+void test_replaced_file_is_served_fresh(void) {
+  Page before = get("/index.html");
+  TEST_ASSERT_EQUAL_STRING("<html>one</html>", before.body.c_str());
+  TEST_ASSERT_EQUAL_UINT32(0, before.cardReads);
+
+  change(HTTP_PUT, "/ui/index.html", "<html>two</html>");
+  // straight from the card until the hot set is loaded again
+  Page changed = get("/index.html");
+  TEST_ASSERT_EQUAL_STRING("<html>two</html>", changed.body.c_str());
+  TEST_ASSERT_GREATER_THAN(0, changed.cardReads);
+
+  ui->loop();
+  Page reloaded = get("/index.html");
+  TEST_ASSERT_EQUAL_STRING("<html>two</html>", reloaded.body.c_str());
+  TEST_ASSERT_EQUAL_UINT32(0, reloaded.cardReads);
+  TEST_ASSERT_FALSE(reloaded.etag.equals(before.etag));
+}
+
+void test_changed_encoding_is_dropped(void) {
+  Page before = get("/app.js", "gzip");
+  TEST_ASSERT_EQUAL_STRING("gzip", before.encoding.c_str());
+  TEST_ASSERT_EQUAL_STRING("gz-one", before.body.c_str());
+
+  change(HTTP_PUT, "/ui/app.js.gz", "gz-two");
+  ui->loop();
+  Page after = get("/app.js", "gzip");
+  TEST_ASSERT_EQUAL_STRING("gz-two", after.body.c_str());
+  TEST_ASSERT_EQUAL_UINT32(0, after.cardReads);
+}
+
+void test_one_encoding_in_ram(void) {
+  size_t cached = ui->cachedBytes();
+  ui->cache("style.css");
+  TEST_ASSERT_EQUAL_UINT32(cached + strlen("br-style"), ui->cachedBytes());
+
+  Page br = get("/style.css", "gzip, br");
+  TEST_ASSERT_EQUAL_STRING("br", br.encoding.c_str());
+  TEST_ASSERT_EQUAL_STRING("br-style", br.body.c_str());
+  TEST_ASSERT_EQUAL_UINT32(0, br.cardReads);
+  Page gzip = get("/style.css", "gzip");
+  TEST_ASSERT_EQUAL_STRING("gzip", gzip.encoding.c_str());
+  TEST_ASSERT_EQUAL_STRING("gz-style", gzip.body.c_str());
+  TEST_ASSERT_GREATER_THAN(0, gzip.cardReads);
+
+  // a file that isn't hot is sent as brotli from the card too
+  Page cold = get("/cold.js", "gzip, deflate, br");
+  TEST_ASSERT_EQUAL_STRING("br", cold.encoding.c_str());
+  TEST_ASSERT_EQUAL_STRING("br-cold", cold.body.c_str());
+  TEST_ASSERT_EQUAL_STRING("gz-cold", get("/cold.js", "gzip").body.c_str());
+}
+
+void test_moved_directory_is_dropped(void) {
+  size_t cached = ui->cachedBytes();
+  change(HTTP_MOVE, "/ui", "", "/ui-old");
+  TEST_ASSERT_EQUAL_UINT32(0, ui->cachedBytes());
+  // nothing is left to serve, neither from RAM nor from the card
+  TEST_ASSERT_EQUAL_INT(404, get("/index.html").status);
+
+  change(HTTP_MOVE, "/ui-old", "", "/ui");
+  ui->loop();
+  TEST_ASSERT_EQUAL_UINT32(cached, ui->cachedBytes());
+  TEST_ASSERT_EQUAL_UINT32(0, get("/index.html").cardReads);
+}
+
+void test_response_in_flight_keeps_its_bytes(void) {
+  std::string big(64 * 1024, 'a');
+  change(HTTP_PUT, "/ui/big.html", big);
+  ui->cache("big.html");
+
+  NativeRequest request(HTTP_GET, "/big.html");
+  request.window(1460);
+  request.begin({ui});
+  for (int i = 0; i < 3; i++) {
+    request.step();
+  }
+  TEST_ASSERT_FALSE(request.done());
+  change(HTTP_PUT, "/ui/big.html", std::string(64 * 1024, 'b'));
+  ui->loop();
+  TEST_ASSERT_TRUE(request.run());
+  TEST_ASSERT_TRUE(request.responseBody() == big);
+  TEST_ASSERT_EQUAL_INT('b', get("/big.html").body[0]);
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  card->mkdir("/ui");
+  card->put("/ui/index.html", "<html>one</html>");
+  card->put("/ui/app.js.gz", "gz-one");
+  card->put("/ui/style.css.br", "br-style");
+  card->put("/ui/style.css.gz", "gz-style");
+  card->put("/ui/cold.js.br", "br-cold");
+  card->put("/ui/cold.js.gz", "gz-cold");
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+  ui = new AsyncUIHandler(*card, "/ui/");
+  ui->cache("index.html").cache("app.js");
+  dav->onFileChanged([](const String &path) { ui->invalidate(path); });
+
+  UNITY_BEGIN();
+  RUN_TEST(test_replaced_file_is_served_fresh);
+  RUN_TEST(test_changed_encoding_is_dropped);
+  RUN_TEST(test_one_encoding_in_ram);
+  RUN_TEST(test_moved_directory_is_dropped);
+  RUN_TEST(test_response_in_flight_keeps_its_bytes);
+  return UNITY_END();
+}
@@ -0,0 +1,113 @@
+// An upload on a card slower than the network never makes the AsyncTCP task
+// wait: once the writer's buffers can't take another receive window, the
+// body is no longer acknowledged and the client stops sending until the
+// writer task wrote a buffer. The file still arrives whole, the window is
+// fully open again once the upload is answered, and a client that leaves
+// while held back leaves nothing behind.
+
+#include <AsyncWebDAV.h>
+#include <BufferedFileWriter.h>
+#include <MutationQueue.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <TempFS.h>
+#include <unity.h>
+
+#ifndef BACKPRESSURE_CARD_LATENCY_US
+#define BACKPRESSURE_CARD_LATENCY_US 20000
+#endif
+#define BACKPRESSURE_SIZE (256 * 1024)
+
+static TempFS *card;
+static AsyncWebDAV *dav;
+static std::string gcode;
+
+void setUp(void) {}
+
+void tearDown(void) { card->setLatency(0); }
+
+static NativeBodySource source() {
+  return [](uint8_t *data, size_t len, size_t index) {
+    memcpy(data, gcode.data() + index, len);
+    return len;
+  };
+}
+
+// the first segment opens the file at card speed, the rest goes in slowly
+static void beginSlowly(NativeRequest &request) {
+  request.body(gcode.size(), source());
+  request.begin({dav});
+  request.step();
+  card->setLatency(BACKPRESSURE_CARD_LATENCY_US);
+}
+
+// steps until the client is held back, or the request is done
+static bool stepUntilHeld(NativeRequest &request) {
+  for (uint32_t start = millis(); millis() - start < 10000;) {
+    if (!request.client().receiveWindow()) {
+      return true;
+    }
+    if (!request.step() && request.done()) {
+      return false;
+    }
+  }
+  return false;
+}
+
+static void waitForWriters() {
+  for (int i = 0; i < 1000 && BufferedFileWriter::freeBuffers() <
+                                  BUFFERED_WRITER_POOL_BLOCKS;
+       i++) {
+    delay(10);
+  }
+}
+
+void test_slow_card_holds_the_client_back(void) {
+  NativeRequest request(HTTP_PUT, "/drive/slow.gcode");
+  uint32_t throttled = BufferedFileWriter::throttled();
+  beginSlowly(request);
+  TEST_ASSERT_TRUE(stepUntilHeld(request));
+  TEST_ASSERT_TRUE(request.run(30000));
+
+  TEST_ASSERT_EQUAL_INT(201, request.status());
+  TEST_ASSERT_TRUE(card->get("/slow.gcode") == gcode);
+  printf("\n  %u KB in %.1f ms, longest callback %.2f ms, %u chunks held\n",
+         BACKPRESSURE_SIZE >> 10, request.latencyUs() / 1000.0,
+         request.maxCallbackUs() / 1000.0,
+         BufferedFileWriter::throttled() - throttled);
+  TEST_ASSERT_GREATER_THAN(throttled, BufferedFileWriter::throttled());
+  // no callback waited for a single card write
+  TEST_ASSERT_LESS_THAN(BACKPRESSURE_CARD_LATENCY_US, request.maxCallbackUs());
+  // everything held was acknowledged in the end
+  TEST_ASSERT_EQUAL_UINT32(NATIVE_TCP_WINDOW,
+                           request.client().receiveWindow());
+  waitForWriters();
+}
+
+void test_client_gone_while_held(void) {
+  card->put("/kept.gcode", "G28 ; old\n");
+  dav->invalidate("/kept.gcode");
+  NativeRequest request(HTTP_PUT, "/drive/kept.gcode");
+  beginSlowly(request);
+  TEST_ASSERT_TRUE(stepUntilHeld(request));
+  request.disconnect();
+
+  // the writer task still acknowledges what it held, to nobody
+  waitForWriters();
+  card->setLatency(0);
+  TEST_ASSERT_EQUAL_UINT32(BUFFERED_WRITER_POOL_BLOCKS,
+                           BufferedFileWriter::freeBuffers());
+  TEST_ASSERT_TRUE(card->get("/kept.gcode") == "G28 ; old\n");
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  dav = new AsyncWebDAV("/drive", *card);
+  gcode = nativeGcode(BACKPRESSURE_SIZE);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_slow_card_holds_the_client_back);
+  RUN_TEST(test_client_gone_while_held);
+  return UNITY_END();
+}
@@ -0,0 +1,117 @@
+// Uploads are answered once the writer task committed them: the AsyncTCP
+// task doesn't wait for the commit, the writer task polls the connection as
+// soon as the file is under its name, and a commit that outlasts its timeout
+// is reported as a failure rather than a success.
+
+#include <AsyncWebDAV.h>
+#include <BufferedFileWriter.h>
+#include <GcodeIndex.h>
+#include <MutationQueue.h>
+#include <NativeGcode.h>
+#include <NativeRequest.h>
+#include <OctoPrintAPI.h>
+#include <PrintHost.h>
+#include <TempFS.h>
+#include <unity.h>
+
+// each call of the commit takes this long, several of them add up
+#ifndef COMMIT_CARD_LATENCY_US
+#define COMMIT_CARD_LATENCY_US 100000
+#endif
+
+static TempFS *card;
+static GcodeIndex *files;
+static PrintHost *printer;
+static OctoPrintAPI *octoPrint;
+static AsyncWebDAV *dav;
+static std::string gcode;
+
+void setUp(void) {}
+
+void tearDown(void) { card->setLatency(0); }
+
+static NativeBodySource source() {
+  return [](uint8_t *data, size_t len, size_t index) {
+    memcpy(data, gcode.data() + index, len);
+    return len;
+  };
+}
+
+// the first segment goes in at card speed, the rest and the commit at
+// latencyUs per call
+static void sendSlowly(NativeRequest &request, AsyncWebHandler *handler,
+                       uint32_t latencyUs) {
+  request.segment(gcode.size() / 2 + 1);
+  request.begin({handler});
+  request.step();
+  card->setLatency(latencyUs);
+  TEST_ASSERT_TRUE(request.run());
+  card->setLatency(0);
+}
+
+static void waitForWriters() {
+  for (int i = 0; i < 1000 && BufferedFileWriter::freeBuffers() <
+                                  BUFFERED_WRITER_POOL_BLOCKS;
+       i++) {
+    delay(10);
+  }
+}
+
+void test_put_is_answered_once_committed(void) {
+  NativeRequest request(HTTP_PUT, "/drive/put.gcode");
+  request.body(gcode.size(), source());
+  sendSlowly(request, dav, COMMIT_CARD_LATENCY_US);
+  TEST_ASSERT_EQUAL_INT(201, request.status());
+  // readable under its name by the time the client hears of it
+  TEST_ASSERT_TRUE(card->get("/put.gcode") == gcode);
+  printf("\n  PUT in %.1f ms, longest callback %.1f ms, %u wakes\n",
+         request.latencyUs() / 1000.0, request.maxCallbackUs() / 1000.0,
+         request.wakes());
+  // the request looks its path up, but never waits for the commit's calls
+  TEST_ASSERT_LESS_THAN(2 * COMMIT_CARD_LATENCY_US, request.maxCallbackUs());
+  // answered when the writer task polled, not on the timer after it
+  TEST_ASSERT_GREATER_THAN(0, request.wakes());
+  waitForWriters();
+}
+
+void test_octoprint_upload_is_answered_once_committed(void) {
+  NativeRequest request(HTTP_POST, "/api/files/local");
+  request.upload("posted.gcode", gcode.size(), source());
+  sendSlowly(request, octoPrint, COMMIT_CARD_LATENCY_US);
+  TEST_ASSERT_EQUAL_INT(201, request.status());
+  TEST_ASSERT_TRUE(request.responseBody().find("\"name\":\"posted.gcode\"") !=
+                   std::string::npos);
+  TEST_ASSERT_TRUE(card->get("/posted.gcode") == gcode);
+  TEST_ASSERT_LESS_THAN(COMMIT_CARD_LATENCY_US, request.maxCallbackUs());
+  TEST_ASSERT_GREATER_THAN(0, request.wakes());
+  waitForWriters();
+}
+
+void test_commit_past_the_timeout_fails(void) {
+  // the calls of the commit add up to well over what the response waits
+  uint32_t latencyUs = DAV_COMMIT_TIMEOUT_MS * 1000 / 2;
+  NativeRequest request(HTTP_PUT, "/drive/late.gcode");
+  request.body(gcode.size(), source());
+  sendSlowly(request, dav, latencyUs);
+  TEST_ASSERT_EQUAL_INT(500, request.status());
+  TEST_ASSERT_LESS_THAN(2 * latencyUs, request.maxCallbackUs());
+  waitForWriters();
+}
+
+int main(int argc, char **argv) {
+  card = new TempFS();
+  MutationQueue::recover(*card);
+  files = new GcodeIndex(*card);
+  files->rebuild();
+  printer = new PrintHost(Serial2, *card);
+  octoPrint = new OctoPrintAPI(*card, *files, *printer);
+  dav = new AsyncWebDAV("/drive", *card, files);
+  // within one writer buffer, so only the commit goes to the card
+  gcode = nativeGcode(8 * 1024);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_put_is_answered_once_committed);
+  RUN_TEST(test_octoprint_upload_is_answered_once_committed);
+  RUN_TEST(test_commit_past_the_timeout_fails);
+  return UNITY_END();
+}
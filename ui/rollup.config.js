@@ -3,6 +3,8 @@ import resolve from '@rollup/plugin-node-resolve';
 import commonjs from '@rollup/plugin-commonjs';
 import livereload from 'rollup-plugin-livereload';
 import { terser } from 'rollup-plugin-terser';
+import fs from 'fs';
+import zlib from 'zlib';
 
 const production = !process.env.ROLLUP_WATCH;
 
@@ -46,7 +48,16 @@ export default {
 
 		// If we're building for production (npm run build
 		// instead of npm run dev), minify
-		production && terser()
+		production && terser(),
+
+		// The device picks these by Accept-Encoding, which saves
+		// SD reads on every first page load
+		production && compress([
+			'public/index.html',
+			'public/global.css',
+			'public/build/bundle.js',
+			'public/build/bundle.css'
+		])
 	],
 	watch: {
 		clearScreen: false
@@ -69,3 +80,17 @@ function serve() {
 		}
 	};
 }
+
+function compress(files) {
+	return {
+		writeBundle() {
+			files.filter(file => fs.existsSync(file)).forEach(file => {
+				const data = fs.readFileSync(file);
+				fs.writeFileSync(file + '.gz', zlib.gzipSync(data, { level: 9 }));
+				fs.writeFileSync(file + '.br', zlib.brotliCompressSync(data, {
+					params: { [zlib.constants.BROTLI_PARAM_QUALITY]: 11 }
+				}));
+			});
+		}
+	};
+}